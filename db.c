@@ -1,29 +1,334 @@
+#define _GNU_SOURCE		/* fallocate() */
 #include "lib.h"
 #include "db.h"
 
 #include <sys/uio.h>		/* struct iovec */
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>		/* FICLONE */
+#endif
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
  * internale index file constants.
  * These are used to construct record in the index file and data file. 
  */
-#define IDXLEN_SIZE	4	/* index record length (ASCII chars) */
+#define IDXLEN_SZ	4	/* index record length (ASCII chars) */
 #define SEP		':'	/* separator char in index record */
 #define SPACE		' '	/* space charactor */
 #define NEWLINE		'\n'	/* newline charactor */
+#define TOMB		'X'	/* dead flag in ptr field */
+
+/*
+ * an index record ends with two crc32c's, in hex: that of its data
+ * record (without the newline), and that of the index record itself
+ * from its length field on, so damage is found when a record is read.
+ * the chain ptr at the front is rewritten on its own, so it is not
+ * covered.
+ */
+#define CRC_SZ		8	/* size of a crc in index record (hex) */
+#define DATOFF_MAX	19	/* most digits of a data offset in one */
 
 /* 
  * the following definitions are for hash chains and
  * free list chain in the index file.
+ * a ptr field holds the offset of the index record it points to, followed
+ * by a fingerprint of that record's key and the length of its stored key,
+ * so a chain walk can pass over most records without reading them.
+ * the last byte is a flag that belongs to the index record the ptr field
+ * is in, not the one it points to: TOMB if the record has been deleted.
+ * a delete just sets it, and the record stays on its chain, passed over
+ * by walks, until _db_reclaim moves a batch of them to the free list.
  */
-#define PTR_SZ		7	/* size of ptr field in hash chain */
-#define PTR_MAX		9999999	/* max file offset 10 ^ PTRSZ - 1 */
+#define OFF_SZ		7	/* size of offset in ptr field */
+#define FPRINT_SZ	4	/* size of key fingerprint in ptr field (hex) */
+#define KEYLEN_SZ	4	/* size of stored key length in ptr field */
+#define DEAD_SZ		1	/* size of dead flag in ptr field */
+#define PTR_SZ		(OFF_SZ + FPRINT_SZ + KEYLEN_SZ + DEAD_SZ)	/* size of ptr field */
+#define PTR_MAX		9999999	/* max file offset 10 ^ OFF_SZ - 1 */
+#define FPRINT_MASK	0xffff	/* fingerprint bits kept, FPRINT_SZ hex digits */
 #define NHASH_DEF	137	/* default hash table size */
-#define FREE_OFF	0	/* free list offset in index file */
-#define HASH_OFF	PTR_SZ	/* hash table offset in index file */
+#define HDR_SZ		256	/* size of header at front of index file */
+#define FREE_OFF	HDR_SZ	/* free list offset in index file */
+#define HASH_OFF	(FREE_OFF + PTR_SZ)	/* hash table offset in index file */
+
+/*
+ * the header records how the index file was created.
+ * it is a line of blank separated fields: magic, version, hash table size,
+ * flags, number of shards, the key and data sizes of fixed size records
+ * (0 if they vary), and the length of the key prefix followed by the
+ * prefix itself.
+ * a second line, at STATS_OFF, holds the counts db_info() reports (see
+ * DBSTATS), preceded by 1 if they were saved by the last process to
+ * close the database and 0 if a writer has had it open since. the counts
+ * are kept in the shared memory segment as the database changes.
+ * a sharded database keeps its records in shards named <name>.0 through
+ * <name>.<nshards - 1>, each a database of its own; <name>.idx holds just
+ * the header.
+ */
+#define HDR_MAGIC	"DBIDX"
+#define HDR_VERSION	8
+#define STATS_OFF	128	/* offset of the counts line in the header */
+#define STATS_WIDTH	15	/* width of a count in it */
+
+#define HDR_WAL		1	/* updates go through the write-ahead log */
+#define HDR_REPLOG	2	/* changes go to the replication log */
+#define HDR_ATTRIDX	4	/* a secondary index: chains are hashed on */
+				/* the key up to ATTR_SEP */
+
+/*
+ * a secondary index is a database of its own, <name>.<index>, with a
+ * record keyed <attribute><ATTR_SEP><key> for each record indexed. its
+ * chains are hashed on the attribute, and the key picks one of the
+ * ATTR_CHAINS that follow that chain, so the entries for an attribute
+ * are on those chains, which db_lookup() walks, and one held by many
+ * records doesn't make one chain that every change to them walks.
+ */
+#define ATTR_SEP	'\t'
+#define ATTR_CHAINS	64	/* chains an attribute's entries are on */
+#define ATTRKEY_MAX	(IDXLEN_MAX - DATOFF_MAX - IDXLEN_SZ - 2 * CRC_SZ - 4)
+					/* longest entry key _db_fmtidx takes, */
+					/* wherever its data is */
+#define INDEXNAME_MAX	32	/* longest index name */
+
+typedef struct {
+	char		name[INDEXNAME_MAX + 1];
+	DBEXTRACT	fn;		/* the record's attribute */
+	void		*arg;
+	DBHANDLE	idx;		/* the index */
+} DBSINDEX;
+
+/*
+ * a database created with a key and data size keeps its records in fixed
+ * size slots instead. the hash table is an array of binary slot numbers,
+ * and is followed, aligned, by an array of FIXSLOTs, each keysize bytes
+ * of key after it, rounded up to SLOT_ALIGN_SZ; slot n's data is the
+ * n'th datsize bytes, rounded up, of the data file. keys and data shorter
+ * than the size are null padded. a slot whose key starts with a null is
+ * free. which slots are in use is kept in a bitmap in the shared memory
+ * segment, built by the first writer to open the database from the hash
+ * chains, so finding a record or a free slot is arithmetic on slot
+ * numbers and a scan of the bitmap, with no free list to walk.
+ */
+#define SLOTPTR_SZ	4	/* size of a slot number in the hash table */
+#define SLOT_ALIGN_SZ	8	/* slots are a multiple of this */
+#define SLOTS_ALIGN	64	/* the first slot is on such a boundary */
+#define SLOTS_MAX	(1U << 26)	/* most slots; the bitmap is 8 Mbytes */
+#define FIXKEY_MAX	(IDXLEN_MAX - 8)	/* largest keysize */
+#define FIXDAT_MAX	(DATALEN_MAX - 1)	/* largest datsize */
+
+typedef struct {
+	unsigned int	next;		/* slot + 1 of the next on the chain, or 0 */
+	unsigned int	crc;		/* crc32c of the key and data, as padded */
+	char		key[];		/* keysize bytes */
+} FIXSLOT;
+
+#define SLOT_ROUND(n)	(((n) + SLOT_ALIGN_SZ - 1) / SLOT_ALIGN_SZ * SLOT_ALIGN_SZ)
+#define SLOT_FIRSTOFF(nhash)	((HASH_OFF + (nhash) * SLOTPTR_SZ + \
+				    SLOTS_ALIGN - 1) / SLOTS_ALIGN * SLOTS_ALIGN)
+#define SLOT_IDXOFF(db, n)	((db)->firstoff + (off_t) (n) * (db)->islotsz)
+#define SLOT_DATOFF(db, n)	((off_t) (n) * (db)->dslotsz)
+
+/* size of a hash table entry */
+#define CHAINPTR_SZ(db)	((db)->keysize > 0 ? SLOTPTR_SZ : PTR_SZ)
+
+/*
+ * with a key prefix, the first byte of every stored key says
+ * whether the prefix was elided from it.
+ */
+#define KEY_PREFIXED	'+'	/* stored key follows the common prefix */
+#define KEY_VERBATIM	'='	/* stored key is the whole key */
+
+#define AIO_DEPTH_DEF	64	/* default most async requests outstanding */
+#define APPEND_EXTENT	(256 * 1024)	/* files are preallocated this much */
+#define SYNCMS_DEF	1000	/* default DB_SYNC_PERIODIC interval */
+
+/* files written since they were last synced */
+#define DIRTY_IDX	1
+#define DIRTY_DAT	2
+#define DIRTY_WAL	4
+#define DIRTY_REP	8
+
+/* the files whose sync makes the changes written so far durable */
+#define DIRTY_COMMIT(db)	(((db)->walfd >= 0 ? DIRTY_WAL : \
+				    DIRTY_IDX | DIRTY_DAT) | \
+				    ((db)->repfd >= 0 ? DIRTY_REP : 0))
+
+/*
+ * the write-ahead log, <name>.wal, is a redo log of every write a store
+ * or delete makes to the index and data files. appends are written as
+ * they are made, overwrites are held back until the operation's log
+ * record has been written, so a crash part way through an operation
+ * leaves a log record to replay, or nothing to undo.
+ * a log record is a WALREC followed by len bytes of WALENTs, each
+ * followed by the bytes written. a checkpoint syncs the index and data
+ * files and starts a new generation of the log: it writes a header with
+ * the new generation and the log's size, start, then truncates the log
+ * to the header. only records of the current generation are replayed,
+ * and those from start on, which a checkpoint that died before it could
+ * truncate left behind the last generation's; a torn record ends the log.
+ * the log header also says how big the index file was then: an index
+ * record appended since by an operation that never logged is blanked
+ * out by recovery, as though it had been deleted.
+ * a record logged but not yet applied has a slot in the shared memory
+ * segment, whose lock byte in the log its writer holds until it has
+ * applied it. a writer that dies in between leaves the version of the
+ * chain it held odd, or the free list marked held: whoever locks either
+ * next replays the records of writers that are gone, as does a checkpoint.
+ */
+#define WAL_MAGIC	0x57414c52U	/* "WALR" */
+#define WALMAX_DEF	(8 * 1024 * 1024)	/* default checkpoint size */
+#define WAL_APPLYLK	0	/* byte read locked from logging to applying */
+#define WAL_APPENDLK	1	/* byte write locked while appending */
+#define WAL_SLOTLK	2	/* bytes write locked from logging to applying, */
+				/* one for each slot of walpend */
+#define WAL_PENDING	64	/* log records logged and not yet applied */
+#define WAL_IDX		0	/* WALENT file: index file */
+#define WAL_DAT		1	/* WALENT file: data file */
+
+typedef struct {
+	unsigned int	magic;
+	unsigned int	gen;		/* generation, one per checkpoint */
+	long long	idxsize;	/* index file size at the checkpoint */
+	long long	start;		/* log size at the checkpoint */
+} WALHDR;
+
+typedef struct {
+	unsigned int	magic;
+	unsigned int	gen;		/* generation written under */
+	unsigned int	len;		/* bytes of entries that follow */
+	unsigned int	crc;		/* crc32c of those bytes */
+} WALREC;
+
+/* an entry follows the bytes of the one before, unaligned, so it is
+   copied out to be read. */
+typedef struct {
+	int		file;		/* WAL_IDX or WAL_DAT */
+	unsigned int	len;		/* bytes written, which follow */
+	long long	offset;		/* where they were written */
+} WALENT;
 
 typedef unsigned long DBHASH;	/* hash value */
 typedef unsigned long COUNT;	/* unsigned counter */
+typedef unsigned long long DBPTR;	/* contents of a ptr field */
+
+#define PTR_MAKE(off, fp, klen)	\
+		((DBPTR) (off) | (DBPTR) (fp) << 32 | (DBPTR) (klen) << 48)
+#define PTR_OFF(p)	((off_t) ((p) & 0xffffffffULL))
+#define PTR_FP(p)	((unsigned) ((p) >> 32) & FPRINT_MASK)
+#define PTR_KLEN(p)	((size_t) ((p) >> 48) & 0x7fff)
+#define PTR_DEAD	(1ULL << 63)	/* the record the field is in is dead */
+
+/* counts of the records, see db_info() */
+typedef struct {
+	unsigned long long nrecs;	/* live records */
+	unsigned long long recbytes;	/* their bytes, index and data */
+	unsigned long long ndead;	/* deleted records still on their chains */
+	unsigned long long deadbytes;
+	unsigned long long nfree;	/* records, or slots, free for reuse */
+	unsigned long long freebytes;
+} DBSTATS;
+
+#define STAT_ADD(db, f, n)	do { if ((db)->shm != NULL) \
+				    __atomic_add_fetch(&(db)->shm->stats.f, \
+				    (unsigned long long) (n), __ATOMIC_RELAXED); \
+				} while (0)
+/* bytes of the record the DB structure describes */
+#define REC_SZ(db)	(PTR_SZ + IDXLEN_SZ + (db)->idxlen + (db)->datlen)
+
+/* a db_backup() of one database or shard in progress */
+typedef struct {
+	int	fd[2];		/* the copies of the index and data files */
+	off_t	end[2];		/* copied up to here by the first pass */
+	int	tracking;	/* we turned on the tracking of writes */
+} DBBACKUP;
+
+struct dbaio;
+
+/*
+ * the shared memory segment, a file alongside the index file mapped by
+ * every process that has the database open. it is recreated by the first
+ * process to open the database, so it holds nothing that must survive
+ * the processes using it.
+ * appends to the index and data files reserve their space by adding to
+ * the ends kept here, without a lock. the files are grown a preallocated
+ * extent at a time, but keep the size of what has been written, so an
+ * append whose writer died before writing it leaves a run of NULs.
+ * while db_backup() copies the files, writers mark the blocks they
+ * write in the dirty maps.
+ * the record counts are loaded from the header, and counted again by
+ * the first db_info() if the header's are stale, under the table lock.
+ * it ends with a version number for each hash chain, odd while a writer
+ * is changing the chain, so db_fetch() can walk a chain without locking
+ * it and know whether it has to walk it again, and for fixed size slots
+ * the slot bitmap.
+ */
+#define SHM_MAGIC	0x44425348UL	/* "DBSH" */
+#define BACKUP_BITS	65536	/* bits in a dirty map */
+
+typedef struct {
+	unsigned long	magic;
+	pthread_mutex_t	mutex;		/* process shared, protects the rest */
+	pthread_cond_t	cond;		/* a group sync finished */
+	unsigned long long syncreq;	/* barriers asked for */
+	unsigned long long syncdone;	/* barriers made durable */
+	pid_t		syncpid;	/* process doing the group sync, or 0 */
+	unsigned int	walgen;		/* current log generation */
+	off_t		walpend[WAL_PENDING];	/* log records not yet */
+					/* applied, or 0 */
+	unsigned int	walcrc[WAL_PENDING];	/* and their crcs */
+	int		freeheld;	/* free list changes logged, not */
+					/* yet applied */
+	off_t		idxend;		/* end of index file, with appends */
+	off_t		datend;		/* end of data file, reserved so far */
+	off_t		idxalloc;	/* index file preallocated to here */
+	off_t		datalloc;	/* data file preallocated to here */
+	pid_t		backuppid;	/* process making a backup, or 0 */
+	off_t		backupblk;	/* bytes a bit of a dirty map covers, */
+					/* 0 unless a backup is tracking writes */
+	unsigned long long backupmap[2][BACKUP_BITS / 64];	/* blocks of the */
+					/* index, data file written since */
+	DBSTATS		stats;		/* record counts, changed by writers */
+					/* holding the chain lock */
+	int		statsok;	/* the counts are right */
+	int		statsclean;	/* the header says they are */
+	unsigned int	nslots;		/* fixed size slots in the files */
+	unsigned int	slothint;	/* bitmap word a slot was last freed in */
+	int		slotsready;	/* the slot bitmap has been built */
+	unsigned int	chainver[];	/* version of each hash chain */
+} DBSHM;
+
+#define SHM_SIZE(nhash)	(sizeof(DBSHM) + (nhash) * sizeof(unsigned int))
+/* with fixed size slots, the slot bitmap follows */
+#define SHM_MAPOFF(nhash)	((SHM_SIZE(nhash) + 7) & ~(size_t) 7)
+
+#define SEQ_TRIES	4	/* lockless walks of a chain before locking it */
+
+#define PROMOTE_HOPS	2	/* records before one worth promoting */
+
+#define RECLAIM_BATCH	8	/* dead records passed before reclaiming them */
+#define RECLAIM_MAX	64	/* most reclaimed at once */
+
+/*
+ * a store held in the write buffer of a handle opened with wbuf, on its
+ * bucket's list in the buffer's hash table.
+ */
+#define WB_BUCKETSZ	128	/* bytes of buffer per bucket */
+#define WB_BUCKETS_MAX	(1UL << 20)	/* most buckets */
+
+typedef struct wbent {
+	struct wbent *next;	/* on its bucket */
+	DBHASH	chain;		/* hash chain the key goes on */
+	size_t	size;		/* bytes it is charged for */
+	char	*data;		/* after the key */
+	char	key[];		/* the key, null, the data, null */
+} WBENT;
 
 /*
  * library's private representation of the database.
@@ -41,37 +346,198 @@ typedef struct {
 				/* incudes newline at end of index record	*/
 	off_t	datoff;		/* offset in data file of data record */
 	size_t	datlen;		/* length of data record include newline at end */
-	off_t	ptrval;		/* contents of chain ptr in index record */
+	unsigned int datcrc;	/* crc of data record, from its index record */
+	DBPTR	ptrval;		/* contents of chain ptr in index record */
 	off_t	ptroff;		/* chain ptr offset pointing to this index record */
 	off_t	chainoff;	/* offset of hash chain for this index record */
 	off_t	hashoff;	/* offset in index file of hash table */
+	off_t	firstoff;	/* offset in index file of first index record */
 	DBHASH	nhash;		/* current hash table size */
+	char	*keybuf;	/* malloc'ed buffer for key as stored */
+	size_t	keylen;		/* length of key in keybuf */
+	unsigned keyfp;		/* fingerprint of key in keybuf */
+	size_t	prefixlen;	/* length of common key prefix, 0 if none */
+	char	prefix[KEYPREFIX_MAX + 1];	/* common key prefix */
+	int	aiodepth;	/* most async requests outstanding */
+	struct dbaio *aio;	/* async requests, allocated on first use */
+	int	sync;		/* durability mode, DB_SYNC_xxx */
+	long	syncms;		/* DB_SYNC_PERIODIC interval */
+	struct timespec lastsync;	/* when we last synced */
+	int	dirty;		/* DIRTY_xxx: files written since last sync */
+	int	shmfd;		/* fd for shared memory segment */
+	pid_t	pid;		/* process that opened us */
+	DBSHM	*shm;		/* shared memory segment, or NULL */
+	size_t	shmsize;	/* size it is mapped at */
+	size_t	keysize;	/* fixed size records: key size, 0 if not */
+	size_t	datsize;	/* data size */
+	size_t	islotsz;	/* size of a slot in the index file */
+	size_t	dslotsz;	/* size of a slot in the data file */
+	unsigned long long *slotmap;	/* slot bitmap in shm, 1 if in use */
+	int	flags;		/* HDR_xxx flags from the header */
+	int	rdonly;		/* opened O_RDONLY */
+	int	walfd;		/* fd for write-ahead log, -1 if none */
+	long	walmax;		/* checkpoint when log grows past this */
+	char	*walbuf;	/* malloc'ed log record being built */
+	size_t	wallen;		/* bytes in walbuf */
+	size_t	walsize;	/* size of walbuf */
+	int	freelocked;	/* free list unlock held back until applied */
+	int	walslot;	/* walpend slot of our log record */
+	int	nshards;	/* number of shards, 0 if not sharded */
+	DBHANDLE *shard;	/* malloc'ed array of open shards */
+	int	curshard;	/* shard db_nextrec() is stepping through */
+	int	promote;	/* promote one deep fetch in this many, or 0 */
+	unsigned int rand;	/* state of the promotion sampler */
+	long	hops;		/* records passed by the last chain walk */
+	int	ndead;		/* dead records among them */
+	int	repfd;		/* fd for replication log, -1 if none */
+	char	*repbuf;	/* malloc'ed log record being built */
+	size_t	replen;		/* bytes in repbuf */
+	int	created;	/* we created (or truncated) the files */
+	DBSINDEX *sindex;	/* malloc'ed array of secondary indexes */
+	int	nsindex;	/* number of them */
+	int	trace;		/* trace one operation in this many, or 0 */
+	int	tracewait;	/* operations until the next one traced */
+	int	tracing;	/* this operation is being traced */
+	DBTRFILE *trfile;	/* trace file, mapped, or NULL */
+	DBTRING	*tring;		/* our ring in it */
+	struct timespec tracestart;	/* when the traced operation began */
+	long long lockwait;	/* nsec it has waited for locks */
+	unsigned long nread;	/* bytes read, for the trace */
+	WBENT	**wbtab;	/* malloc'ed write buffer buckets, or NULL */
+	unsigned long wbmask;	/* number of them - 1, a power of 2 less 1 */
+	size_t	wbmax;		/* bytes it may hold */
+	size_t	wbbytes;	/* bytes it holds */
+	unsigned long wbcount;	/* stores it holds */
+	struct timespec wbtime;	/* when the oldest of them was made */
+	int	wbflushing;	/* stores go to the files */
+	int	wberr;		/* stores that failed when flushed */
 	
 	COUNT	cnt_delok;	/* delete OK */
 	COUNT	cnt_delerr;	/* delete error */
 	COUNT	cnt_fetchok;	/* fetch OK */
 	COUNT 	cnt_fetcherr;	/* fetch error */
+	COUNT	cnt_hops;	/* records passed by fetches */
+	COUNT	cnt_promote;	/* records moved to the front of their chain */
 	COUNT	cnt_nextrec;	/* next record */
 	COUNT	cnt_stor1;	/* store: DB_INSERT, no empty, appended */
 	COUNT	cnt_stor2;	/* store: DB_INSERT, found empty, reused */
-	COUNT	cnt_stor3;	/* store: DB_REPLACE, diff len; appended */
-	COUNT	cnt_stor4;	/* store: DB_REPLACE, same len; overwrote */
+	COUNT	cnt_stor3;	/* store: DB_REPLACE, diff len or no log; new rec */
+	COUNT	cnt_stor4;	/* store: DB_REPLACE, same len, logged; overwrote */
+	COUNT	cnt_reclaim;	/* dead records moved to the free list */
+	COUNT	cnt_wbmerge;	/* stores that replaced one still held */
 	COUNT	cnt_storerr;	/* store error */
 } DB;
 
 /* internal functions */
 static DB	*_db_alloc(int);
+static DB	*_db_open(const char *, int, int, const DBOPTS *, int);
+static int	_db_attr(DBSINDEX *, const char *, const char *, char *);
+static int	_db_attrkey(char *, const char *, const char *);
+static int	_db_indexadd(DBSINDEX *, const char *, const char *,
+		    const char *);
+static void	_db_indexdel(DBSINDEX *, const char *, const char *,
+		    const char *);
+static int	_db_indexopen(DB *, DBSINDEX *);
+static int	_db_indexstore(DB *, const char *, const char *, int, int);
+static void	_db_lookupshard(DB *, int, void *);
 static void	_db_dodelete(DB *);
+static void	_db_doreplace(DB *, const char *);
 static int	_db_find_and_lock(DB *, const char *, int);
-static int 	_db_findfree(DB *, int, int);
+static int	_db_fixdelete(DB *, const char *);
+static char	*_db_fixfetch(DB *, const char *);
+static int	_db_fixkey(DB *, const char *);
+static long	_db_fixmaxhops(DB *);
+static char	*_db_fixnextrec(DB *, char *);
+static void	_db_fixrecover(DB *);
+static int	_db_fixstore(DB *, const char *, const char *, int);
+static int	_db_fixwalk(DB *, long, int);
+static long	_db_slotalloc(DB *, int *);
+static void	_db_slotfree(DB *, long);
+static void	_db_slotwrite(DB *, int, void *, size_t, off_t, int);
+static int 	_db_findfree(DB *, size_t, size_t);
+static unsigned long _db_fnv(const char *);
+static unsigned	_db_fprint(const char *);
 static void	_db_free(DB *);
+static void	_db_aiofree(DB *);
+static void	_db_backupmark(DB *, int, off_t, size_t);
+static int	_db_backupstart(DB *, const char *, DBBACKUP *);
+static int	_db_backupfinish(DB *, DBBACKUP *);
+static int	_db_backupend(DB *, DBBACKUP *, int);
+static int	_db_copy(int, int, off_t, off_t);
+static void	_db_barrier(DB *);
+static void	_db_chainfix(DB *, off_t, int);
+static void	_db_checkpoint(DB *);
+static void	_db_commit(DB *);
+static void	_db_durable(DB *);
+static void	_db_freefix(DB *);
+static void	_db_unlockfree(DB *);
+static void	_db_walapply(DB *);
+static void	_db_walappend(DB *);
+static void	_db_walbegin(DB *);
+static int	_db_walorphans(DB *, off_t, off_t, const char *);
+static int	_db_walopen(DB *, int, int);
+static void	_db_walpeek(DB *, off_t, char *, size_t);
+static void	_db_walput(DB *, int, const struct iovec *, int, off_t);
+static char	*_db_walread(DB *, off_t, const WALREC *);
+static void	_db_walrecover(DB *);
+static void	_db_walredo(DB *, int);
+static void	_db_walreplay(DB *, const char *, size_t, char *, off_t, off_t);
+static ssize_t	_db_write(DB *, int, const struct iovec *, int, off_t, int);
+static void	_db_fsync(DB *, int);
+static void	_db_parallel(DB *, void (*)(DB *, int, void *), void *);
+static void	_db_promote(DB *, const char *);
+static void	_db_recount(DB *);
+static int	_db_readstats(DB *, DBSTATS *);
+static void	_db_savestats(DB *, int);
+static void	_db_fmtstats(char *, const DBSTATS *, int);
+static void	_db_reclaim(DB *);
+static int	_db_repopen(DB *, int, int);
+static void	_db_repput(DB *, int, const char *);
+static DB	*_db_shard(DB *, const char *);
+static int	_db_shardno(DB *, const char *);
+static int	_db_shardopen(DB *, const char *, int, int, const DBOPTS *);
+static void	_db_syncshard(DB *, int, void *);
+static void	_db_tablelock(DB *, int);
+static int	_db_lockw(DB *, int, off_t);
+static int	_db_wbcmp(const void *, const void *);
+static int	_db_wbdue(DB *);
+static int	_db_wbdrop(DB *, const char *);
+static char	*_db_wbfetch(DB *, const char *);
+static WBENT	**_db_wbfind(DB *, const char *);
+static void	_db_wbflush(DB *);
+static void	_db_flushshard(DB *, int, void *);
+static int	_db_wbstore(DB *, const char *, const char *, int);
+static void	_db_tracebegin(DB *);
+static void	_db_traceend(DB *, int, const char *, int);
+static void	_db_traceopen(DB *, int);
+static int	_db_shmflock(DB *, int, int);
+static void	_db_shmlock(DB *);
+static int	_db_shmopen(DB *, int);
+static int	_db_dostore(DB *, const char *, int, int);
 static DBHASH	_db_hash(DB *, const char *);
+static int	_db_keyenc(DB *, const char *);
+static void	_db_keydec(DB *, const char *, char *);
+static DBPTR	_db_parseptr(const char *);
+static void	_db_fmtptr(char *, DBPTR);
+static size_t	_db_fmtidx(DB *, const char *, char *, DBPTR);
 static char	*_db_readdat(DB *);
+static char	*_db_reread(DB *, off_t, char *);
+static int	_db_readhdr(DB *);
 static off_t	_db_readidx(DB *, off_t);
-static off_t	_db_readptr(DB *, off_t);
+static off_t	_db_reserve(DB *, int, size_t);
+static void	_db_seqbegin(DB *);
+static void	_db_seqend(DB *);
+static int	_db_seqfetch(DB *, const char *);
+static int	_db_seqwalk(DB *, off_t, long);
+static off_t	_db_skipnul(int, off_t);
+static DBPTR	_db_readptr(DB *, off_t);
+static const char *_db_splitidx(char *, off_t *, size_t *);
+static int	_db_checkidx(const char *, char *, size_t, unsigned int *);
+static long	_db_strtol(const char *, int, int);
 static void 	_db_writedat(DB *, const char *, off_t, int);
-static void	_db_writeidx(DB *, const char *, off_t, int, off_t);
-static void 	_db_writeptr(DB *, off_t, off_t);
+static void	_db_writehdr(DB *);
+static void	_db_writeidx(DB *, const char *, off_t, int, DBPTR);
+static void 	_db_writeptr(DB *, off_t, DBPTR);
 
 
 /* 
@@ -79,12 +545,41 @@ static void 	_db_writeptr(DB *, off_t, off_t);
  */
 DBHANDLE
 db_open(const char *pathname, int oflag, ...)
+{
+	int	mode = 0;
+	
+	if (oflag & O_CREAT) {
+		va_list	ap;
+		
+		va_start(ap, oflag);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return (db_openopt(pathname, oflag, mode, NULL));
+}
+
+/*
+ * open or create a database, with the options used when it is created.
+ * opts may be NULL for the defaults.
+ */
+DBHANDLE
+db_openopt(const char *pathname, int oflag, int mode, const DBOPTS *opts)
+{
+	return (_db_open(pathname, oflag, mode, opts, 0));
+}
+
+/*
+ * db_openopt(), with HDR_xxx flags for a database we create for
+ * ourselves.
+ */
+static DB *
+_db_open(const char *pathname, int oflag, int mode, const DBOPTS *opts,
+    int hdrflags)
 {
 	DB	*db;
-	int	len, mode;
-	size_t	i;
-	char	asciiptr[PTR_SZ + 1],
-		hash[(NHASH_DEF + 1) * PTR_SZ + 2];	/* +2 for newline and null */
+	int	len, created = 0;
+	size_t	wbuf = 0;
+	unsigned long n;
 	struct stat statbuff;
 	
 	/* allocate a DB structure, and the buffer it needs */
@@ -93,56 +588,424 @@ db_open(const char *pathname, int oflag, ...)
 		err_dump("dp_open: _db_alloc error for DB");
 	db->nhash = NHASH_DEF;		/* hash table size */
 	db->hashoff = HASH_OFF;		/* offset in index file of hash table */
+	db->aiodepth = AIO_DEPTH_DEF;
+	db->syncms = SYNCMS_DEF;
+	db->walmax = WALMAX_DEF;
+	db->flags = hdrflags;
+	if (opts != NULL && opts->nhash > 0)
+		db->nhash = opts->nhash;
+	if (opts != NULL && opts->aiodepth > 0)
+		db->aiodepth = opts->aiodepth;
+	if (opts != NULL) {
+		if (opts->sync < DB_SYNC_NONE || opts->sync > DB_SYNC_GROUP) {
+			_db_free(db);
+			errno = EINVAL;
+			return NULL;
+		}
+		db->sync = opts->sync;
+		if (opts->syncms > 0)
+			db->syncms = opts->syncms;
+		if (opts->wal)
+			db->flags |= HDR_WAL;
+		if (opts->walmax > 0)
+			db->walmax = opts->walmax;
+		if (opts->replog)
+			db->flags |= HDR_REPLOG;
+		if (opts->promote > 0 && (oflag & O_ACCMODE) != O_RDONLY)
+			db->promote = opts->promote;	/* it writes */
+		if (opts->nshards < 0 || opts->nshards > SHARDS_MAX) {
+			_db_free(db);
+			errno = EINVAL;
+			return NULL;
+		}
+		db->nshards = opts->nshards;
+		/* fixed size records need both sizes, and have no room
+		   to save by eliding a prefix.	*/
+		if ((opts->keysize > 0) != (opts->datsize > 0) ||
+		    opts->keysize > FIXKEY_MAX || opts->datsize > FIXDAT_MAX ||
+		    (opts->keysize > 0 && opts->keyprefix != NULL)) {
+			_db_free(db);
+			errno = EINVAL;
+			return NULL;
+		}
+		db->keysize = opts->keysize;
+		db->datsize = opts->datsize;
+		if (opts->trace > 0)
+			db->trace = opts->trace;
+		wbuf = opts->wbuf;
+	}
+	if (opts != NULL && opts->keyprefix != NULL) {
+		if ((db->prefixlen = strlen(opts->keyprefix)) > KEYPREFIX_MAX) {
+			_db_free(db);
+			errno = EINVAL;
+			return NULL;
+		}
+		strcpy(db->prefix, opts->keyprefix);
+	}
+	db->rdonly = (oflag & O_ACCMODE) == O_RDONLY;
 	strcpy(db->name, pathname);
 	strcat(db->name, ".idx");
 	
-	if (oflag & O_CREAT) {
-		va_list	ap;
-		
-		va_start(ap, oflag);
-		mode = va_arg(ap, int);
-		va_end(ap);
-		
-		/* open index file and data file */
-		db->idxfd = open(db->name, oflag, mode);
-		strcpy(db->name + len, ".dat");
-		db->datfd = open(db->name, oflag, mode);
-	} else {	/* open index file and data file */
-		db->idxfd = open(db->name, oflag);
-		strcpy(db->name + len, ".dat");
-		db->datfd = open(db->name, oflag);
-	}
+	/* open index file and data file */
+	db->idxfd = open(db->name, oflag, mode);
+	strcpy(db->name + len, ".dat");
+	db->datfd = open(db->name, oflag, mode);
 	if (db->idxfd < 0 || db->datfd < 0) {
 		_db_free(db);
 		return NULL;
 	}
-	if ((oflag & (O_CREAT | O_TRUNC)) == (O_CREATE | O_TRUNC)) {
+	if ((oflag & (O_CREAT | O_TRUNC)) == (O_CREAT | O_TRUNC)) {
 		/* if the database was created, we have to initialize it.
 		   write lock the entire file so that we can stat it,
 		   check its size, and initialize it, automically.	*/
 		if (writew_lock(db->idxfd, 0, SEEK_SET, 0) < 0)
 			err_dump("db_open: writew_lock error");
-		if (fstat(db->idxfd, db->statbuff) < 0)
+		if (fstat(db->idxfd, &statbuff) < 0)
 			err_sys("db_open: fstat error");
 		if (statbuff.st_size == 0) {
-			/* we have to build a list of (NHASH_DEF + 1) chain
-			   ptrs with a value of 0. the +1 is for the free
-			   list pointer that precedes the hash table.	*/
-			sprintf(asciiptr, "%*d", PTR_SZ, 0);
-			hash[0] = 0;
-			for (i = 0; i < NHASH_DEF + 1; i++)
-				strcat(hash, asciiptr);
-			strcat(hash, "\n");
-			i = strlen(hash);
-			if (write(db->idxfd, hash, i) != i)
-				err_dump("db_open: index file init write error");			
+			/* the header goes first. */
+			_db_writehdr(db);
+			created = 1;
+		}
+		if (created && db->nshards == 0 && db->keysize > 0) {
+			/* a table of slot numbers of 0, up to the first
+			   slot, is all NULs.	*/
+			if (ftruncate(db->idxfd, SLOT_FIRSTOFF(db->nhash)) < 0)
+				err_sys("db_open: ftruncate error");
+		} else if (created && db->nshards == 0) {
+			/* then we need (nhash + 1) chain ptrs with a value
+			   of 0, the +1 for the free list pointer that precedes
+			   the hash table, and a newline. a ptr field of NULs
+			   reads as 0, so writing the newline leaves a hole
+			   that is the table. the shards of a sharded
+			   database have their own.	*/
+			if (pwrite(db->idxfd, "\n", 1, HASH_OFF +
+			    db->nhash * PTR_SZ) != 1)
+				err_dump("db_open: index file init write error");
 		}
 		if (un_lock(db->idxfd, 0, SEEK_SET, 0) < 0)
 			err_dump("db_open: un_lock error");
 	}
+	db->created = created;
+	/* the header, not the options, describes an existing database. */
+	if (_db_readhdr(db) < 0) {
+		_db_free(db);
+		errno = EINVAL;
+		return NULL;
+	}
+	/* a writer logs its changes for the replicas; the shards of a
+	   sharded database share its log.	*/
+	if ((db->flags & HDR_REPLOG) && (oflag & O_ACCMODE) != O_RDONLY &&
+	    _db_repopen(db, len, created) < 0) {
+		_db_free(db);
+		return NULL;
+	}
+	if (db->nshards > 0) {
+		if (_db_shardopen(db, pathname, oflag, mode, opts) < 0) {
+			_db_free(db);
+			return NULL;
+		}
+		db_rewind(db);
+		return (db);
+	}
+	/* only a writer needs the log. */
+	if ((db->flags & HDR_WAL) && (oflag & O_ACCMODE) != O_RDONLY &&
+	    _db_walopen(db, len, created) < 0) {
+		_db_free(db);
+		return NULL;
+	}
+	/* appends, group commit, the log and lockless reads are
+	   coordinated through the shared memory segment. a reader
+	   that can't have it just locks.	*/
+	if (_db_shmopen(db, len) < 0) {
+		if ((oflag & O_ACCMODE) != O_RDONLY ||
+		    db->sync == DB_SYNC_GROUP) {
+			_db_free(db);
+			return NULL;
+		}
+		if (db->shm != NULL)
+			munmap(db->shm, db->shmsize);
+		db->shm = NULL;
+	}
+	/* the counts in the header go stale as soon as a writer has
+	   the database open.	*/
+	if (db->shm != NULL && !db->rdonly) {
+		_db_shmlock(db);
+		if (db->shm->statsclean) {
+			_db_savestats(db, 0);
+			db->shm->statsclean = 0;
+		}
+		pthread_mutex_unlock(&db->shm->mutex);
+	}
+	if (db->trace > 0)
+		_db_traceopen(db, len);
+	if (db->walfd >= 0)
+		_db_walrecover(db);
+	if (db->keysize > 0 && (oflag & O_ACCMODE) != O_RDONLY)
+		_db_fixrecover(db);
+	/* a store has to be durable when it returns in the other sync
+	   modes, so it can't be held. fixed size records are written in
+	   place already.	*/
+	if (wbuf > 0 && !db->rdonly && db->keysize == 0 &&
+	    (db->sync == DB_SYNC_NONE || db->sync == DB_SYNC_PERIODIC)) {
+		for (n = 64; n * WB_BUCKETSZ < wbuf && n < WB_BUCKETS_MAX; n *= 2)
+			;
+		if ((db->wbtab = calloc(n, sizeof(WBENT *))) == NULL)
+			err_dump("db_open: calloc error for write buffer");
+		db->wbmask = n - 1;
+		db->wbmax = wbuf;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &db->lastsync);
+	db->rand = (((unsigned int) getpid() * 2654435761U) ^
+	    (unsigned int) db->lastsync.tv_nsec) | 1;
 	db_rewind(db);
 	return (db);
 }
+
+/*
+ * open the shared memory segment, <name>.shm.
+ * the first process to open it (re)initializes it. every process holds
+ * a read lock on the whole file while it has it open, so a process that
+ * gets a write lock knows no one else is using it.
+ */
+static int
+_db_shmopen(DB *db, int namelen)
+{
+	struct stat	statbuff;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	DBSHM		*shm;
+	int		init = 0;
+	
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_shmopen: fstat error");
+	strcpy(db->name + namelen, ".shm");
+	if ((db->shmfd = open(db->name, O_RDWR | O_CREAT,
+	    statbuff.st_mode & 0666)) < 0)
+		return (-1);
+	if (_db_shmflock(db, 0, F_WRLCK) == 0)
+		init = 1;
+	else if (errno == EACCES || errno == EAGAIN) {
+		/* others have it open. wait out any initialization.	*/
+		if (_db_shmflock(db, 1, F_RDLCK) < 0)
+			err_dump("_db_shmopen: readw_lock error");
+		init = 0;
+	} else
+		err_dump("_db_shmopen: write_lock error");
+	/* the slot bitmap is sized for the most slots there can be;
+	   the pages of it not yet used take no space.	*/
+	db->shmsize = SHM_SIZE(db->nhash);
+	if (db->keysize > 0)
+		db->shmsize = SHM_MAPOFF(db->nhash) + SLOTS_MAX / 8;
+	if (init && (ftruncate(db->shmfd, 0) < 0 ||
+	    ftruncate(db->shmfd, db->shmsize) < 0))
+		err_sys("_db_shmopen: ftruncate error");
+	if ((shm = mmap(NULL, db->shmsize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, db->shmfd, 0)) == MAP_FAILED)
+		err_sys("_db_shmopen: mmap error");
+	db->shm = shm;
+	if (db->keysize > 0)
+		db->slotmap = (unsigned long long *) ((char *) shm +
+		    SHM_MAPOFF(db->nhash));
+	
+	if (init) {
+		pthread_mutexattr_init(&mattr);
+		pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&shm->mutex, &mattr);
+		pthread_mutexattr_destroy(&mattr);
+		pthread_condattr_init(&cattr);
+		pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+		pthread_cond_init(&shm->cond, &cattr);
+		pthread_condattr_destroy(&cattr);
+		/* the files end where the last append that was written
+		   ends; appends reserved past that died with their writers. */
+		shm->idxend = shm->idxalloc = statbuff.st_size;
+		if (fstat(db->datfd, &statbuff) < 0)
+			err_sys("_db_shmopen: fstat error");
+		shm->datend = shm->datalloc = statbuff.st_size;
+		shm->statsok = shm->statsclean =
+		    _db_readstats(db, &shm->stats) == 1;
+		shm->magic = SHM_MAGIC;
+		
+		/* done: turn our write lock into a read lock.	*/
+		if (_db_shmflock(db, 0, F_RDLCK) < 0)
+			err_dump("_db_shmopen: read_lock error");
+	} else if (shm->magic != SHM_MAGIC) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * lock all of the shared memory segment's file, waiting if wait is set,
+ * with a lock of type. the locks say who has the database open, so where
+ * there are open file description locks (Linux) they belong to our open
+ * of the file, not to our process: a process can then open the database
+ * more than once, and close one handle without dropping the others'
+ * locks. elsewhere a process must have a database open only once.
+ */
+static int
+_db_shmflock(DB *db, int wait, int type)
+{
+	struct flock	lock;
+	
+	memset(&lock, 0, sizeof(lock));		/* l_pid 0 for OFD locks */
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;		/* l_len 0: the whole file */
+#ifdef F_OFD_SETLK
+	return (fcntl(db->shmfd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock));
+#else
+	return (fcntl(db->shmfd, wait ? F_SETLKW : F_SETLK, &lock));
+#endif
+}
+
+/*
+ * lock the shared memory segment. if a process died holding the
+ * lock, what it protects is still consistent enough for us.
+ */
+static void
+_db_shmlock(DB *db)
+{
+	int	rc;
+	
+	if ((rc = pthread_mutex_lock(&db->shm->mutex)) == EOWNERDEAD)
+		pthread_mutex_consistent(&db->shm->mutex);
+	else if (rc != 0)
+		err_dump("_db_shmlock: pthread_mutex_lock error");
+}
+
+/*
+ * write the header at the front of the index file.
+ * called by db_open() with the entire file locked.
+ */
+static void
+_db_writehdr(DB *db)
+{
+	char	hdr[HDR_SZ];
+	DBSTATS	st;
+	int	n;
+	
+	memset(hdr, SPACE, HDR_SZ);
+	n = sprintf(hdr, "%s %d %lu %d %d %lu %lu %lu ", HDR_MAGIC, HDR_VERSION,
+	    db->nhash, db->flags, db->nshards, (unsigned long) db->keysize,
+	    (unsigned long) db->datsize, (unsigned long) db->prefixlen);
+	memcpy(hdr + n, db->prefix, db->prefixlen);
+	hdr[STATS_OFF - 1] = NEWLINE;
+	memset(&st, 0, sizeof(st));	/* empty, and that is right */
+	_db_fmtstats(hdr + STATS_OFF, &st, 1);
+	if (pwrite(db->idxfd, hdr, HDR_SZ, 0) != HDR_SZ)
+		err_dump("_db_writehdr: write error of header");
+}
+
+/*
+ * read the header at the front of the index file and set up the
+ * DB structure from it. returns -1 if this is not an index file we know.
+ */
+static int
+_db_readhdr(DB *db)
+{
+	char	hdr[HDR_SZ + 1], magic[sizeof(HDR_MAGIC)];
+	int	version, flags, nshards, n;
+	unsigned long nhash, keysize, datsize, prefixlen;
+	ssize_t	i;
+	
+	/* the creator holds a lock on the whole file until it is initialized. */
+	if (readw_lock(db->idxfd, 0, SEEK_SET, HDR_SZ) < 0)
+		err_dump("_db_readhdr: readw_lock error");
+	i = pread(db->idxfd, hdr, HDR_SZ, 0);
+	if (un_lock(db->idxfd, 0, SEEK_SET, HDR_SZ) < 0)
+		err_dump("_db_readhdr: un_lock error");
+	if (i != HDR_SZ || hdr[STATS_OFF - 1] != NEWLINE ||
+	    hdr[HDR_SZ - 1] != NEWLINE)
+		return (-1);
+	hdr[STATS_OFF - 1] = 0;		/* the counts are read elsewhere */
+	if (sscanf(hdr, "%5s %d %lu %d %d %lu %lu %lu %n", magic, &version,
+	    &nhash, &flags, &nshards, &keysize, &datsize, &prefixlen, &n) != 8)
+		return (-1);
+	if (strcmp(magic, HDR_MAGIC) != 0 || version != HDR_VERSION ||
+	    nhash == 0 || nshards < 0 || nshards > SHARDS_MAX ||
+	    keysize > FIXKEY_MAX || datsize > FIXDAT_MAX ||
+	    (keysize > 0) != (datsize > 0) ||
+	    prefixlen > KEYPREFIX_MAX || n + prefixlen >= STATS_OFF)
+		return (-1);
+	
+	db->nhash = nhash;
+	db->flags = flags;
+	db->nshards = nshards;
+	db->prefixlen = prefixlen;
+	memcpy(db->prefix, hdr + n, prefixlen);
+	db->prefix[prefixlen] = 0;
+	db->firstoff = db->hashoff + db->nhash * PTR_SZ + 1;	/* +1 for newline */
+	if ((db->keysize = keysize) > 0) {
+		db->datsize = datsize;
+		db->islotsz = SLOT_ROUND(sizeof(FIXSLOT) + keysize);
+		db->dslotsz = SLOT_ROUND(datsize);
+		db->firstoff = SLOT_FIRSTOFF(db->nhash);
+	}
+	return (0);
+}
+
+/*
+ * format the counts line of the header into the HDR_SZ - STATS_OFF bytes
+ * at buf.
+ */
+static void
+_db_fmtstats(char *buf, const DBSTATS *st, int clean)
+{
+	char	line[HDR_SZ - STATS_OFF + 1];
+	int	n;
+	
+	n = snprintf(line, sizeof(line), "%d %*llu %*llu %*llu %*llu %*llu %*llu",
+	    clean, STATS_WIDTH, st->nrecs, STATS_WIDTH, st->recbytes,
+	    STATS_WIDTH, st->ndead, STATS_WIDTH, st->deadbytes,
+	    STATS_WIDTH, st->nfree, STATS_WIDTH, st->freebytes);
+	memset(buf, SPACE, HDR_SZ - STATS_OFF);
+	memcpy(buf, line, n);
+	buf[HDR_SZ - STATS_OFF - 1] = NEWLINE;
+}
+
+/*
+ * read the counts saved in the header. returns 1 if they are right,
+ * 0 if they were saved while a writer had the database open, and -1
+ * if they can't be read.
+ */
+static int
+_db_readstats(DB *db, DBSTATS *st)
+{
+	char	line[HDR_SZ - STATS_OFF + 1];
+	int	clean;
+	
+	if (pread(db->idxfd, line, HDR_SZ - STATS_OFF, STATS_OFF) !=
+	    HDR_SZ - STATS_OFF)
+		return (-1);
+	line[HDR_SZ - STATS_OFF] = 0;
+	if (sscanf(line, "%d %llu %llu %llu %llu %llu %llu", &clean,
+	    &st->nrecs, &st->recbytes, &st->ndead, &st->deadbytes,
+	    &st->nfree, &st->freebytes) != 7)
+		return (-1);
+	return (clean == 1);
+}
+
+/*
+ * save the counts in the shared memory segment to the header, marked
+ * clean or not. one small write, made when the last process closes
+ * the database and when the first writer opens it.
+ */
+static void
+_db_savestats(DB *db, int clean)
+{
+	char	line[HDR_SZ - STATS_OFF];
+	DBSTATS	st;
+	
+	memcpy(&st, &db->shm->stats, sizeof(st));
+	_db_fmtstats(line, &st, clean);
+	if (pwrite(db->idxfd, line, HDR_SZ - STATS_OFF, STATS_OFF) !=
+	    HDR_SZ - STATS_OFF)
+		err_sys("_db_savestats: write error of header");
+	_db_backupmark(db, db->idxfd, STATS_OFF, HDR_SZ - STATS_OFF);
+}
 /* 
  * allocate & initialize a DB structure and its buffers 
  */
@@ -154,15 +1017,18 @@ _db_alloc(int namelen)
 	/* use calloc(), to initialize the structure to zero */
 	if ((db = calloc(1, sizeof(DB))) == NULL) 
 		err_dump("_db_alloc: calloc error for DB");
-	db->idxfd = db->datfd = -1;	/* descriptors */
+	db->idxfd = db->datfd = db->shmfd = db->walfd = db->repfd = -1;
+	db->pid = getpid();
 	/* alloc room for the name. +5 for ".idx" or ".dat" plus '\0' at end. */
 	if ((db->name = malloc(namelen + 5)) == NULL)
 		err_dump("_db_alloc: malloc error for name");
 	/* allocate an index buffer and a data buffer. +2 for '\n' and '\0' at end. */
 	if ((db->idxbuf = malloc(IDXLEN_MAX + 2)) == NULL)
 		err_dump("_db_alloc: malloc error for index buffer");
-	if ((db->datbuf = malloc(DATLEN_MAX + 2)) == NULL)
+	if ((db->datbuf = malloc(DATALEN_MAX + 2)) == NULL)
 		err_dump("_db_alloc: malloc error for data buffer");
+	if ((db->keybuf = malloc(IDXLEN_MAX + 2)) == NULL)
+		err_dump("_db_alloc: malloc error for key buffer");
 	
 	return (db);	
 }
@@ -172,7 +1038,13 @@ _db_alloc(int namelen)
 void 
 db_close(DBHANDLE h)
 {
-	_db_free((DB *) h);	/* close fds, free buffers & struct */
+	DB	*db = h;
+	
+	if (db->sync != DB_SYNC_NONE)
+		db_sync(db);	/* all shards at once */
+	else
+		db_flush(db);
+	_db_free(db);	/* close fds, free buffers & struct */
 }
 /* 
  * free up a DB structure, and all the malloc'ed buffers it may point to.
@@ -181,21 +1053,73 @@ db_close(DBHANDLE h)
 static void
 _db_free(DB *db)
 {
+	WBENT	*e;
+	unsigned long b;
+	int	i;
+	
+	if (db->shard != NULL) {
+		for (i = 0; i < db->nshards; i++)
+			if (db->shard[i] != NULL)
+				_db_free(db->shard[i]);
+		free(db->shard);
+	}
+	if (db->sindex != NULL) {
+		for (i = 0; i < db->nsindex; i++)
+			_db_free(db->sindex[i].idx);
+		free(db->sindex);
+	}
+	if (db->aio != NULL)
+		_db_aiofree(db);
+	if (db->wbtab != NULL) {
+		for (b = 0; b <= db->wbmask; b++)
+			while ((e = db->wbtab[b]) != NULL) {
+				db->wbtab[b] = e->next;
+				free(e);
+			}
+		free(db->wbtab);
+	}
+	/* the last process to close the database saves the counts;
+	   a write lock on the shared memory segment says we are it.
+	   a child closing a handle it inherited is never last: the
+	   lock would be the one its parent's handle holds too.	*/
+	if (db->shm != NULL && !db->rdonly && db->shm->statsok &&
+	    db->pid == getpid() && _db_shmflock(db, 0, F_WRLCK) == 0)
+		_db_savestats(db, 1);
 	if (db->idxfd >= 0)
 		close(db->idxfd);
 	if (db->datfd >= 0)
 		close(db->datfd);
+	if (db->shm != NULL)
+		munmap(db->shm, db->shmsize);
+	if (db->shmfd >= 0)
+		close(db->shmfd);	/* releases our read lock */
+	/* the events stay for dbtrace. a child's ring is its parent's. */
+	if (db->tring != NULL && db->pid == getpid())
+		__atomic_store_n(&db->tring->pid, 0, __ATOMIC_RELEASE);
+	if (db->trfile != NULL)
+		munmap(db->trfile, sizeof(DBTRFILE));
+	if (db->walfd >= 0)
+		close(db->walfd);
+	if (db->walbuf != NULL)
+		free(db->walbuf);
+	if (db->repfd >= 0)
+		close(db->repfd);
+	if (db->repbuf != NULL)
+		free(db->repbuf);
 	if (db->idxbuf != NULL)
 		free(db->idxbuf);
 	if (db->datbuf != NULL)
 		free(db->datbuf);
+	if (db->keybuf != NULL)
+		free(db->keybuf);
 	if (db->name != NULL)
 		free(db->name);
 	
 	free(db);
 }
 /*
- * fetch a record. return a pointer to the null-terminated data.
+ * fetch a record. return a pointer to the null-terminated data, or NULL
+ * if it isn't found, with errno EIO if a damaged record was.
  */
 char *
 db_fetch(DBHANDLE h, const char *key)
@@ -203,27 +1127,101 @@ db_fetch(DBHANDLE h, const char *key)
 	DB	*db = h;
 	char	*ptr;
 	
-	if (_db_find_and_lock(db, key, 0) < 0) {
-		ptr = NULL;		/* error, record not found */
-		db->cnt_fetcherr++;
-	} else {
-		ptr = _db_readdat(db);	/* return pointer to data */
+	if (db->nshards > 0)
+		return (db_fetch(_db_shard(db, key), key));
+	if (db->trace > 0 && !db->tracing && --db->tracewait <= 0) {
+		_db_tracebegin(db);
+		ptr = db_fetch(db, key);
+		_db_traceend(db, DBTRACE_FETCH, key, ptr != NULL ? 0 : -1);
+		return (ptr);
+	}
+	if (db->wbcount > 0 && (ptr = _db_wbfetch(db, key)) != NULL) {
 		db->cnt_fetchok++;
+		return (ptr);
 	}
+	if (db->keysize > 0)
+		return (_db_fixfetch(db, key));
 	
-	/* unlock the hash chain that _db_find_and_lock locked. */
-	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-		err_dump("db_fetch: un_lock error");
+	/* first try without locking the chain.	*/
+	db->hops = 0;
+	switch (_db_seqfetch(db, key)) {
+	case 1:
+		ptr = db->datbuf;
+		break;
+	case 0:
+		ptr = NULL;
+		break;
+	default:
+		if (_db_find_and_lock(db, key, 0) < 0)
+			ptr = NULL;		/* error, record not found */
+		else
+			ptr = _db_readdat(db);	/* return pointer to data */
+		
+		/* unlock the hash chain that _db_find_and_lock locked. */
+		if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+			err_dump("db_fetch: un_lock error");
+	}
+	db->cnt_hops += db->hops;
+	if (ptr == NULL) {
+		db->cnt_fetcherr++;
+		return (NULL);
+	}
+	db->cnt_fetchok++;
+	
+	/* a sample of the records found deep in their chains move to the
+	   front, so the keys fetched most end up at the front.	*/
+	if (db->promote > 0 && db->hops >= PROMOTE_HOPS) {
+		db->rand ^= db->rand << 13;	/* xorshift */
+		db->rand ^= db->rand >> 17;
+		db->rand ^= db->rand << 5;
+		if (db->rand % db->promote == 0)
+			_db_promote(db, key);
+	}
 	return (ptr);
 }
+
+/*
+ * move the record for key to the front of its hash chain. db->datbuf,
+ * which db_fetch() returns, is left alone.
+ * the move rewrites three chain ptrs, which only a write-ahead log can
+ * make crash safe, so with DB_SYNC_OP or DB_SYNC_GROUP and no log we
+ * don't. with a log, the move costs a sync of it in those modes.
+ */
+static void
+_db_promote(DB *db, const char *key)
+{
+	DBPTR	head;
+	
+	if (db->walfd < 0 && (db->sync == DB_SYNC_OP ||
+	    db->sync == DB_SYNC_GROUP))
+		return;
+	/* the chain may have changed since we walked it.	*/
+	if (_db_find_and_lock(db, key, 1) == 0 && db->ptroff != db->chainoff) {
+		_db_seqbegin(db);
+		head = _db_readptr(db, db->chainoff);
+		/* unlink it, keeping the dead flag of the record before. */
+		_db_writeptr(db, db->ptroff, db->ptrval |
+		    (_db_readptr(db, db->ptroff) & PTR_DEAD));
+		_db_writeptr(db, db->idxoff, head);
+		_db_writeptr(db, db->chainoff,
+		    PTR_MAKE(db->idxoff, db->keyfp, db->keylen));
+		_db_commit(db);
+		_db_seqend(db);
+		db->cnt_promote++;
+	}
+	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+		err_dump("_db_promote: un_lock error");
+}
 /*
  * find the specified record. call by db_delete, db_fetch, and db_store.
- * return with the hash chain locked.
+ * return with the hash chain locked: 0 if found, -1 if not, -2 with
+ * errno EIO if a damaged record was in the way.
  */
 static int
 _db_find_and_lock(DB *db, const char *key, int writelock)
 {
-	off_t	offset, nextoffset;
+	DBPTR	ptr;
+	off_t	offset;
 	
 	/* calculate the hash value for this key, then calculate the byte offset 
 	   of corresponding chain ptr in hash table.
@@ -234,28 +1232,150 @@ _db_find_and_lock(DB *db, const char *key, int writelock)
 	
 	/* we lock the hash chain here. the caller must un_lock it when done.
 	   note we lock and unlock only the first byte.		*/
-	if (writelock) {
-		if (writew_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-			err_dump("_db_find_and_lock: writew_lock error");
-	} else {
-		if (readw_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-			err_dump("_db_find_and_lock: readw_lock error");
-	}
+	if (_db_lockw(db, writelock ? F_WRLCK : F_RDLCK, db->chainoff) < 0)
+		err_dump("_db_find_and_lock: lock error");
+	_db_chainfix(db, db->chainoff, writelock ? F_WRLCK : F_RDLCK);
 	
-	/* get the offset in the index file of first record on 
-	   the hash chain (can be 0).		*/
-	offset = _db_readptr(db->idxfd, db->ptroff);
-	while (offset != 0) {
-		nextoffset = _db_readidx(db->idxfd, offset);
-		if (strcmp(db->idxbuf, key) == 0)
-			break;		/* found a match */
+	/* get the ptr to the first record on the hash chain (can be 0).
+	   a key too long to have been stored can't be found.	*/
+	if (_db_keyenc(db, key) < 0)
+		return (-1);
+	ptr = _db_readptr(db, db->ptroff);
+	db->hops = 0;
+	db->ndead = 0;
+	while ((offset = PTR_OFF(ptr)) != 0) {
+		/* only a record whose fingerprint and key length both match
+		   is worth reading; for the others the chain ptr at the
+		   front of the record is all we need. a dead record is
+		   no match.	*/
+		if (PTR_FP(ptr) == db->keyfp && PTR_KLEN(ptr) == db->keylen) {
+			if (_db_readidx(db, offset) < -1)
+				return (-2);	/* damaged */
+			if (!(db->ptrval & PTR_DEAD) &&
+			    strcmp(db->idxbuf, db->keybuf) == 0)
+				break;		/* found a match */
+			ptr = db->ptrval;
+		} else {
+			ptr = _db_readptr(db, offset);
+		}
+		if (ptr & PTR_DEAD)
+			db->ndead++;
 		db->ptroff = offset;	/* offset of this (unequal) record */
-		offset = nextoffset;	/* next one to compare */
+		db->hops++;
 	}
 	
 	/* offset == 0 on error (record not found) */
 	return (offset == 0 ? -1 : 0);
 }
+/*
+ * look a key up without locking its chain: walk the chain, and if the
+ * chain's version was the same, and even, before and after, no writer
+ * changed it meanwhile. returns 1 if found, with the data in db->datbuf,
+ * 0 if not found, and -1 if we have to lock the chain after all.
+ */
+static int
+_db_seqfetch(DB *db, const char *key)
+{
+	unsigned int	*ver, v;
+	DBHASH	hash;
+	long	maxhops;
+	int	i, rc;
+	
+	if (db->shm == NULL)
+		return (-1);
+	if (_db_keyenc(db, key) < 0)
+		return (0);		/* too long to have been stored */
+	hash = _db_hash(db, key);
+	ver = &db->shm->chainver[hash];
+	/* a chain longer than the file has room for is garbage.	*/
+	maxhops = __atomic_load_n(&db->shm->idxend, __ATOMIC_RELAXED) /
+	    (PTR_SZ + IDXLEN_SZ + IDXLEN_MIN) + 1;
+	for (i = 0; i < SEQ_TRIES; i++) {
+		if ((v = __atomic_load_n(ver, __ATOMIC_ACQUIRE)) & 1)
+			continue;	/* a writer is at it */
+		rc = _db_seqwalk(db, hash * PTR_SZ + db->hashoff, maxhops);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (rc >= 0 && __atomic_load_n(ver, __ATOMIC_RELAXED) == v)
+			return (rc);
+	}
+	return (-1);
+}
+/*
+ * walk a chain for the key in db->keybuf, with pread(), as _db_find_and_lock
+ * does. a writer may change what we read under us, so we check it all
+ * and stop after maxhops records. returns 1 if found, with the data in
+ * db->datbuf, 0 if not found, and -1 if what we read made no sense.
+ */
+static int
+_db_seqwalk(DB *db, off_t chainoff, long maxhops)
+{
+	char	rec[PTR_SZ + IDXLEN_SZ + IDXLEN_MAX + 1], *idx;
+	DBPTR	ptr;
+	off_t	offset, datoff;
+	size_t	idxlen, datlen;
+	ssize_t	n;
+	unsigned int datcrc;
+	
+	idx = rec + PTR_SZ + IDXLEN_SZ;
+	if (pread(db->idxfd, rec, PTR_SZ, chainoff) != PTR_SZ)
+		return (-1);
+	db->nread += PTR_SZ;
+	ptr = _db_parseptr(rec);
+	for (db->hops = 0; (offset = PTR_OFF(ptr)) != 0; db->hops++) {
+		if (maxhops-- == 0 || offset < db->firstoff)
+			return (-1);
+		if (PTR_FP(ptr) != db->keyfp || PTR_KLEN(ptr) != db->keylen) {
+			if (pread(db->idxfd, rec, PTR_SZ, offset) != PTR_SZ)
+				return (-1);
+			db->nread += PTR_SZ;
+			ptr = _db_parseptr(rec);
+			continue;
+		}
+		/* read the whole record at once: it can't be longer.	*/
+		if ((n = pread(db->idxfd, rec, sizeof(rec) - 1, offset)) <
+		    PTR_SZ + IDXLEN_SZ)
+			return (-1);
+		db->nread += n;
+		idxlen = _db_strtol(rec + PTR_SZ, IDXLEN_SZ, 10);
+		if (idxlen < IDXLEN_MIN || idxlen > IDXLEN_MAX ||
+		    PTR_SZ + IDXLEN_SZ + idxlen > n ||
+		    _db_checkidx(rec + PTR_SZ, idx, idxlen, &datcrc) < 0 ||
+		    _db_splitidx(idx, &datoff, &datlen) != NULL)
+			return (-1);
+		ptr = _db_parseptr(rec);
+		if (!(ptr & PTR_DEAD) && strcmp(idx, db->keybuf) == 0) {
+			if (datlen < DATALEN_MIN || datlen > DATALEN_MAX ||
+			    pread(db->datfd, db->datbuf, datlen, datoff) != datlen ||
+			    db->datbuf[datlen - 1] != NEWLINE ||
+			    crc32c(0, db->datbuf, datlen - 1) != datcrc)
+				return (-1);
+			db->nread += datlen;
+			db->datbuf[datlen - 1] = 0;
+			db->datlen = datlen;
+			return (1);
+		}
+	}
+	return (0);
+}
+/*
+ * a writer holding a chain's write lock brackets its changes to the
+ * chain with these: the chain's version is odd in between.
+ */
+static void
+_db_seqbegin(DB *db)
+{
+	if (db->shm != NULL)
+		__atomic_add_fetch(&db->shm->chainver[(db->chainoff -
+		    db->hashoff) / CHAINPTR_SZ(db)], 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+_db_seqend(DB *db)
+{
+	if (db->shm != NULL)
+		__atomic_add_fetch(&db->shm->chainver[(db->chainoff -
+		    db->hashoff) / CHAINPTR_SZ(db)], 1, __ATOMIC_RELEASE);
+}
 /*
  * calculate the hash value for a key.
  */
@@ -263,42 +1383,143 @@ static DBHASH
 _db_hash(DB *db, const char *key)
 {
 	DBHASH	hval = 0;
-	char	c;
+	char	c, end;
 	int	i;
 	
-	for (i = 1; (c = *key++) != 0; i++)
+	/* the entries of a secondary index hash on their attribute, and
+	   the key after it picks one of the chains that follow.	*/
+	end = (db->flags & HDR_ATTRIDX) ? ATTR_SEP : 0;
+	for (i = 1; (c = *key++) != 0 && c != end; i++)
 		hval += c * i;		/* ascii char times its 1-based index */
+	if (c != 0)
+		hval += _db_fnv(key) % ATTR_CHAINS;
 	return (hval % db->nhash);
 }
 /*
- * read a chain ptr field frome anywhere in the index file:
- * the free list pointer, a hash table chain ptr, or an index record chain ptr.
+ * calculate the 32 bit FNV-1a hash of a key.
  */
-static off_t
-_db_readptr(DB *db, off_t offset)
+static unsigned long
+_db_fnv(const char *key)
 {
-	char	asciiptr[PTR_SZ + 1];
+	unsigned long	h = 2166136261UL;
 	
-	if (lseek(db->idxfd, offset, SEEK_SET) == -1)
-		err_dump("_db_readptr: lseek error to ptr field");
-	if (read(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ)
-		err_dump("_db_readptr: read error of ptr field");
-	asciiptr[PTR_SZ] = 0;
-	return atol(asciiptr);
+	while (*key != 0) {
+		h ^= (unsigned char) *key++;
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+	return (h);
 }
-
 /*
- * read the next index record.
- * we start the specified offset in the index file. we read the index record into db->idxbuf
- * and replace the separators with null('\0') bytes. if all is OK we set db->datoff and db->datlen
- * to the offset and the length of the corresponding data record in the data file.
+ * calculate the fingerprint of a key that goes in the ptr fields.
+ * it has to be independent of _db_hash, since every key on a chain
+ * has the same hash value. this is FNV-1a folded to FPRINT_SZ hex digits.
  */
-static off_t
-_db_readidx(DB *db, off_t offset)
+static unsigned
+_db_fprint(const char *key)
+{
+	unsigned long	h = _db_fnv(key);
+	
+	return ((h >> 16 ^ h) & FPRINT_MASK);
+}
+/*
+ * build the key as it is stored in the index file in db->keybuf,
+ * and set db->keylen and db->keyfp. with a common key prefix the
+ * stored key is a tag byte followed by the key with the prefix elided.
+ * returns -1 if the key is too long to be stored.
+ */
+static int
+_db_keyenc(DB *db, const char *key)
+{
+	char	*ptr = db->keybuf;
+	size_t	len;
+	
+	db->keyfp = _db_fprint(key);
+	if (db->prefixlen > 0) {
+		if (strncmp(key, db->prefix, db->prefixlen) == 0) {
+			*ptr++ = KEY_PREFIXED;
+			key += db->prefixlen;
+		} else
+			*ptr++ = KEY_VERBATIM;
+	}
+	len = strlen(key);
+	if ((ptr - db->keybuf) + len > IDXLEN_MAX)
+		return (-1);
+	memcpy(ptr, key, len + 1);
+	db->keylen = (ptr - db->keybuf) + len;
+	return (0);
+}
+/*
+ * convert a fixed width ascii field, which need not be null terminated.
+ */
+static long
+_db_strtol(const char *ptr, int len, int base)
+{
+	char	buf[32];
+	
+	memcpy(buf, ptr, len);
+	buf[len] = 0;
+	return (strtol(buf, NULL, base));
+}
+/*
+ * convert the ascii ptr field at ptr: offset, key fingerprint, key length,
+ * dead flag.
+ */
+static DBPTR
+_db_parseptr(const char *ptr)
+{
+	return (PTR_MAKE(_db_strtol(ptr, OFF_SZ, 10),
+	    _db_strtol(ptr + OFF_SZ, FPRINT_SZ, 16),
+	    _db_strtol(ptr + OFF_SZ + FPRINT_SZ, KEYLEN_SZ, 10)) |
+	    (ptr[PTR_SZ - DEAD_SZ] == TOMB ? PTR_DEAD : 0));
+}
+/*
+ * format a ptr field into the PTR_SZ + 1 bytes at buf. the fields of a
+ * DBPTR can hold more digits than their ascii fields, so it is formatted
+ * where they fit, and cut to PTR_SZ.
+ */
+static void
+_db_fmtptr(char *buf, DBPTR ptr)
+{
+	char	tmp[PTR_SZ + 16];	/* 10 digit offset, 5 digit length */
+	
+	snprintf(tmp, sizeof(tmp), "%*ld%0*x%*u%c", OFF_SZ, (long) PTR_OFF(ptr),
+	    FPRINT_SZ, PTR_FP(ptr), KEYLEN_SZ, (unsigned) PTR_KLEN(ptr),
+	    (ptr & PTR_DEAD) ? TOMB : SPACE);
+	memcpy(buf, tmp, PTR_SZ);
+	buf[PTR_SZ] = 0;
+}
+/*
+ * read a chain ptr field frome anywhere in the index file:
+ * the free list pointer, a hash table chain ptr, or an index record chain ptr.
+ */
+static DBPTR
+_db_readptr(DB *db, off_t offset)
+{
+	char	asciiptr[PTR_SZ];
+	
+	if (lseek(db->idxfd, offset, SEEK_SET) == -1)
+		err_dump("_db_readptr: lseek error to ptr field");
+	if (read(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ)
+		err_dump("_db_readptr: read error of ptr field");
+	db->nread += PTR_SZ;
+	if (db->wallen > 0)	/* we may have written it, but not yet applied */
+		_db_walpeek(db, offset, asciiptr, PTR_SZ);
+	return (_db_parseptr(asciiptr));
+}
+
+/*
+ * read the next index record.
+ * we start the specified offset in the index file. we read the index record into db->idxbuf
+ * and replace the separators with null('\0') bytes. if all is OK we set db->datoff and db->datlen
+ * to the offset and the length of the corresponding data record in the data file.
+ * returns the offset of the next record on the chain, -1 at the end of
+ * the file for db_nextrec, or -2 with errno EIO if the record is damaged.
+ */
+static off_t
+_db_readidx(DB *db, off_t offset)
 {
 	ssize_t	i;
-	char	*ptr1, *ptr2;
-	char	asciiptr[PTR_SZ + 1], asciilen[IDXLEN_SZ + 1];
+	char	asciiptr[PTR_SZ], asciilen[IDXLEN_SZ + 1];
 	struct iovec iov[2];
 	
 	/* position index file and record the offset. db_nextrec calls us with 
@@ -309,6 +1530,7 @@ _db_readidx(DB *db, off_t offset)
 	
 	/* read the ascii chain ptr and the length at the front of the index record.
 	   this tells us the remaining size of the index record.	*/
+	db->idxlen = 0;		/* not read yet */
 	iov[0].iov_base = asciiptr;
 	iov[0].iov_len =PTR_SZ;
 	iov[1].iov_base = asciilen;
@@ -316,56 +1538,116 @@ _db_readidx(DB *db, off_t offset)
 	if ((i = readv(db->idxfd, &iov[0], 2)) != PTR_SZ + IDXLEN_SZ) {
 		if (i == 0 && offset == 0)
 			return (-1);		/* EOF for db_nextrec */
-		err_dump("_db_readidx: readv error of index record");
+		if (i < 0)
+			err_sys("_db_readidx: readv error of index record");
+		goto damaged;		/* cut short */
 	}
 	
-	/* this is our return value, always >= 0. */
-	asciiptr[PTR_SZ] = 0;		/* null terminate */
-	db->ptrval = atol(asciiptr);	/* offset of next key in chain */
+	db->nread += i;
+	
+	/* the offset in this is our return value, always >= 0. */
+	db->ptrval = _db_parseptr(asciiptr);	/* ptr to next key in chain */
 	
 	asciilen[IDXLEN_SZ] = 0;	/* null terminate */
-	if ((db->idxlen = atol(asciilen)) < IDXLEN_MIN || db->idxlen > IDXLEN_MAX)
-		err_dump("_db_readidx: invalid length");
+	if ((db->idxlen = atol(asciilen)) < IDXLEN_MIN || db->idxlen > IDXLEN_MAX) {
+		/* there's no telling where the next record starts: a
+		   db_nextrec scan ends here.	*/
+		lseek(db->idxfd, 0, SEEK_END);
+		goto damaged;
+	}
 	
 	/* now read the actual index record. we read into the key buffer and
 	   that we malloced when we opened the database. 	*/
-	if ((i = read(db->idxfd, db->idxbuf, db->idxlen)) != db->idxlen)
-		err_dump("_db_readidx: read error of index record");
-	if (db->idxbuf[db->idxlen - 1] != NEWLINE)	/* sanity check */
-		err_dump("_db_readidx: missing newline");
-	db->idxbuf[db->idxlen - 1] = 0;		/* replace newline with null */
+	if ((i = read(db->idxfd, db->idxbuf, db->idxlen)) != db->idxlen) {
+		if (i < 0)
+			err_sys("_db_readidx: read error of index record");
+		goto damaged;
+	}
+	db->nread += i;
+	if (_db_checkidx(asciilen, db->idxbuf, db->idxlen, &db->datcrc) < 0 ||
+	    _db_splitidx(db->idxbuf, &db->datoff, &db->datlen) != NULL)
+		goto damaged;
+	return (PTR_OFF(db->ptrval));	/* return offset of next key in chain */
+	
+damaged:
+	errno = EIO;
+	return (-2);
+}
+
+/*
+ * check the crc at the end of the index record rec, len bytes with its
+ * newline, which was read with the length field asciilen. strip the
+ * crcs and the newline, leaving the key and the offset and length of the
+ * data record null terminated for _db_splitidx. returns 0 with the crc
+ * of the data record in datcrc, or -1 if the record is damaged.
+ */
+static int
+_db_checkidx(const char *asciilen, char *rec, size_t len, unsigned int *datcrc)
+{
+	char	*crcs;
+	
+	if (len < IDXLEN_MIN || rec[len - 1] != NEWLINE)
+		return (-1);
+	crcs = rec + len - 1 - 2 * CRC_SZ;
+	if (crcs[-1] != SEP || _db_strtol(crcs + CRC_SZ, CRC_SZ, 16) !=
+	    crc32c(crc32c(0, asciilen, IDXLEN_SZ), rec, len - 1 - CRC_SZ))
+		return (-1);
+	*datcrc = _db_strtol(crcs, CRC_SZ, 16);
+	crcs[-1] = 0;
+	return (0);
+}
+
+/*
+ * split an index record, with its crcs stripped by _db_checkidx(),
+ * into the key and the offset and length of the data record. the key
+ * is left null terminated at the front of rec.
+ * returns NULL if OK, else what is wrong with the record.
+ */
+static const char *
+_db_splitidx(char *rec, off_t *datoff, size_t *datlen)
+{
+	char	*ptr1, *ptr2;
+	long	len;
 	
 	/* find the separators in the index record. 	*/
-	if ((ptr1 = strchr(db->idxbuf, SEP)) == NULL)
-		err_dump("_db_readidx: missing first separator");
+	if ((ptr1 = strchr(rec, SEP)) == NULL)
+		return ("missing first separator");
 	*ptr1++ = 0;		/* replace SEP with null */
 	if ((ptr2 = strchr(ptr1, SEP)) == NULL)
-		err_dump("_db_readidx: missing second separator");
-	ptr2++ = 0;		/* replace SEP with null */
+		return ("missing second separator");
+	*ptr2++ = 0;		/* replace SEP with null */
 	if (strchr(ptr2, SEP) != NULL)
-		err_dump("_db_readidx: too many separators");
+		return ("too many separators");
 	
 	/* get the starting offset and length of the data record. */
-	if ((db->datoff = atol(ptr1)) < 0)
-		err_dump("_db_readidx: starting offset < 0");
-	if ((db->datlen = atol(ptr2)) <= 0 || db->datlen > DATLEN_MAX)
-		err_dump("_db_readidx: invalid length");
-	return (db->ptrval);	/* return offset of next key in chain */
+	if ((*datoff = atol(ptr1)) < 0)
+		return ("starting offset < 0");
+	if ((len = atol(ptr2)) <= 0 || len > DATALEN_MAX)
+		return ("invalid length");
+	*datlen = len;
+	return (NULL);
 }
 
 /*
  * read the current data record into the data buffer.
- * returns a pointer to the null terminated data buffer.
+ * returns a pointer to the null terminated data buffer, or NULL with
+ * errno EIO if the record is damaged.
  */
 static char *
 _db_readdat(DB *db)
 {
+	ssize_t	i;
+	
 	if (lseek(db->datfd, db->datoff, SEEK_SET) == -1)
 		err_dump("_db_readdat: lseek error");
-	if (read(db->datfd, db->datbuf, db->datlen) != db->datlen)
-		err_dump("_db_readdat: read error");
-	if (db->datbuf[db->datlen - 1] != NEWLINE)	/* sanity check */
-		err_dump("_db_readdat: missing newline");
+	if ((i = read(db->datfd, db->datbuf, db->datlen)) < 0)
+		err_sys("_db_readdat: read error");
+	db->nread += i;
+	if (i != db->datlen || db->datbuf[db->datlen - 1] != NEWLINE ||
+	    crc32c(0, db->datbuf, db->datlen - 1) != db->datcrc) {
+		errno = EIO;		/* damaged */
+		return (NULL);
+	}
 	db->datbuf[db->datlen - 1] = 0;		/* replace newline with null */
 	
 	return db->datbuf;
@@ -373,16 +1655,43 @@ _db_readdat(DB *db)
 
 /*
  * delete the specified record.
+ * return 0 if OK, -1 if not found, with errno EIO if damaged.
  */
 int db_delete(DBHANDLE h, const char *key)
 {
 	DB	*db = h;
-	int	rc = 0;		/* assum record will be found */
+	int	i, held, rc = 0;	/* assum record will be found */
+	char	*odata = NULL;
 	
+	if (db->nshards > 0)
+		return (db_delete(_db_shard(db, key), key));
+	if (db->trace > 0 && !db->tracing && --db->tracewait <= 0) {
+		_db_tracebegin(db);
+		rc = db_delete(db, key);
+		_db_traceend(db, DBTRACE_DELETE, key, rc);
+		return (rc);
+	}
+	if (db->keysize > 0)
+		return (_db_fixdelete(db, key));
+	/* a store still held is dropped; the key may be in the files too. */
+	held = db->wbcount > 0 && _db_wbdrop(db, key);
 	if (_db_find_and_lock(db, key, 1) == 0) {
+		/* the record's index entries come out once it is gone. */
+		if (db->nsindex > 0)
+			odata = _db_readdat(db);	/* NULL if damaged */
+		_db_seqbegin(db);
 		_db_dodelete(db);
+		if (db->ndead >= RECLAIM_BATCH)
+			_db_reclaim(db);
+		_db_repput(db, DBREP_DELETE, NULL);
+		_db_commit(db);
+		_db_seqend(db);
+		for (i = 0; odata != NULL && i < db->nsindex; i++)
+			_db_indexdel(&db->sindex[i], key, odata, NULL);
 		db->cnt_delok++;
-	} else {
+	} else if (held)
+		db->cnt_delok++;
+	else {
 		rc = -1;	/* not found */
 		db->cnt_delerr++;
 	}
@@ -391,54 +1700,191 @@ int db_delete(DBHANDLE h, const char *key)
 	return (rc);
 }
 
+/*
+ * db_fetch(), db_store() and db_delete() with counted keys and data,
+ * which need not be null terminated, for callers that have them that way
+ * (db.hpp). db_fetchn() also returns the length of the data. a key or
+ * data with a null byte in it, or too long, is an error (EINVAL).
+ */
+char *
+db_fetchn(DBHANDLE h, const char *key, size_t keylen, size_t *datlen)
+{
+	DB	*db = h;
+	char	buf[IDXLEN_MAX + KEYPREFIX_MAX + 1], *ptr;
+	
+	if (keylen >= sizeof(buf) || memchr(key, 0, keylen) != NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	memcpy(buf, key, keylen);
+	buf[keylen] = 0;
+	if (db->nshards > 0)
+		db = _db_shard(db, buf);	/* its DB has the length */
+	if ((ptr = db_fetch(db, buf)) != NULL && datlen != NULL)
+		*datlen = db->datlen - 1;	/* without the newline */
+	return (ptr);
+}
+
+int
+db_storen(DBHANDLE h, const char *key, size_t keylen, const char *data,
+    size_t datlen, int flag)
+{
+	char	kbuf[IDXLEN_MAX + KEYPREFIX_MAX + 1], dbuf[DATALEN_MAX];
+	
+	if (keylen >= sizeof(kbuf) || memchr(key, 0, keylen) != NULL ||
+	    datlen + 1 < DATALEN_MIN || datlen >= sizeof(dbuf) ||
+	    memchr(data, 0, datlen) != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memcpy(kbuf, key, keylen);
+	kbuf[keylen] = 0;
+	memcpy(dbuf, data, datlen);
+	dbuf[datlen] = 0;
+	return (db_store(h, kbuf, dbuf, flag));
+}
+
+int
+db_deleten(DBHANDLE h, const char *key, size_t keylen)
+{
+	char	buf[IDXLEN_MAX + KEYPREFIX_MAX + 1];
+	
+	if (keylen >= sizeof(buf) || memchr(key, 0, keylen) != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memcpy(buf, key, keylen);
+	buf[keylen] = 0;
+	return (db_delete(h, buf));
+}
+
 /*
  * delete the current record specified by the DB structure.
  * this function is called by db_delete() and db_store(),
  * after the record has been located by _db_find_and_lock().
+ * it is one small write: the dead flag in the record's own chain ptr.
+ * the record stays where it is, and its chain still runs through it.
  */
 static void
 _db_dodelete(DB *db)
 {
-	int 	i;
-	char	*ptr;
-	off_t	freeptr, saveptr;
-	
-	/* set data buffer and key to all blanks. */
-	for (ptr = db->datbuf, i = 0; i < db->datlen - 1; i++)
-		*ptr++ = SPACE;
-	*ptr = 0;	/* null terminate for _db_datwrite */
-	ptr = db->idxbuf;
-	while (*ptr)
-		*ptr++ = SPACE;
-	
-	/* we have to lock the free list */
-	if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_dodelete: writew_lock error");
-	
-	/* write the data record with all blanks. */
-	_db_writedat(db, db->datbuf, db->datoff, SEEK_SET);
-	
-	/* read the free list pointer. its value becomes the chain ptr
-	   field of the deleted index record. the means the deleted 
-	   record becomes the head of the free list.	*/
+	_db_writeptr(db, db->idxoff, db->ptrval | PTR_DEAD);
+	db->ndead++;
+	STAT_ADD(db, nrecs, -1);
+	STAT_ADD(db, recbytes, -REC_SZ(db));
+	STAT_ADD(db, ndead, 1);
+	STAT_ADD(db, deadbytes, REC_SZ(db));
+}
+
+/*
+ * replace the current record, found by _db_find_and_lock(), without a
+ * log: the new record is written, in a free record or appended, where
+ * nothing points to it yet, pointing on to the record after the existing
+ * one. then it takes the existing record's place on the chain with one
+ * write, so a crash leaves one or the other on it, never both. last the
+ * existing record goes on the free list; a crash before it does loses
+ * it, off every chain, as one in _db_reclaim() can be.
+ */
+static void
+_db_doreplace(DB *db, const char *data)
+{
+	off_t	idxoff = db->idxoff, ptroff = db->ptroff;
+	DBPTR	next = db->ptrval, freeptr;
+	unsigned long long obytes = REC_SZ(db);
+	
+	if (_db_findfree(db, db->keylen, strlen(data) + 1) < 0) {
+		_db_writedat(db, data, 0, SEEK_END);
+		_db_writeidx(db, db->keybuf, 0, SEEK_END, next);
+	} else {
+		_db_barrier(db);	/* durably off the free list first */
+		_db_writedat(db, data, db->datoff, SEEK_SET);
+		_db_writeidx(db, db->keybuf, db->idxoff, SEEK_SET, next);
+		STAT_ADD(db, nfree, -1);
+		STAT_ADD(db, freebytes, -REC_SZ(db));
+	}
+	_db_barrier(db);
+	/* the ptr field of the record before keeps its dead flag. */
+	_db_writeptr(db, ptroff, PTR_MAKE(db->idxoff, db->keyfp, db->keylen) |
+	    (ptroff == db->chainoff ? 0 : _db_readptr(db, ptroff) & PTR_DEAD));
+	STAT_ADD(db, recbytes, REC_SZ(db) - obytes);
+	_db_barrier(db);
+	
+	if (_db_lockw(db, F_WRLCK, FREE_OFF) < 0)
+		err_dump("_db_doreplace: lock error");
+	_db_freefix(db);
 	freeptr = _db_readptr(db, FREE_OFF);
-	/* save the contents of index record chain ptr,
-	   before its rewritten by _db_writeidx.	*/
-	saveptr = db->ptrval;
-	/* rewrite the index record. this also rewrites the length of the 
-	   index record, the data offset, and the data length, non of which
-	   has changed, but that's OK.		*/
-	_db_writeidx(db, db->idxbuf, db->idxoff, SEEK_SET, freeptr);
-	/* write the new free list pointer. 	*/
-	_db_writeptr(db, FREE_OFF, db->idxoff);
-	
-	/* rewrite the chain ptr that pointed to this record being deleted.
-	   Recall that _db_find_and_lock sets db->ptroff to point to this
-	   chain ptr. we set this chain ptr to the contents of the deleted
-	   record's chain ptr, saveptr.		*/
-	_db_writeptr(db, db->ptroff, saveptr);
-	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_dodelete: un_lock error");
+	_db_writeptr(db, idxoff, freeptr | PTR_DEAD);
+	_db_writeptr(db, FREE_OFF, PTR_MAKE(idxoff, 0, db->keylen));
+	_db_unlockfree(db);
+	STAT_ADD(db, nfree, 1);
+	STAT_ADD(db, freebytes, obytes);
+}
+
+/*
+ * take the dead records off the chain at db->chainoff, which we have
+ * write locked, and put them on the free list. a run of dead records
+ * is unlinked with one write, and the free list is locked once for the
+ * lot. they are off the chain, durably, before they go on the free list:
+ * a crash in between can lose them, but they stay dead.
+ */
+static void
+_db_reclaim(DB *db)
+{
+	struct {
+		off_t	offset;
+		size_t	keylen;
+	}	dead[RECLAIM_MAX];
+	unsigned long long bytes = 0;
+	DBPTR	ptr, next, predval, freeptr;
+	off_t	offset, predoff;
+	int	i, n = 0, unlinked = 0;
+	
+	/* predval is what the ptr field at predoff should hold: it skips
+	   the dead records after it, and keeps its own dead flag.	*/
+	predoff = db->chainoff;
+	ptr = predval = _db_readptr(db, predoff);
+	while ((offset = PTR_OFF(ptr)) != 0) {
+		next = _db_readptr(db, offset);
+		if ((next & PTR_DEAD) && n < RECLAIM_MAX) {
+			if (_db_readidx(db, offset) >= 0)	/* for its size */
+				bytes += REC_SZ(db);
+			dead[n].offset = offset;
+			dead[n++].keylen = PTR_KLEN(ptr);
+			predval = (predval & PTR_DEAD) | (next & ~PTR_DEAD);
+			unlinked = 1;
+		} else {
+			if (unlinked)
+				_db_writeptr(db, predoff, predval);
+			unlinked = 0;
+			predoff = offset;
+			predval = next;
+		}
+		ptr = next;
+	}
+	if (unlinked)
+		_db_writeptr(db, predoff, predval);
+	if (n == 0)
+		return;
+	_db_barrier(db);
+	
+	/* the free list ptrs carry the key lengths, for _db_findfree,
+	   and a record on the free list stays dead.	*/
+	if (_db_lockw(db, F_WRLCK, FREE_OFF) < 0)
+		err_dump("_db_reclaim: lock error");
+	_db_freefix(db);
+	freeptr = _db_readptr(db, FREE_OFF);
+	for (i = 0; i < n; i++) {
+		_db_writeptr(db, dead[i].offset, freeptr | PTR_DEAD);
+		freeptr = PTR_MAKE(dead[i].offset, 0, dead[i].keylen);
+	}
+	_db_writeptr(db, FREE_OFF, freeptr);
+	_db_unlockfree(db);
+	STAT_ADD(db, ndead, -n);
+	STAT_ADD(db, deadbytes, -bytes);
+	STAT_ADD(db, nfree, n);
+	STAT_ADD(db, freebytes, bytes);
+	db->cnt_reclaim += n;
+	db->ndead = 0;
 }
 
 /*
@@ -451,26 +1897,22 @@ _db_writedat(DB *db, const char *data, off_t offset, int whence)
 	struct iovec	iov[2];
 	static char	newline = NEWLINE;
 	
-	/* if we are appending, we have to lock before doing the lseek and
-	   write to make the two an atomic operation. if we are overwriting
-	   an existing record, we don't have to lock.		*/
-	if (whence == SEEK_END)		/* we are appending, lock the entire file. */
-		if (writew_lock(db->datfd, 0, SEEK_SET, 0) < 0)
-			err_dump("_db_writedat: writew_lock error");
-	if ((db->dataoff = lseek(db->datfd, offset, whence)) == -1)
-		err_dump("_db_writedat: lseek error");
+	/* if we are appending, we reserve the space first, which makes
+	   it ours to write without a lock.	*/
 	db->datlen = strlen(data) + 1;		/* +1 for newline */
+	db->datcrc = crc32c(0, data, db->datlen - 1);	/* for _db_writeidx */
+	if (whence == SEEK_END)
+		db->datoff = _db_reserve(db, db->datfd, db->datlen);
+	else
+		db->datoff = offset;
 	
 	iov[0].iov_base = (char *) data;
 	iov[0].iov_len = db->datlen - 1;
 	iov[1].iov_base = &newline;
 	iov[1].iov_len = 1;
-	if (writev(db->datfd, &iov[0], 2) != db->datlen)
+	if (_db_write(db, db->datfd, &iov[0], 2, db->datoff,
+	    whence == SEEK_END) != db->datlen)
 		err_dump("_db_writedat: writev error of data record");
-	
-	if (whence == SEEK_END)
-		if (un_lock(db->datfd, 0, SEEK_SET, 0) < 0)
-			err_dump("_db_writedat: un_lock error");
 }
 
 /*
@@ -479,39 +1921,61 @@ _db_writedat(DB *db, const char *data, off_t offset, int whence)
  * in the DB structure, which we need to write the index record.
  */
 static void
-_db_writeidx(DB *db, const char *key, off_t offset, int whence, off_t ptrval)
+_db_writeidx(DB *db, const char *key, off_t offset, int whence, DBPTR ptrval)
 {
 	struct iovec	iov[2];
 	char		asciiptrlen[PTR_SZ + IDXLEN_SZ + 1];
-	int		len;
-	
-	if ((db->ptrval = ptrval) < 0 || ptrval > PTR_MAX)
-		err_quit("_db_writeidx: invalid ptr: %d", ptrval);
-	sprintf(db->idxbuf, "%s%c%ld%c%ld\n", key, SEP, db->datoff, SEP, db->datlen);
-	len = strlen(db->idxbuf);
-	if (len < IDXLEN_MIN || len > IDXLEN_MAX)
-		err_dump("_db_writeidx: invalid length");
-	sprintf(asciiptrlen, "%*ld%*d", PTR_SZ, ptrval, IDXLEN_SZ, len);
-	
-	/* if we are appending, we have to lock before doing the lseek and
-	   write to make the two an atomic operation. if we are overwriting
-	   an existing record, we don't have to lock.		*/
-	if (whence == SEEK_END)		/* we are appending */
-		if (writew_lock(db->idxfd, (db->nhash + 1) * PTR_SZ + 1, SEEK_SET, 0) < 0)
-			err_dump("_db_writeidx: writew_lock error");
-	/* position the index file and record the offset. */
-	if ((db->idxoff = lseek(db->idxfd, offset, whence)) == -1)
-		err_dump("_db_writeidx: lseek error");
+	size_t		len;
+	
+	if (PTR_OFF(ptrval) < 0 || PTR_OFF(ptrval) > PTR_MAX)
+		err_quit("_db_writeidx: invalid ptr: %ld", (long) PTR_OFF(ptrval));
+	db->ptrval = ptrval;
+	len = _db_fmtidx(db, key, asciiptrlen, ptrval);
+	
+	/* if we are appending, reserve the space, and record the offset. */
+	if (whence == SEEK_END)
+		db->idxoff = _db_reserve(db, db->idxfd, PTR_SZ + IDXLEN_SZ + len);
+	else
+		db->idxoff = offset;
 	iov[0].iov_base = asciiptrlen;
 	iov[0].iov_len = PTR_SZ + IDXLEN_SZ;
 	iov[1].iov_base = db->idxbuf;
 	iov[1].iov_len = len;
-	if (writev(db->idxfd, &iov[0], 2) != PTR_SZ + IDXLEN_SZ + len)
+	if (_db_write(db, db->idxfd, &iov[0], 2, db->idxoff,
+	    whence == SEEK_END) != PTR_SZ + IDXLEN_SZ + len)
 		err_dump("_db_writeidx: writev error of index record");
+}
+
+/*
+ * format the index record for the stored key, which may be db->idxbuf
+ * itself, into db->idxbuf, and its ptr field and length into asciiptrlen.
+ * the data length takes at most IDXLEN_SZ digits, but the data offset
+ * as many as the data file needs, up to DATOFF_MAX: more than the OFF_SZ
+ * of an index file offset. the crc of the data record is the one
+ * _db_writedat left us, and the record's own goes last. returns the
+ * length of the record, also in db->idxlen.
+ */
+static size_t
+_db_fmtidx(DB *db, const char *key, char *asciiptrlen, DBPTR ptrval)
+{
+	size_t		len;
+	unsigned int	crc;
 	
-	if (whence == SEEK_END)
-		if (un_lock(db->idxfd, (db->nhash + 1) * PTR_SZ + 1, SEEK_SET, 0) < 0)
-			err_dump("_db_writeidx: un_lock error");
+	if ((len = strlen(key)) > IDXLEN_MAX)
+		err_dump("_db_fmtidx: invalid length");
+	memmove(db->idxbuf, key, len);
+	len += snprintf(db->idxbuf + len, IDXLEN_MAX + 2 - len,
+	    "%c%ld%c%ld%c%0*x", SEP, (long) db->datoff, SEP, (long) db->datlen,
+	    SEP, CRC_SZ, db->datcrc);
+	if (len + CRC_SZ + 1 < IDXLEN_MIN || len + CRC_SZ + 1 > IDXLEN_MAX)
+		err_dump("_db_fmtidx: invalid length");
+	_db_fmtptr(asciiptrlen, ptrval);
+	snprintf(asciiptrlen + PTR_SZ, IDXLEN_SZ + 1, "%*d", IDXLEN_SZ,
+	    (int) (len + CRC_SZ + 1));
+	crc = crc32c(crc32c(0, asciiptrlen + PTR_SZ, IDXLEN_SZ), db->idxbuf, len);
+	len += sprintf(db->idxbuf + len, "%0*x\n", CRC_SZ, crc);
+	db->idxlen = len;
+	return (len);
 }
 
 /*
@@ -519,134 +1983,333 @@ _db_writeidx(DB *db, const char *key, off_t offset, int whence, off_t ptrval)
  * the free list, the hash table, or in an index record.
  */
 static void
-_db_writeptr(DB *db, off_t offset, off_t ptrval)
+_db_writeptr(DB *db, off_t offset, DBPTR ptrval)
 {
 	char	asciiptr[PTR_SZ + 1];
+	struct iovec	iov;
 	
-	if (ptrval < 0 || ptrval > PTR_MAX)
-		err_quit("_db_writeptr: invalid ptr: %ld", ptrval);
-	sprintf(asciiptr, "%*ld", PTR_SZ, ptrval);
+	if (PTR_OFF(ptrval) < 0 || PTR_OFF(ptrval) > PTR_MAX)
+		err_quit("_db_writeptr: invalid ptr: %ld", (long) PTR_OFF(ptrval));
+	_db_fmtptr(asciiptr, ptrval);
 	
-	if (lseek(db->idxfd, offset, SEEK_SET) == -1)
-		err_dump("_db_writeptr: lseek error to ptr field");
-	if (write(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ)
+	iov.iov_base = asciiptr;
+	iov.iov_len = PTR_SZ;
+	if (_db_write(db, db->idxfd, &iov, 1, offset, 0) != PTR_SZ)
 		err_dump("_db_writeptr: write error of ptr field");
 }
 
+/*
+ * write to the index or data file at offset. append says the bytes are
+ * going past the end of the file. with a write-ahead log the write is
+ * logged, and unless it is an append, held back until the log record
+ * is written. returns the number of bytes written (or to be written).
+ */
+static ssize_t
+_db_write(DB *db, int fd, const struct iovec *iov, int iovcnt, off_t offset,
+    int append)
+{
+	ssize_t	n;
+	int	i;
+	
+	if (db->walfd >= 0) {
+		_db_walput(db, fd == db->idxfd ? WAL_IDX : WAL_DAT, iov, iovcnt,
+		    offset);
+		if (!append) {
+			for (n = 0, i = 0; i < iovcnt; i++)
+				n += iov[i].iov_len;
+			return (n);
+		}
+	} else
+		db->dirty |= (fd == db->idxfd ? DIRTY_IDX : DIRTY_DAT);
+	n = pwritev(fd, iov, iovcnt, offset);
+	if (n > 0)
+		_db_backupmark(db, fd, offset, n);
+	return (n);
+}
+
+/*
+ * reserve len bytes at the end of the index or data file, and return
+ * their offset. the counter in the shared memory segment hands out each
+ * byte once, so no lock is needed; if the reservation goes past what is
+ * preallocated, we preallocate another extent (or more) first.
+ */
+static off_t
+_db_reserve(DB *db, int fd, size_t len)
+{
+	off_t	*end, *alloc, offset, want, have;
+	
+	if (fd == db->idxfd) {
+		end = &db->shm->idxend;
+		alloc = &db->shm->idxalloc;
+		/* with a log, a checkpoint mustn't pass the reservation. */
+		if (db->walfd >= 0)
+			_db_walbegin(db);
+	} else {
+		end = &db->shm->datend;
+		alloc = &db->shm->datalloc;
+	}
+	offset = __atomic_fetch_add(end, (off_t) len, __ATOMIC_RELAXED);
+	have = __atomic_load_n(alloc, __ATOMIC_RELAXED);
+	if (offset + len <= have)
+		return (offset);
+	
+	want = (offset + len + APPEND_EXTENT - 1) / APPEND_EXTENT *
+	    APPEND_EXTENT;
+#ifdef __linux__
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, have, want - have) < 0 &&
+	    errno != EOPNOTSUPP)
+		err_sys("_db_reserve: fallocate error");
+#endif
+	/* others may be extending it too: only ever move it forward. */
+	while (have < want && !__atomic_compare_exchange_n(alloc, &have, want,
+	    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return (offset);
+}
+
+/*
+ * return the offset of the first byte at or after offset in the file
+ * that isn't a NUL, or -1 at end of file. an append that was reserved
+ * but not (yet) written reads as NULs; a record never starts with one.
+ */
+static off_t
+_db_skipnul(int fd, off_t offset)
+{
+	char	buf[512];
+	ssize_t	n, i;
+	
+	for ( ; ; offset += n) {
+		if ((n = pread(fd, buf, sizeof(buf), offset)) < 0)
+			err_sys("_db_skipnul: read error");
+		if (n == 0)
+			return (-1);
+		for (i = 0; i < n; i++)
+			if (buf[i] != 0)
+				return (offset + i);
+	}
+}
+
+/*
+ * unlock the free list. with a write-ahead log, our changes to it are
+ * not applied until the operation commits, so it stays locked till then.
+ */
+static void
+_db_unlockfree(DB *db)
+{
+	if (db->walfd >= 0) {
+		db->freelocked = 1;
+		db->shm->freeheld = 1;
+		return;
+	}
+	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
+		err_dump("_db_unlockfree: un_lock error");
+}
+
 /*
  * store a record in the database.
- * return 0 if OK, 1 if record exists and DB_INSERT specified, -1 on error.
+ * return 0 if OK, 1 if record exists and DB_INSERT specified, -1 on error
+ * (errno EIO if a damaged record was in the way).
  */
 int
 db_store(DBHANDLE h, const char *key, const char *data, int flag)
 {
 	DB	*db = h;
-	int	rc, keylen, datlen;
-	off_t	ptrval;
+	int	rc, datlen;
 	
+	if (db->nshards > 0)
+		return (db_store(_db_shard(db, key), key, data, flag));
+	if (db->trace > 0 && !db->tracing && --db->tracewait <= 0) {
+		_db_tracebegin(db);
+		rc = db_store(db, key, data, flag);
+		_db_traceend(db, DBTRACE_STORE, key, rc);
+		return (rc);
+	}
 	if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
 		errno = EINVAL;
 		return (-1);
 	}
-	keylen = strlen(key);
 	datlen = strlen(data) + 1;	/* +1 for newline at end */
-	if (datlen < DATLEN_MIN || datlen > DATLEN_MAX)
+	if (datlen < DATALEN_MIN || datlen > DATALEN_MAX)
 		err_dump("db_store: invalid data length");
+	if (db->wbtab != NULL && !db->wbflushing &&
+	    (rc = _db_wbstore(db, key, data, flag)) != -2)
+		return (rc);
+	if (db->keysize > 0)
+		return (_db_fixstore(db, key, data, flag));
 	
 	/* _db_find_and_lock calculates which hash table this new record 
 	   goes into (db->chainoff), regardless of whether it already
-	   exists or not. the following calls to _db_writeptr change the 
-	   hash table entry for this chain to point to the new record.
-	   the new record is added to the front of the hash chain.	*/
-	if (_db_find_and_lock(db, key, 1) < 0) {	/* record not found */
+	   exists or not. _db_dostore changes the hash table entry for
+	   this chain to point to the new record.	*/
+	if ((rc = _db_find_and_lock(db, key, 1)) < -1) {
+		db->cnt_storerr++;	/* damaged */
+		rc = -1;
+	} else if (db->nsindex > 0)
+		rc = _db_indexstore(db, key, data, flag, rc == 0);
+	else
+		rc = _db_dostore(db, data, flag, rc == 0);
+	
+	/* unlock hash chain locked by _db_find_and_lock	*/
+	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+		err_dump("db_store: un_lock error");
+	return (rc);	
+}
+
+/*
+ * the rest of db_store(), once the key has been looked up and its hash
+ * chain write locked. found says whether the key is in the database,
+ * and if so the DB structure describes its record.
+ * also called by the asynchronous store.
+ */
+static int
+_db_dostore(DB *db, const char *data, int flag, int found)
+{
+	size_t	datlen, oidxlen, odatlen;
+	off_t	idxoff;
+	DBPTR	ptrval, optrval;
+	
+	datlen = strlen(data) + 1;	/* +1 for newline at end */
+	
+	/* the new record is added to the front of the hash chain.	*/
+	if (!found) {	/* record not found */
 		if (flag == DB_REPLACE) {
-			rc = -1;
-			db->cnt_stroerr++;
+			db->cnt_storerr++;
 			errno = ENOENT;		/* error, record does not exist */
-			goto doreturn;
+			return (-1);
 		}
+		_db_seqbegin(db);
 		/* _db_find_and_lock locked the hash chain for us; read the chain
 		   ptr to the first index record on hash chain.		*/
 		ptrval = _db_readptr(db, db->chainoff);
-		if (_db_findfree(db, keylen, datlen) < 0) {
+		if (_db_findfree(db, db->keylen, datlen) < 0) {
 			/* can't find an empty record big enough. Append the new
 			   record to the ends of the index and data file.	*/
 			_db_writedat(db, data, 0, SEEK_END);
-			_db_writeidx(db, key, 0, SEEK_END, ptrval);
+			_db_writeidx(db, db->keybuf, 0, SEEK_END, ptrval);
 			
 			/* db->idxoff was set by _db_writeidx. the new record goes
-			   to the front of the hash chain.	*/
-			_db_writeptr(db, db->chainoff, db->idxoff);
-			_db->cnt_stor1++;
+			   to the front of the hash chain, once it is durable.	*/
+			_db_barrier(db);
+			_db_writeptr(db, db->chainoff,
+			    PTR_MAKE(db->idxoff, db->keyfp, db->keylen));
+			STAT_ADD(db, nrecs, 1);
+			STAT_ADD(db, recbytes, REC_SZ(db));
+			db->cnt_stor1++;
 		} else {
 			/* reuse an empty record. _db_findfree remove it from the
 			   free list and set both db->datoff and db->idxoff.
-			   reuse record goes to the front of of the hash chain.	*/
-			_do_writedat(db, data, db->datoff, SEEK_SET);
-			_do_writeidx(db, key, db->idxoff, SEEK_SET, ptrval);
-			_do_writeptr(db, db->chainoff, db->idxoff);
+			   it must be durably off the free list before we
+			   rewrite it, and durably rewritten before it goes
+			   to the front of of the hash chain.	*/
+			_db_barrier(db);
+			_db_writedat(db, data, db->datoff, SEEK_SET);
+			_db_writeidx(db, db->keybuf, db->idxoff, SEEK_SET, ptrval);
+			_db_barrier(db);
+			_db_writeptr(db, db->chainoff,
+			    PTR_MAKE(db->idxoff, db->keyfp, db->keylen));
+			STAT_ADD(db, nrecs, 1);
+			STAT_ADD(db, recbytes, REC_SZ(db));
+			STAT_ADD(db, nfree, -1);
+			STAT_ADD(db, freebytes, -REC_SZ(db));
 			db->cnt_stor2++;
 		}
 	} else {	/* record found */
 		if (flag == DB_INSERT) {
-			rc = 1;		/* error, record already in db */
 			db->cnt_storerr++;
-			goto doreturn;
+			return (1);	/* error, record already in db */
 		}
+		_db_seqbegin(db);
 		
-		/* we are replacing an existing record. we know the new key
-		   equals the existing key, but we need to check if the data 
-		   records are the same size.	*/
-		if (datlen != db->datlen) {
-			_db_dodelete(db);	/* delete the existing record */
-			
-			/* reread the chain ptr in the hash table
-			   (it may change with the deletion).	*/
-			ptrval = _db_readptr(db, db->chainoff);
+		/* we are replacing an existing record. without a log, data
+		   written over in place and its crc in the index record
+		   can't both be written at once, so it is always replaced
+		   by a new record.	*/
+		if (db->walfd < 0) {
+			_db_doreplace(db, data);
+			db->cnt_stor3++;
+		
+		/* with one, we know the new key equals the existing key, but
+		   we need to check if the data records are the same size.	*/
+		} else if (datlen != db->datlen) {
+			/* the new record goes on the chain before the existing
+			   one is deleted, so a crash leaves one or the other.
+			   save where the existing record is: appending
+			   changes the DB structure.	*/
+			idxoff = db->idxoff;
+			optrval = db->ptrval;
+			oidxlen = db->idxlen;
+			odatlen = db->datlen;
 			
 			/* append new index and data records to end of files.	*/
+			ptrval = _db_readptr(db, db->chainoff);
 			_db_writedat(db, data, 0, SEEK_END);
-			_db_writeidx(db, key, 0, SEEK_END, ptrval);
+			_db_writeidx(db, db->keybuf, 0, SEEK_END, ptrval);
 			
 			/* new record goes to the front of the hash chain.	*/
-			_db_writeptr(db, db->chainoff, db->idxoff);
+			_db_barrier(db);
+			_db_writeptr(db, db->chainoff,
+			    PTR_MAKE(db->idxoff, db->keyfp, db->keylen));
+			_db_barrier(db);
+			STAT_ADD(db, nrecs, 1);
+			STAT_ADD(db, recbytes, REC_SZ(db));
+			db->idxoff = idxoff;
+			db->ptrval = optrval;
+			db->idxlen = oidxlen;
+			db->datlen = odatlen;
+			_db_dodelete(db);	/* delete the existing record */
 			db->cnt_stor3++;
 		} else {
-			/* same size data, just replace data record.	*/
+			/* same size data, just replace data record, and
+			   its crc in the index record.	*/
 			_db_writedat(db, data, db->datoff, SEEK_SET);
+			_db_writeidx(db, db->keybuf, db->idxoff, SEEK_SET,
+			    db->ptrval);
 			db->cnt_stor4++;
 		}
 	}
-	rc = 0;		/* OK */
-doreturn:		/* unlock hash chain locked by _db_find_and_lock	*/
-	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-		err_dump("db_store: un_lock error");
-	return (rc);	
+	if (db->ndead >= RECLAIM_BATCH)
+		_db_reclaim(db);
+	_db_repput(db, DBREP_STORE, data);
+	_db_commit(db);
+	_db_seqend(db);
+	return (0);	/* OK */
 }
 
 /*
  * try to find a free index record and accompanying data record
  * of the correct sizes. We'are only called by db_store().
+ * keylen is the length of the key as stored.
  */
 static int
-_db_findfree(DB *db, int keylen, int datlen)
+_db_findfree(DB *db, size_t keylen, size_t datlen)
 {
 	int	rc;
-	off_t	offset, nextoffset, saveoffset;
+	DBPTR	ptr;
+	off_t	offset, saveoffset;
 	
 	/* Lock the free list */
-	if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_findfree: writew_lock error");
+	if (_db_lockw(db, F_WRLCK, FREE_OFF) < 0)
+		err_dump("_db_findfree: lock error");
+	_db_freefix(db);
 	
-	/* read the free list pointer.	*/
+	/* read the free list pointer. the ptrs on the free list carry
+	   the key length of the record they point to, so we only read
+	   records whose key is the right size.	*/
 	saveoffset = FREE_OFF;
-	offset = _db_readptr(db, saveoffset);
-	while (offset != 0) {
-		nextoffset = _db_readidx(db, offset);
-		if (strlen(db->idxbuf) == keylen && db->datlen == datlen)
-			break;		/* found a match */
+	ptr = _db_readptr(db, saveoffset);
+	while ((offset = PTR_OFF(ptr)) != 0) {
+		if (PTR_KLEN(ptr) == keylen) {
+			if (_db_readidx(db, offset) < -1) {
+				offset = 0;	/* damaged: append instead */
+				break;
+			}
+			if (db->datlen == datlen)
+				break;		/* found a match */
+			ptr = db->ptrval;
+		} else {
+			ptr = _db_readptr(db, offset);
+		}
 		saveoffset = offset;
-		offset = nextoffset;
 	}
 	if (offset == 0)
 		rc = -1;	/* no match found */
@@ -656,15 +2319,22 @@ _db_findfree(DB *db, int keylen, int datlen)
 		   which sets db->ptrval. Also, saveoffset points to
 		   the chain ptr that pointed to this empty record on
 		   the free list. we set this chain ptr to db->ptrval,
-		   which removes the empty record from the free list.	*/
-		_db_writeptr(db, saveoffset, db->ptrval);
+		   which removes the empty record from the free list.
+		   the free list head has no dead flag.	*/
+		_db_writeptr(db, saveoffset, saveoffset == FREE_OFF ?
+		    db->ptrval & ~PTR_DEAD : db->ptrval);
 		rc = 0;
 		/* notice also that _db_readidx set both db->idxoff
 		   and db->datoff. this is used by the caller, db->store,
 		   to write the new index record and data record.	*/
 	}
-	/* unlock the free list.	*/
-	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
+	/* unlock the free list. with a log, a change we made to it isn't
+	   written until the operation is applied, after its sync, but if
+	   we made none, the lock need not wait for that: a group sync
+	   would otherwise go at the pace of the stores that append.	*/
+	if (rc == 0 || db->freelocked)
+		_db_unlockfree(db);
+	else if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
 		err_dump("_db_findfree: un_lock error");
 	return (rc);
 }
@@ -678,14 +2348,16 @@ void
 db_rewind(DBHANDLE h)
 {
 	DB	*db = h;
-	off_t	offset;
-	
-	offset = (db->nhash + 1) * PTR_SZ;	/* +1 for free list ptr */
 	
+	if (db->nshards > 0) {	/* start with the first shard */
+		db->curshard = 0;
+		db_rewind(db->shard[0]);
+		return;
+	}
+	_db_wbflush(db);	/* the records it steps through include them */
 	/* we are just setting the file offset for this process 
-	   to the start of the index records; no need to lock.
-	   +1 below for newline at end of the hash table.	*/
-	if ((db->idxoff = lseek(db->idxfd, offset + 1, SEEK_SET)) == -1)
+	   to the start of the index records; no need to lock.	*/
+	if ((db->idxoff = lseek(db->idxfd, db->firstoff, SEEK_SET)) == -1)
 		err_dump("db_rewind: lseek error");	
 }
 
@@ -693,38 +2365,4560 @@ db_rewind(DBHANDLE h)
  * return the next sequential record.
  * we just step our way through the index file, ignoring deleted records.
  * db_rewind() must be called before this function is called the first time.
+ * returns NULL at the end, or with errno EIO at a damaged record; the
+ * next call carries on past it if it can. a record that fails its crc
+ * is read again with its chain locked, as a replace may be rewriting it.
  */
 char *
 db_nextrec(DBHANDLE h, char *key)
 {
 	DB	*db = h;
 	char	c;
-	char	*ptr;
+	char	*ptr, *sep;
+	char	kbuf[IDXLEN_MAX + KEYPREFIX_MAX + 1];
+	off_t	offset;
+	int	reread, oerrno = errno;
 	
+	if (db->nshards > 0) {	/* on to the next shard at the end of each, */
+		errno = 0;	/* but not past a damaged record */
+		while ((ptr = db_nextrec(db->shard[db->curshard], key)) == NULL &&
+		    errno != EIO && db->curshard + 1 < db->nshards)
+			db_rewind(db->shard[++db->curshard]);
+		return (ptr);
+	}
+	if (db->keysize > 0)
+		return (_db_fixnextrec(db, key));
+again:
 	/* we read lock the free list so that we don't read a record
 	   in the middle of its being deleted.		*/
 	if (readw_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
 		err_dump("db_nextrec: readw_lock error");
 	
+	reread = 0;
 	do {		/* read next sequential index record */
-		if (_db_readidx(db, 0) < 0) {
+		if ((offset = lseek(db->idxfd, 0, SEEK_CUR)) == -1)
+			err_dump("db_nextrec: lseek error");
+		if ((offset = _db_skipnul(db->idxfd, offset)) < 0) {
 			ptr = NULL;	/* end of index file, EOF */
 			goto doreturn;
 		}
-		/* check if key is all blank (empty record)	*/
+		if (_db_readidx(db, offset) < 0) {
+			/* damaged, or half rewritten by a replace: read
+			   again below if we have its key.	*/
+			ptr = NULL;
+			if (db->idxlen < IDXLEN_MIN || db->idxlen > IDXLEN_MAX ||
+			    (sep = memchr(db->idxbuf, SEP, db->idxlen)) == NULL)
+				goto doreturn;
+			*sep = 0;
+			reread = 1;
+			break;
+		}
+		/* check if the record is dead, or its key is all blank
+		   (empty record)	*/
+		if (db->ptrval & PTR_DEAD) {
+			c = 0;
+			continue;
+		}
 		ptr = db->idxbuf;
 		while ((c = *ptr++) != 0 && c == SPACE)
 			;		/* skip until non byte or nonblank */		
 	} while (c == 0);		/* loop until a nonblank key is found */
 	
-	if (key != NULL)
-		strcpy(key, db->idxbuf);	/* return key */
-	ptr = _db_readdat(db);		/* return pointer to data buffer */
-	db->cnt_nextrec++;
+	_db_keydec(db, db->idxbuf, kbuf);
+	if (!reread)
+		reread = (ptr = _db_readdat(db)) == NULL;
 	
-doreturn：
-	if (un_lock(db->idxfd, FREE_OF, SEEK_SET, 1) < 0)
+doreturn:
+	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
 		err_dump("db_nextrec: un_lock error");
+	if (reread && (ptr = _db_reread(db, offset, kbuf)) == NULL &&
+	    errno == 0)
+		goto again;		/* deleted since */
+	if (ptr != NULL) {
+		if (key != NULL)
+			strcpy(key, kbuf);
+		errno = oerrno;		/* from a read before a reread */
+		db->cnt_nextrec++;
+	}
+	return (ptr);
+}
+
+/*
+ * put the key stored in an index record, stored, in key whole, putting
+ * back any elided prefix.
+ */
+static void
+_db_keydec(DB *db, const char *stored, char *key)
+{
+	if (db->prefixlen > 0 && *stored++ == KEY_PREFIXED) {
+		strcpy(key, db->prefix);
+		strcat(key, stored);
+	} else
+		strcpy(key, stored);
+}
+
+/*
+ * read the record at offset again with its chain read locked, for a scan
+ * that read it with only the free list locked and found it damaged. a
+ * replace with a log rewrites a record of the same length in place, and
+ * the scan may have read it half written; the key isn't changed. key is
+ * the key the scan read, and if the record has another now, it is read
+ * again under that one's chain, and key set to it. returns the data,
+ * NULL with errno EIO if the record is damaged, or NULL with errno 0 if
+ * it is dead. the offset of the index file is left alone.
+ */
+static char *
+_db_reread(DB *db, off_t offset, char *key)
+{
+	char	*ptr;
+	off_t	pos;
+	int	moved;
+	
+	if ((pos = lseek(db->idxfd, 0, SEEK_CUR)) == -1)
+		err_dump("_db_reread: lseek error");
+	do {
+		moved = 0;
+		db->chainoff = _db_hash(db, key) * PTR_SZ + db->hashoff;
+		if (readw_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_reread: readw_lock error");
+		_db_chainfix(db, db->chainoff, F_RDLCK);
+		if (_db_readidx(db, offset) < 0) {
+			ptr = NULL;		/* damaged */
+		} else if ((db->ptrval & PTR_DEAD) ||
+		    strspn(db->idxbuf, " ") == strlen(db->idxbuf)) {
+			ptr = NULL;
+			errno = 0;
+		} else if (_db_keyenc(db, key) < 0 ||
+		    strcmp(db->idxbuf, db->keybuf) != 0) {
+			_db_keydec(db, db->idxbuf, key);
+			ptr = NULL;
+			moved = 1;		/* another key's: again */
+		} else
+			ptr = _db_readdat(db);
+		if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_reread: un_lock error");
+	} while (moved);
+	if (lseek(db->idxfd, pos, SEEK_SET) == -1)
+		err_dump("_db_reread: lseek error");
 	return (ptr);
 }
 
+/*
+ * report the counts of live, dead and free records and their bytes. they
+ * are kept up to date as the database changes, so this is O(1), but for
+ * the first call after a crash, which counts the records again.
+ */
+int
+db_info(DBHANDLE h, DBINFO *info)
+{
+	DB	*db = h;
+	DBINFO	si;
+	DBSTATS	st;
+	int	i;
+	
+	memset(info, 0, sizeof(*info));
+	memset(&st, 0, sizeof(st));
+	_db_wbflush(db);	/* so the counts include them */
+	if (db->nshards > 0) {
+		info->exact = 1;
+		for (i = 0; i < db->nshards; i++) {
+			db_info(db->shard[i], &si);
+			st.nrecs += si.nrecs;
+			st.recbytes += si.recbytes;
+			st.ndead += si.ndead;
+			st.deadbytes += si.deadbytes;
+			st.nfree += si.nfree;
+			st.freebytes += si.freebytes;
+			info->nhash += si.nhash;
+			info->exact &= si.exact;
+		}
+	} else if (db->shm == NULL) {	/* all we have is the header */
+		info->exact = _db_readstats(db, &st) == 1;
+		info->nhash = db->nhash;
+	} else {
+		if (!__atomic_load_n(&db->shm->statsok, __ATOMIC_ACQUIRE))
+			_db_recount(db);
+		memcpy(&st, &db->shm->stats, sizeof(st));
+		info->exact = 1;
+		info->nhash = db->nhash;
+	}
+	info->nrecs = st.nrecs;
+	info->recbytes = st.recbytes;
+	info->ndead = st.ndead;
+	info->deadbytes = st.deadbytes;
+	info->nfree = st.nfree;
+	info->freebytes = st.freebytes;
+	if (info->nhash > 0)
+		info->chainlen = (double) (st.nrecs + st.ndead) / info->nhash;
+	return (0);
+}
+
+/*
+ * count the records again, for db_info() when the counts in the header
+ * were stale. a read lock on the hash table keeps the writers out.
+ */
+static void
+_db_recount(DB *db)
+{
+	FIXSLOT	*slot = (FIXSLOT *) db->idxbuf;
+	DBSTATS	st;
+	DBPTR	ptr;
+	off_t	offset, pos, end;
+	long	hops;
+	char	*p;
+	
+	_db_tablelock(db, F_RDLCK);
+	if (db->shm->statsok) {		/* someone beat us to it */
+		_db_tablelock(db, F_UNLCK);
+		return;
+	}
+	memset(&st, 0, sizeof(st));
+	/* db_nextrec() carries on from the file offset.	*/
+	if ((pos = lseek(db->idxfd, 0, SEEK_CUR)) == -1 ||
+	    (end = lseek(db->idxfd, 0, SEEK_END)) == -1)
+		err_dump("_db_recount: lseek error");
+	if (db->keysize > 0) {
+		for (offset = db->firstoff; offset + db->islotsz <= end;
+		    offset += db->islotsz) {
+			if (pread(db->idxfd, slot, db->islotsz, offset) !=
+			    db->islotsz)
+				err_sys("_db_recount: read error");
+			if (slot->key[0] != 0)
+				st.nrecs++;
+			else
+				st.nfree++;
+		}
+		st.recbytes = st.nrecs * (db->islotsz + db->dslotsz);
+		st.freebytes = st.nfree * (db->islotsz + db->dslotsz);
+	} else {
+		/* a record is dead if it is flagged, as those on the free
+		   list are too, or was blanked by recovery.	*/
+		for (offset = db->firstoff;
+		    (offset = _db_skipnul(db->idxfd, offset)) >= 0;
+		    offset = lseek(db->idxfd, 0, SEEK_CUR)) {
+			if (_db_readidx(db, offset) < 0)
+				continue;	/* damaged */
+			for (p = db->idxbuf; *p == SPACE; p++)
+				;
+			if ((db->ptrval & PTR_DEAD) || *p == 0) {
+				st.ndead++;
+				st.deadbytes += REC_SZ(db);
+			} else {
+				st.nrecs++;
+				st.recbytes += REC_SZ(db);
+			}
+		}
+		/* then those on the free list are free instead.	*/
+		hops = end / (PTR_SZ + IDXLEN_SZ + IDXLEN_MIN) + 1;
+		ptr = _db_readptr(db, FREE_OFF);
+		while ((offset = PTR_OFF(ptr)) != 0 && hops-- > 0 &&
+		    _db_readidx(db, offset) >= 0 && st.ndead > 0) {
+			st.ndead--;
+			st.deadbytes -= REC_SZ(db);
+			st.nfree++;
+			st.freebytes += REC_SZ(db);
+			ptr = db->ptrval;
+		}
+	}
+	if (lseek(db->idxfd, pos, SEEK_SET) == -1)
+		err_dump("_db_recount: lseek error");
+	memcpy(&db->shm->stats, &st, sizeof(st));
+	__atomic_store_n(&db->shm->statsok, 1, __ATOMIC_RELEASE);
+	_db_tablelock(db, F_UNLCK);
+}
+
+
+/*
+ * fixed size records. the calls above come here for a database created
+ * with a keysize and datsize.
+ */
+
+/*
+ * put the key in db->keybuf, null padded to the key size, as it is in
+ * a slot. returns -1 if it is empty or too long to be stored.
+ */
+static int
+_db_fixkey(DB *db, const char *key)
+{
+	size_t	len;
+	
+	if ((len = strlen(key)) == 0 || len > db->keysize)
+		return (-1);
+	memcpy(db->keybuf, key, len);
+	memset(db->keybuf + len, 0, db->keysize - len + 1);
+	db->keylen = len;
+	db->chainoff = _db_hash(db, key) * SLOTPTR_SZ + db->hashoff;
+	return (0);
+}
+
+/*
+ * the most slots a chain can pass through: once the bitmap is built,
+ * the slots there are.
+ */
+static long
+_db_fixmaxhops(DB *db)
+{
+	if (db->shm != NULL && __atomic_load_n(&db->shm->slotsready,
+	    __ATOMIC_ACQUIRE))
+		return (__atomic_load_n(&db->shm->nslots, __ATOMIC_RELAXED));
+	return (SLOTS_MAX);
+}
+
+/*
+ * walk the chain at db->chainoff for the key in db->keybuf, with pread(),
+ * locked or not. if found, set db->idxoff, db->datoff, db->ptroff and
+ * db->ptrval as _db_find_and_lock does, and with wantdata read the data
+ * into db->datbuf and check it against the slot's crc. returns 1 if
+ * found, 0 if not, -1 if what we read made no sense.
+ */
+static int
+_db_fixwalk(DB *db, long maxhops, int wantdata)
+{
+	FIXSLOT	*slot = (FIXSLOT *) db->idxbuf;
+	unsigned int next;
+	off_t	offset;
+	
+	if (pread(db->idxfd, &next, SLOTPTR_SZ, db->chainoff) != SLOTPTR_SZ)
+		return (-1);
+	db->nread += SLOTPTR_SZ;
+	db->ptroff = db->chainoff;
+	for (db->hops = 0; next != 0; db->hops++) {
+		if (maxhops-- == 0 || next > SLOTS_MAX)
+			return (-1);
+		offset = SLOT_IDXOFF(db, next - 1);
+		if (pread(db->idxfd, slot, db->islotsz, offset) != db->islotsz)
+			return (-1);
+		db->nread += db->islotsz;
+		if (memcmp(slot->key, db->keybuf, db->keysize) != 0) {
+			db->ptroff = offset;
+			next = slot->next;
+			continue;
+		}
+		db->idxoff = offset;
+		db->datoff = SLOT_DATOFF(db, next - 1);
+		db->ptrval = slot->next;
+		if (!wantdata)
+			return (1);
+		if (pread(db->datfd, db->datbuf, db->dslotsz, db->datoff) !=
+		    db->dslotsz || crc32c(crc32c(0, slot->key, db->keysize),
+		    db->datbuf, db->datsize) != slot->crc)
+			return (-1);
+		db->nread += db->dslotsz;
+		db->datbuf[db->datsize] = 0;
+		db->datlen = strlen(db->datbuf) + 1;	/* as with a newline */
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * db_fetch(): without locking the chain if we can, as _db_seqfetch().
+ */
+static char *
+_db_fixfetch(DB *db, const char *key)
+{
+	unsigned int	*ver, v;
+	long	maxhops;
+	int	i, rc = -1;
+	
+	if (_db_fixkey(db, key) < 0) {
+		db->cnt_fetcherr++;
+		return (NULL);
+	}
+	maxhops = _db_fixmaxhops(db);
+	for (i = 0; db->shm != NULL && i < SEQ_TRIES; i++) {
+		ver = &db->shm->chainver[(db->chainoff - db->hashoff) /
+		    SLOTPTR_SZ];
+		if ((v = __atomic_load_n(ver, __ATOMIC_ACQUIRE)) & 1)
+			continue;	/* a writer is at it */
+		rc = _db_fixwalk(db, maxhops, 1);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (rc >= 0 && __atomic_load_n(ver, __ATOMIC_RELAXED) == v)
+			break;
+		rc = -1;
+	}
+	if (rc < 0) {
+		if (_db_lockw(db, F_RDLCK, db->chainoff) < 0)
+			err_dump("_db_fixfetch: lock error");
+		_db_chainfix(db, db->chainoff, F_RDLCK);
+		if ((rc = _db_fixwalk(db, maxhops, 1)) < 0)
+			errno = EIO;	/* damaged */
+		if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_fixfetch: un_lock error");
+	}
+	db->cnt_hops += db->hops;
+	if (rc <= 0) {
+		db->cnt_fetcherr++;
+		return (NULL);
+	}
+	db->cnt_fetchok++;
+	return (db->datbuf);
+}
+
+/*
+ * take a slot for a new record: a free one from the bitmap if there is
+ * one, starting where one was last freed, else a new one at the end of
+ * the files. *appended says which. returns -1 if all SLOTS_MAX are used.
+ */
+static long
+_db_slotalloc(DB *db, int *appended)
+{
+	DBSHM	*shm = db->shm;
+	unsigned long long w;
+	unsigned int nslots, nwords, i, n, bit;
+	long	slot;
+	
+	nslots = __atomic_load_n(&shm->nslots, __ATOMIC_ACQUIRE);
+	nwords = (nslots + 63) / 64;
+	i = __atomic_load_n(&shm->slothint, __ATOMIC_RELAXED);
+	for (n = 0; n < nwords; n++, i++) {
+		if (i >= nwords)
+			i = 0;
+		w = __atomic_load_n(&db->slotmap[i], __ATOMIC_RELAXED);
+		while (~w != 0 && i * 64 + (bit = __builtin_ctzll(~w)) < nslots)
+			if (__atomic_compare_exchange_n(&db->slotmap[i], &w,
+			    w | 1ULL << bit, 0, __ATOMIC_ACQUIRE,
+			    __ATOMIC_RELAXED)) {
+				*appended = 0;
+				return (i * 64 + bit);
+			}
+	}
+	
+	/* its bit is set before others can see it in nslots.	*/
+	_db_shmlock(db);
+	if ((slot = shm->nslots) < SLOTS_MAX) {
+		__atomic_fetch_or(&db->slotmap[slot / 64], 1ULL << (slot % 64),
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&shm->nslots, slot + 1, __ATOMIC_RELEASE);
+	} else
+		slot = -1;
+	pthread_mutex_unlock(&shm->mutex);
+	*appended = 1;
+	return (slot);
+}
+
+/*
+ * give a slot back to the bitmap. its key must be blank on disk by now,
+ * with a log applied, since whoever takes it next writes it at once.
+ */
+static void
+_db_slotfree(DB *db, long slot)
+{
+	__atomic_fetch_and(&db->slotmap[slot / 64], ~(1ULL << (slot % 64)),
+	    __ATOMIC_RELEASE);
+	__atomic_store_n(&db->shm->slothint, slot / 64, __ATOMIC_RELAXED);
+}
+
+/*
+ * write len bytes of buf to the index or data file, as _db_write().
+ */
+static void
+_db_slotwrite(DB *db, int fd, void *buf, size_t len, off_t offset, int append)
+{
+	struct iovec	iov;
+	
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (_db_write(db, fd, &iov, 1, offset, append) != len)
+		err_dump("_db_slotwrite: write error");
+}
+
+/*
+ * db_store(). a new record's slot is written in full, data first, and
+ * only then put at the front of its chain; a slot is on no chain while
+ * it is free, so it can be written at once, even with a log. a record
+ * replaced gets a new slot too, which the chain ptr to the old one is
+ * swapped to point to, so that a crash leaves one or the other whole;
+ * the old one is then blanked and freed, as by _db_fixdelete().
+ */
+static int
+_db_fixstore(DB *db, const char *key, const char *data, int flag)
+{
+	FIXSLOT	*slot = (FIXSLOT *) db->idxbuf;
+	unsigned int crc, head;
+	size_t	datlen;
+	off_t	ptroff;
+	long	n, old = 0;
+	int	rc, appended;
+	
+	if ((datlen = strlen(data)) > db->datsize || _db_fixkey(db, key) < 0) {
+		db->cnt_storerr++;
+		errno = EINVAL;
+		return (-1);
+	}
+	if (_db_lockw(db, F_WRLCK, db->chainoff) < 0)
+		err_dump("_db_fixstore: lock error");
+	_db_chainfix(db, db->chainoff, F_WRLCK);
+	if ((rc = _db_fixwalk(db, _db_fixmaxhops(db), 0)) < 0) {
+		db->cnt_storerr++;	/* damaged */
+		errno = EIO;
+		goto doreturn;
+	}
+	if (rc == 1 && flag == DB_INSERT) {
+		db->cnt_storerr++;
+		goto doreturn;		/* rc is 1: already in db */
+	}
+	if (rc == 0 && flag == DB_REPLACE) {
+		db->cnt_storerr++;
+		errno = ENOENT;
+		rc = -1;
+		goto doreturn;
+	}
+	
+	memset(db->datbuf, 0, db->dslotsz);
+	memcpy(db->datbuf, data, datlen);
+	crc = crc32c(crc32c(0, db->keybuf, db->keysize), db->datbuf,
+	    db->datsize);
+	if ((n = _db_slotalloc(db, &appended)) < 0) {
+		db->cnt_storerr++;
+		errno = ENOSPC;
+		rc = -1;
+		goto doreturn;
+	}
+	_db_seqbegin(db);
+	if (rc == 1) {		/* it takes the place of the old one */
+		old = (db->idxoff - db->firstoff) / db->islotsz;
+		head = db->ptrval;
+		ptroff = db->ptroff;
+	} else {		/* or goes at the front */
+		if (pread(db->idxfd, &head, SLOTPTR_SZ, db->chainoff) !=
+		    SLOTPTR_SZ)
+			err_dump("_db_fixstore: read error of chain");
+		ptroff = db->chainoff;
+	}
+	memset(slot, 0, db->islotsz);
+	slot->next = head;
+	slot->crc = crc;
+	memcpy(slot->key, db->keybuf, db->keysize);
+	_db_slotwrite(db, db->datfd, db->datbuf, db->dslotsz,
+	    SLOT_DATOFF(db, n), 1);
+	_db_slotwrite(db, db->idxfd, slot, db->islotsz, SLOT_IDXOFF(db, n), 1);
+	_db_barrier(db);
+	head = n + 1;
+	_db_slotwrite(db, db->idxfd, &head, SLOTPTR_SZ, ptroff, 0);
+	if (!appended) {
+		STAT_ADD(db, nfree, -1);
+		STAT_ADD(db, freebytes, -(db->islotsz + db->dslotsz));
+	}
+	if (rc == 1) {
+		/* the old slot is on no chain now: blank it to free it. */
+		_db_barrier(db);
+		memset(db->datbuf, 0, db->keysize);
+		_db_slotwrite(db, db->idxfd, db->datbuf, db->keysize,
+		    SLOT_IDXOFF(db, old) + offsetof(FIXSLOT, key), 0);
+		STAT_ADD(db, nfree, 1);
+		STAT_ADD(db, freebytes, db->islotsz + db->dslotsz);
+		db->cnt_stor3++;
+	} else {
+		STAT_ADD(db, nrecs, 1);
+		STAT_ADD(db, recbytes, db->islotsz + db->dslotsz);
+		if (appended)
+			db->cnt_stor1++;
+		else
+			db->cnt_stor2++;
+	}
+	_db_repput(db, DBREP_STORE, data);
+	_db_commit(db);
+	_db_seqend(db);
+	if (rc == 1)
+		_db_slotfree(db, old);
+	rc = 0;
+	
+doreturn:
+	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+		err_dump("_db_fixstore: un_lock error");
+	return (rc);
+}
+
+/*
+ * db_delete(). the slot is taken off its chain, then its key blanked,
+ * then it goes back to the bitmap.
+ */
+static int
+_db_fixdelete(DB *db, const char *key)
+{
+	int	rc;
+	
+	if (_db_fixkey(db, key) < 0) {
+		db->cnt_delerr++;
+		return (-1);
+	}
+	if (_db_lockw(db, F_WRLCK, db->chainoff) < 0)
+		err_dump("_db_fixdelete: lock error");
+	_db_chainfix(db, db->chainoff, F_WRLCK);
+	if ((rc = _db_fixwalk(db, _db_fixmaxhops(db), 0)) == 1) {
+		_db_seqbegin(db);
+		_db_slotwrite(db, db->idxfd, &db->ptrval, SLOTPTR_SZ,
+		    db->ptroff, 0);
+		_db_barrier(db);
+		memset(db->datbuf, 0, db->keysize);
+		_db_slotwrite(db, db->idxfd, db->datbuf, db->keysize,
+		    db->idxoff + offsetof(FIXSLOT, key), 0);
+		_db_repput(db, DBREP_DELETE, NULL);
+		_db_commit(db);
+		_db_seqend(db);
+		_db_slotfree(db, (db->idxoff - db->firstoff) / db->islotsz);
+		STAT_ADD(db, nrecs, -1);
+		STAT_ADD(db, recbytes, -(db->islotsz + db->dslotsz));
+		STAT_ADD(db, nfree, 1);
+		STAT_ADD(db, freebytes, db->islotsz + db->dslotsz);
+		db->cnt_delok++;
+		rc = 0;
+	} else {
+		if (rc < 0)
+			errno = EIO;	/* damaged */
+		db->cnt_delerr++;
+		rc = -1;
+	}
+	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+		err_dump("_db_fixdelete: un_lock error");
+	return (rc);
+}
+
+/*
+ * db_nextrec(): step through the slots, passing over the free ones.
+ * a slot in use is read again under its chain's lock, so we don't
+ * return a record half stored.
+ */
+static char *
+_db_fixnextrec(DB *db, char *key)
+{
+	FIXSLOT	*slot = (FIXSLOT *) db->idxbuf;
+	off_t	offset;
+	int	ok;
+	
+	if ((offset = lseek(db->idxfd, 0, SEEK_CUR)) == -1)
+		err_dump("_db_fixnextrec: lseek error");
+	for ( ; ; offset += db->islotsz) {
+		if (pread(db->idxfd, slot, db->islotsz, offset) != db->islotsz)
+			return (NULL);		/* end of index file */
+		if (slot->key[0] == 0)
+			continue;		/* free */
+		memcpy(db->keybuf, slot->key, db->keysize);
+		db->keybuf[db->keysize] = 0;
+		db->chainoff = _db_hash(db, db->keybuf) * SLOTPTR_SZ +
+		    db->hashoff;
+		if (readw_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_fixnextrec: readw_lock error");
+		ok = pread(db->idxfd, slot, db->islotsz, offset) ==
+		    db->islotsz && pread(db->datfd, db->datbuf, db->dslotsz,
+		    SLOT_DATOFF(db, (offset - db->firstoff) / db->islotsz)) ==
+		    db->dslotsz;
+		if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_fixnextrec: un_lock error");
+		if (!ok || memcmp(slot->key, db->keybuf, db->keysize) != 0) {
+			offset -= db->islotsz;	/* it changed: again */
+			continue;
+		}
+		break;
+	}
+	if (lseek(db->idxfd, offset + db->islotsz, SEEK_SET) == -1)
+		err_dump("_db_fixnextrec: lseek error");
+	if (crc32c(crc32c(0, slot->key, db->keysize), db->datbuf,
+	    db->datsize) != slot->crc) {
+		errno = EIO;
+		return (NULL);
+	}
+	if (key != NULL)
+		strcpy(key, db->keybuf);
+	db->datbuf[db->datsize] = 0;
+	db->datlen = strlen(db->datbuf) + 1;
+	db->cnt_nextrec++;
+	return (db->datbuf);
+}
+
+/*
+ * the first writer to open the database builds the slot bitmap from
+ * the hash chains. a slot with a key that is on no chain was being
+ * stored or deleted by a process that died, and is blanked. a damaged
+ * chain is followed only until it runs off the end or into a slot
+ * already seen.
+ */
+static void
+_db_fixrecover(DB *db)
+{
+	FIXSLOT	*slot = (FIXSLOT *) db->idxbuf;
+	DBSHM	*shm = db->shm;
+	unsigned int next, nslots, n;
+	off_t	end;
+	DBHASH	i;
+	
+	_db_tablelock(db, F_WRLCK);	/* as _db_walrecover() */
+	_db_shmlock(db);
+	if (shm->slotsready) {		/* someone already did */
+		pthread_mutex_unlock(&shm->mutex);
+		_db_tablelock(db, F_UNLCK);
+		return;
+	}
+	if ((end = lseek(db->idxfd, 0, SEEK_END)) == -1)
+		err_dump("_db_fixrecover: lseek error");
+	nslots = end > db->firstoff ? (end - db->firstoff) / db->islotsz : 0;
+	if (nslots > SLOTS_MAX)
+		nslots = SLOTS_MAX;
+	for (i = 0; i < db->nhash; i++) {
+		if (pread(db->idxfd, &next, SLOTPTR_SZ, db->hashoff +
+		    i * SLOTPTR_SZ) != SLOTPTR_SZ)
+			err_sys("_db_fixrecover: read error of hash table");
+		while (next != 0 && next <= nslots &&
+		    (db->slotmap[(next - 1) / 64] & 1ULL << (next - 1) % 64) == 0) {
+			db->slotmap[(next - 1) / 64] |= 1ULL << (next - 1) % 64;
+			if (pread(db->idxfd, slot, db->islotsz,
+			    SLOT_IDXOFF(db, next - 1)) != db->islotsz)
+				err_sys("_db_fixrecover: read error");
+			next = slot->next;
+		}
+	}
+	for (n = 0; n < nslots; n++) {
+		if (db->slotmap[n / 64] & 1ULL << n % 64)
+			continue;
+		if (pread(db->idxfd, slot, db->islotsz, SLOT_IDXOFF(db, n)) !=
+		    db->islotsz)
+			err_sys("_db_fixrecover: read error");
+		if (slot->key[0] != 0) {
+			memset(slot->key, 0, db->keysize);
+			if (pwrite(db->idxfd, slot, db->islotsz,
+			    SLOT_IDXOFF(db, n)) != db->islotsz)
+				err_sys("_db_fixrecover: write error");
+			_db_backupmark(db, db->idxfd, SLOT_IDXOFF(db, n),
+			    db->islotsz);
+		}
+	}
+	/* and now the counts are known.	*/
+	memset(&shm->stats, 0, sizeof(shm->stats));
+	for (n = 0; n < nslots; n++)
+		if (db->slotmap[n / 64] & 1ULL << n % 64)
+			shm->stats.nrecs++;
+	shm->stats.recbytes = shm->stats.nrecs * (db->islotsz + db->dslotsz);
+	shm->stats.nfree = nslots - shm->stats.nrecs;
+	shm->stats.freebytes = shm->stats.nfree * (db->islotsz + db->dslotsz);
+	shm->statsok = 1;
+	shm->nslots = nslots;
+	__atomic_store_n(&shm->slotsready, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shm->mutex);
+	_db_tablelock(db, F_UNLCK);
+}
+
+/*
+ * make everything written to the database so far durable, the stores
+ * held in the write buffer included. returns 0, or -1 as db_flush().
+ */
+int
+db_sync(DBHANDLE h)
+{
+	DB	*db = h;
+	int	i, rc;
+	
+	rc = db_flush(db);
+	if (db->nshards > 0)
+		_db_parallel(db, _db_syncshard, NULL);
+	else
+		_db_fsync(db, DIRTY_COMMIT(db));
+	for (i = 0; i < db->nsindex; i++)
+		db_sync(db->sindex[i].idx);
+	return (rc);
+}
+
+/*
+ * sync the files in which, and clear their dirty flags.
+ */
+static void
+_db_fsync(DB *db, int which)
+{
+	if ((which & DIRTY_DAT) && fdatasync(db->datfd) < 0)
+		err_sys("_db_fsync: fdatasync error for data file");
+	if ((which & DIRTY_IDX) && fdatasync(db->idxfd) < 0)
+		err_sys("_db_fsync: fdatasync error for index file");
+	if ((which & DIRTY_WAL) && fdatasync(db->walfd) < 0)
+		err_sys("_db_fsync: fdatasync error for log");
+	if ((which & DIRTY_REP) && fdatasync(db->repfd) < 0)
+		err_sys("_db_fsync: fdatasync error for replication log");
+	db->dirty &= ~which;
+	clock_gettime(CLOCK_MONOTONIC, &db->lastsync);
+}
+
+/*
+ * a write ordering point: with DB_SYNC_OP or DB_SYNC_GROUP, what we have
+ * written so far is durable before anything we write after.
+ * with a write-ahead log, the log record makes the whole operation
+ * atomic, so there is nothing to order.
+ */
+static void
+_db_barrier(DB *db)
+{
+	if (db->walfd < 0)
+		_db_durable(db);
+}
+
+/*
+ * with DB_SYNC_OP or DB_SYNC_GROUP, make what we have written durable:
+ * the log if there is one, else the index and data files.
+ * with DB_SYNC_GROUP the callers in all processes that arrive while a
+ * sync is in progress share the next one. each takes a ticket; one of
+ * them, the leader, syncs for all tickets taken so far, since a sync
+ * covers every process's writes to the file. the others wait.
+ */
+static void
+_db_durable(DB *db)
+{
+	DBSHM	*shm = db->shm;
+	unsigned long long ticket, upto;
+	struct timespec	ts;
+	
+	if (db->dirty == 0 || db->sync == DB_SYNC_NONE ||
+	    db->sync == DB_SYNC_PERIODIC)
+		return;
+	if (db->sync == DB_SYNC_OP) {
+		_db_fsync(db, db->dirty);
+		return;
+	}
+	
+	_db_shmlock(db);
+	ticket = ++shm->syncreq;
+	while (shm->syncdone < ticket) {
+		/* a leader that died leaves syncpid behind.	*/
+		if (shm->syncpid != 0 && kill(shm->syncpid, 0) < 0 &&
+		    errno == ESRCH)
+			shm->syncpid = 0;
+		if (shm->syncpid == 0) {
+			shm->syncpid = getpid();
+			upto = shm->syncreq;
+			pthread_mutex_unlock(&shm->mutex);
+			_db_fsync(db, DIRTY_COMMIT(db));
+			_db_shmlock(db);
+			if (upto > shm->syncdone)
+				shm->syncdone = upto;
+			shm->syncpid = 0;
+			pthread_cond_broadcast(&shm->cond);
+		} else {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			if (pthread_cond_timedwait(&shm->cond, &shm->mutex,
+			    &ts) == EOWNERDEAD)
+				pthread_mutex_consistent(&shm->mutex);
+		}
+	}
+	pthread_mutex_unlock(&shm->mutex);
+	db->dirty = 0;
+}
+
+/*
+ * a store or delete is done. with a write-ahead log, write its log record
+ * and apply the writes held back. with a replication log, write its
+ * record there, while we still hold the chain lock, so the changes to a
+ * key are logged in the order they were made. with DB_SYNC_OP or DB_SYNC_GROUP make
+ * it durable before we return (and with a log, before it is applied),
+ * with DB_SYNC_PERIODIC sync if it is time.
+ */
+static void
+_db_commit(DB *db)
+{
+	struct timespec	now;
+	long	ms;
+	
+	if (db->walfd >= 0)
+		_db_walappend(db);
+	if (db->replen > 0) {
+		/* O_APPEND: writers in all processes append in turn. */
+		if (write(db->repfd, db->repbuf, db->replen) != db->replen)
+			err_sys("_db_commit: write error of replication log");
+		db->replen = 0;
+		db->dirty |= DIRTY_REP;
+	}
+	if (db->sync != DB_SYNC_PERIODIC)
+		_db_durable(db);
+	else {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (now.tv_sec - db->lastsync.tv_sec) * 1000 +
+		    (now.tv_nsec - db->lastsync.tv_nsec) / 1000000;
+		if (ms >= db->syncms)
+			_db_fsync(db, DIRTY_COMMIT(db));
+	}
+	if (db->walfd >= 0)
+		_db_walapply(db);
+}
+
+/*
+ * open the write-ahead log, <name>.wal. if we just created the database,
+ * start the log afresh.
+ */
+static int
+_db_walopen(DB *db, int namelen, int created)
+{
+	struct stat	statbuff;
+	WALHDR		hdr;
+	
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_walopen: fstat error");
+	strcpy(db->name + namelen, ".wal");
+	if ((db->walfd = open(db->name, O_RDWR | O_CREAT,
+	    statbuff.st_mode & 0666)) < 0)
+		return (-1);
+	if (created || fstat(db->walfd, &statbuff) < 0 ||
+	    statbuff.st_size < sizeof(WALHDR)) {
+		hdr.magic = WAL_MAGIC;
+		hdr.gen = 1;
+		if ((hdr.idxsize = lseek(db->idxfd, 0, SEEK_END)) == -1)
+			err_dump("_db_walopen: lseek error");
+		hdr.start = sizeof(hdr);
+		if (ftruncate(db->walfd, 0) < 0 ||
+		    pwrite(db->walfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			err_sys("_db_walopen: write error of log header");
+	}
+	return (0);
+}
+
+/*
+ * replay the log. only the first writer to open the database since the
+ * shared memory segment was set up does this, so any operations logged
+ * were cut short by a crash. replaying an operation that was applied
+ * does no harm, since the log is replayed in order.
+ */
+static void
+_db_walrecover(DB *db)
+{
+	WALHDR	hdr;
+	WALREC	rec;
+	char	*buf, *logged;
+	off_t	offset, end;
+	int	n = 0;
+	
+	/* the table lock keeps a backup from copying us half done;
+	   it comes first, as it does for a store.	*/
+	_db_tablelock(db, F_WRLCK);
+	if (writew_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+		err_dump("_db_walrecover: writew_lock error");
+	if (db->shm->walgen != 0) {	/* someone already did */
+		if (un_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+			err_dump("_db_walrecover: un_lock error");
+		_db_tablelock(db, F_UNLCK);
+		return;
+	}
+	if (pread(db->walfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != WAL_MAGIC)
+		err_quit("_db_walrecover: %s is not a log", db->name);
+	db->shm->walgen = hdr.gen;
+	
+	/* logged marks the index records written since the checkpoint. */
+	if ((end = lseek(db->idxfd, 0, SEEK_END)) == -1)
+		err_dump("_db_walrecover: lseek error");
+	if (end < hdr.idxsize)
+		err_quit("_db_walrecover: index file shorter than logged");
+	if ((logged = calloc(end - hdr.idxsize + 1, 1)) == NULL)
+		err_dump("_db_walrecover: calloc error");
+	
+	offset = sizeof(hdr);
+	while (pread(db->walfd, &rec, sizeof(rec), offset) == sizeof(rec)) {
+		buf = NULL;
+		if (rec.magic == WAL_MAGIC &&
+		    (rec.gen == hdr.gen || offset >= hdr.start))
+			buf = _db_walread(db, offset, &rec);
+		if (buf == NULL) {
+			if (offset >= hdr.start)
+				break;	/* torn: the crash was while writing it */
+			/* the last generation, left by a checkpoint that died
+			   before it truncated the log; what was logged since
+			   follows it.	*/
+			offset = hdr.start;
+			continue;
+		}
+		_db_walreplay(db, buf, rec.len, logged, hdr.idxsize, end);
+		free(buf);
+		n++;
+		offset += sizeof(rec) + rec.len;
+	}
+	if (db->keysize == 0)	/* _db_fixrecover() sees to slots */
+		n += _db_walorphans(db, hdr.idxsize, end, logged);
+	free(logged);
+	if (un_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+		err_dump("_db_walrecover: un_lock error");
+	if (n > 0)
+		db->shm->statsok = 0;	/* count again */
+	_db_tablelock(db, F_UNLCK);
+	if (n > 0)
+		_db_checkpoint(db);
+}
+
+/*
+ * read the entries of the log record at offset, whose WALREC is rec.
+ * returns them in a malloc'ed buffer, or NULL if the record is torn.
+ */
+static char *
+_db_walread(DB *db, off_t offset, const WALREC *rec)
+{
+	char	*buf;
+	
+	if ((buf = malloc(rec->len)) == NULL)
+		err_dump("_db_walread: malloc error");
+	if (pread(db->walfd, buf, rec->len, offset + sizeof(WALREC)) !=
+	    rec->len || crc32c(0, buf, rec->len) != rec->crc) {
+		free(buf);
+		return (NULL);
+	}
+	return (buf);
+}
+
+/*
+ * make the len bytes of log entries in buf again. if logged isn't NULL,
+ * mark in it the index records from idxsize to end they write.
+ */
+static void
+_db_walreplay(DB *db, const char *buf, size_t len, char *logged,
+    off_t idxsize, off_t end)
+{
+	WALENT	ent;
+	const char *ptr;
+	int	fd;
+	
+	for (ptr = buf; ptr < buf + len; ptr += sizeof(ent) + ent.len) {
+		memcpy(&ent, ptr, sizeof(ent));
+		fd = ent.file == WAL_IDX ? db->idxfd : db->datfd;
+		if (pwrite(fd, ptr + sizeof(ent), ent.len, ent.offset) != ent.len)
+			err_sys("_db_walreplay: write error");
+		_db_backupmark(db, fd, ent.offset, ent.len);
+		if (logged != NULL && ent.file == WAL_IDX &&
+		    ent.offset >= idxsize && ent.offset < end)
+			logged[ent.offset - idxsize] = 1;
+	}
+}
+
+/*
+ * replay the log records of writers that died between logging and
+ * applying them, in the order they were logged, and free their slots.
+ * we wait for the lock of each slot in use: once we have it, its writer
+ * has either given the slot up or died. with all set, as when the apply
+ * lock is write locked, every slot in use is a dead writer's already.
+ * whoever calls this holds the lock on what the dead writer held, the
+ * chain or the free list, or the apply lock, so nothing the records
+ * write has been changed since.
+ */
+static void
+_db_walredo(DB *db, int all)
+{
+	DBSHM	*shm = db->shm;
+	WALREC	rec;
+	char	*buf;
+	int	used[WAL_PENDING], dead[WAL_PENDING], i, j, n = 0, first;
+	
+	/* not with the mutex held: a writer takes it to give one up. */
+	_db_shmlock(db);
+	for (i = 0; i < WAL_PENDING; i++)
+		used[i] = !all && shm->walpend[i] != 0;
+	pthread_mutex_unlock(&shm->mutex);
+	for (i = 0; i < WAL_PENDING; i++)
+		if (used[i] &&
+		    writew_lock(db->walfd, WAL_SLOTLK + i, SEEK_SET, 1) < 0)
+			err_dump("_db_walredo: writew_lock error");
+	
+	_db_shmlock(db);
+	for (i = 0; i < WAL_PENDING; i++)
+		if (shm->walpend[i] != 0 && (all || used[i]))
+			dead[n++] = i;
+	for (j = 0; j < n; j++) {
+		for (first = j, i = j + 1; i < n; i++)
+			if (shm->walpend[dead[i]] < shm->walpend[dead[first]])
+				first = i;
+		i = dead[first];
+		dead[first] = dead[j];
+		dead[j] = i;
+		
+		/* a torn record never got as far as being applied; one
+		   not written at all may have another's in its place.	*/
+		if (pread(db->walfd, &rec, sizeof(rec), shm->walpend[i]) ==
+		    sizeof(rec) && rec.magic == WAL_MAGIC &&
+		    rec.gen == shm->walgen && rec.crc == shm->walcrc[i] &&
+		    (buf = _db_walread(db, shm->walpend[i], &rec)) != NULL) {
+			_db_walreplay(db, buf, rec.len, NULL, 0, 0);
+			free(buf);
+		}
+		shm->walpend[i] = 0;
+	}
+	if (n > 0)
+		shm->statsok = 0;	/* count again */
+	pthread_mutex_unlock(&shm->mutex);
+	for (i = 0; i < WAL_PENDING; i++)
+		if (used[i] && un_lock(db->walfd, WAL_SLOTLK + i, SEEK_SET, 1) < 0)
+			err_dump("_db_walredo: un_lock error");
+}
+
+/*
+ * we just locked the chain at chainoff, with a lock of type. if its
+ * version is odd, the writer that had it before died part way through
+ * changing it: replay what that writer logged, if we can write, and
+ * make the version even again. a read lock is traded for a write lock
+ * to do it, and back.
+ */
+static void
+_db_chainfix(DB *db, off_t chainoff, int type)
+{
+	unsigned int	*ver;
+	
+	if (db->shm == NULL || db->rdonly)
+		return;
+	ver = &db->shm->chainver[(chainoff - db->hashoff) / CHAINPTR_SZ(db)];
+	if (!(__atomic_load_n(ver, __ATOMIC_ACQUIRE) & 1))
+		return;
+	if (type == F_RDLCK && (un_lock(db->idxfd, chainoff, SEEK_SET, 1) < 0 ||
+	    writew_lock(db->idxfd, chainoff, SEEK_SET, 1) < 0))
+		err_dump("_db_chainfix: lock error");
+	if (__atomic_load_n(ver, __ATOMIC_ACQUIRE) & 1) {	/* no one beat us */
+		if (db->walfd >= 0)
+			_db_walredo(db, 0);
+		__atomic_add_fetch(ver, 1, __ATOMIC_RELEASE);
+	}
+	if (type == F_RDLCK &&
+	    read_lock(db->idxfd, chainoff, SEEK_SET, 1) < 0)
+		err_dump("_db_chainfix: lock error");
+}
+
+/*
+ * we just write locked the free list. if it is marked held, the writer
+ * that had it died before applying its changes to it: replay them.
+ */
+static void
+_db_freefix(DB *db)
+{
+	if (db->walfd < 0 || db->freelocked || !db->shm->freeheld)
+		return;
+	_db_walredo(db, 0);
+	db->shm->freeheld = 0;
+}
+
+/*
+ * blank out the index records from offset to end that no log record
+ * wrote. they were appended by operations that never finished, and are
+ * on no hash chain. runs of NULs are appends never written; a record
+ * cut short ends the index file. returns the number of records changed.
+ */
+static int
+_db_walorphans(DB *db, off_t offset, off_t end, const char *logged)
+{
+	char	asciilen[IDXLEN_SZ + 1], asciicrc[CRC_SZ + 1], *ptr;
+	size_t	idxlen;
+	off_t	start = offset;
+	int	n = 0;
+	
+	for ( ; ; offset += PTR_SZ + IDXLEN_SZ + idxlen) {
+		if ((offset = _db_skipnul(db->idxfd, offset)) < 0)
+			return (n);		/* nothing but NULs left */
+		if (offset + PTR_SZ + IDXLEN_SZ > end)
+			break;
+		if (pread(db->idxfd, asciilen, IDXLEN_SZ, offset + PTR_SZ) !=
+		    IDXLEN_SZ)
+			err_sys("_db_walorphans: read error");
+		asciilen[IDXLEN_SZ] = 0;
+		idxlen = atol(asciilen);
+		if (idxlen < IDXLEN_MIN || idxlen > IDXLEN_MAX ||
+		    offset + PTR_SZ + IDXLEN_SZ + idxlen > end)
+			break;
+		if (!logged[offset - start]) {
+			if (pread(db->idxfd, db->idxbuf, idxlen,
+			    offset + PTR_SZ + IDXLEN_SZ) != idxlen)
+				err_sys("_db_walorphans: read error");
+			if ((ptr = memchr(db->idxbuf, SEP, idxlen)) != NULL) {
+				/* blank the key, and redo the record's crc. */
+				memset(db->idxbuf, SPACE, ptr - db->idxbuf);
+				sprintf(asciicrc, "%0*x", CRC_SZ,
+				    crc32c(crc32c(0, asciilen, IDXLEN_SZ),
+				    db->idxbuf, idxlen - 1 - CRC_SZ));
+				memcpy(db->idxbuf + idxlen - 1 - CRC_SZ, asciicrc,
+				    CRC_SZ);
+				if (pwrite(db->idxfd, db->idxbuf, idxlen,
+				    offset + PTR_SZ + IDXLEN_SZ) != idxlen)
+					err_sys("_db_walorphans: write error");
+				_db_backupmark(db, db->idxfd,
+				    offset + PTR_SZ + IDXLEN_SZ, idxlen);
+			}
+			n++;
+		}
+	}
+	if (ftruncate(db->idxfd, offset) < 0)
+		err_sys("_db_walorphans: ftruncate error");
+	db->shm->idxend = offset;
+	return (n + 1);
+}
+
+/*
+ * start the log record for an operation, if it isn't started.
+ * we hold the apply lock from the first write (or reservation) until
+ * the last write is applied, which keeps a checkpoint from passing
+ * over an operation in progress.
+ */
+static void
+_db_walbegin(DB *db)
+{
+	if (db->wallen > 0)
+		return;
+	if (db->walbuf == NULL &&
+	    (db->walbuf = malloc(db->walsize = 4 * IDXLEN_MAX)) == NULL)
+		err_dump("_db_walbegin: malloc error");
+	if (readw_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+		err_dump("_db_walbegin: readw_lock error");
+	db->wallen = sizeof(WALREC);	/* WALREC goes at the front */
+}
+
+/*
+ * add a write to the log record being built.
+ */
+static void
+_db_walput(DB *db, int file, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	WALENT	ent;
+	size_t	len, need;
+	int	i;
+	
+	_db_walbegin(db);
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	need = db->wallen + sizeof(ent) + len;
+	if (need > db->walsize) {
+		db->walsize = need * 2;
+		if ((db->walbuf = realloc(db->walbuf, db->walsize)) == NULL)
+			err_dump("_db_walput: realloc error");
+	}
+	memset(&ent, 0, sizeof(ent));
+	ent.file = file;
+	ent.len = len;
+	ent.offset = offset;
+	memcpy(db->walbuf + db->wallen, &ent, sizeof(ent));
+	db->wallen += sizeof(ent);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(db->walbuf + db->wallen, iov[i].iov_base, iov[i].iov_len);
+		db->wallen += iov[i].iov_len;
+	}
+}
+
+/*
+ * lay the index file writes in the log record being built, which are not
+ * yet applied, over the len bytes read at offset into buf.
+ */
+static void
+_db_walpeek(DB *db, off_t offset, char *buf, size_t len)
+{
+	WALENT	ent;
+	char	*ptr;
+	off_t	from, to;
+	
+	for (ptr = db->walbuf + sizeof(WALREC); ptr < db->walbuf + db->wallen;
+	    ptr += sizeof(ent) + ent.len) {
+		memcpy(&ent, ptr, sizeof(ent));
+		if (ent.file != WAL_IDX)
+			continue;
+		from = ent.offset > offset ? ent.offset : offset;
+		to = ent.offset + ent.len < offset + len ?
+		    ent.offset + ent.len : offset + len;
+		if (from < to)
+			memcpy(buf + (from - offset),
+			    ptr + sizeof(ent) + (from - ent.offset), to - from);
+	}
+}
+
+/*
+ * append the log record built by this operation to the log.
+ */
+static void
+_db_walappend(DB *db)
+{
+	WALREC	*rec;
+	struct timespec	ts = { 0, 1000000 };
+	off_t	offset;
+	int	i, n = 0;
+	
+	if (db->wallen == 0)
+		return;
+	rec = (WALREC *) db->walbuf;
+	rec->magic = WAL_MAGIC;
+	rec->gen = db->shm->walgen;	/* can't change while we hold the lock */
+	rec->len = db->wallen - sizeof(WALREC);
+	rec->crc = crc32c(0, db->walbuf + sizeof(WALREC), rec->len);
+	
+	if (writew_lock(db->walfd, WAL_APPENDLK, SEEK_SET, 1) < 0)
+		err_dump("_db_walappend: writew_lock error");
+	if ((offset = lseek(db->walfd, 0, SEEK_END)) == -1)
+		err_dump("_db_walappend: lseek error");
+	
+	/* the record has a slot before it is written, its lock ours till
+	   it is applied. a slot whose lock someone holds, whoever has it
+	   in use, is passed over; with none free we wait for one.	*/
+	for (i = 0; ; i = (i + 1) % WAL_PENDING) {
+		if (i == 0 && n++ > 0)
+			nanosleep(&ts, NULL);
+		if (db->shm->walpend[i] != 0 ||
+		    write_lock(db->walfd, WAL_SLOTLK + i, SEEK_SET, 1) < 0)
+			continue;
+		_db_shmlock(db);
+		if (db->shm->walpend[i] == 0) {
+			db->shm->walpend[i] = offset;
+			db->shm->walcrc[i] = rec->crc;
+			pthread_mutex_unlock(&db->shm->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&db->shm->mutex);
+		if (un_lock(db->walfd, WAL_SLOTLK + i, SEEK_SET, 1) < 0)
+			err_dump("_db_walappend: un_lock error");
+	}
+	db->walslot = i;
+	if (pwrite(db->walfd, db->walbuf, db->wallen, offset) != db->wallen)
+		err_sys("_db_walappend: write error of log record");
+	if (un_lock(db->walfd, WAL_APPENDLK, SEEK_SET, 1) < 0)
+		err_dump("_db_walappend: un_lock error");
+	db->dirty |= DIRTY_WAL;
+}
+
+/*
+ * the log record is written: apply the writes that were held back,
+ * and release the locks held for them. checkpoint if the log has
+ * grown too big.
+ */
+static void
+_db_walapply(DB *db)
+{
+	WALENT	ent;
+	char	*ptr;
+	struct stat statbuff;
+	int	fd;
+	
+	if (db->wallen > 0) {
+		for (ptr = db->walbuf + sizeof(WALREC);
+		    ptr < db->walbuf + db->wallen;
+		    ptr += sizeof(ent) + ent.len) {
+			memcpy(&ent, ptr, sizeof(ent));
+			fd = ent.file == WAL_IDX ? db->idxfd : db->datfd;
+			if (pwrite(fd, ptr + sizeof(ent), ent.len,
+			    ent.offset) != ent.len)
+				err_sys("_db_walapply: write error");
+			_db_backupmark(db, fd, ent.offset, ent.len);
+		}
+		db->wallen = 0;
+		_db_shmlock(db);
+		db->shm->walpend[db->walslot] = 0;
+		pthread_mutex_unlock(&db->shm->mutex);
+		if (un_lock(db->walfd, WAL_SLOTLK + db->walslot, SEEK_SET, 1) < 0 ||
+		    un_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+			err_dump("_db_walapply: un_lock error");
+	}
+	if (db->freelocked) {
+		db->freelocked = 0;
+		db->shm->freeheld = 0;
+		if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
+			err_dump("_db_walapply: un_lock error");
+	}
+	if (fstat(db->walfd, &statbuff) == 0 && statbuff.st_size > db->walmax)
+		_db_checkpoint(db);
+}
+
+/*
+ * sync the index and data files, after which the log is not needed,
+ * and start a new generation of it. we wait for every operation that
+ * has written its log record to apply it.
+ */
+static void
+_db_checkpoint(DB *db)
+{
+	WALHDR	hdr;
+	struct stat statbuff;
+	
+	if (writew_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+		err_dump("_db_checkpoint: writew_lock error");
+	_db_walredo(db, 1);	/* any slot in use is a dead writer's */
+	if (fstat(db->walfd, &statbuff) < 0)
+		err_sys("_db_checkpoint: fstat error");
+	if (statbuff.st_size > sizeof(hdr)) {	/* else someone beat us to it */
+		_db_fsync(db, DIRTY_IDX | DIRTY_DAT);
+		hdr.magic = WAL_MAGIC;
+		hdr.gen = db->shm->walgen + 1;
+		if ((hdr.idxsize = lseek(db->idxfd, 0, SEEK_END)) == -1)
+			err_dump("_db_checkpoint: lseek error");
+		hdr.start = statbuff.st_size;
+		if (pwrite(db->walfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			err_sys("_db_checkpoint: write error of log header");
+		if (fdatasync(db->walfd) < 0)
+			err_sys("_db_checkpoint: sync error of log");
+		/* the header is the checkpoint: if we die from here on,
+		   what is logged next goes after hdr.start.	*/
+		db->shm->walgen = hdr.gen;
+		if (ftruncate(db->walfd, sizeof(hdr)) < 0)
+			err_sys("_db_checkpoint: ftruncate error of log");
+	}
+	if (un_lock(db->walfd, WAL_APPLYLK, SEEK_SET, 1) < 0)
+		err_dump("_db_checkpoint: un_lock error");
+}
+
+/*
+ * open the replication log, <name>.rep, for appending. if we just created
+ * the database, start it afresh; a follower finding it shorter than
+ * where it got to copies the database again.
+ */
+static int
+_db_repopen(DB *db, int namelen, int created)
+{
+	struct stat	statbuff;
+	
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_repopen: fstat error");
+	strcpy(db->name + namelen, ".rep");
+	if ((db->repfd = open(db->name, O_WRONLY | O_APPEND | O_CREAT |
+	    (created ? O_TRUNC : 0), statbuff.st_mode & 0666)) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * build the replication log record of a store (with its data) or a
+ * delete of the key in db->keybuf. _db_commit() writes it.
+ */
+static void
+_db_repput(DB *db, int op, const char *data)
+{
+	DBREPREC	rec;
+	struct timespec	ts;
+	const char	*key = db->keybuf;
+	char		*ptr;
+	size_t		len;
+	
+	if (db->repfd < 0)
+		return;
+	if (db->repbuf == NULL && (db->repbuf = malloc(sizeof(rec) +
+	    KEYPREFIX_MAX + IDXLEN_MAX + DATALEN_MAX)) == NULL)
+		err_dump("_db_repput: malloc error");
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = DBREP_MAGIC;
+	rec.op = op;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.usec = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	
+	/* the whole key, putting back any elided prefix.	*/
+	ptr = db->repbuf + sizeof(rec);
+	if (db->prefixlen > 0 && *key++ == KEY_PREFIXED) {
+		memcpy(ptr, db->prefix, db->prefixlen);
+		ptr += db->prefixlen;
+	}
+	len = strlen(key);
+	memcpy(ptr, key, len);
+	ptr += len;
+	rec.keylen = ptr - (db->repbuf + sizeof(rec));
+	if (data != NULL) {
+		rec.datlen = strlen(data);
+		memcpy(ptr, data, rec.datlen);
+		ptr += rec.datlen;
+	}
+	db->replen = ptr - db->repbuf;
+	rec.crc = crc32c(crc32c(0, &rec, sizeof(rec)), db->repbuf + sizeof(rec),
+	    db->replen - sizeof(rec));
+	memcpy(db->repbuf, &rec, sizeof(rec));
+}
+
+/*
+ * online backup. the files are copied in two passes: the first with
+ * writers carrying on, tracking the blocks they write meanwhile in the
+ * dirty maps in the shared memory segment; the second with the hash
+ * table read locked, so no store or delete is part way through, copying
+ * just the blocks written since and what was appended. writers are only
+ * held up for the second pass.
+ */
+/*
+ * note that len bytes at offset in the index or data file were written,
+ * if a backup is tracking writes. the fence orders the write before our
+ * look at backupblk, as the backup orders setting it before its copy:
+ * either the copy sees the write, or we see backupblk.
+ */
+static void
+_db_backupmark(DB *db, int fd, off_t offset, size_t len)
+{
+	unsigned long long *map;
+	off_t	blk, b, e;
+	
+	if (db->shm == NULL || len == 0)
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((blk = __atomic_load_n(&db->shm->backupblk, __ATOMIC_RELAXED)) == 0)
+		return;
+	map = db->shm->backupmap[fd == db->idxfd ? 0 : 1];
+	if ((b = offset / blk) >= BACKUP_BITS)
+		b = BACKUP_BITS - 1;	/* the last bit covers the rest */
+	if ((e = (offset + len - 1) / blk) >= BACKUP_BITS)
+		e = BACKUP_BITS - 1;
+	for ( ; b <= e; b++)
+		__atomic_fetch_or(&map[b / 64], 1ULL << (b % 64),
+		    __ATOMIC_RELAXED);
+}
+
+/*
+ * copy len bytes at offset from one file to the same place in another,
+ * in the kernel where it can (a filesystem that can share the blocks
+ * shares them), else through a buffer. stops early at the end of from.
+ */
+static int
+_db_copy(int from, int to, off_t offset, off_t len)
+{
+	char	buf[64 * 1024];
+	loff_t	in, out;
+	ssize_t	n;
+	int	kernel = 1;
+	
+	while (len > 0) {
+		n = -1;
+		if (kernel) {
+			in = out = offset;
+			if ((n = copy_file_range(from, &in, to, &out, len, 0)) < 0) {
+				if (errno != EXDEV && errno != EINVAL &&
+				    errno != ENOSYS && errno != EOPNOTSUPP)
+					return (-1);
+				kernel = 0;	/* not between these files */
+			}
+		}
+		if (!kernel) {
+			if ((n = pread(from, buf, len < sizeof(buf) ? len :
+			    sizeof(buf), offset)) < 0 ||
+			    (n > 0 && pwrite(to, buf, n, offset) != n))
+				return (-1);
+		}
+		if (n == 0)
+			break;
+		offset += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * create the copies at <path>.idx and <path>.dat, start tracking writes,
+ * and make the first pass.
+ */
+static int
+_db_backupstart(DB *db, const char *path, DBBACKUP *bk)
+{
+	struct stat	statbuff, sb;
+	DBSHM	*shm = db->shm;
+	char	*name;
+	off_t	size;
+	int	f, src;
+	
+	bk->fd[0] = bk->fd[1] = -1;
+	bk->end[0] = bk->end[1] = 0;
+	bk->tracking = 0;
+	if ((name = malloc(strlen(path) + 5)) == NULL)
+		err_dump("_db_backupstart: malloc error");
+	/* a copy over the database itself would truncate it.	*/
+	for (f = 0; f < 2; f++) {
+		if (fstat(f == 0 ? db->idxfd : db->datfd, &statbuff) < 0)
+			err_sys("_db_backupstart: fstat error");
+		sprintf(name, f == 0 ? "%s.idx" : "%s.dat", path);
+		if (stat(name, &sb) == 0 && sb.st_dev == statbuff.st_dev &&
+		    sb.st_ino == statbuff.st_ino) {
+			free(name);
+			errno = EINVAL;
+			return (-1);
+		}
+	}
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_backupstart: fstat error");
+	sprintf(name, "%s.idx", path);
+	bk->fd[0] = open(name, O_RDWR | O_CREAT | O_TRUNC, statbuff.st_mode & 0666);
+	sprintf(name, "%s.dat", path);
+	bk->fd[1] = open(name, O_RDWR | O_CREAT | O_TRUNC, statbuff.st_mode & 0666);
+	/* a log left from an earlier database of the name would be
+	   replayed over the copy, and a replication log appended to.	*/
+	sprintf(name, "%s.wal", path);
+	if (unlink(name) < 0 && errno != ENOENT) {
+		free(name);
+		return (-1);
+	}
+	sprintf(name, "%s.rep", path);
+	if (unlink(name) < 0 && errno != ENOENT) {
+		free(name);
+		return (-1);
+	}
+	free(name);
+	if (bk->fd[0] < 0 || bk->fd[1] < 0)
+		return (-1);
+	if (shm == NULL)
+		return (0);	/* all of it in the second pass */
+	
+	/* one backup at a time; one whose process died is over.	*/
+	_db_shmlock(db);
+	if (shm->backuppid != 0 && (kill(shm->backuppid, 0) == 0 ||
+	    errno != ESRCH)) {
+		pthread_mutex_unlock(&shm->mutex);
+		errno = EBUSY;
+		return (-1);
+	}
+	shm->backuppid = getpid();
+	pthread_mutex_unlock(&shm->mutex);
+	bk->tracking = 1;
+	
+	/* a bit of a map covers enough that the files fit twice over. */
+	size = statbuff.st_size;
+	if (fstat(db->datfd, &statbuff) < 0)
+		err_sys("_db_backupstart: fstat error");
+	if (statbuff.st_size > size)
+		size = statbuff.st_size;
+	memset(shm->backupmap, 0, sizeof(shm->backupmap));
+	__atomic_store_n(&shm->backupblk, (2 * size / BACKUP_BITS / 4096 + 1) *
+	    4096, __ATOMIC_SEQ_CST);
+	
+	for (f = 0; f < 2; f++) {
+		src = f == 0 ? db->idxfd : db->datfd;
+#ifdef FICLONE
+		if (ioctl(bk->fd[f], FICLONE, src) == 0) {
+			if (fstat(bk->fd[f], &statbuff) < 0)
+				err_sys("_db_backupstart: fstat error");
+			bk->end[f] = statbuff.st_size;
+			continue;
+		}
+#endif
+		if (fstat(src, &statbuff) < 0)
+			err_sys("_db_backupstart: fstat error");
+		if (_db_copy(src, bk->fd[f], 0, statbuff.st_size) < 0)
+			return (-1);
+		bk->end[f] = statbuff.st_size;
+	}
+	return (0);
+}
+
+/*
+ * the second pass, with the hash table locked: copy the blocks written
+ * since the first pass, and what was appended.
+ */
+static int
+_db_backupfinish(DB *db, DBBACKUP *bk)
+{
+	struct stat	statbuff;
+	unsigned long long *map;
+	off_t	blk, b, offset, len;
+	int	f, src;
+	
+	blk = db->shm != NULL ? db->shm->backupblk : 0;
+	for (f = 0; f < 2; f++) {
+		src = f == 0 ? db->idxfd : db->datfd;
+		map = blk > 0 ? db->shm->backupmap[f] : NULL;
+		for (b = 0; map != NULL && b < BACKUP_BITS; b++) {
+			if (map[b / 64] == 0) {
+				b += 63;	/* a word at a time */
+				continue;
+			}
+			if ((map[b / 64] & 1ULL << (b % 64)) == 0)
+				continue;
+			offset = b * blk;
+			len = b < BACKUP_BITS - 1 ? blk : bk->end[f] - offset;
+			if (offset + len > bk->end[f])
+				len = bk->end[f] - offset;
+			if (len > 0 && _db_copy(src, bk->fd[f], offset, len) < 0)
+				return (-1);
+		}
+		if (fstat(src, &statbuff) < 0)
+			err_sys("_db_backupfinish: fstat error");
+		if (statbuff.st_size > bk->end[f] && _db_copy(src, bk->fd[f],
+		    bk->end[f], statbuff.st_size - bk->end[f]) < 0)
+			return (-1);
+		if (ftruncate(bk->fd[f], statbuff.st_size) < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * stop tracking writes, and close the copies, synced if rc is 0.
+ */
+static int
+_db_backupend(DB *db, DBBACKUP *bk, int rc)
+{
+	int	f;
+	
+	if (bk->tracking) {
+		__atomic_store_n(&db->shm->backupblk, 0, __ATOMIC_SEQ_CST);
+		db->shm->backuppid = 0;
+	}
+	for (f = 0; f < 2; f++) {
+		if (bk->fd[f] < 0)
+			continue;
+		if (rc == 0 && fdatasync(bk->fd[f]) < 0)
+			rc = -1;
+		close(bk->fd[f]);
+	}
+	return (rc);
+}
+
+/*
+ * lock the hash table, and the free list ptr in front of it, with type
+ * F_RDLCK, F_WRLCK or F_UNLCK. a store or delete write locks its chain
+ * throughout, so with the table read locked none is part way through.
+ */
+static void
+_db_tablelock(DB *db, int type)
+{
+	if (lock_reg(db->idxfd, type == F_UNLCK ? F_SETLK : F_SETLKW, type,
+	    FREE_OFF, SEEK_SET, db->firstoff - FREE_OFF) < 0)
+		err_dump("_db_tablelock: lock_reg error");
+}
+
+/*
+ * copy the database to path, as it was at one moment, while others go
+ * on using it. the copy is a database of its own, with no log: what
+ * was logged is in it. the shards of a sharded database are all locked
+ * for the second pass together, so the copy is of one moment across
+ * them. the locks are fcntl locks, so other threads of this process
+ * must not be writing meanwhile. returns 0 if OK, -1 on error (EBUSY
+ * if a backup is in progress already, EINVAL if path is the database).
+ */
+int
+db_backup(DBHANDLE h, const char *path)
+{
+	DB	*db = h, *master = NULL, **dbs = &db;
+	DBBACKUP *bk;
+	char	*name;
+	int	i, n = 1, rc = 0;
+	
+	db_flush(db);		/* the copy has what we have stored */
+	if (db->nshards > 0) {
+		/* the header, which doesn't change, then the shards. */
+		master = db;
+		dbs = (DB **) db->shard;
+		n = db->nshards;
+		if ((bk = malloc(sizeof(DBBACKUP))) == NULL)
+			err_dump("db_backup: malloc error");
+		rc = _db_backupstart(master, path, bk);
+		if (rc == 0)
+			rc = _db_backupfinish(master, bk);
+		rc = _db_backupend(master, bk, rc);
+		free(bk);
+		if (rc < 0)
+			return (-1);
+	}
+	if ((bk = calloc(n, sizeof(DBBACKUP))) == NULL ||
+	    (name = malloc(strlen(path) + 5)) == NULL)	/* ".255" */
+		err_dump("db_backup: malloc error");
+	for (i = 0; i < n; i++)
+		bk[i].fd[0] = bk[i].fd[1] = -1;
+	for (i = 0; i < n && rc == 0; i++) {
+		if (master != NULL)
+			sprintf(name, "%s.%d", path, i);
+		rc = _db_backupstart(dbs[i], master != NULL ? name : path,
+		    &bk[i]);
+	}
+	if (rc == 0) {
+		for (i = 0; i < n; i++)
+			_db_tablelock(dbs[i], F_RDLCK);
+		for (i = 0; i < n && rc == 0; i++)
+			rc = _db_backupfinish(dbs[i], &bk[i]);
+		for (i = 0; i < n; i++)
+			_db_tablelock(dbs[i], F_UNLCK);
+	}
+	for (i = 0; i < n; i++)
+		rc = _db_backupend(dbs[i], &bk[i], rc);
+	free(name);
+	free(bk);
+	return (rc);
+}
+
+/*
+ * secondary indexes. db_index() declares one on an open database:
+ * fn gives the attribute of a record, and db_store() and db_delete()
+ * keep an entry for it in the index, <name>.<index> (<name>.<n>.<index>
+ * for each shard of a sharded database), while they hold the record's
+ * chain lock. the entry for a new attribute goes in before the record is
+ * written, and the one for the attribute it replaces comes out after,
+ * so even after a crash the index has an entry for every record; an
+ * entry left over is skipped by db_lookup(), which checks the attribute
+ * of each record it finds. every process that writes the database must
+ * declare its indexes, the same ones, before its first change.
+ * the entries for an attribute are spread over ATTR_CHAINS chains, so
+ * an attribute held by many records makes changes to them slower by
+ * less. fixed size databases can't have indexes.
+ */
+int
+db_index(DBHANDLE h, const char *name, DBEXTRACT fn, void *arg)
+{
+	DB	*db = h;
+	DBSINDEX *si;
+	const char *p;
+	int	i;
+	
+	if (db->nshards > 0) {
+		for (i = 0; i < db->nshards; i++)
+			if (db_index(db->shard[i], name, fn, arg) < 0)
+				return (-1);
+		return (0);
+	}
+	/* a name that can't be taken for a suffix of ours, or a shard. */
+	for (p = name; (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+	    (p > name && ((*p >= '0' && *p <= '9') || *p == '_')); p++)
+		;
+	if (*p != 0 || p == name || p - name > INDEXNAME_MAX ||
+	    db->keysize > 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (i = 0; i < db->nsindex; i++)
+		if (strcmp(db->sindex[i].name, name) == 0) {
+			errno = EEXIST;
+			return (-1);
+		}
+	if ((si = realloc(db->sindex, (db->nsindex + 1) *
+	    sizeof(DBSINDEX))) == NULL)
+		err_dump("db_index: realloc error");
+	db->sindex = si;
+	si += db->nsindex;
+	strcpy(si->name, name);
+	si->fn = fn;
+	si->arg = arg;
+	if (_db_indexopen(db, si) < 0)
+		return (-1);
+	db->nsindex++;
+	return (0);
+}
+
+/*
+ * open the index si of db, creating it if need be. a new index is built
+ * from the records there are, with db_nextrec(), which rewinds db.
+ */
+static int
+_db_indexopen(DB *db, DBSINDEX *si)
+{
+	struct stat	statbuff;
+	DBOPTS		opts;
+	DB		*idx;
+	char		*path, key[IDXLEN_MAX + KEYPREFIX_MAX + 1], *data;
+	int		namelen, oflag, rc = 0;
+	
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_indexopen: fstat error");
+	namelen = strlen(db->name) - 4;		/* less ".idx" or the like */
+	if ((path = malloc(namelen + strlen(si->name) + 2)) == NULL)
+		err_dump("_db_indexopen: malloc error");
+	sprintf(path, "%.*s.%s", namelen, db->name, si->name);
+	memset(&opts, 0, sizeof(opts));
+	opts.nhash = db->nhash;
+	opts.sync = db->sync;
+	opts.syncms = db->syncms;
+	opts.wal = (db->flags & HDR_WAL) != 0;
+	opts.walmax = db->walmax;
+	
+	/* a database created afresh gets a fresh index. */
+	oflag = db->rdonly ? O_RDONLY : O_RDWR;
+	idx = NULL;
+	if (!db->created)
+		idx = _db_open(path, oflag, 0, &opts, HDR_ATTRIDX);
+	if (idx == NULL && !db->rdonly && (db->created || errno == ENOENT))
+		idx = _db_open(path, O_RDWR | O_CREAT | O_TRUNC,
+		    statbuff.st_mode & 0666, &opts, HDR_ATTRIDX);
+	free(path);
+	if (idx == NULL)
+		return (-1);
+	if (!(idx->flags & HDR_ATTRIDX)) {
+		_db_free(idx);
+		errno = EINVAL;		/* a database, but no index */
+		return (-1);
+	}
+	si->idx = idx;
+	if (idx->created) {
+		db_rewind(db);
+		while (rc == 0 && (data = db_nextrec(db, key)) != NULL)
+			rc = _db_indexadd(si, key, data, NULL);
+		db_rewind(db);
+	}
+	if (rc < 0) {
+		_db_free(idx);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * the rest of db_store() for a database with indexes, once the key has
+ * been looked up and its chain write locked.
+ */
+static int
+_db_indexstore(DB *db, const char *key, const char *data, int flag,
+    int found)
+{
+	char	ndata[DATALEN_MAX + 1], odata[DATALEN_MAX + 1];
+	int	i, rc, old;
+	
+	if ((found && flag == DB_INSERT) || (!found && flag == DB_REPLACE))
+		return (_db_dostore(db, data, flag, found));
+	strcpy(ndata, data);		/* it may be db->datbuf */
+	if ((old = found && _db_readdat(db) != NULL))	/* not if damaged */
+		strcpy(odata, db->datbuf);
+	for (i = 0; i < db->nsindex; i++)
+		if (_db_indexadd(&db->sindex[i], key, ndata,
+		    old ? odata : NULL) < 0) {
+			db->cnt_storerr++;
+			return (-1);
+		}
+	if ((rc = _db_dostore(db, ndata, flag, found)) == 0 && old)
+		for (i = 0; i < db->nsindex; i++)
+			_db_indexdel(&db->sindex[i], key, odata, ndata);
+	return (rc);
+}
+
+/*
+ * the attribute of a record under index si, in attr. returns 1, or 0 if
+ * the record isn't indexed.
+ */
+static int
+_db_attr(DBSINDEX *si, const char *key, const char *data, char *attr)
+{
+	if ((*si->fn)(si->arg, key, data, attr) != 1)
+		return (0);
+	return (memchr(attr, 0, DBATTR_MAX) != NULL &&
+	    strpbrk(attr, "\t:\n") == NULL);
+}
+
+/*
+ * the key of the index entry for attr and key in buf, ATTRKEY_MAX + 1
+ * bytes. returns -1 if it would be too long, and the record isn't
+ * indexed.
+ */
+static int
+_db_attrkey(char *buf, const char *attr, const char *key)
+{
+	size_t	alen = strlen(attr), klen = strlen(key);
+	
+	if (alen + 1 + klen > ATTRKEY_MAX)
+		return (-1);
+	memcpy(buf, attr, alen);
+	buf[alen] = ATTR_SEP;
+	memcpy(buf + alen + 1, key, klen + 1);
+	return (0);
+}
+
+/*
+ * add the entry for the record key, data to index si, unless the record
+ * it replaces, odata or NULL, has the same attribute. returns 0, or -1 if
+ * the entry can't be stored.
+ */
+static int
+_db_indexadd(DBSINDEX *si, const char *key, const char *data,
+    const char *odata)
+{
+	char	attr[DBATTR_MAX], oattr[DBATTR_MAX], ekey[ATTRKEY_MAX + 1];
+	
+	if (!_db_attr(si, key, data, attr) || _db_attrkey(ekey, attr, key) < 0)
+		return (0);
+	if (odata != NULL && _db_attr(si, key, odata, oattr) &&
+	    strcmp(attr, oattr) == 0)
+		return (0);
+	return (db_store(si->idx, ekey, "1", DB_STORE) < 0 ? -1 : 0);
+}
+
+/*
+ * remove the entry for the record key, odata from index si, unless the
+ * record that replaced it, data or NULL, has the same attribute.
+ */
+static void
+_db_indexdel(DBSINDEX *si, const char *key, const char *odata,
+    const char *data)
+{
+	char	attr[DBATTR_MAX], oattr[DBATTR_MAX], ekey[ATTRKEY_MAX + 1];
+	
+	if (!_db_attr(si, key, odata, oattr) ||
+	    _db_attrkey(ekey, oattr, key) < 0)
+		return;
+	if (data != NULL && _db_attr(si, key, data, attr) &&
+	    strcmp(attr, oattr) == 0)
+		return;
+	db_delete(si->idx, ekey);
+}
+
+typedef struct {
+	const char	*name;
+	const char	*attr;
+	DBVISIT		fn;
+	void		*arg;
+	int		count;		/* records found */
+	int		stop;		/* fn returned nonzero */
+	int		err;		/* errno of an error, or 0 */
+} DBLOOKUP;
+
+/*
+ * call fn for each record whose attribute under index name is attr,
+ * until it returns nonzero. with shards it is called from a thread per
+ * shard at once. returns the number of records, or -1 with errno EINVAL
+ * if there is no such index, or EIO if it is damaged.
+ */
+int
+db_lookup(DBHANDLE h, const char *name, const char *attr, DBVISIT fn,
+    void *arg)
+{
+	DBLOOKUP	lk;
+	
+	memset(&lk, 0, sizeof(lk));
+	lk.name = name;
+	lk.attr = attr;
+	lk.fn = fn;
+	lk.arg = arg;
+	_db_parallel(h, _db_lookupshard, &lk);
+	if (lk.err != 0) {
+		errno = lk.err;
+		return (-1);
+	}
+	return (lk.count);
+}
+
+/*
+ * db_lookup() in one database or shard: gather the keys on the entries
+ * for the attribute from its chains in the index, each read locked in
+ * turn, then, with none locked, fetch the records and check their
+ * attribute is still it.
+ */
+static void
+_db_lookupshard(DB *db, int n, void *arg)
+{
+	DBLOOKUP *lk = arg;
+	DBSINDEX *si = NULL;
+	DB	*idx;
+	char	prefix[DBATTR_MAX + 1], attr[DBATTR_MAX], **keys = NULL, *data;
+	size_t	len, i, nkeys = 0, maxkeys = 0;
+	DBHASH	hash;
+	DBPTR	ptr;
+	off_t	offset;
+	int	c, err = 0;
+	
+	_db_wbflush(db);	/* the index has entries for them once made */
+	for (i = 0; i < db->nsindex; i++)
+		if (strcmp(db->sindex[i].name, lk->name) == 0)
+			si = &db->sindex[i];
+	if (si == NULL) {
+		__atomic_store_n(&lk->err, EINVAL, __ATOMIC_RELAXED);
+		return;
+	}
+	if ((len = strlen(lk->attr)) >= DBATTR_MAX ||
+	    strpbrk(lk->attr, "\t:\n") != NULL)
+		return;			/* can't be indexed */
+	sprintf(prefix, "%s%c", lk->attr, ATTR_SEP);
+	len++;
+	
+	idx = si->idx;
+	hash = _db_hash(idx, lk->attr);	/* the first of its chains */
+	for (c = 0; c < ATTR_CHAINS && c < idx->nhash && err == 0; c++) {
+		idx->chainoff = (hash + c) % idx->nhash * PTR_SZ +
+		    idx->hashoff;
+		if (_db_lockw(idx, F_RDLCK, idx->chainoff) < 0)
+			err_dump("_db_lookupshard: lock error");
+		_db_chainfix(idx, idx->chainoff, F_RDLCK);
+		ptr = _db_readptr(idx, idx->chainoff);
+		while ((offset = PTR_OFF(ptr)) != 0) {
+			/* an entry for the attribute has a longer key. */
+			if (PTR_KLEN(ptr) <= len) {
+				ptr = _db_readptr(idx, offset);
+				continue;
+			}
+			if (_db_readidx(idx, offset) < -1) {
+				err = EIO;	/* damaged */
+				break;
+			}
+			if (!(idx->ptrval & PTR_DEAD) &&
+			    strncmp(idx->idxbuf, prefix, len) == 0) {
+				if (nkeys == maxkeys) {
+					maxkeys = maxkeys > 0 ? 2 * maxkeys : 64;
+					if ((keys = realloc(keys, maxkeys *
+					    sizeof(char *))) == NULL)
+						err_dump("_db_lookupshard: "
+						    "realloc error");
+				}
+				if ((keys[nkeys++] = strdup(idx->idxbuf +
+				    len)) == NULL)
+					err_dump("_db_lookupshard: strdup error");
+			}
+			ptr = idx->ptrval;
+		}
+		if (un_lock(idx->idxfd, idx->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_lookupshard: un_lock error");
+	}
+	
+	for (i = 0; i < nkeys; i++) {
+		if (!__atomic_load_n(&lk->stop, __ATOMIC_RELAXED) &&
+		    (data = db_fetch(db, keys[i])) != NULL &&
+		    _db_attr(si, keys[i], data, attr) &&
+		    strcmp(attr, lk->attr) == 0) {
+			__atomic_add_fetch(&lk->count, 1, __ATOMIC_RELAXED);
+			if ((*lk->fn)(lk->arg, keys[i], data) != 0)
+				__atomic_store_n(&lk->stop, 1, __ATOMIC_RELAXED);
+		}
+		free(keys[i]);
+	}
+	free(keys);
+	if (err != 0)
+		__atomic_store_n(&lk->err, err, __ATOMIC_RELAXED);
+}
+
+/*
+ * tracing. one in db->trace of the calls of db_fetch(), db_store() and
+ * db_delete() on a handle records an event in the handle's ring in
+ * <name>.trc (see DBTRFILE in db.h): how long it took, how much of that
+ * was spent waiting for locks, and how far down its chain it went. the
+ * file is mapped by every process tracing the database, and dbtrace
+ * reads it while they run. a call not traced costs a decrement.
+ * a handle that can't have a ring, because the file can't be opened or
+ * all the rings are taken, isn't traced.
+ */
+static void
+_db_traceopen(DB *db, int namelen)
+{
+	struct stat	statbuff;
+	DBTRFILE	*tf;
+	unsigned int	magic = 0;
+	int		fd, i, pid, trace = db->trace;
+	
+	db->trace = 0;		/* until we have a ring */
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_traceopen: fstat error");
+	strcpy(db->name + namelen, ".trc");
+	if ((fd = open(db->name, O_RDWR | O_CREAT, statbuff.st_mode & 0666)) < 0)
+		return;
+	/* the rings never written take no space.	*/
+	if (fstat(fd, &statbuff) < 0 || (statbuff.st_size < sizeof(DBTRFILE) &&
+	    ftruncate(fd, sizeof(DBTRFILE)) < 0) || (tf = mmap(NULL,
+	    sizeof(DBTRFILE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	__atomic_compare_exchange_n(&tf->magic, &magic, DBTRACE_MAGIC, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	/* a ring is free if no process has it, or its process is gone. */
+	for (i = 0; tf->magic == DBTRACE_MAGIC && i < DBTRACE_RINGS; i++) {
+		pid = __atomic_load_n(&tf->ring[i].pid, __ATOMIC_RELAXED);
+		if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+			continue;
+		if (__atomic_compare_exchange_n(&tf->ring[i].pid, &pid,
+		    (int) getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			db->trfile = tf;
+			db->tring = &tf->ring[i];
+			db->trace = db->tracewait = trace;
+			return;
+		}
+	}
+	munmap(tf, sizeof(DBTRFILE));
+}
+
+/*
+ * start tracing the call being made. the call is made again, with
+ * db->tracing set, by the entry point.
+ */
+static void
+_db_tracebegin(DB *db)
+{
+	db->tracewait = db->trace;
+	db->tracing = 1;
+	db->lockwait = 0;
+	db->nread = 0;
+	db->hops = 0;
+	clock_gettime(CLOCK_MONOTONIC, &db->tracestart);
+}
+
+/*
+ * record the event for the call traced, op DBTRACE_xxx on key, which
+ * returned rc. the chain is the key's: a fetch without locks, or one
+ * from the write buffer, doesn't set db->chainoff.
+ */
+static void
+_db_traceend(DB *db, int op, const char *key, int rc)
+{
+	struct timespec	now;
+	DBTRACE		*ev;
+	unsigned long long n;
+	long long	ns;
+	
+	db->tracing = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - db->tracestart.tv_sec) * 1000000000LL +
+	    now.tv_nsec - db->tracestart.tv_nsec;
+	/* we are the ring's only writer. the event we overwrite is
+	   dropped by a reader that sees next past it, which the store
+	   that published the last event made so; that store goes before
+	   our writes.	*/
+	n = __atomic_load_n(&db->tring->next, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev = &db->tring->ev[n % DBTRACE_EVENTS];
+	clock_gettime(CLOCK_REALTIME, &now);
+	ev->usec = now.tv_sec * 1000000LL + (now.tv_nsec - ns) / 1000;
+	ev->latency = ns / 1000;
+	ev->lockwait = db->lockwait / 1000;
+	ev->chain = _db_hash(db, key);
+	ev->hops = db->hops;
+	ev->bytes = db->nread;
+	ev->op = op;
+	ev->rc = rc;
+	__atomic_store_n(&db->tring->next, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * wait for a lock on the byte at offset in the index file, timing the
+ * wait if the call is being traced.
+ */
+static int
+_db_lockw(DB *db, int type, off_t offset)
+{
+	struct timespec	t0, t1;
+	int		rc;
+	
+	if (!db->tracing)
+		return (lock_reg(db->idxfd, F_SETLKW, type, offset, SEEK_SET, 1));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	rc = lock_reg(db->idxfd, F_SETLKW, type, offset, SEEK_SET, 1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	db->lockwait += (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+	    t1.tv_nsec - t0.tv_nsec;
+	return (rc);
+}
+
+/*
+ * the write buffer. a handle opened with wbuf holds the db_store()s it
+ * is given in memory, up to wbuf bytes, and makes them to the files in
+ * one batch when it is full, when the oldest has been held for syncms,
+ * and on db_flush(), db_sync(), db_close() and db_rewind(). a key stored
+ * again while held is stored once, with its last data, and db_fetch()
+ * reads through the buffer. the batch is sorted by hash chain, so it
+ * walks the hash table once, front to back, and the stores to a chain
+ * are made one after the other.
+ * only the handle sees the stores it holds; other handles and processes
+ * see them once they are flushed. the buffer is only used with
+ * DB_SYNC_NONE and DB_SYNC_PERIODIC, since in the other modes a store
+ * has to be durable when it returns; with DB_SYNC_PERIODIC a store is
+ * flushed within syncms and synced by the periodic sync after that.
+ * the timer is checked by the calls on the handle, so an idle handle
+ * holds its stores until one of them, or db_flush().
+ * a DB_INSERT or DB_REPLACE of a key not held goes to the files at once,
+ * as does a delete, which drops a store held. a store that fails when it
+ * is flushed is counted, and reported by the next db_flush().
+ */
+int
+db_flush(DBHANDLE h)
+{
+	DB	*db = h;
+	int	i, rc = 0;
+	
+	if (db->nshards > 0) {
+		_db_parallel(db, _db_flushshard, NULL);
+		for (i = 0; i < db->nshards; i++)
+			if (db_flush(db->shard[i]) < 0)
+				rc = -1;
+		return (rc);
+	}
+	_db_wbflush(db);
+	if (db->wberr > 0) {
+		db->wberr = 0;
+		errno = EIO;
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+_db_flushshard(DB *db, int n, void *arg)
+{
+	_db_wbflush(db);
+}
+
+/*
+ * db_store() of a key with the write buffer: hold the store, or make a
+ * DB_INSERT or DB_REPLACE of a key held. returns as db_store(), or -2 if
+ * the store has to go to the files.
+ */
+static int
+_db_wbstore(DB *db, const char *key, const char *data, int flag)
+{
+	WBENT	**pp, *e;
+	size_t	keylen, datlen, size;
+	
+	e = *(pp = _db_wbfind(db, key));
+	if (e == NULL && flag != DB_STORE)
+		return (-2);		/* only the files know */
+	if (e != NULL && flag == DB_INSERT)
+		return (1);
+	keylen = strlen(key);
+	if (keylen > IDXLEN_MAX)
+		return (-2);		/* for the error */
+	datlen = strlen(data);
+	size = sizeof(WBENT) + keylen + datlen + 2;
+	if (e != NULL) {	/* replace its data */
+		db->wbbytes -= e->size;
+		db->cnt_wbmerge++;
+		if ((e = realloc(e, size)) == NULL)
+			err_dump("_db_wbstore: realloc error");
+	} else {
+		if ((e = malloc(size)) == NULL)
+			err_dump("_db_wbstore: malloc error");
+		e->next = NULL;
+		e->chain = _db_hash(db, key);
+		memcpy(e->key, key, keylen + 1);
+		if (db->wbcount++ == 0)
+			clock_gettime(CLOCK_MONOTONIC, &db->wbtime);
+	}
+	*pp = e;
+	e->size = size;
+	e->data = e->key + keylen + 1;
+	memcpy(e->data, data, datlen + 1);
+	db->wbbytes += size;
+	if (db->wbbytes > db->wbmax || _db_wbdue(db))
+		_db_wbflush(db);
+	return (0);
+}
+
+/*
+ * the data of the store of key held, in db->datbuf as db_fetch() returns
+ * it, or NULL if none is. a buffer held past its time is flushed first.
+ */
+static char *
+_db_wbfetch(DB *db, const char *key)
+{
+	WBENT	*e;
+	
+	if (_db_wbdue(db)) {
+		_db_wbflush(db);
+		return (NULL);
+	}
+	if ((e = *_db_wbfind(db, key)) == NULL)
+		return (NULL);
+	db->datlen = strlen(e->data) + 1;	/* as though it had a newline */
+	memcpy(db->datbuf, e->data, db->datlen);
+	return (db->datbuf);
+}
+
+/*
+ * drop the store of key held, if there is one. returns 1 if there was.
+ */
+static int
+_db_wbdrop(DB *db, const char *key)
+{
+	WBENT	**pp, *e;
+	
+	if ((e = *(pp = _db_wbfind(db, key))) == NULL)
+		return (0);
+	*pp = e->next;
+	db->wbbytes -= e->size;
+	db->wbcount--;
+	free(e);
+	return (1);
+}
+
+/*
+ * the link to the store of key held, or the null link at the end of its
+ * bucket if there is none.
+ */
+static WBENT **
+_db_wbfind(DB *db, const char *key)
+{
+	WBENT	**pp;
+	
+	for (pp = &db->wbtab[_db_fnv(key) & db->wbmask]; *pp != NULL;
+	    pp = &(*pp)->next)
+		if (strcmp((*pp)->key, key) == 0)
+			break;
+	return (pp);
+}
+
+/*
+ * 1 if the oldest store held has been held for syncms.
+ */
+static int
+_db_wbdue(DB *db)
+{
+	struct timespec	now;
+	
+	if (db->wbcount == 0)
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - db->wbtime.tv_sec) * 1000 +
+	    (now.tv_nsec - db->wbtime.tv_nsec) / 1000000 >= db->syncms);
+}
+
+/*
+ * make the stores held to the files, in hash chain order, and empty the
+ * buffer.
+ */
+static void
+_db_wbflush(DB *db)
+{
+	WBENT	**ents, *e;
+	unsigned long b, i, n = 0;
+	
+	if (db->wbcount == 0)
+		return;
+	if ((ents = malloc(db->wbcount * sizeof(WBENT *))) == NULL)
+		err_dump("_db_wbflush: malloc error");
+	for (b = 0; b <= db->wbmask; b++) {
+		for (e = db->wbtab[b]; e != NULL; e = e->next)
+			ents[n++] = e;
+		db->wbtab[b] = NULL;
+	}
+	db->wbcount = 0;
+	db->wbbytes = 0;
+	qsort(ents, n, sizeof(WBENT *), _db_wbcmp);
+	db->wbflushing = 1;
+	for (i = 0; i < n; i++) {
+		if (db_store(db, ents[i]->key, ents[i]->data, DB_STORE) != 0)
+			db->wberr++;
+		free(ents[i]);
+	}
+	db->wbflushing = 0;
+	free(ents);
+}
+
+static int
+_db_wbcmp(const void *a, const void *b)
+{
+	const WBENT	*ea = *(const WBENT **) a, *eb = *(const WBENT **) b;
+	
+	if (ea->chain != eb->chain)
+		return (ea->chain < eb->chain ? -1 : 1);
+	return (strcmp(ea->key, eb->key));
+}
+
+/*
+ * asynchronous fetch and store.
+ * each request walks its hash chain as a little state machine: every
+ * read it needs is queued on an io_uring, and the next read is queued
+ * from the completion of the last one, so many chain walks and data
+ * reads are in flight at once from a single thread.
+ * a request holds its chain lock from the moment the walk starts until
+ * its callback has run. the locks are taken without waiting, and
+ * requests whose chain is locked by another process are retried.
+ * the updates of a store are done synchronously once its walk is done.
+ * the synchronous calls must not be used on a handle while async
+ * requests are outstanding, since they unlock the chains they use.
+ */
+#define AIO_FETCH	1
+#define AIO_STORE	2
+
+#define AIO_PTR		1	/* reading a ptr field */
+#define AIO_IDX		2	/* reading an index record that may match */
+#define AIO_DAT		3	/* reading the data record */
+
+typedef struct dbreq {
+	struct dbreq *next;	/* on the free, lock wait or done list */
+	int	op;		/* AIO_FETCH or AIO_STORE */
+	int	state;		/* what the read in flight is for */
+	int	flag;		/* db_store flag */
+	DBAIOFN	fn;		/* completion callback */
+	void	*arg;		/* and its argument */
+	DBHASH	hash;		/* hash chain, as for chainoff */
+	off_t	chainoff;	/* offset of hash chain */
+	off_t	ptroff;		/* chain ptr offset pointing to record at offset */
+	off_t	offset;		/* offset of index record being read, 0 for head */
+	DBPTR	ptrval;		/* chain ptr in the matching index record */
+	off_t	datoff;		/* offset of data record */
+	size_t	datlen;		/* length of data record */
+	unsigned int datcrc;	/* crc of data record */
+	ssize_t	res;		/* result of the read, -errno on error */
+	struct iovec iov;	/* what is being read */
+	size_t	keylen;		/* length of keybuf */
+	unsigned keyfp;		/* fingerprint of key */
+	char	keybuf[IDXLEN_MAX + 2];	/* key as stored */
+	char	data[DATALEN_MAX + 1];	/* data to store */
+	char	buf[PTR_SZ + IDXLEN_SZ + IDXLEN_MAX + DATALEN_MAX];
+} DBREQ;
+
+typedef struct dbaio {
+	struct uring ring;	/* ring.fd < 0 when reads are done with pread */
+	DBREQ	*reqs;		/* aiodepth requests */
+	DBREQ	*freereq;	/* free requests */
+	DBREQ	*lockwait;	/* requests waiting for their chain lock */
+	DBREQ	*done;		/* reads done with pread, to be completed */
+	int	active;		/* requests not on the free list */
+	int	inflight;	/* reads submitted to the ring */
+	int	incallback;	/* running a completion callback */
+	COUNT	ncomplete;	/* requests completed */
+	short	*chainlk;	/* per chain: our read locks, -1 if write locked */
+} DBAIO;
+
+static void	_db_aio_advance(DB *, DBREQ *);
+static void	_db_aio_complete(DB *, DBREQ *, int, char *);
+static DBAIO	*_db_aio_init(DB *);
+static int	_db_aio_lock(DB *, DBREQ *, int);
+static DBREQ	*_db_aio_newreq(DB *, const char *, DBAIOFN, void *);
+static void	_db_aio_read(DB *, DBREQ *, int, int, size_t, off_t);
+static void	_db_aio_start(DB *, DBREQ *);
+static void	_db_aio_walk(DB *, DBREQ *, DBPTR);
+
+/*
+ * start fetching a record. the callback gets the null terminated data.
+ * returns 0 if the request was queued, -1 on error.
+ */
+int
+db_fetch_async(DBHANDLE h, const char *key, DBAIOFN fn, void *arg)
+{
+	DB	*db = h;
+	DBREQ	*req;
+	char	*data;
+	
+	if (db->nshards > 0)
+		return (db_fetch_async(_db_shard(db, key), key, fn, arg));
+	if (db->wbcount > 0 && (data = _db_wbfetch(db, key)) != NULL) {
+		(*fn)(arg, 0, data);
+		return (0);
+	}
+	if (db->keysize > 0) {	/* no chain of reads to overlap: do it now */
+		data = db_fetch(db, key);
+		(*fn)(arg, data != NULL ? 0 : -1, data);
+		return (0);
+	}
+	if ((req = _db_aio_newreq(db, key, fn, arg)) == NULL)
+		return (-1);
+	req->op = AIO_FETCH;
+	_db_aio_start(db, req);
+	return (0);
+}
+
+/*
+ * start storing a record, with the same flags as db_store().
+ * returns 0 if the request was queued, -1 on error.
+ */
+int
+db_store_async(DBHANDLE h, const char *key, const char *data, int flag,
+    DBAIOFN fn, void *arg)
+{
+	DB	*db = h;
+	DBREQ	*req;
+	size_t	datlen;
+	
+	if (db->nshards > 0)
+		return (db_store_async(_db_shard(db, key), key, data, flag,
+		    fn, arg));
+	if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
+		errno = EINVAL;
+		return (-1);
+	}
+	datlen = strlen(data) + 1;	/* +1 for newline at end */
+	if (datlen < DATALEN_MIN || datlen > DATALEN_MAX)
+		err_dump("db_store_async: invalid data length");
+	if (db->keysize > 0 || db->nsindex > 0 || db->wbtab != NULL) {
+		(*fn)(arg, db_store(db, key, data, flag), NULL);
+		return (0);
+	}
+	if ((req = _db_aio_newreq(db, key, fn, arg)) == NULL)
+		return (-1);
+	req->op = AIO_STORE;
+	req->flag = flag;
+	memcpy(req->data, data, datlen);
+	_db_aio_start(db, req);
+	return (0);
+}
+
+/*
+ * run the async requests until at least min of them have completed,
+ * or none are left. min of 0 just handles what is ready.
+ * returns the number of requests completed.
+ */
+int
+db_aio_wait(DBHANDLE h, int min)
+{
+	DB	*db = h;
+	DBAIO	*aio;
+	DBREQ	*req, *waiting;
+	struct io_uring_cqe *cqe;
+	COUNT	start;
+	int	block, i, n;
+	
+	if (db->nshards > 0) {
+		/* poll every shard; when none has anything ready, block
+		   in one that has requests outstanding.	*/
+		for (n = 0; ; ) {
+			for (i = 0; i < db->nshards; i++)
+				n += db_aio_wait(db->shard[i], 0);
+			if (n >= min)
+				break;
+			for (i = 0; i < db->nshards; i++)
+				if ((aio = ((DB *) db->shard[i])->aio) != NULL &&
+				    aio->active > 0)
+					break;
+			if (i == db->nshards)
+				break;		/* nothing left */
+			n += db_aio_wait(db->shard[i], 1);
+		}
+		return (n);
+	}
+	if ((aio = db->aio) == NULL)
+		return (0);
+	start = aio->ncomplete;
+	for ( ; ; ) {
+		/* retry the requests whose chains were locked.	*/
+		waiting = aio->lockwait;
+		aio->lockwait = NULL;
+		while ((req = waiting) != NULL) {
+			waiting = req->next;
+			_db_aio_start(db, req);
+		}
+		
+		/* complete the reads that were done with pread.	*/
+		while ((req = aio->done) != NULL) {
+			aio->done = req->next;
+			_db_aio_advance(db, req);
+		}
+		
+		if (aio->ring.fd >= 0) {
+			block = aio->inflight > 0 && aio->done == NULL &&
+			    aio->ncomplete - start < (COUNT) min;
+			if (uring_submit(&aio->ring, block) < 0)
+				err_sys("db_aio_wait: io_uring_enter error");
+			while ((cqe = uring_peek_cqe(&aio->ring)) != NULL) {
+				req = (DBREQ *) (unsigned long) cqe->user_data;
+				req->res = cqe->res;
+				uring_cqe_seen(&aio->ring);
+				aio->inflight--;
+				_db_aio_advance(db, req);
+			}
+		}
+		if (aio->ncomplete - start >= (COUNT) min || aio->active == 0)
+			break;
+		
+		/* if all that is left is waiting for other processes to
+		   unlock chains, wait for the first of them.	*/
+		if (aio->inflight == 0 && aio->done == NULL &&
+		    (req = aio->lockwait) != NULL) {
+			aio->lockwait = req->next;
+			_db_aio_lock(db, req, 1);
+			req->state = AIO_PTR;
+			_db_aio_read(db, req, db->idxfd, 0, PTR_SZ, req->chainoff);
+		}
+	}
+	return (aio->ncomplete - start);
+}
+
+/*
+ * set up for async requests, on first use.
+ * the reads fall back to pread when the kernel has no io_uring.
+ */
+static DBAIO *
+_db_aio_init(DB *db)
+{
+	DBAIO	*aio;
+	int	i;
+	
+	if ((aio = calloc(1, sizeof(DBAIO))) == NULL)
+		err_dump("_db_aio_init: calloc error for DBAIO");
+	if ((aio->reqs = calloc(db->aiodepth, sizeof(DBREQ))) == NULL)
+		err_dump("_db_aio_init: calloc error for requests");
+	if ((aio->chainlk = calloc(db->nhash, sizeof(short))) == NULL)
+		err_dump("_db_aio_init: calloc error for chain locks");
+	for (i = db->aiodepth - 1; i >= 0; i--) {
+		aio->reqs[i].next = aio->freereq;
+		aio->freereq = &aio->reqs[i];
+	}
+	if (uring_init(&aio->ring, db->aiodepth) < 0)
+		aio->ring.fd = -1;
+	db->aio = aio;
+	return (aio);
+}
+
+/*
+ * wait for the outstanding requests and release what _db_aio_init set up.
+ */
+static void
+_db_aiofree(DB *db)
+{
+	DBAIO	*aio = db->aio;
+	
+	while (aio->active > 0)
+		db_aio_wait(db, aio->active);
+	if (aio->ring.fd >= 0)
+		uring_exit(&aio->ring);
+	free(aio->chainlk);
+	free(aio->reqs);
+	free(aio);
+	db->aio = NULL;
+}
+
+/*
+ * get a free request for key, waiting for one to complete if need be.
+ */
+static DBREQ *
+_db_aio_newreq(DB *db, const char *key, DBAIOFN fn, void *arg)
+{
+	DBAIO	*aio;
+	DBREQ	*req;
+	
+	if ((aio = db->aio) == NULL)
+		aio = _db_aio_init(db);
+	while (aio->freereq == NULL) {
+		if (aio->incallback) {	/* can't wait from a callback */
+			errno = EAGAIN;
+			return (NULL);
+		}
+		db_aio_wait(db, 1);
+	}
+	req = aio->freereq;
+	aio->freereq = req->next;
+	aio->active++;
+	
+	req->next = NULL;
+	req->fn = fn;
+	req->arg = arg;
+	req->hash = _db_hash(db, key);
+	req->chainoff = (req->hash * PTR_SZ) + db->hashoff;
+	req->ptroff = req->chainoff;
+	req->offset = 0;
+	if (_db_keyenc(db, key) < 0)
+		req->keylen = IDXLEN_MAX + 1;	/* too long, can't be found */
+	else {
+		memcpy(req->keybuf, db->keybuf, db->keylen + 1);
+		req->keylen = db->keylen;
+	}
+	req->keyfp = db->keyfp;
+	return (req);
+}
+
+/*
+ * lock the request's chain, and read the ptr at the head of it.
+ * if another process has the chain locked, the request waits its turn.
+ */
+static void
+_db_aio_start(DB *db, DBREQ *req)
+{
+	if (_db_aio_lock(db, req, 0) < 0) {
+		req->next = db->aio->lockwait;
+		db->aio->lockwait = req;
+		return;
+	}
+	req->state = AIO_PTR;
+	_db_aio_read(db, req, db->idxfd, 0, PTR_SZ, req->chainoff);
+}
+
+/*
+ * lock the request's chain: a read lock for a fetch, a write lock for
+ * a store. fcntl locks are not counted, so we count our own read locks
+ * on each chain and only unlock the last. returns -1 if the chain is
+ * locked and wait is 0.
+ */
+static int
+_db_aio_lock(DB *db, DBREQ *req, int wait)
+{
+	short	*lk = &db->aio->chainlk[req->hash];
+	int	cmd = wait ? F_SETLKW : F_SETLK;
+	
+	if (req->op == AIO_FETCH) {
+		if (*lk < 0)
+			return (-1);	/* one of our stores has it */
+		if (*lk == 0 && lock_reg(db->idxfd, cmd, F_RDLCK,
+		    req->chainoff, SEEK_SET, 1) < 0) {
+			if (errno == EACCES || errno == EAGAIN)
+				return (-1);
+			err_dump("_db_aio_lock: read_lock error");
+		}
+		if (*lk == 0)
+			_db_chainfix(db, req->chainoff, F_RDLCK);
+		(*lk)++;
+	} else {
+		if (*lk != 0)
+			return (-1);	/* our own requests have it */
+		if (lock_reg(db->idxfd, cmd, F_WRLCK, req->chainoff,
+		    SEEK_SET, 1) < 0) {
+			if (errno == EACCES || errno == EAGAIN)
+				return (-1);
+			err_dump("_db_aio_lock: write_lock error");
+		}
+		_db_chainfix(db, req->chainoff, F_WRLCK);
+		*lk = -1;
+	}
+	return (0);
+}
+
+/*
+ * queue a read of len bytes at offset into the request's buffer,
+ * starting at bufoff. without a ring the read is done here and the
+ * request goes on the done list.
+ */
+static void
+_db_aio_read(DB *db, DBREQ *req, int fd, int bufoff, size_t len, off_t offset)
+{
+	DBAIO	*aio = db->aio;
+	struct io_uring_sqe *sqe;
+	
+	req->iov.iov_base = req->buf + bufoff;
+	req->iov.iov_len = len;
+	if (aio->ring.fd < 0) {
+		if ((req->res = pread(fd, req->iov.iov_base, len, offset)) < 0)
+			req->res = -errno;
+		req->next = aio->done;
+		aio->done = req;
+		return;
+	}
+	while ((sqe = uring_get_sqe(&aio->ring)) == NULL)
+		if (uring_submit(&aio->ring, 0) < 0)
+			err_sys("_db_aio_read: io_uring_enter error");
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) &req->iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = (unsigned long) req;
+	aio->inflight++;
+}
+
+/*
+ * a read for the request has completed: take the next step.
+ */
+static void
+_db_aio_advance(DB *db, DBREQ *req)
+{
+	char	*rec;
+	size_t	idxlen;
+	
+	if (req->res < 0) {
+		errno = -req->res;
+		err_sys("_db_aio_advance: read error");
+	}
+	switch (req->state) {
+	case AIO_PTR:	/* a hash table entry or the front of a record */
+		if (req->res != PTR_SZ)
+			err_dump("_db_aio_advance: read error of ptr field");
+		if (req->offset != 0)
+			req->ptroff = req->offset;	/* an unequal record */
+		_db_aio_walk(db, req, _db_parseptr(req->buf));
+		break;
+		
+	case AIO_IDX:	/* an index record whose fingerprint matched */
+		rec = req->buf + PTR_SZ + IDXLEN_SZ;
+		idxlen = req->res < PTR_SZ + IDXLEN_SZ ? 0 :
+		    _db_strtol(req->buf + PTR_SZ, IDXLEN_SZ, 10);
+		if (idxlen < IDXLEN_MIN || idxlen > IDXLEN_MAX ||
+		    (size_t) req->res < PTR_SZ + IDXLEN_SZ + idxlen ||
+		    _db_checkidx(req->buf + PTR_SZ, rec, idxlen, &req->datcrc) < 0 ||
+		    _db_splitidx(rec, &req->datoff, &req->datlen) != NULL) {
+			errno = EIO;		/* damaged */
+			_db_aio_complete(db, req, -1, NULL);
+			break;
+		}
+		if ((_db_parseptr(req->buf) & PTR_DEAD) ||
+		    strcmp(rec, req->keybuf) != 0) {
+			req->ptroff = req->offset;
+			_db_aio_walk(db, req, _db_parseptr(req->buf));
+			break;
+		}
+		req->ptrval = _db_parseptr(req->buf);	/* found a match */
+		if (req->op == AIO_FETCH) {
+			req->state = AIO_DAT;
+			_db_aio_read(db, req, db->datfd, 0, req->datlen,
+			    req->datoff);
+			break;
+		}
+		
+		/* a store: hand the record to _db_dostore, as if
+		   _db_find_and_lock had found it.	*/
+		db->idxoff = req->offset;
+		db->idxlen = idxlen;
+		db->datoff = req->datoff;
+		db->datlen = req->datlen;
+		db->ptrval = req->ptrval;
+		db->datcrc = req->datcrc;
+		memcpy(db->idxbuf, req->keybuf, req->keylen + 1);
+		_db_aio_complete(db, req, 1, NULL);
+		break;
+		
+	case AIO_DAT:
+		if ((size_t) req->res != req->datlen ||
+		    req->buf[req->datlen - 1] != NEWLINE ||
+		    crc32c(0, req->buf, req->datlen - 1) != req->datcrc) {
+			errno = EIO;		/* damaged */
+			_db_aio_complete(db, req, 0, NULL);
+			break;
+		}
+		req->buf[req->datlen - 1] = 0;
+		_db_aio_complete(db, req, 0, req->buf);
+		break;
+	}
+}
+
+/*
+ * follow the chain ptr ptr: read the ptr field at the front of the record
+ * it points to, or the whole record if its fingerprint and key length match.
+ * how long that is depends on the digits of its data offset, so we read
+ * as much as it can be, as _db_seqwalk() does.
+ */
+static void
+_db_aio_walk(DB *db, DBREQ *req, DBPTR ptr)
+{
+	if ((req->offset = PTR_OFF(ptr)) == 0) {	/* end of chain */
+		_db_aio_complete(db, req, 0, NULL);
+		return;
+	}
+	if (PTR_FP(ptr) == req->keyfp && PTR_KLEN(ptr) == req->keylen) {
+		req->state = AIO_IDX;
+		_db_aio_read(db, req, db->idxfd, 0, PTR_SZ + IDXLEN_SZ +
+		    IDXLEN_MAX, req->offset);
+	} else {
+		req->state = AIO_PTR;
+		_db_aio_read(db, req, db->idxfd, 0, PTR_SZ, req->offset);
+	}
+}
+
+/*
+ * the chain walk is over. for a fetch, data is the record found or NULL.
+ * for a store, found says whether the key is in the database, or is -1
+ * if a damaged record was in the way, and the store itself is done now. run the callback and free the request.
+ */
+static void
+_db_aio_complete(DB *db, DBREQ *req, int found, char *data)
+{
+	DBAIO	*aio = db->aio;
+	int	rc;
+	
+	if (req->op == AIO_FETCH) {
+		rc = (data == NULL ? -1 : 0);
+		if (data == NULL)
+			db->cnt_fetcherr++;
+		else
+			db->cnt_fetchok++;
+	} else {
+		db->chainoff = req->chainoff;
+		db->ptroff = req->ptroff;
+		memcpy(db->keybuf, req->keybuf, req->keylen + 1);
+		db->keylen = req->keylen;
+		db->keyfp = req->keyfp;
+		db->ndead = 0;
+		if (found < 0) {
+			db->cnt_storerr++;
+			rc = -1;
+		} else
+			rc = _db_dostore(db, req->data, req->flag, found);
+	}
+	
+	req->state = 0;
+	aio->incallback++;
+	if (req->fn != NULL)
+		(*req->fn)(req->arg, rc, data);
+	aio->incallback--;
+	aio->ncomplete++;
+	
+	/* unlock the chain, unless other requests of ours hold it too.	*/
+	if (req->op == AIO_STORE || --aio->chainlk[req->hash] == 0) {
+		aio->chainlk[req->hash] = 0;
+		if (un_lock(db->idxfd, req->chainoff, SEEK_SET, 1) < 0)
+			err_dump("_db_aio_complete: un_lock error");
+	}
+	req->next = aio->freereq;
+	aio->freereq = req;
+	aio->active--;
+}
+
+/*
+ * shards.
+ * a sharded database is a set of independent databases, each with its
+ * own files, locks and shared memory segment. a key belongs to the shard
+ * picked by the high bits of its FNV-1a hash, which neither _db_hash()
+ * nor the fingerprint depends on much. scans and batches run a thread
+ * per shard; each thread uses only its shard's DB.
+ */
+typedef struct {
+	DB	*db;		/* shard */
+	int	n;		/* its number */
+	void	(*fn)(DB *, int, void *);
+	void	*arg;
+	pthread_t tid;
+} DBTASK;
+
+typedef struct {
+	DBVISIT	fn;
+	void	*arg;
+	int	rc;		/* first nonzero return of fn */
+} DBSCAN;
+
+#define SCAN_BLOCK	(64 * 1024)	/* index file read by db_scanmatch() */
+
+typedef struct {
+	int	how;		/* DB_MATCH_xxx */
+	const char *pat;
+	size_t	patlen;
+	const char *lit;	/* what a matching key contains: the pattern, */
+	size_t	litlen;		/* or the longest plain run of a glob */
+	DBVISIT	fn;
+	void	*arg;
+	int	rc;		/* first nonzero return of fn */
+	int	err;		/* EIO if a damaged record was passed */
+} DBMATCH;
+
+typedef struct {
+	const char **keys;
+	const char **data;	/* for a store */
+	const int *shardno;	/* shard of each key */
+	int	nkeys;
+	int	flag;		/* for a store */
+	int	*rc;		/* for a store, or NULL */
+	DBVISIT	fn;		/* for a fetch */
+	void	*arg;
+	int	count;		/* keys found, or stores that failed */
+} DBBATCH;
+
+/*
+ * open (or create) the shards of a database whose header we just read.
+ */
+static int
+_db_shardopen(DB *db, const char *pathname, int oflag, int mode,
+    const DBOPTS *opts)
+{
+	DBOPTS	shardopts;
+	char	*name;
+	int	i;
+	
+	if (opts != NULL)
+		shardopts = *opts;
+	else
+		memset(&shardopts, 0, sizeof(shardopts));
+	shardopts.nshards = 0;
+	shardopts.replog = 0;		/* they share ours */
+	shardopts.wbuf /= db->nshards;	/* and the write buffer's bytes */
+	if ((db->shard = calloc(db->nshards, sizeof(DBHANDLE))) == NULL ||
+	    (name = malloc(strlen(pathname) + 5)) == NULL)	/* ".255" */
+		err_dump("_db_shardopen: malloc error");
+	for (i = 0; i < db->nshards; i++) {
+		sprintf(name, "%s.%d", pathname, i);
+		if ((db->shard[i] = db_openopt(name, oflag, mode,
+		    &shardopts)) == NULL) {
+			free(name);
+			return (-1);
+		}
+		if (db->repfd >= 0 &&
+		    (((DB *) db->shard[i])->repfd = dup(db->repfd)) < 0) {
+			free(name);
+			return (-1);
+		}
+	}
+	free(name);
+	return (0);
+}
+
+/*
+ * the shard a key belongs to.
+ */
+static int
+_db_shardno(DB *db, const char *key)
+{
+	return ((int) (((unsigned long long) _db_fnv(key) * db->nshards) >> 32));
+}
+
+static DB *
+_db_shard(DB *db, const char *key)
+{
+	return (db->shard[_db_shardno(db, key)]);
+}
+
+static void *
+_db_task(void *arg)
+{
+	DBTASK	*task = arg;
+	
+	(*task->fn)(task->db, task->n, task->arg);
+	return (NULL);
+}
+
+/*
+ * call fn for every shard, each in a thread of its own, and wait for
+ * them all. a database that is not sharded is its own only shard.
+ */
+static void
+_db_parallel(DB *db, void (*fn)(DB *, int, void *), void *arg)
+{
+	DBTASK	*task;
+	int	i;
+	
+	if (db->nshards == 0) {
+		(*fn)(db, 0, arg);
+		return;
+	}
+	if ((task = calloc(db->nshards, sizeof(DBTASK))) == NULL)
+		err_dump("_db_parallel: calloc error");
+	for (i = 0; i < db->nshards; i++) {
+		task[i].db = db->shard[i];
+		task[i].n = i;
+		task[i].fn = fn;
+		task[i].arg = arg;
+		/* this thread takes shard 0 itself. */
+		if (i > 0 && (errno = pthread_create(&task[i].tid, NULL,
+		    _db_task, &task[i])) != 0)
+			err_sys("_db_parallel: pthread_create error");
+	}
+	_db_task(&task[0]);
+	for (i = 1; i < db->nshards; i++)
+		if ((errno = pthread_join(task[i].tid, NULL)) != 0)
+			err_sys("_db_parallel: pthread_join error");
+	free(task);
+}
+
+static void
+_db_syncshard(DB *db, int n, void *arg)
+{
+	db_sync(db);
+}
+
+static void
+_db_scanshard(DB *db, int n, void *arg)
+{
+	DBSCAN	*scan = arg;
+	char	key[IDXLEN_MAX + KEYPREFIX_MAX + 1], *data;
+	int	rc, none = 0;
+	
+	db_rewind(db);
+	while (__atomic_load_n(&scan->rc, __ATOMIC_RELAXED) == 0 &&
+	    (data = db_nextrec(db, key)) != NULL)
+		if ((rc = (*scan->fn)(scan->arg, key, data)) != 0)
+			__atomic_compare_exchange_n(&scan->rc, &none, rc, 0,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * call fn for every record, the shards in parallel.
+ * returns 0, or the nonzero value fn returned to stop the scan.
+ * the position of db_nextrec() is lost.
+ */
+int
+db_scan(DBHANDLE h, DBVISIT fn, void *arg)
+{
+	DBSCAN	scan;
+	
+	scan.fn = fn;
+	scan.arg = arg;
+	scan.rc = 0;
+	_db_parallel(h, _db_scanshard, &scan);
+	return (scan.rc);
+}
+
+/*
+ * memmem(), 16 places at a time with SSE2: two compares find the places
+ * where both the first and the last byte of the needle are, and only
+ * those are compared in full.
+ */
+static const char *
+_db_memmem(const char *hay, size_t hlen, const char *needle, size_t nlen)
+{
+	size_t	i = 0;
+#ifdef __SSE2__
+	__m128i	first, last, b0, b1;
+	unsigned int mask;
+#endif
+	
+	if (nlen == 0)
+		return (hay);
+	if (nlen > hlen)
+		return (NULL);
+	if (nlen == 1)
+		return (memchr(hay, needle[0], hlen));
+#ifdef __SSE2__
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[nlen - 1]);
+	for ( ; i + nlen - 1 + 16 <= hlen; i += 16) {
+		b0 = _mm_loadu_si128((const __m128i *) (hay + i));
+		b1 = _mm_loadu_si128((const __m128i *) (hay + i + nlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, first),
+		    _mm_cmpeq_epi8(b1, last)));
+		for ( ; mask != 0; mask &= mask - 1)
+			if (memcmp(hay + i + __builtin_ctz(mask) + 1, needle + 1,
+			    nlen - 2) == 0)
+				return (hay + i + __builtin_ctz(mask));
+	}
+#endif
+	for ( ; i + nlen <= hlen; i++)
+		if (hay[i] == needle[0] &&
+		    memcmp(hay + i + 1, needle + 1, nlen - 1) == 0)
+			return (hay + i);
+	return (NULL);
+}
+
+/*
+ * whether the key, of len bytes, null terminated, matches.
+ */
+static int
+_db_keymatch(DBMATCH *m, const char *key, size_t len)
+{
+	switch (m->how) {
+	case DB_MATCH_PREFIX:
+		return (len >= m->patlen && memcmp(key, m->pat, m->patlen) == 0);
+	case DB_MATCH_SUBSTR:
+		return (_db_memmem(key, len, m->pat, m->patlen) != NULL);
+	default:
+		return (_db_memmem(key, len, m->lit, m->litlen) != NULL &&
+		    fnmatch(m->pat, key, 0) == 0);
+	}
+}
+
+/*
+ * db_scanmatch() in one database or shard. the index file is read a
+ * block at a time, and its records are matched where they lie in the
+ * block: the literal is searched for through the rest of the block at
+ * once, and a record is only looked at if the next place it is found is
+ * in the record (for a prefix, if the record starts with it). the records
+ * that match are checked and their data read with the free list read
+ * locked, as db_nextrec() does, and handed to fn once it is unlocked.
+ * one that fails its crc is read again then, under its chain lock.
+ * with a key prefix elided from the stored keys, each key is put back
+ * together and matched whole.
+ */
+static void
+_db_matchshard(DB *db, int n, void *arg)
+{
+	DBMATCH	*m = arg;
+	char	*buf, *p, *end, *rec, *keyend, *k, *data, *out = NULL;
+	char	*redo = NULL, key[IDXLEN_MAX + KEYPREFIX_MAX + 1];
+	const char *hit;
+	size_t	idxlen = 0, keylen, outlen, outsize = 0, redolen, redosize = 0;
+	size_t	i, len;
+	off_t	offset, off;
+	ssize_t	nread;
+	int	rc, err = 0, none = 0, more = 1;
+	
+	_db_wbflush(db);
+	if (db->keysize > 0) {	/* a slot's key and data are read together */
+		db_rewind(db);
+		errno = 0;
+		while (__atomic_load_n(&m->rc, __ATOMIC_RELAXED) == 0 &&
+		    ((data = db_nextrec(db, key)) != NULL || errno == EIO)) {
+			if (data == NULL) {
+				err = EIO;
+				errno = 0;
+			} else if (_db_keymatch(m, key, strlen(key)) &&
+			    (rc = (*m->fn)(m->arg, key, data)) != 0)
+				__atomic_compare_exchange_n(&m->rc, &none, rc, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+		if (err != 0)
+			__atomic_store_n(&m->err, err, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	if ((buf = malloc(SCAN_BLOCK)) == NULL)
+		err_dump("_db_matchshard: malloc error");
+	for (offset = db->firstoff; more &&
+	    __atomic_load_n(&m->rc, __ATOMIC_RELAXED) == 0; offset += p - buf) {
+		if (readw_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
+			err_dump("_db_matchshard: readw_lock error");
+		if ((nread = pread(db->idxfd, buf, SCAN_BLOCK, offset)) < 0)
+			err_sys("_db_matchshard: read error of index file");
+		db->nread += nread;
+		more = nread == SCAN_BLOCK;
+		end = buf + nread;
+		hit = buf;		/* not searched for yet */
+		outlen = redolen = 0;
+		for (p = buf; ; p += PTR_SZ + IDXLEN_SZ + idxlen) {
+			while (p < end && *p == 0)	/* see _db_reserve */
+				p++;
+			if (end - p < PTR_SZ + IDXLEN_SZ)
+				break;
+			idxlen = _db_strtol(p + PTR_SZ, IDXLEN_SZ, 10);
+			if (idxlen < IDXLEN_MIN || idxlen > IDXLEN_MAX) {
+				err = EIO;	/* no telling where the next is */
+				more = 0;
+				break;
+			}
+			if (end - p < PTR_SZ + IDXLEN_SZ + idxlen)
+				break;		/* it starts the next block */
+			rec = p + PTR_SZ + IDXLEN_SZ;
+			if (p[PTR_SZ - 1] == TOMB)
+				continue;
+			if (db->prefixlen > 0)
+				;		/* matched once put back together */
+			else if (m->how == DB_MATCH_PREFIX) {
+				if (idxlen < m->patlen ||
+				    memcmp(rec, m->pat, m->patlen) != 0)
+					continue;
+			} else if (m->litlen > 0) {
+				if (hit != NULL && hit < rec)
+					hit = _db_memmem(rec, end - rec, m->lit,
+					    m->litlen);
+				if (hit == NULL || hit >= rec + idxlen)
+					continue;
+			}
+			
+			/* a candidate: its key, as it was stored.	*/
+			if ((keyend = memchr(rec, SEP, idxlen)) == NULL) {
+				err = EIO;
+				continue;
+			}
+			for (k = rec; k < keyend && *k == SPACE; k++)
+				;
+			if (k == keyend)
+				continue;	/* blanked by _db_walorphans */
+			k = rec;
+			keylen = 0;
+			if (db->prefixlen > 0) {
+				if (*k++ == KEY_PREFIXED) {
+					memcpy(key, db->prefix, db->prefixlen);
+					keylen = db->prefixlen;
+				}
+			}
+			memcpy(key + keylen, k, keyend - k);
+			keylen += keyend - k;
+			key[keylen] = 0;
+			if (!_db_keymatch(m, key, keylen))
+				continue;
+			
+			if (_db_checkidx(p + PTR_SZ, rec, idxlen,
+			    &db->datcrc) < 0 ||
+			    _db_splitidx(rec, &db->datoff, &db->datlen) != NULL ||
+			    (data = _db_readdat(db)) == NULL) {
+				/* it may be half rewritten: its offset and
+				   key, to read again under its chain lock
+				   once the free list is unlocked.	*/
+				off = offset + (p - buf);
+				len = sizeof(off) + keylen + 1;
+				if (redolen + len > redosize) {
+					redosize = redosize > 0 ? 2 * redosize :
+					    1024;
+					if (redosize < redolen + len)
+						redosize = redolen + len;
+					if ((redo = realloc(redo, redosize)) ==
+					    NULL)
+						err_dump("_db_matchshard: "
+						    "realloc error");
+				}
+				memcpy(redo + redolen, &off, sizeof(off));
+				memcpy(redo + redolen + sizeof(off), key,
+				    keylen + 1);
+				redolen += len;
+				continue;
+			}
+			len = keylen + 1 + db->datlen;	/* two nulls */
+			if (outlen + len > outsize) {
+				outsize = outsize > 0 ? 2 * outsize : SCAN_BLOCK;
+				if (outsize < outlen + len)
+					outsize = outlen + len;
+				if ((out = realloc(out, outsize)) == NULL)
+					err_dump("_db_matchshard: realloc error");
+			}
+			memcpy(out + outlen, key, keylen + 1);
+			memcpy(out + outlen + keylen + 1, data, db->datlen);
+			outlen += len;
+			db->cnt_nextrec++;
+		}
+		if (!more && p < end)
+			err = EIO;	/* cut short */
+		if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
+			err_dump("_db_matchshard: un_lock error");
+		
+		/* the key and data of each match, null terminated. */
+		for (i = 0; i < outlen; ) {
+			k = out + i;
+			data = k + strlen(k) + 1;
+			i = data + strlen(data) + 1 - out;
+			if ((rc = (*m->fn)(m->arg, k, data)) != 0) {
+				__atomic_compare_exchange_n(&m->rc, &none, rc, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				redolen = 0;
+				break;
+			}
+		}
+		for (i = 0; i < redolen; ) {
+			memcpy(&off, redo + i, sizeof(off));
+			strcpy(key, redo + i + sizeof(off));
+			i += sizeof(off) + strlen(key) + 1;
+			if ((data = _db_reread(db, off, key)) == NULL) {
+				if (errno == EIO)
+					err = EIO;
+				continue;	/* or deleted since */
+			}
+			db->cnt_nextrec++;
+			if (_db_keymatch(m, key, strlen(key)) &&
+			    (rc = (*m->fn)(m->arg, key, data)) != 0) {
+				__atomic_compare_exchange_n(&m->rc, &none, rc, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	if (err != 0)
+		__atomic_store_n(&m->err, err, __ATOMIC_RELAXED);
+	free(redo);
+	free(out);
+	free(buf);
+}
+
+/*
+ * call fn for every record whose key matches pattern, the shards in
+ * parallel, as db_scan() does: how is DB_MATCH_PREFIX for the keys that
+ * start with it, DB_MATCH_SUBSTR for those that contain it, and
+ * DB_MATCH_GLOB for those it matches as fnmatch(3) would (no flags).
+ * keys are matched in the index file's blocks as they are read, and only
+ * the data of those that match is read. returns 0, the nonzero value fn
+ * returned to stop the scan, or -1 with errno EIO if a damaged record
+ * was passed over (EINVAL for an unknown how).
+ */
+int
+db_scanmatch(DBHANDLE h, int how, const char *pattern, DBVISIT fn, void *arg)
+{
+	DBMATCH	m;
+	const char *p, *run;
+	size_t	len;
+	
+	if (how != DB_MATCH_PREFIX && how != DB_MATCH_SUBSTR &&
+	    how != DB_MATCH_GLOB) {
+		errno = EINVAL;
+		return (-1);
+	}
+	memset(&m, 0, sizeof(m));
+	m.how = how;
+	m.pat = m.lit = pattern;
+	m.patlen = m.litlen = strlen(pattern);
+	m.fn = fn;
+	m.arg = arg;
+	if (how == DB_MATCH_GLOB) {
+		/* what a key has to contain: the longest run of the
+		   pattern with no special character in it, before any
+		   bracket, whose insides aren't runs.	*/
+		m.litlen = 0;
+		for (p = run = pattern; ; p++) {
+			if (*p != 0 && strchr("*?[\\", *p) == NULL)
+				continue;
+			if ((len = p - run) > m.litlen) {
+				m.lit = run;
+				m.litlen = len;
+			}
+			if (*p == 0 || *p == '[')
+				break;
+			run = p + 1;
+		}
+	}
+	_db_parallel(h, _db_matchshard, &m);
+	if (m.rc == 0 && m.err != 0) {
+		errno = m.err;
+		return (-1);
+	}
+	return (m.rc);
+}
+
+/*
+ * the shard of every key in a batch, malloc'ed.
+ */
+static int *
+_db_batchshards(DB *db, const char **keys, int nkeys)
+{
+	int	*shardno, i;
+	
+	if ((shardno = malloc((nkeys + 1) * sizeof(int))) == NULL)
+		err_dump("_db_batchshards: malloc error");
+	for (i = 0; i < nkeys; i++)
+		shardno[i] = db->nshards > 0 ? _db_shardno(db, keys[i]) : 0;
+	return (shardno);
+}
+
+static void
+_db_fetchshard(DB *db, int n, void *arg)
+{
+	DBBATCH	*batch = arg;
+	char	*data;
+	int	i, found = 0;
+	
+	for (i = 0; i < batch->nkeys; i++)
+		if (batch->shardno[i] == n &&
+		    (data = db_fetch(db, batch->keys[i])) != NULL) {
+			found++;
+			(*batch->fn)(batch->arg, batch->keys[i], data);
+		}
+	__atomic_add_fetch(&batch->count, found, __ATOMIC_RELAXED);
+}
+
+/*
+ * fetch nkeys keys, the shards in parallel, calling fn for each
+ * one found. returns the number found.
+ */
+int
+db_fetch_batch(DBHANDLE h, const char **keys, int nkeys, DBVISIT fn,
+    void *arg)
+{
+	DBBATCH	batch;
+	int	*shardno;
+	
+	memset(&batch, 0, sizeof(batch));
+	batch.keys = keys;
+	batch.nkeys = nkeys;
+	batch.shardno = shardno = _db_batchshards(h, keys, nkeys);
+	batch.fn = fn;
+	batch.arg = arg;
+	_db_parallel(h, _db_fetchshard, &batch);
+	free(shardno);
+	return (batch.count);
+}
+
+static void
+_db_storeshard(DB *db, int n, void *arg)
+{
+	DBBATCH	*batch = arg;
+	int	i, rc, failed = 0;
+	
+	for (i = 0; i < batch->nkeys; i++) {
+		if (batch->shardno[i] != n)
+			continue;
+		rc = db_store(db, batch->keys[i], batch->data[i], batch->flag);
+		if (rc != 0)
+			failed++;
+		if (batch->rc != NULL)
+			batch->rc[i] = rc;
+	}
+	__atomic_add_fetch(&batch->count, failed, __ATOMIC_RELAXED);
+}
+
+/*
+ * store nkeys records with the same flag, the shards in parallel.
+ * if rc isn't NULL, rc[i] is set to what db_store() returned for
+ * keys[i]. returns the number of stores that didn't return 0.
+ */
+int
+db_store_batch(DBHANDLE h, const char **keys, const char **data, int nkeys,
+    int flag, int *rc)
+{
+	DBBATCH	batch;
+	int	*shardno;
+	
+	memset(&batch, 0, sizeof(batch));
+	batch.keys = keys;
+	batch.data = data;
+	batch.nkeys = nkeys;
+	batch.flag = flag;
+	batch.rc = rc;
+	batch.shardno = shardno = _db_batchshards(h, keys, nkeys);
+	_db_parallel(h, _db_storeshard, &batch);
+	free(shardno);
+	return (batch.count);
+}
+
+/*
+ * checking and rebuilding. db_check() reads each database or shard in
+ * passes spread over threads, so that the files are read once, front to
+ * back, in large blocks, and the random access is all to memory:
+ *	the index file is cut into a range for each thread, which keeps a
+ *	CKREC for every intact index record in it; the ranges are put
+ *	together in order.
+ *	the free list and the hash chains, taken a batch at a time by the
+ *	threads, are walked through the CKRECs, found by binary search.
+ *	the data records of the live ones are read in the order they lie
+ *	in the data file, a range of them to each thread.
+ * a thread starts its range at the first record that follows a newline
+ * or a NUL in it: an index record ends with a newline, a key has none,
+ * and an append cut short leaves NULs (see _db_reserve). a damaged
+ * record is passed over the same way, to the next one whose crc is right.
+ * the hash table is read locked throughout, so writers wait.
+ * db_rebuild() makes the same passes, and stores each live record whose
+ * index and data records are intact in a new database as its data is
+ * read. a key is kept only in its index record, so the records whose
+ * index record is damaged are lost; the chains and free list don't matter.
+ * when each of our shards is one of the new database's, and its records
+ * vary in size, _db_ckload() appends them to the shard's files a block
+ * at a time, with the hash table in memory, rather than store each one.
+ * fixed size slots are checked in the same way, a range of slots, with
+ * their data, to each thread, then the chains.
+ */
+#define CHECK_BLOCK	(1024 * 1024)	/* read from a file at once */
+#define CHECK_BATCH	1024		/* chains a thread takes at once */
+#define CHECK_THREADS_MAX 64		/* most threads for a shard */
+
+#define CK_CHAIN	1	/* CKREC seen: found on a chain */
+#define CK_FREE		2	/* found on the free list */
+
+#define CKSLOT_FREE	0xffffffffU	/* CKSLOT chain: the slot is free */
+#define CKSLOT_BAD	0xfffffffeU	/* it is damaged */
+
+typedef struct {
+	off_t	off;		/* of the index record */
+	DBPTR	ptr;		/* its ptr field */
+	off_t	datoff;		/* of its data record */
+	unsigned int datlen;
+	unsigned int datcrc;
+	DBHASH	chain;		/* the chain its key hashes to */
+	size_t	key;		/* the key in CKSHARD keys, for db_rebuild() */
+	unsigned short fp;	/* fingerprint of the key */
+	unsigned short klen;	/* length of the key as stored */
+	unsigned char blank;	/* the key was blanked by _db_walorphans */
+	unsigned char seen;	/* CK_xxx, or 0 if no walk found it */
+	unsigned char ok;	/* its data record is intact */
+	unsigned char dup;	/* db_rebuild(): another record has the key */
+} CKREC;
+
+typedef struct {
+	const char *key;
+	CKREC	*r;
+} CKKEY;
+
+#define CKLOAD_IDX	0
+#define CKLOAD_DAT	1
+
+typedef struct {
+	DB	*db;		/* the new database, or one of its shards */
+	DBPTR	*head;		/* its hash table */
+	char	*buf[2];	/* appends held for the files, CKLOAD_xxx */
+	size_t	len[2];
+	off_t	end[2];		/* where they go */
+} CKLOAD;
+
+typedef struct {
+	unsigned int next;	/* slot + 1 of the next on the chain, or 0 */
+	unsigned int chain;	/* the chain its key hashes to, or CKSLOT_xxx */
+} CKSLOT;
+
+typedef struct {
+	CKREC	*rec;		/* the intact index records of a range */
+	size_t	nrec, maxrec;
+	char	*keys;		/* their keys, for db_rebuild() */
+	size_t	nkeys, maxkeys;
+	unsigned long long nrecs;	/* counts, see DBCHECK */
+	unsigned long long ndead;
+	unsigned long long nfree;
+} CKPART;
+
+typedef struct {
+	struct dbck *ck;
+	DB	*db;
+	int	shard;		/* its number, -1 if not sharded */
+	int	nthreads;
+	off_t	idxend;		/* size of the index file */
+	off_t	datend;		/* size of the data file */
+	CKPART	part[CHECK_THREADS_MAX];	/* one for each thread */
+	CKREC	*rec;		/* all the intact index records, by offset */
+	size_t	nrec;
+	char	*keys;
+	char	*table;		/* the free list ptr and the hash table */
+	unsigned long next;	/* next chain for a thread to take */
+	CKREC	**live;		/* the live records, by data offset */
+	size_t	nlive;
+	CKSLOT	*slot;		/* fixed size: every slot */
+	unsigned int nslots;
+	unsigned long long *seen;	/* and those found on a chain */
+	CKLOAD	*load;		/* db_rebuild() appending, or NULL */
+} CKSHARD;
+
+typedef struct dbck {
+	DBCHECK	*res;
+	int	sharded;
+	int	nthreads;	/* for each shard */
+	DB	*to;		/* db_rebuild(): the new database, or NULL */
+	int	pershard;	/* its shards are ours, each stored by ours */
+	int	bulk;		/* and are appended to by _db_ckload() */
+	pthread_mutex_t mutex;	/* else stores to it take this */
+	int	err;		/* errno of a store that failed */
+} DBCK;
+
+typedef struct {
+	CKSHARD	*s;
+	int	n;
+	void	(*fn)(CKSHARD *, int);
+	pthread_t tid;
+} CKTASK;
+
+static void	_db_ckchains(CKSHARD *, int);
+static void	_db_ckdata(CKSHARD *, int);
+static CKREC	*_db_ckfind(CKSHARD *, off_t);
+static void	_db_ckfixchains(CKSHARD *, int);
+static void	_db_ckfixed(CKSHARD *);
+static void	_db_ckfixscan(CKSHARD *, int);
+static int	_db_ckkeycmp(const void *, const void *);
+static int	_db_cklivecmp(const void *, const void *);
+static void	_db_ckload(CKLOAD *, const char *, const char *, DBCK *);
+static void	_db_ckloadend(CKLOAD *);
+static CKLOAD	*_db_ckloadstart(DB *);
+static void	_db_ckloadwrite(CKLOAD *, int);
+static void	_db_ckreport(CKSHARD *, int, const char *, ...);
+static void	_db_ckscan(CKSHARD *, int);
+static void	_db_ckshard(DB *, int, void *);
+static void	_db_ckstore(CKSHARD *, const char *, const char *, int);
+static void	_db_ckthreads(CKSHARD *, int, void (*)(CKSHARD *, int));
+static void	_db_ckwalk(CKSHARD *, int, long, DBPTR);
+
+/*
+ * check a database: walk every hash chain and the free list, and check
+ * every index record, and the data record of every live one, against
+ * each other. what is found is counted in res, and each problem passed
+ * to res->fn. returns 0 if nothing is damaged, else -1 with errno EIO.
+ */
+int
+db_check(DBHANDLE h, DBCHECK *res)
+{
+	DB	*db = h;
+	DBCHECK	check;
+	DBCK	ck;
+	
+	if (res == NULL) {
+		memset(&check, 0, sizeof(check));
+		res = &check;
+	}
+	res->nrecs = res->ndead = res->nfree = res->nlost = 0;
+	res->nbad = res->nrebuilt = 0;
+	memset(&ck, 0, sizeof(ck));
+	ck.res = res;
+	ck.sharded = db->nshards > 0;
+	ck.nthreads = res->nthreads > 0 ? res->nthreads :
+	    (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (ck.sharded)		/* the shards are checked in parallel */
+		ck.nthreads = (ck.nthreads + db->nshards - 1) / db->nshards;
+	_db_parallel(db, _db_ckshard, &ck);
+	if (res->nbad > 0) {
+		errno = EIO;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * make a new database at path from the records of this one, as they are
+ * found by db_check(), which counts in res what it finds: the live
+ * records whose index and data records are intact, those on no chain
+ * too, unless a record on a chain has the key. it is created with opts,
+ * or as this one was if opts is NULL, without a replication log.
+ * returns 0 if OK, -1 on error (EINVAL if path names this database).
+ */
+int
+db_rebuild(DBHANDLE h, const char *path, const DBOPTS *opts, DBCHECK *res)
+{
+	DB	*db = h;
+	DBOPTS	o;
+	DBCHECK	check;
+	DBCK	ck;
+	struct stat	statbuff, sb;
+	char	*name;
+	
+	if (res == NULL) {
+		memset(&check, 0, sizeof(check));
+		res = &check;
+	}
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("db_rebuild: fstat error");
+	if ((name = malloc(strlen(path) + 5)) == NULL)
+		err_dump("db_rebuild: malloc error");
+	sprintf(name, "%s.idx", path);
+	if (stat(name, &sb) == 0 && sb.st_dev == statbuff.st_dev &&
+	    sb.st_ino == statbuff.st_ino) {
+		free(name);
+		errno = EINVAL;		/* it would be truncated */
+		return (-1);
+	}
+	free(name);
+	if (opts == NULL) {
+		memset(&o, 0, sizeof(o));
+		o.nhash = db->nhash;
+		o.keyprefix = db->prefixlen > 0 ? db->prefix : NULL;
+		o.wal = (db->flags & HDR_WAL) != 0;
+		o.nshards = db->nshards;
+		o.keysize = db->keysize;
+		o.datsize = db->datsize;
+		opts = &o;
+	}
+	
+	memset(&ck, 0, sizeof(ck));
+	/* a secondary index is rebuilt as one.	*/
+	if ((ck.to = _db_open(path, O_RDWR | O_CREAT | O_TRUNC,
+	    statbuff.st_mode & 0666, opts, db->flags & HDR_ATTRIDX)) == NULL)
+		return (-1);
+	ck.pershard = db->nshards > 0 && ck.to->nshards == db->nshards;
+	ck.bulk = db->keysize == 0 && ck.to->keysize == 0 &&
+	    (ck.pershard || (db->nshards == 0 && ck.to->nshards == 0));
+	pthread_mutex_init(&ck.mutex, NULL);
+	res->nrecs = res->ndead = res->nfree = res->nlost = 0;
+	res->nbad = res->nrebuilt = 0;
+	ck.res = res;
+	ck.sharded = db->nshards > 0;
+	ck.nthreads = res->nthreads > 0 ? res->nthreads :
+	    (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (ck.sharded)
+		ck.nthreads = (ck.nthreads + db->nshards - 1) / db->nshards;
+	_db_parallel(db, _db_ckshard, &ck);
+	if (ck.err == 0 && db_sync(ck.to) < 0)
+		ck.err = EIO;
+	db_close(ck.to);
+	pthread_mutex_destroy(&ck.mutex);
+	if (ck.err != 0) {
+		errno = ck.err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * db_check() or db_rebuild() of one database or shard.
+ */
+static void
+_db_ckshard(DB *db, int n, void *arg)
+{
+	DBCK	*ck = arg;
+	CKSHARD	*s;
+	CKPART	*part;
+	CKREC	*r;
+	CKKEY	*key;
+	struct stat	statbuff;
+	size_t	i, len;
+	int	j;
+	
+	if ((s = calloc(1, sizeof(CKSHARD))) == NULL)
+		err_dump("_db_ckshard: calloc error");
+	s->ck = ck;
+	s->db = db;
+	s->shard = ck->sharded ? n : -1;
+	s->nthreads = ck->nthreads < 1 ? 1 : ck->nthreads > CHECK_THREADS_MAX ?
+	    CHECK_THREADS_MAX : ck->nthreads;
+	
+	_db_wbflush(db);	/* the stores it holds are checked too */
+	_db_tablelock(db, F_RDLCK);
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_ckshard: fstat error");
+	s->idxend = statbuff.st_size;
+	if (fstat(db->datfd, &statbuff) < 0)
+		err_sys("_db_ckshard: fstat error");
+	s->datend = statbuff.st_size;
+	if (db->keysize > 0) {
+		_db_ckfixed(s);
+		goto done;
+	}
+	
+	/* the index records, put together in order.	*/
+	_db_ckthreads(s, s->nthreads, _db_ckscan);
+	for (j = 0, len = 0; j < s->nthreads; j++) {
+		s->nrec += s->part[j].nrec;
+		len += s->part[j].nkeys;
+	}
+	if ((s->rec = malloc((s->nrec + 1) * sizeof(CKREC))) == NULL ||
+	    (s->keys = malloc(len + 1)) == NULL)
+		err_dump("_db_ckshard: malloc error");
+	for (j = 0, s->nrec = 0, len = 0; j < s->nthreads; j++) {
+		part = &s->part[j];
+		for (i = 0; i < part->nrec; i++) {
+			s->rec[s->nrec] = part->rec[i];
+			s->rec[s->nrec++].key += len;
+		}
+		if (part->nkeys > 0)
+			memcpy(s->keys + len, part->keys, part->nkeys);
+		len += part->nkeys;
+		free(part->rec);
+		free(part->keys);
+	}
+	
+	/* the free list and the chains.	*/
+	len = db->firstoff - FREE_OFF;
+	if ((s->table = malloc(len)) == NULL)
+		err_dump("_db_ckshard: malloc error");
+	if (pread(db->idxfd, s->table, len, FREE_OFF) != len)
+		err_sys("_db_ckshard: read error of hash table");
+	_db_ckthreads(s, s->nthreads, _db_ckchains);
+	
+	/* a dead record on no chain was left by a reclaim cut short, or
+	   blanked by recovery; a live one by a store cut short.	*/
+	if ((s->live = malloc((s->nrec + 1) * sizeof(CKREC *))) == NULL)
+		err_dump("_db_ckshard: malloc error");
+	for (i = 0; i < s->nrec; i++) {
+		r = &s->rec[i];
+		if ((r->ptr & PTR_DEAD) || r->blank) {
+			if (r->seen == 0)
+				s->part[0].ndead++;
+		} else if (r->seen != CK_FREE) {
+			if (r->seen == 0) {
+				__atomic_add_fetch(&ck->res->nlost, 1,
+				    __ATOMIC_RELAXED);
+				_db_ckreport(s, 0, "the record at %lld is on "
+				    "no chain", (long long) r->off);
+			}
+			s->live[s->nlive++] = r;
+		}
+	}
+	
+	/* their data records, in order.	*/
+	qsort(s->live, s->nlive, sizeof(CKREC *), _db_cklivecmp);
+	for (i = 1; i < s->nlive; i++)
+		if (s->live[i]->datoff < s->live[i - 1]->datoff +
+		    s->live[i - 1]->datlen)
+			_db_ckreport(s, 1, "the data of the records at %lld "
+			    "and %lld overlap", (long long) s->live[i - 1]->off,
+			    (long long) s->live[i]->off);
+	if (ck->to == NULL) {
+		_db_ckthreads(s, s->nthreads, _db_ckdata);
+		goto done;
+	}
+	
+	/* a key is rebuilt from one record: one on a chain, rather than
+	   one a store cut short left, else the one written last.	*/
+	if ((key = malloc((s->nlive + 1) * sizeof(CKKEY))) == NULL)
+		err_dump("_db_ckshard: malloc error");
+	for (i = 0; i < s->nlive; i++) {
+		key[i].key = s->keys + s->live[i]->key;
+		key[i].r = s->live[i];
+	}
+	qsort(key, s->nlive, sizeof(CKKEY), _db_ckkeycmp);
+	for (i = 1; i < s->nlive; i++)
+		if (strcmp(key[i].key, key[i - 1].key) == 0)
+			key[i].r->dup = 1;
+	free(key);
+	
+	/* a database is stored into by one thread at a time.	*/
+	if (ck->bulk)
+		s->load = _db_ckloadstart(ck->pershard ?
+		    ck->to->shard[s->shard] : ck->to);
+	_db_ckthreads(s, 1, _db_ckdata);
+	if (s->load != NULL)
+		_db_ckloadend(s->load);
+	
+done:
+	_db_tablelock(db, F_UNLCK);
+	for (j = 0; j < s->nthreads; j++) {
+		__atomic_add_fetch(&ck->res->nrecs, s->part[j].nrecs,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ck->res->ndead, s->part[j].ndead,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ck->res->nfree, s->part[j].nfree,
+		    __ATOMIC_RELAXED);
+	}
+	free(s->rec);
+	free(s->keys);
+	free(s->table);
+	free(s->live);
+	free(s->slot);
+	free(s->seen);
+	free(s);
+}
+
+static void *
+_db_cktask(void *arg)
+{
+	CKTASK	*task = arg;
+	
+	(*task->fn)(task->s, task->n);
+	return (NULL);
+}
+
+/*
+ * call fn in n threads, numbered from 0, and wait for them, as
+ * _db_parallel() does for shards.
+ */
+static void
+_db_ckthreads(CKSHARD *s, int n, void (*fn)(CKSHARD *, int))
+{
+	CKTASK	task[CHECK_THREADS_MAX];
+	int	i;
+	
+	for (i = 0; i < n; i++) {
+		task[i].s = s;
+		task[i].n = i;
+		task[i].fn = fn;
+		if (i > 0 && (errno = pthread_create(&task[i].tid, NULL,
+		    _db_cktask, &task[i])) != 0)
+			err_sys("_db_ckthreads: pthread_create error");
+	}
+	_db_cktask(&task[0]);
+	for (i = 1; i < n; i++)
+		if ((errno = pthread_join(task[i].tid, NULL)) != 0)
+			err_sys("_db_ckthreads: pthread_join error");
+}
+
+/*
+ * pass a problem to the caller's function, and count it if it is damage.
+ */
+static void
+_db_ckreport(CKSHARD *s, int bad, const char *fmt, ...)
+{
+	DBCHECK	*res = s->ck->res;
+	char	buf[256];
+	int	n = 0;
+	va_list	ap;
+	
+	if (bad)
+		__atomic_add_fetch(&res->nbad, 1, __ATOMIC_RELAXED);
+	if (res->fn == NULL)
+		return;
+	if (s->shard >= 0)
+		n = snprintf(buf, sizeof(buf), "shard %d: ", s->shard);
+	va_start(ap, fmt);
+	vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+	va_end(ap);
+	(*res->fn)(res->arg, buf);
+}
+
+/*
+ * store a record in the new database of a db_rebuild().
+ */
+static void
+_db_ckstore(CKSHARD *s, const char *key, const char *data, int flag)
+{
+	DBCK	*ck = s->ck;
+	DB	*to = ck->to;
+	int	rc;
+	
+	if (s->load != NULL) {
+		_db_ckload(s->load, key, data, ck);
+		return;
+	}
+	if (ck->pershard)
+		to = to->shard[s->shard];
+	else
+		pthread_mutex_lock(&ck->mutex);
+	if ((rc = db_store(to, key, data, flag)) < 0)
+		__atomic_store_n(&ck->err, errno, __ATOMIC_RELAXED);
+	else if (rc == 0)
+		__atomic_add_fetch(&ck->res->nrebuilt, 1, __ATOMIC_RELAXED);
+	if (!ck->pershard)
+		pthread_mutex_unlock(&ck->mutex);
+}
+
+/*
+ * start appending to db, just created by db_rebuild(), which no one else
+ * has open yet: its records go after its hash table, and each onto the
+ * front of its chain, as db_store() would put it.
+ */
+static CKLOAD *
+_db_ckloadstart(DB *db)
+{
+	CKLOAD	*l;
+	struct stat	statbuff;
+	
+	if ((l = calloc(1, sizeof(CKLOAD))) == NULL ||
+	    (l->head = calloc(db->nhash, sizeof(DBPTR))) == NULL ||
+	    (l->buf[CKLOAD_IDX] = malloc(CHECK_BLOCK)) == NULL ||
+	    (l->buf[CKLOAD_DAT] = malloc(CHECK_BLOCK)) == NULL)
+		err_dump("_db_ckloadstart: malloc error");
+	l->db = db;
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_ckloadstart: fstat error");
+	l->end[CKLOAD_IDX] = statbuff.st_size;
+	if (fstat(db->datfd, &statbuff) < 0)
+		err_sys("_db_ckloadstart: fstat error");
+	l->end[CKLOAD_DAT] = statbuff.st_size;
+	return (l);
+}
+
+/*
+ * write what is held for one of the files.
+ */
+static void
+_db_ckloadwrite(CKLOAD *l, int which)
+{
+	int	fd = which == CKLOAD_IDX ? l->db->idxfd : l->db->datfd;
+	
+	if (l->len[which] == 0)
+		return;
+	if (pwrite(fd, l->buf[which], l->len[which], l->end[which]) !=
+	    l->len[which])
+		err_sys("_db_ckloadwrite: write error");
+	l->end[which] += l->len[which];
+	l->len[which] = 0;
+}
+
+/*
+ * append a record. one that can't be stored, as db_store() would refuse
+ * it, sets the errno db_rebuild() returns.
+ */
+static void
+_db_ckload(CKLOAD *l, const char *key, const char *data, DBCK *ck)
+{
+	DB	*db = l->db;
+	DBHASH	chain;
+	off_t	off;
+	size_t	len;
+	char	*p;
+	
+	len = strlen(data) + 1;
+	if (_db_keyenc(db, key) < 0 || len < DATALEN_MIN ||
+	    len > DATALEN_MAX) {
+		__atomic_store_n(&ck->err, EINVAL, __ATOMIC_RELAXED);
+		return;
+	}
+	if (l->len[CKLOAD_DAT] + len > CHECK_BLOCK)
+		_db_ckloadwrite(l, CKLOAD_DAT);
+	if (l->len[CKLOAD_IDX] + PTR_SZ + IDXLEN_SZ + IDXLEN_MAX > CHECK_BLOCK)
+		_db_ckloadwrite(l, CKLOAD_IDX);
+	off = l->end[CKLOAD_IDX] + l->len[CKLOAD_IDX];
+	if (off > PTR_MAX) {
+		__atomic_store_n(&ck->err, EFBIG, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	p = l->buf[CKLOAD_DAT] + l->len[CKLOAD_DAT];
+	memcpy(p, data, len - 1);
+	p[len - 1] = NEWLINE;
+	db->datoff = l->end[CKLOAD_DAT] + l->len[CKLOAD_DAT];
+	db->datlen = len;
+	db->datcrc = crc32c(0, data, len - 1);
+	l->len[CKLOAD_DAT] += len;
+	
+	chain = _db_hash(db, key);
+	p = l->buf[CKLOAD_IDX] + l->len[CKLOAD_IDX];
+	len = _db_fmtidx(db, db->keybuf, p, l->head[chain]);
+	memcpy(p + PTR_SZ + IDXLEN_SZ, db->idxbuf, len);
+	l->len[CKLOAD_IDX] += PTR_SZ + IDXLEN_SZ + len;
+	l->head[chain] = PTR_MAKE(off, db->keyfp, db->keylen);
+	STAT_ADD(db, nrecs, 1);
+	STAT_ADD(db, recbytes, REC_SZ(db));
+	__atomic_add_fetch(&ck->res->nrebuilt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * finish appending: write what is held, then the hash table, and tell
+ * the shared memory segment where the files end now. a log's header
+ * is moved past the records, which recovery would otherwise take to be
+ * appends cut short, once they are on disk.
+ */
+static void
+_db_ckloadend(CKLOAD *l)
+{
+	DB	*db = l->db;
+	WALHDR	hdr;
+	char	*table;
+	size_t	i;
+	
+	_db_ckloadwrite(l, CKLOAD_IDX);
+	_db_ckloadwrite(l, CKLOAD_DAT);
+	if ((table = malloc(db->nhash * PTR_SZ + 1)) == NULL)
+		err_dump("_db_ckloadend: malloc error");
+	for (i = 0; i < db->nhash; i++)
+		_db_fmtptr(table + i * PTR_SZ, l->head[i]);
+	if (pwrite(db->idxfd, table, db->nhash * PTR_SZ, db->hashoff) !=
+	    db->nhash * PTR_SZ)
+		err_sys("_db_ckloadend: write error of hash table");
+	free(table);
+	db->shm->idxend = db->shm->idxalloc = l->end[CKLOAD_IDX];
+	db->shm->datend = db->shm->datalloc = l->end[CKLOAD_DAT];
+	db->dirty |= DIRTY_IDX | DIRTY_DAT;
+	
+	if (db->walfd >= 0) {
+		_db_fsync(db, DIRTY_IDX | DIRTY_DAT);
+		if (pread(db->walfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			err_sys("_db_ckloadend: read error of log header");
+		hdr.idxsize = l->end[CKLOAD_IDX];
+		if (pwrite(db->walfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			err_sys("_db_ckloadend: write error of log header");
+	}
+	free(l->buf[CKLOAD_IDX]);
+	free(l->buf[CKLOAD_DAT]);
+	free(l->head);
+	free(l);
+}
+
+/*
+ * the first pass, in thread n: keep a CKREC for each intact index record
+ * that starts in the thread's range of the index file.
+ */
+static void
+_db_ckscan(CKSHARD *s, int n)
+{
+	DB	*db = s->db;
+	CKPART	*part = &s->part[n];
+	CKREC	*r;
+	char	*buf, *p, *end, *rec, *k;
+	char	key[IDXLEN_MAX + KEYPREFIX_MAX + 1];
+	off_t	lo, hi, pos, boff = 0, badfrom = -1, datoff;
+	ssize_t	blen = 0;
+	size_t	idxlen, datlen, len, keylen;
+	unsigned int datcrc;
+	int	sync, eof = 0;
+	
+	lo = db->firstoff + (s->idxend - db->firstoff) * n / s->nthreads;
+	hi = db->firstoff + (s->idxend - db->firstoff) * (n + 1) / s->nthreads;
+	if ((buf = malloc(CHECK_BLOCK)) == NULL)
+		err_dump("_db_ckscan: malloc error");
+	/* the first range starts after the hash table's newline. */
+	sync = n > 0;
+	for (pos = lo; pos < s->idxend; ) {
+		/* the block has the byte before pos, and the record at
+		   pos unless the file ends first.	*/
+		if (pos - 1 < boff || (!eof && pos + PTR_SZ + IDXLEN_SZ +
+		    IDXLEN_MAX > boff + blen)) {
+			boff = pos - 1;
+			len = s->idxend - boff < CHECK_BLOCK ?
+			    s->idxend - boff : CHECK_BLOCK;
+			if ((blen = pread(db->idxfd, buf, len, boff)) < 0)
+				err_sys("_db_ckscan: read error of index file");
+			eof = blen < len || boff + blen == s->idxend;
+		}
+		p = buf + (pos - boff);
+		end = buf + blen;
+		if (sync) {
+			while (p < end && (*p == 0 ||
+			    (p[-1] != NEWLINE && p[-1] != 0)))
+				p++;
+		} else {
+			while (p < end && *p == 0)
+				p++;
+		}
+		pos = boff + (p - buf);
+		if (p == end) {
+			if (eof)
+				break;
+			continue;
+		}
+		sync = 0;
+		if (pos >= hi)
+			break;		/* the next range's */
+		
+		rec = p + PTR_SZ + IDXLEN_SZ;
+		if (end - p < PTR_SZ + IDXLEN_SZ ||
+		    (idxlen = _db_strtol(p + PTR_SZ, IDXLEN_SZ, 10)) <
+		    IDXLEN_MIN || idxlen > IDXLEN_MAX ||
+		    end - rec < idxlen ||
+		    _db_checkidx(p + PTR_SZ, rec, idxlen, &datcrc) < 0 ||
+		    _db_splitidx(rec, &datoff, &datlen) != NULL) {
+			if (badfrom < 0)
+				badfrom = pos;
+			sync = 1;	/* on to the next that is intact */
+			pos++;
+			continue;
+		}
+		if (badfrom >= 0) {
+			_db_ckreport(s, 1, "the index file is damaged from %lld "
+			    "to %lld", (long long) badfrom, (long long) pos);
+			badfrom = -1;
+		}
+		
+		if (part->nrec == part->maxrec) {
+			part->maxrec = part->maxrec > 0 ? 2 * part->maxrec : 4096;
+			if ((part->rec = realloc(part->rec,
+			    part->maxrec * sizeof(CKREC))) == NULL)
+				err_dump("_db_ckscan: realloc error");
+		}
+		r = &part->rec[part->nrec++];
+		memset(r, 0, sizeof(CKREC));
+		r->off = pos;
+		r->ptr = _db_parseptr(p);
+		r->datoff = datoff;
+		r->datlen = datlen;
+		r->datcrc = datcrc;
+		r->klen = strlen(rec);
+		for (k = rec; *k == SPACE; k++)
+			;
+		r->blank = *k == 0;
+		
+		/* the key, with any prefix put back.	*/
+		k = rec;
+		keylen = 0;
+		if (db->prefixlen > 0 && *k++ == KEY_PREFIXED) {
+			memcpy(key, db->prefix, db->prefixlen);
+			keylen = db->prefixlen;
+		}
+		strcpy(key + keylen, k);
+		r->chain = _db_hash(db, key);
+		r->fp = _db_fprint(key);
+		if (s->ck->to != NULL) {
+			len = strlen(key) + 1;
+			if (part->nkeys + len > part->maxkeys) {
+				part->maxkeys = part->maxkeys > 0 ?
+				    2 * part->maxkeys : 65536;
+				if ((part->keys = realloc(part->keys,
+				    part->maxkeys)) == NULL)
+					err_dump("_db_ckscan: realloc error");
+			}
+			memcpy(part->keys + part->nkeys, key, len);
+			r->key = part->nkeys;
+			part->nkeys += len;
+		}
+		pos += PTR_SZ + IDXLEN_SZ + idxlen;
+	}
+	if (badfrom >= 0)
+		_db_ckreport(s, 1, "the index file is damaged from %lld to %lld",
+		    (long long) badfrom, (long long) pos);
+	free(buf);
+}
+
+/*
+ * the CKREC of the index record at off, or NULL if there is no intact one.
+ */
+static CKREC *
+_db_ckfind(CKSHARD *s, off_t off)
+{
+	size_t	lo = 0, hi = s->nrec, mid;
+	
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->rec[mid].off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < s->nrec && s->rec[lo].off == off ? &s->rec[lo] : NULL);
+}
+
+/*
+ * the second pass, in thread n: walk the chains a batch at a time, and
+ * in the first thread the free list.
+ */
+static void
+_db_ckchains(CKSHARD *s, int n)
+{
+	DBHASH	c, c0;
+	
+	if (n == 0)
+		_db_ckwalk(s, n, -1, _db_parseptr(s->table));
+	while ((c0 = __atomic_fetch_add(&s->next, CHECK_BATCH,
+	    __ATOMIC_RELAXED)) < s->db->nhash)
+		for (c = c0; c < c0 + CHECK_BATCH && c < s->db->nhash; c++)
+			_db_ckwalk(s, n, c, _db_parseptr(s->table +
+			    (c + 1) * PTR_SZ));
+}
+
+/*
+ * walk a chain, or the free list if chain is -1, from ptr, counting its
+ * records in thread n's part. each record can be found by one walk only.
+ */
+static void
+_db_ckwalk(CKSHARD *s, int n, long chain, DBPTR ptr)
+{
+	CKPART	*part = &s->part[n];
+	CKREC	*r;
+	off_t	off;
+	char	where[32];
+	unsigned char none;
+	
+	if (chain < 0)
+		strcpy(where, "the free list");
+	else
+		sprintf(where, "chain %ld", chain);
+	while ((off = PTR_OFF(ptr)) != 0) {
+		if ((r = _db_ckfind(s, off)) == NULL) {
+			_db_ckreport(s, 1, "%s points to %lld, where there is no "
+			    "intact index record", where, (long long) off);
+			return;
+		}
+		none = 0;
+		if (!__atomic_compare_exchange_n(&r->seen, &none, chain < 0 ?
+		    CK_FREE : CK_CHAIN, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			_db_ckreport(s, 1, "%s reaches the record at %lld, "
+			    "already reached", where, (long long) off);
+			return;
+		}
+		/* the free list ptrs have a key length, but no fingerprint. */
+		if (PTR_KLEN(ptr) != r->klen ||
+		    (chain >= 0 && PTR_FP(ptr) != r->fp))
+			_db_ckreport(s, 1, "%s: the ptr to the record at %lld has "
+			    "the wrong key fingerprint or length", where,
+			    (long long) off);
+		if (chain < 0) {
+			if (!(r->ptr & PTR_DEAD))
+				_db_ckreport(s, 1, "the record at %lld is on the "
+				    "free list, but not dead", (long long) off);
+			part->nfree++;
+		} else if ((r->ptr & PTR_DEAD) || r->blank)
+			part->ndead++;
+		else {
+			if (r->chain != chain)
+				_db_ckreport(s, 1, "%s: the record at %lld "
+				    "belongs on chain %lu", where,
+				    (long long) off, r->chain);
+			part->nrecs++;
+		}
+		ptr = r->ptr;
+	}
+}
+
+static int
+_db_cklivecmp(const void *a, const void *b)
+{
+	off_t	oa = (*(CKREC * const *) a)->datoff;
+	off_t	ob = (*(CKREC * const *) b)->datoff;
+	
+	return (oa < ob ? -1 : oa > ob);
+}
+
+/*
+ * order by key, and the records with a key by which is kept: the first.
+ */
+static int
+_db_ckkeycmp(const void *a, const void *b)
+{
+	const CKKEY	*ka = a, *kb = b;
+	int		rc;
+	
+	if ((rc = strcmp(ka->key, kb->key)) != 0)
+		return (rc);
+	if ((ka->r->seen == CK_CHAIN) != (kb->r->seen == CK_CHAIN))
+		return (ka->r->seen == CK_CHAIN ? -1 : 1);
+	return (ka->r->datoff > kb->r->datoff ? -1 :
+	    ka->r->datoff < kb->r->datoff);
+}
+
+/*
+ * the third pass, in thread n: check the data records of the thread's
+ * range of the live records, and for db_rebuild() store them.
+ */
+static void
+_db_ckdata(CKSHARD *s, int n)
+{
+	DB	*db = s->db;
+	CKREC	*r;
+	char	*buf, *p;
+	off_t	boff = 0;
+	ssize_t	blen = 0;
+	size_t	i, hi, len;
+	int	nthreads = s->ck->to != NULL ? 1 : s->nthreads;
+	
+	if ((buf = malloc(CHECK_BLOCK)) == NULL)
+		err_dump("_db_ckdata: malloc error");
+	hi = s->nlive * (n + 1) / nthreads;
+	for (i = s->nlive * n / nthreads; i < hi; i++) {
+		r = s->live[i];
+		if (r->datoff + r->datlen > s->datend) {
+			_db_ckreport(s, 1, "the data of the record at %lld runs "
+			    "past the end of the data file", (long long) r->off);
+			continue;
+		}
+		if (r->datoff < boff || r->datoff + r->datlen > boff + blen) {
+			boff = r->datoff;
+			len = s->datend - boff < CHECK_BLOCK ?
+			    s->datend - boff : CHECK_BLOCK;
+			if ((blen = pread(db->datfd, buf, len, boff)) < 0)
+				err_sys("_db_ckdata: read error of data file");
+		}
+		p = buf + (r->datoff - boff);
+		if (r->datoff + r->datlen > boff + blen ||
+		    p[r->datlen - 1] != NEWLINE ||
+		    crc32c(0, p, r->datlen - 1) != r->datcrc) {
+			_db_ckreport(s, 1, "the data of the record at %lld is "
+			    "damaged", (long long) r->off);
+			continue;
+		}
+		r->ok = 1;
+		if (s->ck->to != NULL && !r->dup) {
+			p[r->datlen - 1] = 0;
+			_db_ckstore(s, s->keys + r->key, p, DB_STORE);
+			p[r->datlen - 1] = NEWLINE;
+		}
+	}
+	free(buf);
+}
+
+/*
+ * db_check() or db_rebuild() of fixed size slots: each slot and its data
+ * read in ranges, then the chains walked through them.
+ */
+static void
+_db_ckfixed(CKSHARD *s)
+{
+	DB	*db = s->db;
+	FIXSLOT	*slot = (FIXSLOT *) db->idxbuf;
+	unsigned int i;
+	int	pass;
+	size_t	len;
+	
+	s->nslots = s->idxend > db->firstoff ?
+	    (s->idxend - db->firstoff) / db->islotsz : 0;
+	if (s->nslots > SLOTS_MAX)
+		s->nslots = SLOTS_MAX;
+	len = db->nhash * SLOTPTR_SZ;
+	if ((s->slot = malloc((s->nslots + 1) * sizeof(CKSLOT))) == NULL ||
+	    (s->seen = calloc(s->nslots / 64 + 1, sizeof(s->seen[0]))) == NULL ||
+	    (s->table = malloc(len)) == NULL)
+		err_dump("_db_ckfixed: malloc error");
+	_db_ckthreads(s, s->nthreads, _db_ckfixscan);
+	if (pread(db->idxfd, s->table, len, db->hashoff) != len)
+		err_sys("_db_ckfixed: read error of hash table");
+	_db_ckthreads(s, s->nthreads, _db_ckfixchains);
+	
+	/* a slot in use on no chain is blanked by the next writer to
+	   open the database (see _db_fixrecover).	*/
+	for (i = 0; i < s->nslots; i++) {
+		if (s->slot[i].chain >= CKSLOT_BAD ||
+		    (s->seen[i / 64] & 1ULL << i % 64))
+			continue;
+		__atomic_add_fetch(&s->ck->res->nlost, 1, __ATOMIC_RELAXED);
+		_db_ckreport(s, 0, "slot %u is on no chain", i);
+	}
+	
+	/* those on a chain first, then those on none if the key isn't. */
+	for (pass = 0; s->ck->to != NULL && pass < 2; pass++) {
+		for (i = 0; i < s->nslots; i++) {
+			if (s->slot[i].chain >= CKSLOT_BAD ||
+			    ((s->seen[i / 64] & 1ULL << i % 64) != 0) == pass)
+				continue;
+			if (pread(db->idxfd, slot, db->islotsz,
+			    SLOT_IDXOFF(db, i)) != db->islotsz ||
+			    pread(db->datfd, db->datbuf, db->dslotsz,
+			    SLOT_DATOFF(db, i)) != db->dslotsz)
+				err_sys("_db_ckfixed: read error");
+			memcpy(db->keybuf, slot->key, db->keysize);
+			db->keybuf[db->keysize] = 0;
+			db->datbuf[db->datsize] = 0;
+			_db_ckstore(s, db->keybuf, db->datbuf,
+			    pass == 0 ? DB_STORE : DB_INSERT);
+		}
+	}
+}
+
+/*
+ * the first pass of fixed size slots, in thread n: the thread's range of
+ * slots, and their data, a block at a time.
+ */
+static void
+_db_ckfixscan(CKSHARD *s, int n)
+{
+	DB	*db = s->db;
+	CKPART	*part = &s->part[n];
+	FIXSLOT	*slot;
+	char	*ibuf, *dbuf, key[FIXKEY_MAX + 1];
+	unsigned int i, lo, hi, j, nb, per;
+	ssize_t	dlen;
+	
+	per = CHECK_BLOCK / db->islotsz;
+	if ((ibuf = malloc(per * db->islotsz)) == NULL ||
+	    (dbuf = malloc(per * db->dslotsz)) == NULL)
+		err_dump("_db_ckfixscan: malloc error");
+	lo = (unsigned long long) s->nslots * n / s->nthreads;
+	hi = (unsigned long long) s->nslots * (n + 1) / s->nthreads;
+	for (i = lo; i < hi; i += nb) {
+		nb = hi - i < per ? hi - i : per;
+		if (pread(db->idxfd, ibuf, nb * db->islotsz,
+		    SLOT_IDXOFF(db, i)) != nb * db->islotsz)
+			err_sys("_db_ckfixscan: read error of index file");
+		/* the data file may have been cut short.	*/
+		if ((dlen = pread(db->datfd, dbuf, nb * db->dslotsz,
+		    SLOT_DATOFF(db, i))) < 0)
+			err_sys("_db_ckfixscan: read error of data file");
+		for (j = 0; j < nb; j++) {
+			slot = (FIXSLOT *) (ibuf + j * db->islotsz);
+			s->slot[i + j].next = slot->next;
+			if (slot->key[0] == 0) {
+				s->slot[i + j].chain = CKSLOT_FREE;
+				part->nfree++;
+				continue;
+			}
+			if ((j + 1) * db->dslotsz > dlen ||
+			    crc32c(crc32c(0, slot->key, db->keysize),
+			    dbuf + j * db->dslotsz, db->datsize) != slot->crc) {
+				s->slot[i + j].chain = CKSLOT_BAD;
+				_db_ckreport(s, 1, "slot %u is damaged", i + j);
+				continue;
+			}
+			memcpy(key, slot->key, db->keysize);
+			key[db->keysize] = 0;
+			s->slot[i + j].chain = _db_hash(db, key);
+		}
+	}
+	free(ibuf);
+	free(dbuf);
+}
+
+/*
+ * the second pass of fixed size slots, in thread n: walk the chains a
+ * batch at a time.
+ */
+static void
+_db_ckfixchains(CKSHARD *s, int n)
+{
+	CKPART	*part = &s->part[n];
+	CKSLOT	*cs;
+	DBHASH	c, c0;
+	unsigned int next;
+	unsigned long long bit;
+	
+	while ((c0 = __atomic_fetch_add(&s->next, CHECK_BATCH,
+	    __ATOMIC_RELAXED)) < s->db->nhash) {
+		for (c = c0; c < c0 + CHECK_BATCH && c < s->db->nhash; c++) {
+			memcpy(&next, s->table + c * SLOTPTR_SZ, SLOTPTR_SZ);
+			while (next != 0) {
+				if (next > s->nslots) {
+					_db_ckreport(s, 1, "chain %lu points to "
+					    "slot %u, past the end", c, next - 1);
+					break;
+				}
+				bit = 1ULL << (next - 1) % 64;
+				if (__atomic_fetch_or(&s->seen[(next - 1) / 64],
+				    bit, __ATOMIC_RELAXED) & bit) {
+					_db_ckreport(s, 1, "chain %lu reaches "
+					    "slot %u, already reached", c,
+					    next - 1);
+					break;
+				}
+				cs = &s->slot[next - 1];
+				if (cs->chain == CKSLOT_FREE)
+					_db_ckreport(s, 1, "chain %lu: slot %u "
+					    "is free", c, next - 1);
+				else if (cs->chain == CKSLOT_BAD)
+					;	/* reported */
+				else if (cs->chain != c)
+					_db_ckreport(s, 1, "chain %lu: slot %u "
+					    "belongs on chain %u", c, next - 1,
+					    cs->chain);
+				else
+					part->nrecs++;
+				next = cs->next;
+			}
+		}
+	}
+}
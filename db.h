@@ -1,22 +1,210 @@
+#ifndef _DB_H
+#define _DB_H
+
+#include <stddef.h>		/* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef	void * DBHANDLE;
 
+/* options for db_openopt(), zero fields select the defaults */
+typedef struct {
+	unsigned long	nhash;		/* hash table size, used at creation */
+	const char	*keyprefix;	/* common key prefix elided from index */
+					/* records, used at creation		*/
+	int		aiodepth;	/* most async requests outstanding */
+	int		sync;		/* durability mode, DB_SYNC_xxx */
+	long		syncms;		/* DB_SYNC_PERIODIC interval, msec */
+	int		wal;		/* keep a write-ahead log, at creation */
+	long		walmax;		/* checkpoint when the log passes this */
+	int		nshards;	/* spread keys over this many pairs of */
+					/* files, used at creation		*/
+	int		replog;		/* keep a replication log, at creation */
+	int		promote;	/* move a record db_fetch() finds deep in */
+					/* its chain to the front, one such	*/
+					/* fetch in promote; 0 never. needs	*/
+					/* the database open for writing	*/
+	size_t		keysize;	/* fixed size records, in slots: keys of */
+	size_t		datsize;	/* at most keysize bytes, data of at	*/
+					/* most datsize; used at creation, 0	*/
+					/* for records that vary		*/
+	int		trace;		/* trace one call in this many to */
+					/* <name>.trc; 0 never		*/
+	size_t		wbuf;		/* hold up to this many bytes of */
+					/* db_store()s in memory, to write	*/
+					/* in batches; 0 none (see db_flush) */
+} DBOPTS;
+
+/* what db_info() reports. the counts are kept as the database changes */
+typedef struct {
+	unsigned long long nrecs;	/* live records */
+	unsigned long long recbytes;	/* their bytes, index and data */
+	unsigned long long ndead;	/* deleted records not yet reclaimed */
+	unsigned long long deadbytes;	/* their bytes */
+	unsigned long long nfree;	/* records, or fixed size slots, free */
+	unsigned long long freebytes;	/* for reuse, and their bytes */
+	unsigned long	nhash;		/* hash chains, over all shards */
+	double		chainlen;	/* mean records on a chain, dead ones */
+					/* included */
+	int		exact;		/* 0 if the counts are the header's, */
+					/* which a crash left stale */
+} DBINFO;
+
+/* completion for db_fetch_async() and db_store_async(): rc as returned by
+   db_fetch() (0 found, -1 not) or by db_store(), and for a fetch the data,
+   which is only valid until the callback returns. */
+typedef void	(*DBAIOFN)(void *arg, int rc, char *data);
+
+/* called by db_scan() for each record and by db_fetch_batch() for each key
+   found. with shards it is called from a thread per shard at once. a
+   nonzero return stops db_scan(). */
+typedef int	(*DBVISIT)(void *arg, const char *key, const char *data);
+
+/* for db_index(): put the attribute the record is indexed under in attr,
+   null terminated, at most DBATTR_MAX bytes with the null, and return 1,
+   or return 0 if the record isn't indexed. an attribute with a tab, ':'
+   or newline in it isn't indexed. */
+typedef int	(*DBEXTRACT)(void *arg, const char *key, const char *data,
+		    char *attr);
+
+/* called by db_check() and db_rebuild() with each problem found, a line
+   of text without the newline, from several threads at once. */
+typedef void	(*DBPROBLEM)(void *arg, const char *what);
+
+/* for db_check() and db_rebuild(): how to go about it, and what was found
+   (zeroed at the start). nbad counts damage; a record on no chain was
+   left by a store that died part way through, and isn't. */
+typedef struct {
+	int		nthreads;	/* threads for each shard, 0 one per cpu */
+	DBPROBLEM	fn;		/* called with each problem, or NULL */
+	void		*arg;
+	unsigned long long nrecs;	/* live records on the chains */
+	unsigned long long ndead;	/* dead records, blanked ones included */
+	unsigned long long nfree;	/* records, or slots, free for reuse */
+	unsigned long long nlost;	/* live records, or slots, on no chain */
+	unsigned long long nbad;	/* problems found */
+	unsigned long long nrebuilt;	/* records in the new database */
+} DBCHECK;
+
 DBHANDLE	db_open(const char *, int, ...);
+DBHANDLE	db_openopt(const char *, int, int, const DBOPTS *);
 void 		db_close(DBHANDLE);
 char		*db_fetch(DBHANDLE, const char *);
 int		db_store(DBHANDLE, const char *, const char *, int);
 int		db_delete(DBHANDLE, const char *);
 void		db_rewind(DBHANDLE);
 char		*db_nextrec(DBHANDLE, char *);
+int		db_fetch_async(DBHANDLE, const char *, DBAIOFN, void *);
+int		db_store_async(DBHANDLE, const char *, const char *, int,
+		    DBAIOFN, void *);
+int		db_aio_wait(DBHANDLE, int);
+int		db_sync(DBHANDLE);
+int		db_scan(DBHANDLE, DBVISIT, void *);
+int		db_fetch_batch(DBHANDLE, const char **, int, DBVISIT, void *);
+int		db_store_batch(DBHANDLE, const char **, const char **, int, int,
+		    int *);
+char		*db_fetchn(DBHANDLE, const char *, size_t, size_t *);
+int		db_storen(DBHANDLE, const char *, size_t, const char *, size_t,
+		    int);
+int		db_deleten(DBHANDLE, const char *, size_t);
+int		db_backup(DBHANDLE, const char *);
+int		db_info(DBHANDLE, DBINFO *);
+int		db_index(DBHANDLE, const char *, DBEXTRACT, void *);
+int		db_lookup(DBHANDLE, const char *, const char *, DBVISIT, void *);
+int		db_flush(DBHANDLE);
+int		db_scanmatch(DBHANDLE, int, const char *, DBVISIT, void *);
+int		db_check(DBHANDLE, DBCHECK *);
+int		db_rebuild(DBHANDLE, const char *, const DBOPTS *, DBCHECK *);
 
 /* flags for db_store() */
 #define	DB_INSERT	1
 #define DB_REPLACE	2
 #define DB_STORE	3	/* replace or insert */
 
+/* patterns for db_scanmatch() */
+#define DB_MATCH_PREFIX	1	/* keys that start with it */
+#define DB_MATCH_SUBSTR	2	/* keys that contain it */
+#define DB_MATCH_GLOB	3	/* keys it matches, as fnmatch(3) */
+
+/* durability modes for DBOPTS sync. the data, index record and chain
+   ptr are written in an order that is crash safe in the last two. */
+#define DB_SYNC_NONE	0	/* leave it to the kernel */
+#define DB_SYNC_PERIODIC 1	/* a change syncs if syncms have passed */
+#define DB_SYNC_OP	2	/* db_store and db_delete are durable on return */
+#define DB_SYNC_GROUP	3	/* as DB_SYNC_OP, concurrent callers share syncs */
+
+/* the replication log, <name>.rep, of a database created with replog:
+   a DBREPREC for each store or delete, in the order they were made to
+   each key, followed by the key and for a store the data, neither null
+   terminated. crc is the crc32c of the DBREPREC, with crc 0, and the
+   bytes that follow. dbfollow applies it to a replica. */
+#define DBREP_MAGIC	0x52455043U	/* "REPC" */
+#define DBREP_STORE	1
+#define DBREP_DELETE	2
+
+typedef struct {
+	unsigned int	magic;
+	unsigned int	crc;
+	unsigned short	keylen;
+	unsigned short	datlen;
+	int		op;		/* DBREP_xxx */
+	long long	usec;		/* when, in usec since the epoch */
+} DBREPREC;
+
+/* the trace file, <name>.trc, of a database opened with trace: a ring
+   of events for each handle that has it open, each written by its
+   handle without locks. next counts the events written to a ring; the
+   last DBTRACE_EVENTS of them are in ev[], event n at n % DBTRACE_EVENTS.
+   a reader copies them, then reads next again and drops the events it
+   has since overtaken (those up to next - DBTRACE_EVENTS). the times are
+   in usec, lockwait included in latency. dbtrace prints it. */
+#define DBTRACE_MAGIC	0x54524345U	/* "TRCE" */
+#define DBTRACE_RINGS	64		/* most handles traced at once */
+#define DBTRACE_EVENTS	1024		/* events a ring holds */
+#define DBTRACE_FETCH	1
+#define DBTRACE_STORE	2
+#define DBTRACE_DELETE	3
+
+typedef struct {
+	long long	usec;		/* when it began, since the epoch */
+	unsigned int	latency;	/* how long it took */
+	unsigned int	lockwait;	/* of that, waiting for record locks */
+	unsigned int	chain;		/* hash chain of the key */
+	unsigned int	hops;		/* records passed on the chain */
+	unsigned int	bytes;		/* bytes read from the files */
+	unsigned char	op;		/* DBTRACE_xxx */
+	signed char	rc;		/* 0 done, 1 key there for DB_INSERT, */
+					/* -1 key not found or error */
+} DBTRACE;
+
+typedef struct {
+	int		pid;		/* process that has it, 0 if none */
+	unsigned int	pad;
+	unsigned long long next;	/* events written to it */
+	DBTRACE		ev[DBTRACE_EVENTS];
+} DBTRING;
+
+typedef struct {
+	unsigned int	magic;
+	unsigned int	pad[3];
+	DBTRING		ring[DBTRACE_RINGS];
+} DBTRFILE;
+
 /* implementation limits */
-#define IDXLEN_MIN	6	/* key, sep, start, sep, length, \n */
+#define IDXLEN_MIN	23	/* key, sep, start, sep, length, sep, */
+				/* two crcs, \n */
 #define IDXLEN_MAX	1024	/* arbitrary */
 #define DATALEN_MIN	2	/* data byte, newline */
 #define DATALEN_MAX	1024	/* arbitrary */
+#define SHARDS_MAX	256	/* most shards */
+#define DBATTR_MAX	256	/* longest attribute, with its null */
+#define KEYPREFIX_MAX	64	/* longest keyprefix; the key buffer passed */
+				/* to db_nextrec needs IDXLEN_MAX + KEYPREFIX_MAX */
+
+#ifdef __cplusplus
+}
+#endif
 
+#endif /* _DB_H */
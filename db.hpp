@@ -0,0 +1,343 @@
+#ifndef _DB_HPP
+#define _DB_HPP
+
+/*
+ * a C++ layer over db.h, all inline, so a typed call compiles down to
+ * the C call it wraps.
+ *
+ *	db::Database d("users", O_RDWR | O_CREAT, 0644);
+ *	db::Table<std::uint32_t, Point> points(d);
+ *	points.put(42, Point{1, 2});
+ *	if (auto p = points.get(42)) ...
+ *
+ * keys and data go to the C calls as counted strings, so std::string_view
+ * needs no copy to null terminate it. what a fetch returns is a view of
+ * the handle's data buffer, valid until the next call on the handle, as
+ * with db_fetch(); decode it (or copy it) before the next call.
+ * records are text: no null bytes, and a key has no ':' or newline.
+ * the codec for a trivially copyable type encodes its bytes as fixed
+ * width hex, twice its size, so integers and structs can be keys and data.
+ */
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "db.h"
+
+namespace db {
+
+/*
+ * an open database, closed when it goes out of scope. it can be moved
+ * but not copied, since it owns the handle.
+ */
+class Database {
+public:
+	Database() noexcept = default;
+
+	/* same arguments as db_openopt(); throws std::system_error on failure */
+	Database(const char *path, int oflag, int mode = 0,
+	    const DBOPTS *opts = nullptr)
+	    : h_(db_openopt(path, oflag, mode, opts))
+	{
+		if (h_ == nullptr)
+			throw std::system_error(errno, std::generic_category(),
+			    path);
+	}
+
+	~Database() { close(); }
+
+	Database(const Database &) = delete;
+	Database &operator=(const Database &) = delete;
+
+	Database(Database &&other) noexcept
+	    : h_(std::exchange(other.h_, nullptr)) {}
+
+	Database &
+	operator=(Database &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			h_ = std::exchange(other.h_, nullptr);
+		}
+		return *this;
+	}
+
+	void
+	close() noexcept
+	{
+		if (h_ != nullptr)
+			db_close(std::exchange(h_, nullptr));
+	}
+
+	/* the data, a view of the handle's buffer, or nothing if the key
+	   isn't there (errno EIO if a damaged record was) */
+	std::optional<std::string_view>
+	fetch(std::string_view key) noexcept
+	{
+		size_t	len;
+		char	*data = db_fetchn(h_, key.data(), key.size(), &len);
+
+		if (data == nullptr)
+			return std::nullopt;
+		return std::string_view(data, len);
+	}
+
+	/* as db_store(): 0 if OK, 1 if DB_INSERT found the key, -1 on error */
+	int
+	store(std::string_view key, std::string_view data,
+	    int flag = DB_STORE) noexcept
+	{
+		return db_storen(h_, key.data(), key.size(), data.data(),
+		    data.size(), flag);
+	}
+
+	/* true if the key was there to delete */
+	bool
+	remove(std::string_view key) noexcept
+	{
+		return db_deleten(h_, key.data(), key.size()) == 0;
+	}
+
+	void sync() noexcept { db_sync(h_); }
+
+	/* as db_flush(): 0 if OK, -1 if a buffered store failed */
+	int flush() noexcept { return db_flush(h_); }
+
+	/* as db_backup(): 0 if OK, -1 on error */
+	int
+	backup(const char *path) noexcept
+	{
+		return db_backup(h_, path);
+	}
+
+	/* as db_index(): 0 if OK, -1 on error */
+	int
+	index(const char *name, DBEXTRACT fn, void *arg) noexcept
+	{
+		return db_index(h_, name, fn, arg);
+	}
+
+	/* as db_lookup(): the records found, -1 on error */
+	int
+	lookup(const char *name, const char *attr, DBVISIT fn,
+	    void *arg) noexcept
+	{
+		return db_lookup(h_, name, attr, fn, arg);
+	}
+
+	/* as db_scanmatch(): 0, what fn returned to stop, or -1 on error */
+	int
+	scanmatch(int how, const char *pattern, DBVISIT fn, void *arg) noexcept
+	{
+		return db_scanmatch(h_, how, pattern, fn, arg);
+	}
+
+	/* as db_check(): 0 if nothing is damaged, -1 if something is */
+	int
+	check(DBCHECK *res = nullptr) noexcept
+	{
+		return db_check(h_, res);
+	}
+
+	/* as db_rebuild(): 0 if OK, -1 on error */
+	int
+	rebuild(const char *path, const DBOPTS *opts = nullptr,
+	    DBCHECK *res = nullptr) noexcept
+	{
+		return db_rebuild(h_, path, opts, res);
+	}
+
+	/* as db_info() */
+	DBINFO
+	info() const noexcept
+	{
+		DBINFO	i;
+
+		db_info(h_, &i);
+		return i;
+	}
+
+	DBHANDLE handle() const noexcept { return h_; }
+	explicit operator bool() const noexcept { return h_ != nullptr; }
+
+private:
+	DBHANDLE h_ = nullptr;
+};
+
+/*
+ * codecs: how a type becomes a key or data and back. a codec has
+ *	value_type	what decode() gives back
+ *	buffer		room encode() may need, which the caller provides
+ *	encode(v, buf)	the encoding of v, as a view into v or buf
+ *	decode(s, &v)	v from s, false if s is no encoding of one
+ * Codec<T> is picked at compile time; a Table can be given another.
+ */
+template <class T, class = void>
+struct Codec;
+
+/* text is stored as it is, and comes back as a view: no copies */
+template <>
+struct Codec<std::string_view> {
+	using value_type = std::string_view;
+	struct buffer {};
+
+	static std::string_view
+	encode(std::string_view v, buffer &) noexcept { return v; }
+
+	static bool
+	decode(std::string_view s, value_type *v) noexcept
+	{
+		*v = s;
+		return true;
+	}
+};
+
+template <>
+struct Codec<std::string> {
+	using value_type = std::string;
+	struct buffer {};
+
+	static std::string_view
+	encode(const std::string &v, buffer &) noexcept { return v; }
+
+	static bool
+	decode(std::string_view s, value_type *v)
+	{
+		v->assign(s);
+		return true;
+	}
+};
+
+template <>
+struct Codec<const char *> {
+	using value_type = std::string_view;	/* a view, not a copy */
+	struct buffer {};
+
+	static std::string_view
+	encode(const char *v, buffer &) noexcept { return v; }
+
+	static bool
+	decode(std::string_view s, value_type *v) noexcept
+	{
+		*v = s;
+		return true;
+	}
+};
+
+/*
+ * integers, enums and structs of them: the bytes as 2 * sizeof(T)
+ * hex digits, in memory order, so the files are only good on machines
+ * with the same byte order and layout.
+ */
+template <class T>
+struct Codec<T, std::enable_if_t<std::is_trivially_copyable_v<T> &&
+    !std::is_pointer_v<T>>> {
+	using value_type = T;
+	using buffer = std::array<char, 2 * sizeof(T)>;
+
+	static std::string_view
+	encode(const T &v, buffer &buf) noexcept
+	{
+		static constexpr char hex[] = "0123456789abcdef";
+		unsigned char	bytes[sizeof(T)];
+
+		std::memcpy(bytes, &v, sizeof(T));
+		for (std::size_t i = 0; i < sizeof(T); i++) {
+			buf[2 * i] = hex[bytes[i] >> 4];
+			buf[2 * i + 1] = hex[bytes[i] & 0xf];
+		}
+		return std::string_view(buf.data(), buf.size());
+	}
+
+	static bool
+	decode(std::string_view s, value_type *v) noexcept
+	{
+		unsigned char	bytes[sizeof(T)];
+		int		hi, lo;
+
+		if (s.size() != 2 * sizeof(T))
+			return false;
+		for (std::size_t i = 0; i < sizeof(T); i++) {
+			if ((hi = digit(s[2 * i])) < 0 ||
+			    (lo = digit(s[2 * i + 1])) < 0)
+				return false;
+			bytes[i] = (unsigned char) (hi << 4 | lo);
+		}
+		std::memcpy(v, bytes, sizeof(T));
+		return true;
+	}
+
+private:
+	static int
+	digit(char c) noexcept
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		return -1;
+	}
+};
+
+/*
+ * a typed view of a database: keys of type K, data of type V. it doesn't
+ * own the database, which must outlive it.
+ */
+template <class K, class V, class KC = Codec<K>, class VC = Codec<V>>
+class Table {
+public:
+	using key_type = K;
+	using value_type = typename VC::value_type;
+
+	explicit Table(Database &d) noexcept : db_(&d) {}
+
+	/* nothing if the key isn't there or its data doesn't decode */
+	std::optional<value_type>
+	get(const K &key) const
+	{
+		typename KC::buffer kbuf;
+		std::optional<std::string_view> s =
+		    db_->fetch(KC::encode(key, kbuf));
+		value_type v;
+
+		if (!s || !VC::decode(*s, &v))
+			return std::nullopt;
+		return v;
+	}
+
+	/* as Database::store() */
+	int
+	put(const K &key, const V &val, int flag = DB_STORE) const noexcept
+	{
+		typename KC::buffer kbuf;
+		typename VC::buffer vbuf;
+
+		return db_->store(KC::encode(key, kbuf), VC::encode(val, vbuf),
+		    flag);
+	}
+
+	bool
+	erase(const K &key) const noexcept
+	{
+		typename KC::buffer kbuf;
+
+		return db_->remove(KC::encode(key, kbuf));
+	}
+
+	Database &database() const noexcept { return *db_; }
+
+private:
+	Database *db_;
+};
+
+} /* namespace db */
+
+#endif /* _DB_HPP */
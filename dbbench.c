@@ -0,0 +1,516 @@
+#include "db.c"		/* the kernels are static */
+
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * dbbench: time the kernels on the hot paths of db.c, on synthetic keys,
+ * with no i/o.
+ *
+ *	dbbench [-n ops] [-r runs] [-w runs] [-b baseline] [-s save]
+ *		[-t pct] [kernel[/keys] ...]
+ *
+ * it includes db.c, to call its static functions:
+ *	cc -O2 -o dbbench dbbench.c lib.c -lpthread -lm
+ * the kernels are
+ *	hash		_db_hash(), the chain a key is on
+ *	keyenc		_db_keyenc(), the stored key and its fingerprint
+ *	parseptr	_db_parseptr(), a ptr field
+ *	fmtptr		_db_fmtptr(), as _db_writeptr() does
+ *	parseidx	what _db_readidx() does to a record once read
+ *	fmtidx		_db_fmtidx(), as _db_writeidx() does
+ *	walk		the key compares of _db_find_and_lock() down a chain
+ *			of CHAIN_LEN records, in memory
+ *	memmem		_db_memmem(), as db_scanmatch() uses it: the tail
+ *			of a key found in its chain's records, end to end
+ * each on the key sets short ("k%d"), long (about 80 bytes) and prefixed
+ * (with a common prefix the database elides). the arguments pick the
+ * kernels, or kernel/keys pairs; all of them by default.
+ * a kernel is run -w times to warm up, then timed -r times, each time
+ * over -n operations; we print the time an operation took in the fastest
+ * and the median run, the mean, and the coefficient of variation of the
+ * runs. the time is in cycles from the time stamp counter on x86, and
+ * in nsec elsewhere.
+ * -s saves the fastest times to a file; -b compares the fastest times
+ * with one so saved, and exits 1 if one is more than -t percent (default
+ * 10) slower. noise only ever adds time, so the fastest run is the
+ * steadiest figure. a baseline is only good on the machine it was saved
+ * on.
+ */
+
+#define NKEYS		4096	/* keys in a set, a power of 2 */
+#define CHAIN_LEN	16	/* records on a synthetic chain */
+#define OPS_DEF		200000	/* operations timed in a run */
+#define RUNS_DEF	21
+#define WARMUP_DEF	3
+#define TOLERANCE_DEF	10	/* percent slower that is a regression */
+#define PREFIX		"tenant-000042/"	/* the prefixed keys' prefix */
+#define NAME_MAX_SZ	32
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UNIT		"cycles"
+
+static inline unsigned long long
+ticks(void)
+{
+	_mm_lfence();		/* don't let the work drift past the read */
+	return (__rdtsc());
+}
+#else
+#define UNIT		"nsec"
+
+static inline unsigned long long
+ticks(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+/*
+ * a set of keys, with what the kernels need of each made ready: as the
+ * key is stored, its ptr field, and its index record as it is on disk.
+ * the keys are in chains of CHAIN_LEN, key i in chain i / CHAIN_LEN.
+ */
+typedef struct {
+	const char	*name;
+	DB		*db;		/* for its buffers and prefix */
+	char		*keys[NKEYS];
+	char		*stored[NKEYS];
+	DBPTR		ptrs[NKEYS];
+	char		asciiptrs[NKEYS][PTR_SZ];
+	char		*recs[NKEYS];	/* ptr field, length and record */
+	size_t		reclens[NKEYS];
+	char		*runs[NKEYS / CHAIN_LEN];	/* a chain's records, */
+	size_t		runlens[NKEYS / CHAIN_LEN];	/* end to end */
+} KEYSET;
+
+typedef unsigned long (*KERNEL)(KEYSET *, long);
+
+typedef struct {
+	char	name[NAME_MAX_SZ];
+	double	best;
+} RESULT;
+
+static volatile unsigned long sink;	/* so the work isn't optimized away */
+
+static int	cmpdouble(const void *, const void *);
+static unsigned long k_fmtidx(KEYSET *, long);
+static unsigned long k_fmtptr(KEYSET *, long);
+static unsigned long k_hash(KEYSET *, long);
+static unsigned long k_keyenc(KEYSET *, long);
+static unsigned long k_memmem(KEYSET *, long);
+static unsigned long k_parseidx(KEYSET *, long);
+static unsigned long k_parseptr(KEYSET *, long);
+static unsigned long k_walk(KEYSET *, long);
+static int	loadbase(const char *, RESULT **);
+static void	mkkeys(KEYSET *, const char *, int);
+static int	picked(const char *, int, char **);
+static void	usage(void);
+
+static const struct {
+	const char	*name;
+	KERNEL		fn;
+} kernels[] = {
+	{ "hash",	k_hash },
+	{ "keyenc",	k_keyenc },
+	{ "parseptr",	k_parseptr },
+	{ "fmtptr",	k_fmtptr },
+	{ "parseidx",	k_parseidx },
+	{ "fmtidx",	k_fmtidx },
+	{ "walk",	k_walk },
+	{ "memmem",	k_memmem },
+};
+#define NKERNELS	(sizeof(kernels) / sizeof(kernels[0]))
+
+int
+main(int argc, char *argv[])
+{
+	KEYSET		sets[3];
+	RESULT		*base = NULL, *res;
+	FILE		*fp;
+	unsigned long long t;
+	double		*pt, mean, sd, slower;
+	char		name[NAME_MAX_SZ];
+	const char	*basefile = NULL, *savefile = NULL;
+	long		nops = OPS_DEF;
+	int		c, i, j, r, nbase = 0, nres = 0, regressed = 0;
+	int		runs = RUNS_DEF, warmup = WARMUP_DEF;
+	int		tolerance = TOLERANCE_DEF;
+
+	while ((c = getopt(argc, argv, "b:n:r:s:t:w:")) != EOF) {
+		switch (c) {
+		case 'b':
+			basefile = optarg;
+			break;
+		case 'n':
+			nops = atol(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 's':
+			savefile = optarg;
+			break;
+		case 't':
+			tolerance = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nops <= 0 || runs <= 0 || warmup < 0)
+		usage();
+	if (basefile != NULL && (nbase = loadbase(basefile, &base)) < 0)
+		err_sys("can't read %s", basefile);
+
+	mkkeys(&sets[0], "short", 0);
+	mkkeys(&sets[1], "long", 1);
+	mkkeys(&sets[2], "prefixed", 2);
+	if ((pt = malloc(runs * sizeof(double))) == NULL ||
+	    (res = malloc(NKERNELS * 3 * sizeof(RESULT))) == NULL)
+		err_dump("malloc error");
+
+	printf("%-20s %10s %10s %10s %6s  (%s/op)\n", "kernel/keys", "min",
+	    "median", "mean", "cv", UNIT);
+	for (i = 0; i < NKERNELS; i++) {
+		for (j = 0; j < 3; j++) {
+			snprintf(name, sizeof(name), "%s/%s", kernels[i].name,
+			    sets[j].name);
+			if (!picked(name, argc - optind, argv + optind))
+				continue;
+			for (r = 0; r < warmup; r++)
+				sink += (*kernels[i].fn)(&sets[j], nops);
+			for (r = 0; r < runs; r++) {
+				t = ticks();
+				sink += (*kernels[i].fn)(&sets[j], nops);
+				pt[r] = (double) (ticks() - t) / nops;
+			}
+			for (mean = 0, r = 0; r < runs; r++)
+				mean += pt[r];
+			mean /= runs;
+			for (sd = 0, r = 0; r < runs; r++)
+				sd += (pt[r] - mean) * (pt[r] - mean);
+			sd = sqrt(sd / runs);
+			qsort(pt, runs, sizeof(double), cmpdouble);
+			strcpy(res[nres].name, name);
+			res[nres].best = pt[0];
+			printf("%-20s %10.1f %10.1f %10.1f %5.1f%%", name, pt[0],
+			    pt[runs / 2], mean, 100 * sd / mean);
+
+			/* against the baseline	*/
+			for (r = 0; r < nbase; r++)
+				if (strcmp(base[r].name, name) == 0)
+					break;
+			if (r < nbase) {
+				slower = 100 * (res[nres].best / base[r].best - 1);
+				if (slower > tolerance) {
+					printf("  REGRESSED %+.1f%%", slower);
+					regressed++;
+				} else
+					printf("  %+.1f%%", slower);
+			}
+			printf("\n");
+			fflush(stdout);
+			nres++;
+		}
+	}
+
+	if (savefile != NULL) {
+		if ((fp = fopen(savefile, "w")) == NULL)
+			err_sys("can't create %s", savefile);
+		for (r = 0; r < nres; r++)
+			fprintf(fp, "%s %.2f\n", res[r].name, res[r].best);
+		if (fclose(fp) != 0)
+			err_sys("write error of %s", savefile);
+	}
+	if (regressed > 0) {
+		printf("%d regressed past %d%%\n", regressed, tolerance);
+		exit(1);
+	}
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	err_quit("usage: dbbench [-n ops] [-r runs] [-w runs] [-b baseline] "
+	    "[-s save]\n               [-t pct] [kernel[/keys] ...]");
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double	x = *(const double *) a, y = *(const double *) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * whether kernel/keys name is among the n asked for, or none were.
+ */
+static int
+picked(const char *name, int n, char **want)
+{
+	size_t	len;
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		len = strlen(want[i]);
+		if (strncmp(name, want[i], len) == 0 &&
+		    (name[len] == 0 || name[len] == '/'))
+			return (1);
+	}
+	return (n == 0);
+}
+
+/*
+ * read a baseline saved with -s. returns the number of results, or -1.
+ */
+static int
+loadbase(const char *path, RESULT **base)
+{
+	FILE	*fp;
+	RESULT	r;
+	int	n = 0, max = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+	while (fscanf(fp, "%31s %lf", r.name, &r.best) == 2) {
+		if (n == max) {
+			max = max > 0 ? 2 * max : 32;
+			if ((*base = realloc(*base, max * sizeof(RESULT))) == NULL)
+				err_dump("realloc error");
+		}
+		(*base)[n++] = r;
+	}
+	fclose(fp);
+	return (n);
+}
+
+/*
+ * make a key set of the kind given: 0 short, 1 long, 2 prefixed.
+ */
+static void
+mkkeys(KEYSET *ks, const char *name, int kind)
+{
+	char		key[IDXLEN_MAX + KEYPREFIX_MAX + 1];
+	char		asciiptrlen[PTR_SZ + IDXLEN_SZ + 1];
+	unsigned int	x = 2463534242U;
+	size_t		len;
+	off_t		offset = FREE_OFF + PTR_SZ + NHASH_DEF * PTR_SZ;
+	int		i;
+
+	memset(ks, 0, sizeof(*ks));
+	ks->name = name;
+	if ((ks->db = _db_alloc(0)) == NULL)
+		err_dump("_db_alloc error");
+	ks->db->nhash = NHASH_DEF;
+	ks->db->hashoff = HASH_OFF;
+	if (kind == 2) {
+		strcpy(ks->db->prefix, PREFIX);
+		ks->db->prefixlen = strlen(PREFIX);
+	}
+	for (i = 0; i < NKEYS; i++) {
+		x ^= x << 13;		/* xorshift */
+		x ^= x >> 17;
+		x ^= x << 5;
+		if (kind == 0)
+			sprintf(key, "k%d", i);
+		else if (kind == 1)
+			sprintf(key, "/accounts/%08x/sessions/%08x/events/"
+			    "%010u/attributes/%d", x, x * 2654435761U, x >> 3, i);
+		else
+			sprintf(key, PREFIX "user-%u", x % 1000000);
+		if ((ks->keys[i] = strdup(key)) == NULL)
+			err_dump("strdup error");
+		if (_db_keyenc(ks->db, key) < 0)
+			err_quit("key too long: %s", key);
+		if ((ks->stored[i] = strdup(ks->db->keybuf)) == NULL)
+			err_dump("strdup error");
+
+		/* the record follows the one before in the file, and
+		   its ptr field points to the next on its chain.	*/
+		ks->ptrs[i] = PTR_MAKE(offset, ks->db->keyfp, ks->db->keylen);
+		_db_fmtptr(key, ks->ptrs[i]);
+		memcpy(ks->asciiptrs[i], key, PTR_SZ);
+		ks->db->datoff = offset / 2;
+		ks->db->datlen = 10 + i % 90;
+		ks->db->datcrc = x;
+		len = _db_fmtidx(ks->db, ks->stored[i], asciiptrlen,
+		    i % CHAIN_LEN == CHAIN_LEN - 1 ? 0 : PTR_MAKE(offset +
+		    PTR_SZ + IDXLEN_SZ + ks->db->idxlen + 64, 0, 0));
+		ks->reclens[i] = PTR_SZ + IDXLEN_SZ + len;
+		if ((ks->recs[i] = malloc(ks->reclens[i])) == NULL)
+			err_dump("malloc error");
+		memcpy(ks->recs[i], asciiptrlen, PTR_SZ + IDXLEN_SZ);
+		memcpy(ks->recs[i] + PTR_SZ + IDXLEN_SZ, ks->db->idxbuf, len);
+		offset += ks->reclens[i];
+	}
+	for (i = 0; i < NKEYS; i++) {
+		if (i % CHAIN_LEN == 0 && (ks->runs[i / CHAIN_LEN] =
+		    malloc(CHAIN_LEN * (PTR_SZ + IDXLEN_SZ + IDXLEN_MAX))) == NULL)
+			err_dump("malloc error");
+		memcpy(ks->runs[i / CHAIN_LEN] + ks->runlens[i / CHAIN_LEN],
+		    ks->recs[i], ks->reclens[i]);
+		ks->runlens[i / CHAIN_LEN] += ks->reclens[i];
+	}
+}
+
+static unsigned long
+k_hash(KEYSET *ks, long n)
+{
+	unsigned long	sum = 0;
+	long		i;
+
+	for (i = 0; i < n; i++)
+		sum += _db_hash(ks->db, ks->keys[i & (NKEYS - 1)]);
+	return (sum);
+}
+
+static unsigned long
+k_keyenc(KEYSET *ks, long n)
+{
+	unsigned long	sum = 0;
+	long		i;
+
+	for (i = 0; i < n; i++) {
+		_db_keyenc(ks->db, ks->keys[i & (NKEYS - 1)]);
+		sum += ks->db->keyfp + ks->db->keylen;
+	}
+	return (sum);
+}
+
+static unsigned long
+k_parseptr(KEYSET *ks, long n)
+{
+	unsigned long	sum = 0;
+	long		i;
+
+	for (i = 0; i < n; i++)
+		sum += _db_parseptr(ks->asciiptrs[i & (NKEYS - 1)]);
+	return (sum);
+}
+
+static unsigned long
+k_fmtptr(KEYSET *ks, long n)
+{
+	char		buf[PTR_SZ + 1];
+	unsigned long	sum = 0;
+	long		i;
+
+	for (i = 0; i < n; i++) {
+		_db_fmtptr(buf, ks->ptrs[i & (NKEYS - 1)]);
+		sum += buf[OFF_SZ - 1];
+	}
+	return (sum);
+}
+
+/*
+ * as _db_readidx(), from the ptr field on, once the record is read.
+ */
+static unsigned long
+k_parseidx(KEYSET *ks, long n)
+{
+	char		rec[PTR_SZ + IDXLEN_SZ + IDXLEN_MAX + 1];
+	char		asciilen[IDXLEN_SZ + 1], *idx;
+	unsigned long	sum = 0;
+	unsigned int	datcrc;
+	size_t		idxlen, datlen;
+	off_t		datoff;
+	long		i;
+	int		k;
+
+	idx = rec + PTR_SZ + IDXLEN_SZ;
+	for (i = 0; i < n; i++) {
+		k = i & (NKEYS - 1);
+		memcpy(rec, ks->recs[k], ks->reclens[k]);
+		sum += PTR_OFF(_db_parseptr(rec));
+		memcpy(asciilen, rec + PTR_SZ, IDXLEN_SZ);
+		asciilen[IDXLEN_SZ] = 0;
+		if ((idxlen = atol(asciilen)) < IDXLEN_MIN ||
+		    idxlen > IDXLEN_MAX ||
+		    _db_checkidx(asciilen, idx, idxlen, &datcrc) < 0 ||
+		    _db_splitidx(idx, &datoff, &datlen) != NULL)
+			err_quit("parseidx: damaged record %d", k);
+		sum += datoff + datlen + datcrc;
+	}
+	return (sum);
+}
+
+static unsigned long
+k_fmtidx(KEYSET *ks, long n)
+{
+	char		asciiptrlen[PTR_SZ + IDXLEN_SZ + 1];
+	unsigned long	sum = 0;
+	long		i;
+	int		k;
+
+	for (i = 0; i < n; i++) {
+		k = i & (NKEYS - 1);
+		ks->db->datoff = i;
+		ks->db->datlen = 10 + k % 90;
+		ks->db->datcrc = k;
+		sum += _db_fmtidx(ks->db, ks->stored[k], asciiptrlen,
+		    ks->ptrs[k]);
+	}
+	return (sum);
+}
+
+/*
+ * look each key up on its chain, as _db_find_and_lock() does: a record
+ * whose fingerprint and key length match the key's has its key compared.
+ */
+static unsigned long
+k_walk(KEYSET *ks, long n)
+{
+	DB		*db = ks->db;
+	unsigned long	sum = 0;
+	long		i;
+	int		k, j;
+
+	for (i = 0; i < n; i++) {
+		k = i & (NKEYS - 1);
+		_db_keyenc(db, ks->keys[k]);
+		for (j = k & ~(CHAIN_LEN - 1); ; j++) {
+			if (PTR_FP(ks->ptrs[j]) == db->keyfp &&
+			    PTR_KLEN(ks->ptrs[j]) == db->keylen &&
+			    strcmp(ks->stored[j], db->keybuf) == 0)
+				break;
+		}
+		sum += j;
+	}
+	return (sum);
+}
+
+/*
+ * search the records of a chain, laid end to end as in the index file,
+ * for the last (up to) 4 bytes of the stored key of one of them.
+ */
+static unsigned long
+k_memmem(KEYSET *ks, long n)
+{
+	const char	*key, *hit;
+	unsigned long	sum = 0;
+	size_t		len;
+	long		i;
+	int		k;
+
+	for (i = 0; i < n; i++) {
+		k = i & (NKEYS - 1);
+		len = strlen(ks->stored[k]);
+		key = ks->stored[k] + (len > 4 ? len - 4 : 0);
+		if ((hit = _db_memmem(ks->runs[k / CHAIN_LEN],
+		    ks->runlens[k / CHAIN_LEN], key, len > 4 ? 4 : len)) == NULL)
+			err_quit("memmem: key %d not found", k);
+		sum += hit - ks->runs[k / CHAIN_LEN];
+	}
+	return (sum);
+}
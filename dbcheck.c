@@ -0,0 +1,81 @@
+#include "lib.h"
+#include "db.h"
+
+/*
+ * dbcheck: check a database, and rebuild it from what is intact.
+ *
+ *	dbcheck [-q] [-j threads] [-r newname] name
+ *
+ * every hash chain and the free list are walked, every index record is
+ * checked, and the data record of every live one against it (see
+ * db_check()). each problem is printed, a line each, then the counts.
+ * -j sets the threads used for each shard, one per cpu by default.
+ * -r makes a new database, newname, of the records that are intact
+ * (see db_rebuild()), whatever state their chains are in; it is created
+ * as the database was. -q prints only the counts.
+ * the database is opened read only, so a crash is not recovered from
+ * first; a writer's open replays the log of a database that has one.
+ * exits 0 if nothing is damaged, 1 if something is.
+ */
+
+static void	problem(void *, const char *);
+static void	usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	DBHANDLE	db;
+	DBCHECK		res;
+	char		*newname = NULL;
+	int		c, quiet = 0, rc;
+
+	memset(&res, 0, sizeof(res));
+	while ((c = getopt(argc, argv, "j:qr:")) != EOF) {
+		switch (c) {
+		case 'j':
+			res.nthreads = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'r':
+			newname = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	if ((db = db_open(argv[optind], O_RDONLY)) == NULL)
+		err_sys("can't open %s", argv[optind]);
+	if (!quiet)
+		res.fn = problem;
+	if (newname != NULL) {
+		if (db_rebuild(db, newname, NULL, &res) < 0)
+			err_sys("can't rebuild %s as %s", argv[optind], newname);
+		rc = res.nbad > 0 ? -1 : 0;
+	} else
+		rc = db_check(db, &res);
+	db_close(db);
+
+	printf("%llu live, %llu dead, %llu free, %llu on no chain, "
+	    "%llu problems\n", res.nrecs, res.ndead, res.nfree, res.nlost,
+	    res.nbad);
+	if (newname != NULL)
+		printf("%llu records in %s\n", res.nrebuilt, newname);
+	exit(rc < 0 ? 1 : 0);
+}
+
+static void
+usage(void)
+{
+	err_quit("usage: dbcheck [-q] [-j threads] [-r newname] name");
+}
+
+static void
+problem(void *arg, const char *what)
+{
+	printf("%s\n", what);
+}
@@ -0,0 +1,263 @@
+#include "lib.h"
+#include "dbclnt.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define OBUF_MAX	(64 * 1024)	/* send queued requests past this */
+
+/*
+ * a request sent, or queued to be, that has no reply yet.
+ */
+typedef struct {
+	uint32_t	id;
+	DBAIOFN		fn;
+	void		*arg;
+} DBCWAIT;
+
+/*
+ * library's private representation of a connection.
+ */
+typedef struct {
+	int	fd;		/* socket to the server */
+	char	*obuf;		/* malloc'ed requests not yet sent */
+	size_t	olen;		/* bytes in obuf */
+	size_t	osize;		/* size of obuf */
+	DBCWAIT	*wait;		/* malloc'ed ring of requests with no reply */
+	int	nwait;		/* requests in wait */
+	int	waithead;	/* oldest of them */
+	int	waitsize;	/* size of wait */
+	uint32_t nextid;	/* id of the next request */
+	int	rc;		/* rc of the last synchronous call */
+	int	found;		/* fetch of the last synchronous call found it */
+	char	data[DATALEN_MAX + 1];	/* data of the last reply */
+} DBC;
+
+static int	_dbc_queue(DBC *, int, int, const char *, const char *,
+		    DBAIOFN, void *);
+static void	_dbc_done(void *, int, char *);
+static int	_dbc_flush(DBC *);
+static int	_dbc_call(DBC *, int, int, const char *, const char *);
+
+/*
+ * connect to the server listening on the unix domain socket at path.
+ */
+DBCHANDLE
+dbc_open(const char *path)
+{
+	DBC	*dbc;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return (NULL);
+	}
+	if ((dbc = calloc(1, sizeof(DBC))) == NULL)
+		err_dump("dbc_open: calloc error");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((dbc->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(dbc->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		if (dbc->fd >= 0)
+			close(dbc->fd);
+		free(dbc);
+		return (NULL);
+	}
+	return (dbc);
+}
+
+/*
+ * wait for the replies still to come, and disconnect.
+ */
+void
+dbc_close(DBCHANDLE h)
+{
+	DBC	*dbc = h;
+
+	dbc_wait(dbc, dbc->nwait);
+	close(dbc->fd);
+	if (dbc->obuf != NULL)
+		free(dbc->obuf);
+	if (dbc->wait != NULL)
+		free(dbc->wait);
+	free(dbc);
+}
+
+/*
+ * fetch a record, as db_fetch() does. the data is valid until the
+ * next call.
+ */
+char *
+dbc_fetch(DBCHANDLE h, const char *key)
+{
+	DBC	*dbc = h;
+
+	if (_dbc_call(dbc, DBP_FETCH, 0, key, NULL) < 0 || !dbc->found)
+		return (NULL);
+	return (dbc->data);
+}
+
+int
+dbc_store(DBCHANDLE h, const char *key, const char *data, int flag)
+{
+	return (_dbc_call(h, DBP_STORE, flag, key, data));
+}
+
+int
+dbc_delete(DBCHANDLE h, const char *key)
+{
+	return (_dbc_call(h, DBP_DELETE, 0, key, NULL));
+}
+
+/*
+ * make everything the server has done for us durable.
+ */
+int
+dbc_sync(DBCHANDLE h)
+{
+	return (_dbc_call(h, DBP_SYNC, 0, "", NULL));
+}
+
+int
+dbc_fetch_async(DBCHANDLE h, const char *key, DBAIOFN fn, void *arg)
+{
+	return (_dbc_queue(h, DBP_FETCH, 0, key, NULL, fn, arg));
+}
+
+int
+dbc_store_async(DBCHANDLE h, const char *key, const char *data, int flag,
+    DBAIOFN fn, void *arg)
+{
+	return (_dbc_queue(h, DBP_STORE, flag, key, data, fn, arg));
+}
+
+int
+dbc_delete_async(DBCHANDLE h, const char *key, DBAIOFN fn, void *arg)
+{
+	return (_dbc_queue(h, DBP_DELETE, 0, key, NULL, fn, arg));
+}
+
+/*
+ * send the queued requests, and handle replies until at least min of
+ * them have come back, or none are left. returns the number handled,
+ * or -1 if the connection failed.
+ */
+int
+dbc_wait(DBCHANDLE h, int min)
+{
+	DBC	*dbc = h;
+	DBCWAIT	*w;
+	DBPREP	rep;
+	int	n;
+
+	if (_dbc_flush(dbc) < 0)
+		return (-1);
+	for (n = 0; n < min && dbc->nwait > 0; n++) {
+		if (readn(dbc->fd, &rep, sizeof(rep)) != sizeof(rep) ||
+		    rep.len > DATALEN_MAX ||
+		    readn(dbc->fd, dbc->data, rep.len) != rep.len)
+			return (-1);
+		dbc->data[rep.len] = 0;
+		w = &dbc->wait[dbc->waithead];
+		if (rep.id != w->id)
+			err_quit("dbc_wait: reply %u to request %u", rep.id, w->id);
+		dbc->waithead = (dbc->waithead + 1) % dbc->waitsize;
+		dbc->nwait--;
+		if (w->fn != NULL)
+			(*w->fn)(w->arg, rep.rc, rep.len > 0 ? dbc->data : NULL);
+	}
+	return (n);
+}
+
+/*
+ * make a request and wait for its reply, and all before it.
+ */
+static int
+_dbc_call(DBC *dbc, int op, int flag, const char *key, const char *data)
+{
+	if (_dbc_queue(dbc, op, flag, key, data, _dbc_done, dbc) < 0 ||
+	    dbc_wait(dbc, dbc->nwait) < 0)
+		return (-1);
+	return (dbc->rc);
+}
+
+static void
+_dbc_done(void *arg, int rc, char *data)
+{
+	DBC	*dbc = arg;
+
+	dbc->rc = rc;
+	dbc->found = data != NULL;
+}
+
+/*
+ * add a request to the output buffer, sending the buffer if it is full.
+ */
+static int
+_dbc_queue(DBC *dbc, int op, int flag, const char *key, const char *data,
+    DBAIOFN fn, void *arg)
+{
+	DBPREQ	req;
+	DBCWAIT	*w;
+	size_t	keylen, datlen, need;
+	int	i;
+
+	keylen = strlen(key);
+	datlen = data != NULL ? strlen(data) : 0;
+	if (keylen > IDXLEN_MAX || datlen + 1 > DATALEN_MAX ||
+	    (op == DBP_STORE && datlen + 1 < DATALEN_MIN)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/* remember what to call with the reply.	*/
+	if (dbc->nwait == dbc->waitsize) {
+		i = dbc->waitsize > 0 ? dbc->waitsize * 2 : 64;
+		if ((w = malloc(i * sizeof(DBCWAIT))) == NULL)
+			err_dump("_dbc_queue: malloc error");
+		for (need = 0; need < dbc->nwait; need++)
+			w[need] = dbc->wait[(dbc->waithead + need) % dbc->waitsize];
+		free(dbc->wait);
+		dbc->wait = w;
+		dbc->waitsize = i;
+		dbc->waithead = 0;
+	}
+	w = &dbc->wait[(dbc->waithead + dbc->nwait++) % dbc->waitsize];
+	w->id = dbc->nextid++;
+	w->fn = fn;
+	w->arg = arg;
+
+	req.len = keylen + datlen;
+	req.id = w->id;
+	req.keylen = keylen;
+	req.op = op;
+	req.flag = flag;
+	need = dbc->olen + sizeof(req) + req.len;
+	if (need > dbc->osize) {
+		dbc->osize = need > 2 * dbc->osize ? need : 2 * dbc->osize;
+		if ((dbc->obuf = realloc(dbc->obuf, dbc->osize)) == NULL)
+			err_dump("_dbc_queue: realloc error");
+	}
+	memcpy(dbc->obuf + dbc->olen, &req, sizeof(req));
+	memcpy(dbc->obuf + dbc->olen + sizeof(req), key, keylen);
+	if (datlen > 0)
+		memcpy(dbc->obuf + dbc->olen + sizeof(req) + keylen, data, datlen);
+	dbc->olen = need;
+	if (dbc->olen >= OBUF_MAX)
+		return (_dbc_flush(dbc));
+	return (0);
+}
+
+/*
+ * send what is in the output buffer. the server never stops reading
+ * to write, so this can't deadlock with replies we haven't read.
+ */
+static int
+_dbc_flush(DBC *dbc)
+{
+	if (dbc->olen > 0 && writen(dbc->fd, dbc->obuf, dbc->olen) != dbc->olen)
+		return (-1);
+	dbc->olen = 0;
+	return (0);
+}
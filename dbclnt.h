@@ -0,0 +1,52 @@
+#ifndef _DBCLNT_H
+#define _DBCLNT_H
+
+#include <stdint.h>
+#include "db.h"
+
+/*
+ * client of dbsrv, the server that owns a database and serves it over a
+ * unix domain socket. the calls mirror db_fetch() and friends; the _async
+ * ones queue a request and return, so many can be in flight at once.
+ */
+typedef	void * DBCHANDLE;
+
+DBCHANDLE	dbc_open(const char *);
+void		dbc_close(DBCHANDLE);
+char		*dbc_fetch(DBCHANDLE, const char *);
+int		dbc_store(DBCHANDLE, const char *, const char *, int);
+int		dbc_delete(DBCHANDLE, const char *);
+int		dbc_sync(DBCHANDLE);
+int		dbc_fetch_async(DBCHANDLE, const char *, DBAIOFN, void *);
+int		dbc_store_async(DBCHANDLE, const char *, const char *, int,
+		    DBAIOFN, void *);
+int		dbc_delete_async(DBCHANDLE, const char *, DBAIOFN, void *);
+int		dbc_wait(DBCHANDLE, int);
+
+/*
+ * the protocol. a request is a DBPREQ followed by len bytes: the key,
+ * then for a store the data. a reply is a DBPREP followed by len bytes
+ * of data, for a fetch that found its key. replies come back in the
+ * order the requests were sent. both ends are on the same host, so
+ * integers are in host byte order.
+ */
+#define DBP_FETCH	1
+#define DBP_STORE	2
+#define DBP_DELETE	3
+#define DBP_SYNC	4
+
+typedef struct {
+	uint32_t	len;		/* bytes that follow */
+	uint32_t	id;		/* returned in the reply */
+	uint16_t	keylen;		/* bytes of key at the front */
+	uint8_t		op;		/* DBP_xxx */
+	uint8_t		flag;		/* db_store() flag */
+} DBPREQ;
+
+typedef struct {
+	uint32_t	len;		/* bytes that follow */
+	uint32_t	id;		/* of the request */
+	int32_t		rc;		/* what the db_xxx call returned */
+} DBPREP;
+
+#endif /* _DBCLNT_H */
@@ -0,0 +1,325 @@
+#include "lib.h"
+#include "db.h"
+
+#include <time.h>
+
+/*
+ * dbfollow: keep a replica of a database up to date from its replication
+ * log (see DBREPREC in db.h).
+ *
+ *	dbfollow [-1v] [-i msec] [-n nhash] primary replica
+ *	dbfollow -s replica
+ *
+ * the replica is an ordinary database, which readers open read only.
+ * we apply the records of <primary>.rep to it in order, and after each
+ * batch sync it and save in <replica>.pos how far into the log we have
+ * got, and how far behind the primary we were. the replica is synced
+ * first, so the position saved is never ahead of what it holds.
+ * we copy the primary to a replica that has no position, and again if
+ * the log is shorter than the position (the primary was recreated) or
+ * damaged. changes made during a copy are applied again from the log
+ * afterwards; applying a store or delete twice does no harm.
+ * -1 exits once caught up; -v prints the lag after each batch; -s
+ * prints the lag a running dbfollow last saved. -n is used if the
+ * replica is created.
+ */
+
+#define INTERVAL_DEF	100	/* msec to wait at the end of the log */
+#define BATCH_MAX	1000	/* records applied between syncs */
+
+/*
+ * <replica>.pos: a line of fixed width fields, rewritten in place.
+ */
+#define POS_FMT		"%20lld %20lld %20lld %20lld\n"
+#define POS_SZ		(4 * 21)
+
+typedef struct {
+	long long	offset;		/* log applied up to here */
+	long long	logsize;	/* log size when we last looked */
+	long long	oldest;		/* usec of the first change not applied, */
+					/* 0 if none */
+	long long	saved;		/* usec this was saved */
+} POS;
+
+static DBHANDLE	replica;
+static int	logfd;
+static int	posfd;
+static POS	pos;
+static char	*buf;		/* a record, its key and its data */
+static char	key[IDXLEN_MAX + KEYPREFIX_MAX + 1];
+
+static int	apply(int);
+static void	copy(const char *);
+static long long now(void);
+static void	print_lag(const POS *);
+static int	readrec(off_t, off_t, DBREPREC *);
+static void	savepos(off_t);
+static void	status(const char *);
+static void	usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct stat	statbuff;
+	DBOPTS	opts;
+	char	*name;
+	char	line[POS_SZ + 1];
+	int	c, n, once = 0, verbose = 0, interval = INTERVAL_DEF, sflag = 0;
+
+	memset(&opts, 0, sizeof(opts));
+	while ((c = getopt(argc, argv, "1i:n:sv")) != EOF) {
+		switch (c) {
+		case '1':
+			once = 1;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'n':
+			opts.nhash = atol(optarg);
+			break;
+		case 's':
+			sflag = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (sflag) {
+		if (argc - optind != 1)
+			usage();
+		status(argv[optind]);
+		exit(0);
+	}
+	if (argc - optind != 2)
+		usage();
+
+	if ((name = malloc(strlen(argv[optind]) + strlen(argv[optind + 1]) +
+	    5)) == NULL || (buf = malloc(sizeof(DBREPREC) + KEYPREFIX_MAX +
+	    IDXLEN_MAX + DATALEN_MAX + 1)) == NULL)
+		err_dump("malloc error");
+	sprintf(name, "%s.rep", argv[optind]);
+	if ((logfd = open(name, O_RDONLY)) < 0)
+		err_sys("can't open %s", name);
+	if ((replica = db_openopt(argv[optind + 1], O_RDWR, 0, &opts)) == NULL &&
+	    (errno != ENOENT || (replica = db_openopt(argv[optind + 1],
+	    O_RDWR | O_CREAT | O_TRUNC, 0644, &opts)) == NULL))
+		err_sys("can't open replica %s", argv[optind + 1]);
+	sprintf(name, "%s.pos", argv[optind + 1]);
+	if ((posfd = open(name, O_RDWR | O_CREAT, 0644)) < 0)
+		err_sys("can't open %s", name);
+	if (write_lock(posfd, 0, SEEK_SET, 0) < 0)
+		err_quit("%s is being followed already", argv[optind + 1]);
+	if (pread(posfd, line, POS_SZ, 0) != POS_SZ ||
+	    (line[POS_SZ] = 0, sscanf(line, "%lld", &pos.offset)) != 1)
+		pos.offset = -1;	/* a new replica */
+
+	for ( ; ; ) {
+		if (fstat(logfd, &statbuff) < 0)
+			err_sys("fstat error");
+		if (pos.offset < 0 || statbuff.st_size < pos.offset)
+			copy(argv[optind]);
+		if ((n = apply(BATCH_MAX)) < 0)
+			copy(argv[optind]);	/* the log is damaged */
+		else if (n > 0 || pos.logsize != statbuff.st_size) {
+			db_sync(replica);
+			savepos(statbuff.st_size);
+			if (verbose)
+				print_lag(&pos);
+		}
+		if (n == 0) {
+			if (once)
+				break;
+			usleep(interval * 1000);
+		}
+	}
+	db_close(replica);
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	err_quit("usage: dbfollow [-1v] [-i msec] [-n nhash] primary replica\n"
+	    "       dbfollow -s replica");
+}
+
+static long long
+now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/*
+ * read the record at offset into buf, if it is all in the first size
+ * bytes of the log. returns 1 if so, 0 if not (it is still being
+ * written), -1 if it is damaged.
+ */
+static int
+readrec(off_t offset, off_t size, DBREPREC *rec)
+{
+	unsigned int	crc;
+	size_t		len;
+
+	if (offset + sizeof(*rec) > size)
+		return (0);
+	if (pread(logfd, rec, sizeof(*rec), offset) != sizeof(*rec))
+		err_sys("read error of log");
+	if (rec->magic != DBREP_MAGIC || rec->keylen == 0 ||
+	    rec->keylen > IDXLEN_MAX + KEYPREFIX_MAX ||
+	    rec->datlen > DATALEN_MAX)
+		return (-1);
+	len = rec->keylen + rec->datlen;
+	if (offset + sizeof(*rec) + len > size)
+		return (0);
+	if (pread(logfd, buf, len, offset + sizeof(*rec)) != len)
+		err_sys("read error of log");
+	crc = rec->crc;
+	rec->crc = 0;
+	if (crc32c(crc32c(0, rec, sizeof(*rec)), buf, len) != crc)
+		return (-1);
+	return (1);
+}
+
+/*
+ * apply up to max records from the position in the log on. returns the
+ * number applied, or -1 if the log is damaged.
+ */
+static int
+apply(int max)
+{
+	struct stat	statbuff;
+	DBREPREC	rec;
+	int		n, rc;
+
+	if (fstat(logfd, &statbuff) < 0)
+		err_sys("fstat error");
+	for (n = 0; n < max; n++) {
+		if ((rc = readrec(pos.offset, statbuff.st_size, &rec)) <= 0)
+			return (rc < 0 ? -1 : n);
+		memcpy(key, buf, rec.keylen);
+		key[rec.keylen] = 0;
+		buf[rec.keylen + rec.datlen] = 0;
+		if (rec.op == DBREP_STORE) {
+			if (rec.datlen == 0 ||
+			    db_store(replica, key, buf + rec.keylen, DB_STORE) < 0)
+				return (-1);
+		} else if (rec.op == DBREP_DELETE)
+			db_delete(replica, key);	/* may be gone already */
+		else
+			return (-1);
+		pos.offset += sizeof(rec) + rec.keylen + rec.datlen;
+	}
+	return (n);
+}
+
+/*
+ * make the replica a copy of the primary, and start applying the log from
+ * where it ended when we began.
+ */
+static void
+copy(const char *primary)
+{
+	struct stat	statbuff;
+	DBHANDLE	db;
+	char		**keys = NULL, *data;
+	size_t		i, nkeys = 0, maxkeys = 0;
+
+	if (fstat(logfd, &statbuff) < 0)
+		err_sys("fstat error");
+	pos.offset = statbuff.st_size;
+	if ((db = db_open(primary, O_RDONLY)) == NULL)
+		err_sys("can't open %s", primary);
+
+	/* store what differs, then delete what the primary doesn't have.
+	   the replica is never emptied, so its readers can carry on.	*/
+	while ((data = db_nextrec(db, key)) != NULL) {
+		if ((data = strdup(data)) == NULL)
+			err_dump("strdup error");
+		if (db_store(replica, key, data, DB_INSERT) == 1 &&
+		    strcmp(db_fetch(replica, key), data) != 0)
+			db_store(replica, key, data, DB_REPLACE);
+		free(data);
+	}
+	db_rewind(replica);
+	while (db_nextrec(replica, key) != NULL) {
+		if (nkeys == maxkeys) {
+			maxkeys = maxkeys > 0 ? 2 * maxkeys : 1024;
+			if ((keys = realloc(keys, maxkeys * sizeof(char *))) == NULL)
+				err_dump("realloc error");
+		}
+		if ((keys[nkeys++] = strdup(key)) == NULL)
+			err_dump("strdup error");
+	}
+	for (i = 0; i < nkeys; i++) {
+		if (db_fetch(db, keys[i]) == NULL)
+			db_delete(replica, keys[i]);
+		free(keys[i]);
+	}
+	free(keys);
+	db_close(db);
+	db_sync(replica);
+	savepos(statbuff.st_size);
+}
+
+/*
+ * save our position, and how far behind the primary's log of size bytes
+ * it is.
+ */
+static void
+savepos(off_t size)
+{
+	DBREPREC	rec;
+	char		line[POS_SZ + 1];
+
+	pos.logsize = size;
+	pos.oldest = 0;
+	if (pos.offset < size && pread(logfd, &rec, sizeof(rec), pos.offset) ==
+	    sizeof(rec) && rec.magic == DBREP_MAGIC)
+		pos.oldest = rec.usec;
+	pos.saved = now();
+	sprintf(line, POS_FMT, pos.offset, pos.logsize, pos.oldest, pos.saved);
+	if (pwrite(posfd, line, POS_SZ, 0) != POS_SZ)
+		err_sys("write error of position");
+}
+
+static void
+print_lag(const POS *p)
+{
+	printf("%lld bytes behind, %lld ms", p->logsize - p->offset,
+	    p->oldest > 0 ? (p->saved - p->oldest) / 1000 : 0LL);
+	if (p->saved > 0)
+		printf(", as of %lld ms ago", (now() - p->saved) / 1000);
+	printf("\n");
+	fflush(stdout);
+}
+
+/*
+ * print the lag the dbfollow of the replica last saved.
+ */
+static void
+status(const char *name)
+{
+	char	*path, line[POS_SZ + 1];
+	int	fd;
+	POS	p;
+
+	if ((path = malloc(strlen(name) + 5)) == NULL)
+		err_dump("malloc error");
+	sprintf(path, "%s.pos", name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		err_sys("can't open %s", path);
+	if (pread(fd, line, POS_SZ, 0) != POS_SZ ||
+	    (line[POS_SZ] = 0, sscanf(line, "%lld %lld %lld %lld", &p.offset,
+	    &p.logsize, &p.oldest, &p.saved)) != 4)
+		err_quit("%s: no position saved yet", path);
+	print_lag(&p);
+	free(path);
+	close(fd);
+}
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE		/* accept4() */
+#include "lib.h"
+#include "dbclnt.h"
+
+#include <stddef.h>		/* offsetof */
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * dbsrv: own a database and serve it to clients (see dbclnt.h) over a
+ * unix domain socket.
+ *
+ *	dbsrv [-b bytes] [-d] [-n shards] [-s sync] [-t n] [-w] database socket
+ *
+ * each pass of the event loop reads what every ready client has sent,
+ * runs all the complete requests as one batch, then writes the replies.
+ * a run of fetches, or of stores with the same flag, goes to
+ * db_fetch_batch() or db_store_batch(), which work on the shards of a
+ * sharded database in parallel. with -d the replies to a batch that
+ * changed anything wait for one db_sync(), so each client's changes are
+ * durable when it hears of them at the cost of one sync per batch;
+ * crash safety then needs a database with a write-ahead log (-w).
+ * -n, -s and -w are used if the database is created. -t traces one
+ * call in n for dbtrace. -b holds up to bytes of stores in a write
+ * buffer, so a key rewritten often is written to the files once a
+ * flush; when the clients go quiet the buffer is flushed.
+ */
+
+#define NEVENTS		64	/* events handled per epoll_wait() */
+#define IBUF_SZ		(64 * 1024)	/* read this much at a time */
+#define IDLE_MS		1000	/* with -b, flush after this long idle */
+
+/*
+ * a connected client.
+ */
+typedef struct client {
+	int	fd;
+	char	*ibuf;		/* malloc'ed bytes read, not yet parsed */
+	size_t	ilen;		/* bytes in ibuf */
+	size_t	isize;		/* size of ibuf */
+	char	*obuf;		/* malloc'ed replies not yet written */
+	size_t	olen;		/* bytes in obuf */
+	size_t	osize;		/* size of obuf */
+	int	pollout;	/* we asked epoll for EPOLLOUT */
+	int	nreq;		/* its requests in the batch */
+	int	closed;		/* free once its requests are done */
+	struct client *next;	/* on the list of clients */
+} CLIENT;
+
+/*
+ * a request in the batch. the key, then the data, follow null terminated.
+ */
+typedef struct {
+	CLIENT	*cl;
+	DBPREQ	hdr;
+	int	rc;
+	char	*reply;		/* malloc'ed data fetched, or NULL */
+	char	*data;		/* in buf, after the key */
+	char	buf[];		/* the key */
+} REQ;
+
+static DBHANDLE	db;
+static int	epfd;
+static int	durable;	/* -d */
+static CLIENT	*clients;
+static REQ	**batch;	/* requests to run */
+static int	nbatch;
+static int	batchsize;
+static volatile sig_atomic_t quit;
+
+static void	accept_clients(int);
+static void	client_close(CLIENT *);
+static void	client_flush(CLIENT *);
+static int	client_read(CLIENT *);
+static int	fetched(void *, const char *, const char *);
+static void	reply(REQ *);
+static void	run_batch(void);
+static void	sig_quit(int);
+static void	usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct epoll_event ev[NEVENTS], e;
+	struct sockaddr_un addr;
+	DBOPTS	opts;
+	CLIENT	*cl, **clp;
+	int	c, i, n, listenfd, timeout = -1;
+
+	memset(&opts, 0, sizeof(opts));
+	while ((c = getopt(argc, argv, "b:dn:s:t:w")) != EOF) {
+		switch (c) {
+		case 'b':
+			opts.wbuf = strtoul(optarg, NULL, 0);
+			timeout = IDLE_MS;
+			break;
+		case 'd':
+			durable = 1;
+			break;
+		case 'n':
+			opts.nshards = atoi(optarg);
+			break;
+		case 's':
+			opts.sync = atoi(optarg);
+			break;
+		case 't':
+			opts.trace = atoi(optarg);
+			break;
+		case 'w':
+			opts.wal = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 2)
+		usage();
+	if (durable)
+		opts.sync = DB_SYNC_NONE;	/* we sync each batch */
+
+	if ((db = db_openopt(argv[optind], O_RDWR, 0, &opts)) == NULL &&
+	    (errno != ENOENT || (db = db_openopt(argv[optind],
+	    O_RDWR | O_CREAT | O_TRUNC, 0644, &opts)) == NULL))
+		err_sys("can't open database %s", argv[optind]);
+
+	if (strlen(argv[optind + 1]) >= sizeof(addr.sun_path))
+		err_quit("socket name too long");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[optind + 1]);
+	unlink(addr.sun_path);
+	if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		err_sys("socket error");
+	if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		err_sys("bind error for %s", addr.sun_path);
+	if (listen(listenfd, SOMAXCONN) < 0)
+		err_sys("listen error");
+
+	if ((epfd = epoll_create1(0)) < 0)
+		err_sys("epoll_create1 error");
+	e.events = EPOLLIN;
+	e.data.ptr = NULL;		/* the listening socket */
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &e) < 0)
+		err_sys("epoll_ctl error");
+	Signal(SIGPIPE, SIG_IGN);
+	Signal(SIGINT, sig_quit);
+	Signal(SIGTERM, sig_quit);
+
+	while (!quit) {
+		if ((n = epoll_wait(epfd, ev, NEVENTS, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys("epoll_wait error");
+		}
+		if (n == 0)
+			db_flush(db);	/* idle */
+		for (i = 0; i < n; i++) {
+			if ((cl = ev[i].data.ptr) == NULL) {
+				accept_clients(listenfd);
+				continue;
+			}
+			if (ev[i].events & EPOLLOUT)
+				client_flush(cl);
+			if ((ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			    !cl->closed && client_read(cl) < 0)
+				client_close(cl);
+		}
+		run_batch();
+
+		/* send the replies, and free clients that went away.	*/
+		for (clp = &clients; (cl = *clp) != NULL; ) {
+			if (!cl->closed)
+				client_flush(cl);
+			if (cl->closed) {
+				*clp = cl->next;
+				close(cl->fd);
+				free(cl->ibuf);
+				free(cl->obuf);
+				free(cl);
+			} else
+				clp = &cl->next;
+		}
+	}
+	unlink(addr.sun_path);
+	db_close(db);
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	err_quit("usage: dbsrv [-b bytes] [-d] [-n shards] [-s sync] [-t n] [-w] "
+	    "database socket");
+}
+
+static void
+sig_quit(int signo)
+{
+	quit = 1;
+}
+
+static void
+accept_clients(int listenfd)
+{
+	struct epoll_event e;
+	CLIENT	*cl;
+	int	fd;
+
+	while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		if ((cl = calloc(1, sizeof(CLIENT))) == NULL)
+			err_dump("accept_clients: calloc error");
+		cl->fd = fd;
+		e.events = EPOLLIN;
+		e.data.ptr = cl;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) < 0)
+			err_sys("epoll_ctl error");
+		cl->next = clients;
+		clients = cl;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+		err_ret("accept error");
+}
+
+/*
+ * the client is gone, or broke the protocol. it is freed after the batch,
+ * which may still have requests of its.
+ */
+static void
+client_close(CLIENT *cl)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, cl->fd, NULL);
+	cl->closed = 1;
+}
+
+/*
+ * read what the client has sent, and add each complete request to the
+ * batch. returns -1 at EOF, on error, or for a malformed request.
+ */
+static int
+client_read(CLIENT *cl)
+{
+	DBPREQ	hdr;
+	REQ	*req;
+	ssize_t	n;
+	size_t	off, datlen;
+
+	for ( ; ; ) {
+		if (cl->isize - cl->ilen < IBUF_SZ) {
+			cl->isize = cl->ilen + IBUF_SZ;
+			if ((cl->ibuf = realloc(cl->ibuf, cl->isize)) == NULL)
+				err_dump("client_read: realloc error");
+		}
+		if ((n = read(cl->fd, cl->ibuf + cl->ilen, IBUF_SZ)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
+		if (n == 0)
+			return (-1);
+		cl->ilen += n;
+	}
+
+	for (off = 0; off + sizeof(hdr) <= cl->ilen; off += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, cl->ibuf + off, sizeof(hdr));
+		datlen = hdr.len - hdr.keylen;
+		if (hdr.keylen > hdr.len || hdr.keylen > IDXLEN_MAX ||
+		    datlen + 1 > DATALEN_MAX || hdr.op < DBP_FETCH ||
+		    hdr.op > DBP_SYNC ||
+		    (hdr.op == DBP_STORE && datlen + 1 < DATALEN_MIN))
+			return (-1);
+		if (off + sizeof(hdr) + hdr.len > cl->ilen)
+			break;		/* the rest is still to come */
+
+		if ((req = malloc(sizeof(REQ) + hdr.len + 2)) == NULL)
+			err_dump("client_read: malloc error");
+		req->cl = cl;
+		req->hdr = hdr;
+		req->rc = -1;
+		req->reply = NULL;
+		memcpy(req->buf, cl->ibuf + off + sizeof(hdr), hdr.keylen);
+		req->buf[hdr.keylen] = 0;
+		req->data = req->buf + hdr.keylen + 1;
+		memcpy(req->data, cl->ibuf + off + sizeof(hdr) + hdr.keylen, datlen);
+		req->data[datlen] = 0;
+		if (nbatch == batchsize) {
+			batchsize = batchsize > 0 ? 2 * batchsize : 256;
+			if ((batch = realloc(batch, batchsize * sizeof(REQ *))) == NULL)
+				err_dump("client_read: realloc error");
+		}
+		batch[nbatch++] = req;
+		cl->nreq++;
+	}
+	memmove(cl->ibuf, cl->ibuf + off, cl->ilen - off);
+	cl->ilen -= off;
+	return (0);
+}
+
+/*
+ * run the batch, in order but a run of the same kind of request at a time,
+ * and queue the replies.
+ */
+static void
+run_batch(void)
+{
+	const char **keys, **data;
+	int	*rc, i, j, k, op, changed = 0;
+
+	if (nbatch == 0)
+		return;
+	keys = malloc(nbatch * sizeof(char *));
+	data = malloc(nbatch * sizeof(char *));
+	rc = malloc(nbatch * sizeof(int));
+	if (keys == NULL || data == NULL || rc == NULL)
+		err_dump("run_batch: malloc error");
+
+	for (i = 0; i < nbatch; i = j) {
+		op = batch[i]->hdr.op;
+		for (j = i + 1; j < nbatch && batch[j]->hdr.op == op &&
+		    (op != DBP_STORE || batch[j]->hdr.flag == batch[i]->hdr.flag);
+		    j++)
+			;
+		for (k = i; k < j; k++) {
+			keys[k - i] = batch[k]->buf;
+			data[k - i] = batch[k]->data;
+		}
+		switch (op) {
+		case DBP_FETCH:
+			db_fetch_batch(db, keys, j - i, fetched, NULL);
+			break;
+		case DBP_STORE:
+			db_store_batch(db, keys, data, j - i, batch[i]->hdr.flag, rc);
+			for (k = i; k < j; k++)
+				batch[k]->rc = rc[k - i];
+			changed = 1;
+			break;
+		case DBP_DELETE:
+			for (k = i; k < j; k++)
+				batch[k]->rc = db_delete(db, batch[k]->buf);
+			changed = 1;
+			break;
+		case DBP_SYNC:
+			db_sync(db);
+			for (k = i; k < j; k++)
+				batch[k]->rc = 0;
+			changed = 0;
+			break;
+		}
+	}
+	if (durable && changed)
+		db_sync(db);
+
+	for (i = 0; i < nbatch; i++) {
+		reply(batch[i]);
+		free(batch[i]->reply);
+		free(batch[i]);
+	}
+	nbatch = 0;
+	free(keys);
+	free(data);
+	free(rc);
+}
+
+/*
+ * db_fetch_batch() hands us back our own key pointers, so we can find
+ * the request. it may call us from a thread per shard at once, but each
+ * request is only found once.
+ */
+static int
+fetched(void *arg, const char *key, const char *data)
+{
+	REQ	*req = (REQ *) (key - offsetof(REQ, buf));
+
+	req->rc = 0;
+	if ((req->reply = strdup(data)) == NULL)
+		err_dump("fetched: strdup error");
+	return (0);
+}
+
+/*
+ * queue the reply to a request on its client.
+ */
+static void
+reply(REQ *req)
+{
+	CLIENT	*cl = req->cl;
+	DBPREP	rep;
+	size_t	need;
+
+	cl->nreq--;
+	if (cl->closed)
+		return;
+	rep.len = req->reply != NULL ? strlen(req->reply) : 0;
+	rep.id = req->hdr.id;
+	rep.rc = req->rc;
+	need = cl->olen + sizeof(rep) + rep.len;
+	if (need > cl->osize) {
+		cl->osize = need > 2 * cl->osize ? need : 2 * cl->osize;
+		if ((cl->obuf = realloc(cl->obuf, cl->osize)) == NULL)
+			err_dump("reply: realloc error");
+	}
+	memcpy(cl->obuf + cl->olen, &rep, sizeof(rep));
+	if (rep.len > 0)
+		memcpy(cl->obuf + cl->olen + sizeof(rep), req->reply, rep.len);
+	cl->olen = need;
+}
+
+/*
+ * write what we can of the client's replies. if some are left, ask to
+ * hear when the socket can take more.
+ */
+static void
+client_flush(CLIENT *cl)
+{
+	struct epoll_event e;
+	ssize_t	n;
+	size_t	off = 0;
+
+	while (off < cl->olen) {
+		if ((n = write(cl->fd, cl->obuf + off, cl->olen - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client_close(cl);
+			break;
+		}
+		off += n;
+	}
+	memmove(cl->obuf, cl->obuf + off, cl->olen - off);
+	cl->olen -= off;
+	if (cl->closed || (cl->olen > 0) == cl->pollout)
+		return;
+	cl->pollout = cl->olen > 0;
+	e.events = EPOLLIN | (cl->pollout ? EPOLLOUT : 0);
+	e.data.ptr = cl;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &e) < 0)
+		err_sys("epoll_ctl error");
+}
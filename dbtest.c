@@ -0,0 +1,2324 @@
+#include "lib.h"
+#include "db.h"
+
+#include <fnmatch.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/*
+ * dbtest: tests of what db.c promises, most of all across crashes, each
+ * on scratch databases.
+ *
+ *	dbtest [-d dir] [-r rounds] [test ...]
+ *
+ *	cc -O2 -o dbtest dbtest.c db.c lib.c -lpthread
+ * the tests are
+ *	prefix	keys with a common prefix, stored without it, and keys
+ *		without it: db_fetch() and db_nextrec() give them back whole
+ *	aio	async stores and fetches of records that make the data
+ *		file larger than 10 Mbytes: each fetch gets what was stored
+ *	group	writers storing at once with DB_SYNC_GROUP, each sync
+ *		slowed down as a disk would: they share syncs, where
+ *		DB_SYNC_OP takes one a store, and every store is there
+ *	wal	writers to a database with a log, one killed inside a
+ *		checkpoint each round and the rest at random: every store
+ *		and delete they finished is there after recovery, and
+ *		db_check() finds nothing wrong
+ *	apply	the same, but the one killed part way through applying an
+ *		operation it logged, while this process has the database
+ *		open, so there is no recovery: the others, or a checkpoint,
+ *		replay what it logged, and every store and delete is there
+ *	shard	a database in shards, stored to with db_store_batch():
+ *		db_scan(), db_nextrec() and db_fetch_batch() each give
+ *		back every record left once, and db_info() counts them
+ *	reserve	the same without a log, the writers all killed at random,
+ *		part way through appends they reserved at once: a store cut
+ *		short leaves a record on no chain, or reserved space never
+ *		written, and nothing else
+ *	reopen	a database with a log opened twice by this process, and
+ *		then by another after one handle is closed: neither open
+ *		sets up the shared memory segment again under the handle
+ *		still open, which would recover and checkpoint the log,
+ *		and the stores through each handle are all there; a
+ *		child closing the handle it inherited leaves it open
+ *	promote	keys on one long chain, fetched by a handle that
+ *		promotes: a key fetched from the end is then at the front,
+ *		the keys fetched most stay near it, and none is lost, with
+ *		a log and without
+ *	crc	a data record and an index record damaged: fetches
+ *		and db_nextrec() give EIO at them, and go on; then a
+ *		writer rewriting records in place, with a log, while
+ *		db_nextrec() and db_scanmatch() scans find every record,
+ *		and none damaged
+ *	fixed	a database in fixed size slots, each record replaced by
+ *		a new slot that frees the old, and writers to one killed
+ *		at random: every store and delete they finished is there
+ *	backup	backups taken while two processes write, with a log and
+ *		without: each checks clean and is of one moment, and one
+ *		over the database itself is refused
+ *	info	the counts db_info() keeps, as records are stored and
+ *		deleted, from the header after a reopen, and after a
+ *		writer is killed: db_check() finds the same
+ *	trace	calls traced to the trace file, all and one in 3: each
+ *		event has the op, what it returned and the key's chain,
+ *		fetches without locks included
+ *	index	a secondary index, most records under one attribute,
+ *		as they are stored, replaced to change it and deleted:
+ *		db_lookup() finds the records under each attribute and no
+ *		others, after a reopen and a rebuild of the index too, and
+ *		the entries under one attribute are on many chains
+ *	wbuf	stores held in a write buffer, each key stored 3 times:
+ *		the handle reads them back, another sees none of them
+ *		until db_flush(), a close, the buffer filling or the
+ *		oldest coming due, and then sees the last of each, with no
+ *		dead records left by those before it
+ *	match	db_scanmatch() of prefixes, substrings and globs, on keys
+ *		with a common prefix elided and without, some deleted, in
+ *		one file and in shards: each finds the keys a brute force
+ *		match of every key does, once, and a bad how is refused
+ *	reclaim	stores and deletes on a few long chains, so that deletes
+ *		pass dead records and put them on the free list, and
+ *		stores reuse them: every key has what it should, and
+ *		db_check() counts what db_info() does
+ *	check	db_check() and db_rebuild() of a database, clean and then
+ *		with a key, a data record and a chain ptr damaged, in one
+ *		file, in shards and in fixed size slots: the damage is
+ *		found, and the rebuild has all but the damaged records
+ * the arguments pick the tests, all of them by default, run on databases
+ * made in dir (default /tmp); those that go in rounds run -r of them
+ * (default 20). a line is printed for each test, and each thing found
+ * wrong; exits 1 if any was.
+ */
+
+#define NWRITERS	4	/* processes writing at once */
+#define NKEYS		500	/* keys each writes */
+#define ROUND_MSEC	3000	/* most a round waits for its crash point */
+
+/* a writer's operation, written to its log of them before it is made */
+typedef struct {
+	unsigned int	key;	/* which of the writer's keys */
+	unsigned int	seq;	/* the data stored, 0 for a delete */
+} OP;
+
+typedef struct {
+	const char	*name;
+	int		(*fn)(const char *, int);
+} TEST;
+
+static int	test_aio(const char *, int);
+static int	test_backup(const char *, int);
+static int	test_apply(const char *, int);
+static int	test_check(const char *, int);
+static int	test_crc(const char *, int);
+static int	test_fixed(const char *, int);
+static int	test_group(const char *, int);
+static int	test_index(const char *, int);
+static int	test_info(const char *, int);
+static int	test_match(const char *, int);
+static int	test_prefix(const char *, int);
+static int	test_promote(const char *, int);
+static int	test_reclaim(const char *, int);
+static int	test_reopen(const char *, int);
+static int	test_reserve(const char *, int);
+static int	test_shard(const char *, int);
+static int	test_trace(const char *, int);
+static int	test_wal(const char *, int);
+static int	test_wbuf(const char *, int);
+
+static TEST	tests[] = {
+	{ "prefix",	test_prefix },
+	{ "aio",	test_aio },
+	{ "group",	test_group },
+	{ "wal",	test_wal },
+	{ "apply",	test_apply },
+	{ "shard",	test_shard },
+	{ "reserve",	test_reserve },
+	{ "reopen",	test_reopen },
+	{ "promote",	test_promote },
+	{ "crc",	test_crc },
+	{ "fixed",	test_fixed },
+	{ "backup",	test_backup },
+	{ "info",	test_info },
+	{ "trace",	test_trace },
+	{ "index",	test_index },
+	{ "wbuf",	test_wbuf },
+	{ "match",	test_match },
+	{ "reclaim",	test_reclaim },
+	{ "check",	test_check },
+};
+#define NTESTS	(sizeof(tests) / sizeof(tests[0]))
+
+static int	checks(const char *, const DBOPTS *, const char *);
+static int	counted(void *, const char *, const char *);
+static void	aiodata(char *, int);
+static void	aiodone(void *, int, char *);
+static int	backups(const char *, const DBOPTS *, const char *, int);
+static DBHANDLE	create(const char *, const DBOPTS *);
+static int	crashes(const char *, const DBOPTS *, int, int);
+static int	damage(const char *, const char *, int);
+static unsigned long syncs(const char *, int);
+static void	crashnext(int);
+static void	fail(const char *, ...);
+static void	infochecks(DBHANDLE, const char *);
+static int	indexattr(void *, const char *, const char *, char *);
+static void	lookups(DBHANDLE, const char *, const char *);
+static int	lookupvisit(void *, const char *, const char *);
+static void	matchkey(char *, int);
+static int	matches(DBHANDLE, const char *);
+static int	matchstop(void *, const char *, const char *);
+static int	matchvisit(void *, const char *, const char *);
+static void	msleep(long);
+static void	prefixkey(char *, int);
+static int	promotes(const char *, const DBOPTS *, const char *);
+static void	problem(void *, const char *);
+static int	shardvisit(void *, const char *, const char *);
+static int	shardseen(int *, const char *);
+static void	storekeys(DBHANDLE, int, int);
+static long	traced(const char *, DBTRACE *);
+static off_t	walsize(const char *);
+static int	unseen(DBHANDLE, int, int, int);
+static void	usage(void);
+static int	verify(const char *, char **, int, const char *);
+static void	writer(const char *, const DBOPTS *, int, unsigned int, int);
+
+static int	nfail;		/* things found wrong by the test running */
+
+/*
+ * crash points: a writer can be made to kill itself part way through a
+ * checkpoint by standing in for fdatasync() and ftruncate(), or through
+ * applying what it logged by standing in for pwrite(), which then call
+ * the kernel. there are crash points only on Linux; elsewhere
+ * writers are killed at random. the stand-in for fdatasync() can also
+ * count the calls, in all processes, and make each take a while.
+ */
+#define CRASH_START	1	/* fdatasync() of the data file, which starts it */
+#define CRASH_SYNC	2	/* fdatasync() of the log */
+#define CRASH_TRUNCATE	3	/* ftruncate() of the log */
+#define CRASH_APPLY	4	/* pwrite() to the index file */
+
+static ino_t	idxino, datino, walino;	/* the files' inodes */
+static volatile sig_atomic_t crashat;	/* CRASH_xxx to die at, 0 none */
+static volatile sig_atomic_t crashskip;	/* calls there to let through first */
+static unsigned long *nsyncs;	/* shared count of fdatasync()s, or NULL */
+static long	syncmsec;	/* how long each takes */
+
+static void
+crashpoint(int fd, int where)
+{
+	struct stat	statbuff;
+
+	if (crashat == where && fstat(fd, &statbuff) == 0 &&
+	    statbuff.st_ino == (where == CRASH_START ? datino :
+	    where == CRASH_APPLY ? idxino : walino) && crashskip-- == 0)
+		kill(getpid(), SIGKILL);
+}
+
+/* SIGUSR1: die when the next checkpoint starts */
+static void
+crashnext(int signo)
+{
+	crashskip = 0;
+	crashat = CRASH_START;
+}
+
+#ifdef __linux__
+int
+fdatasync(int fd)
+{
+	crashpoint(fd, CRASH_START);
+	crashpoint(fd, CRASH_SYNC);
+	if (nsyncs != NULL) {
+		__atomic_add_fetch(nsyncs, 1, __ATOMIC_RELAXED);
+		msleep(syncmsec);
+	}
+	return (syscall(SYS_fdatasync, fd));
+}
+
+int
+ftruncate(int fd, off_t length)
+{
+	crashpoint(fd, CRASH_TRUNCATE);
+	return (syscall(SYS_ftruncate, fd, length));
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+	crashpoint(fd, CRASH_APPLY);
+	return (syscall(SYS_pwrite64, fd, buf, nbytes, offset));
+}
+#endif
+
+int
+main(int argc, char *argv[])
+{
+	const char	*dir = "/tmp";
+	char		*path;
+	int		c, i, j, rounds = 20, failed = 0;
+
+	while ((c = getopt(argc, argv, "d:r:")) != EOF) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < NTESTS; j++)
+			if (strcmp(argv[i], tests[j].name) == 0)
+				break;
+		if (j == NTESTS)
+			usage();
+	}
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	path = Malloc(strlen(dir) + 32);
+	for (j = 0; j < NTESTS; j++) {
+		for (i = optind; i < argc; i++)
+			if (strcmp(argv[i], tests[j].name) == 0)
+				break;
+		if (optind < argc && i == argc)
+			continue;
+		sprintf(path, "%s/dbtest-%s", dir, tests[j].name);
+		nfail = 0;
+		if ((*tests[j].fn)(path, rounds) < 0 || nfail > 0) {
+			printf("%s: FAILED\n", tests[j].name);
+			failed = 1;
+		} else
+			printf("%s: ok\n", tests[j].name);
+	}
+	free(path);
+	exit(failed);
+}
+
+static void
+usage(void)
+{
+	int	j;
+
+	fprintf(stderr, "usage: dbtest [-d dir] [-r rounds] [test ...]\ntests:");
+	for (j = 0; j < NTESTS; j++)
+		fprintf(stderr, " %s", tests[j].name);
+	fprintf(stderr, "\n");
+	exit(2);
+}
+
+static void
+fail(const char *fmt, ...)
+{
+	va_list	ap;
+
+	nfail++;
+	printf("\t");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static void
+problem(void *arg, const char *what)
+{
+	printf("\tround %d: db_check: %s\n", *(int *) arg, what);
+}
+
+static void
+msleep(long msec)
+{
+	struct timespec	ts;
+
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+/* a new database at path, or NULL, which is a failure */
+static DBHANDLE
+create(const char *path, const DBOPTS *o)
+{
+	DBHANDLE	db;
+
+	if ((db = db_openopt(path, O_RDWR | O_CREAT | O_TRUNC, 0644, o)) ==
+	    NULL)
+		fail("can't create %s: %s", path, strerror(errno));
+	return (db);
+}
+
+/* key i of test_prefix(): with the prefix, with part of it, or without */
+static void
+prefixkey(char *key, int i)
+{
+	sprintf(key, i % 3 == 0 ? "user/%d" : i % 3 == 1 ? "user%d" :
+	    "other/%d", i);
+}
+
+/*
+ * keys stored with the common prefix user/ elided, and others, in a
+ * database reopened without the option, which the header has. every
+ * key db_nextrec() returns is whole, and has its data, and the keys
+ * not deleted are all returned once.
+ */
+static int
+test_prefix(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	char		key[IDXLEN_MAX + KEYPREFIX_MAX], want[32], *data, *seen;
+	int		i, n = 0;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.keyprefix = "user/";
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	for (i = 0; i < NKEYS; i++) {
+		prefixkey(key, i);
+		sprintf(want, "d%d", i);
+		if (db_store(db, key, want, DB_STORE) != 0)
+			fail("store of %s: %s", key, strerror(errno));
+	}
+	for (i = 0; i < NKEYS; i += 5) {
+		prefixkey(key, i);
+		db_delete(db, key);
+	}
+	db_close(db);
+
+	if ((db = db_openopt(path, O_RDONLY, 0, NULL)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		return (-1);
+	}
+	seen = Calloc(NKEYS, 1);
+	db_rewind(db);
+	while ((data = db_nextrec(db, key)) != NULL) {
+		n++;
+		if (data[0] != 'd' || (i = atoi(data + 1)) < 0 || i >= NKEYS ||
+		    i % 5 == 0 || seen[i]) {
+			fail("db_nextrec: %s has %s", key, data);
+			continue;
+		}
+		seen[i] = 1;
+		prefixkey(want, i);
+		if (strcmp(key, want) != 0)
+			fail("db_nextrec: %s, not %s", key, want);
+	}
+	if (n != NKEYS - NKEYS / 5)
+		fail("db_nextrec: %d records, not %d", n, NKEYS - NKEYS / 5);
+	for (i = 0; i < NKEYS; i++) {
+		prefixkey(key, i);
+		if ((data = db_fetch(db, key)) == NULL ? i % 5 != 0 :
+		    i % 5 == 0 || atoi(data + 1) != i)
+			fail("db_fetch: %s has %s", key,
+			    data != NULL ? data : "nothing");
+	}
+	free(seen);
+	db_close(db);
+	return (0);
+}
+
+#define NAIO	12000		/* records, of 1000 bytes, in test_aio() */
+
+/* the data of key i in test_aio() */
+static void
+aiodata(char *data, int i)
+{
+	int	n;
+
+	n = sprintf(data, "%d ", i);
+	memset(data + n, 'a' + i % 26, 999 - n);
+	data[999] = 0;
+}
+
+/* the completion of a request of test_aio(), arg the key's number */
+static void
+aiodone(void *arg, int rc, char *data)
+{
+	char	want[1000];
+	int	i = *(int *) arg;
+
+	if (i < 0) {		/* a store */
+		if (rc != 0)
+			fail("db_store_async of k%d: %d", -i - 1, rc);
+		return;
+	}
+	aiodata(want, i);
+	if (i >= NAIO ? rc != -1 : rc != 0 || strcmp(data, want) != 0)
+		fail("db_fetch_async of k%d: %d, %.20s", i, rc,
+		    data != NULL ? data : "nothing");
+}
+
+/*
+ * async stores of NAIO records, then async fetches of them and of keys
+ * that aren't there, from a small ring, so requests wait for room. the
+ * data file ends up past 10 Mbytes, so the offsets of the later records
+ * in it have more digits than the offsets of the index records.
+ */
+static int
+test_aio(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	struct stat	statbuff;
+	char		name[PATH_MAX], key[32], data[1000];
+	int		i, *arg;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 1009;
+	o.aiodepth = 16;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	arg = Calloc(2 * NAIO, sizeof(int));
+	for (i = 0; i < NAIO; i++) {
+		sprintf(key, "k%d", i);
+		aiodata(data, i);
+		arg[NAIO + i] = -i - 1;
+		if (db_store_async(db, key, data, DB_STORE, aiodone,
+		    &arg[NAIO + i]) < 0)
+			fail("db_store_async of %s: %s", key, strerror(errno));
+	}
+	db_aio_wait(db, NAIO);
+	sprintf(name, "%s.dat", path);
+	if (stat(name, &statbuff) < 0 || statbuff.st_size <= 10 * 1024 * 1024)
+		fail("%s is too small", name);
+
+	for (i = 0; i < NAIO + NAIO / 10; i++) {
+		sprintf(key, "k%d", i);
+		arg[i] = i;
+		if (db_fetch_async(db, key, aiodone, &arg[i]) < 0)
+			fail("db_fetch_async of %s: %s", key, strerror(errno));
+	}
+	db_aio_wait(db, NAIO + NAIO / 10);
+	db_close(db);
+	free(arg);
+	return (0);
+}
+
+#define NGROUP	50		/* stores each writer makes in syncs() */
+#define NGWRITERS (2 * NWRITERS)	/* writers in syncs() */
+
+/*
+ * writers storing at once, with a log, in DB_SYNC_OP and then in
+ * DB_SYNC_GROUP, each sync taking 2 msec. a sync for each store is
+ * expected of the first, and the writers waiting during one sharing
+ * the next of the second. a writer a sync has let go often comes back
+ * to find the next one started, and waits for the one after, so they
+ * share fewer than they might, but there must be under 3/4 as many.
+ */
+static int
+test_group(const char *path, int rounds)
+{
+	unsigned long	nop, ngroup;
+
+	if ((nsyncs = mmap(NULL, sizeof(*nsyncs), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err_sys("mmap error");
+	syncmsec = 2;
+	nop = syncs(path, DB_SYNC_OP);
+	ngroup = syncs(path, DB_SYNC_GROUP);
+	munmap(nsyncs, sizeof(*nsyncs));
+	nsyncs = NULL;
+#ifdef __linux__
+	if (nop < NGWRITERS * NGROUP)
+		fail("DB_SYNC_OP: %lu syncs for %d stores", nop,
+		    NGWRITERS * NGROUP);
+	if (ngroup >= NGWRITERS * NGROUP * 3 / 4)
+		fail("DB_SYNC_GROUP: %lu syncs for %d stores", ngroup,
+		    NGWRITERS * NGROUP);
+#endif
+	return (0);
+}
+
+/*
+ * NGWRITERS writers each make NGROUP stores at once to a database with a
+ * log, in durability mode sync. returns the syncs they took, on Linux.
+ */
+static unsigned long
+syncs(const char *path, int sync)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	char		key[32], data[32], *got;
+	pid_t		pid[NGWRITERS];
+	int		w, k, status;
+	unsigned long	n;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.wal = 1;
+	o.sync = sync;
+	if ((db = create(path, &o)) == NULL)
+		return (0);
+	db_close(db);
+	*nsyncs = 0;
+	for (w = 0; w < NGWRITERS; w++) {
+		if ((pid[w] = Fork()) == 0) {
+			if ((db = db_openopt(path, O_RDWR, 0, &o)) == NULL)
+				err_sys("can't open %s", path);
+			for (k = 0; k < NGROUP; k++) {
+				sprintf(key, "w%dk%d", w, k);
+				sprintf(data, "%d", k);
+				if (db_store(db, key, data, DB_STORE) != 0)
+					err_sys("store of %s", key);
+			}
+			db_close(db);
+			_exit(0);
+		}
+	}
+	for (w = 0; w < NGWRITERS; w++)
+		if (Waitpid(pid[w], &status, 0) == pid[w] &&
+		    (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			fail("sync %d: writer %d failed", sync, w);
+	n = *nsyncs;
+
+	if ((db = db_openopt(path, O_RDONLY, 0, NULL)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		return (n);
+	}
+	for (w = 0; w < NGWRITERS; w++)
+		for (k = 0; k < NGROUP; k++) {
+			sprintf(key, "w%dk%d", w, k);
+			if ((got = db_fetch(db, key)) == NULL || atoi(got) != k)
+				fail("sync %d: %s has %s", sync, key,
+				    got != NULL ? got : "nothing");
+		}
+	db_close(db);
+	return (n);
+}
+
+/*
+ * writers to a database with a log, with a small walmax so that they
+ * checkpoint often. the first of them dies at a crash point of a
+ * checkpoint, and the others go on, over what it left, until they are
+ * killed too.
+ */
+static int
+test_wal(const char *path, int rounds)
+{
+	DBOPTS	o;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.wal = 1;
+	o.walmax = 16 * 1024;
+	return (crashes(path, &o, rounds, CRASH_SYNC));
+}
+
+/*
+ * the same, but the first writer dies between writes to the index file
+ * of what it logged, with the others going on over what it left, and
+ * the database open here all along.
+ */
+static int
+test_apply(const char *path, int rounds)
+{
+	DBOPTS	o;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.wal = 1;
+	o.walmax = 16 * 1024;
+	return (crashes(path, &o, rounds, CRASH_APPLY));
+}
+
+#define NSHARD	(4 * NKEYS)	/* records in test_shard() */
+
+/*
+ * DBVISIT for test_shard(), called from a thread per shard: count the
+ * record in seen, the array arg, if its data is right, and in its last
+ * element if not.
+ */
+static int
+shardvisit(void *arg, const char *key, const char *data)
+{
+	int	*seen = arg, i;
+
+	if (sscanf(key, "user-%d", &i) != 1 || i < 0 || i >= NSHARD ||
+	    data[0] != 'd' || atoi(data + 1) != i)
+		i = NSHARD;
+	__atomic_add_fetch(&seen[i], 1, __ATOMIC_RELAXED);
+	return (0);
+}
+
+/*
+ * every record left in test_shard(), those not deleted, must be in
+ * seen once, and nothing else. clears seen for the next.
+ */
+static int
+shardseen(int *seen, const char *what)
+{
+	int	i, n = nfail;
+
+	for (i = 0; i < NSHARD; i++)
+		if (seen[i] != (i % 3 != 0))
+			fail("%s: user-%d seen %d times", what, i, seen[i]);
+	if (seen[NSHARD] != 0)
+		fail("%s: %d records with the wrong data", what, seen[NSHARD]);
+	memset(seen, 0, (NSHARD + 1) * sizeof(int));
+	return (nfail > n ? -1 : 0);
+}
+
+/*
+ * a database in 4 shards, filled by db_store_batch(), with every third
+ * key deleted. the parallel scans and batches, and db_nextrec() going
+ * from one shard to the next, must all find the rest.
+ */
+static int
+test_shard(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	DBINFO		info;
+	const char	**keys, **data;
+	char		key[IDXLEN_MAX + KEYPREFIX_MAX], *p;
+	int		i, n, *seen, *rc;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.nshards = 4;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	keys = Calloc(NSHARD, sizeof(char *));
+	data = Calloc(NSHARD, sizeof(char *));
+	rc = Calloc(NSHARD, sizeof(int));
+	seen = Calloc(NSHARD + 1, sizeof(int));
+	for (i = 0; i < NSHARD; i++) {
+		sprintf(key, "user-%d", i);
+		keys[i] = strdup(key);
+		sprintf(key, "d%d", i);
+		data[i] = strdup(key);
+	}
+	if ((n = db_store_batch(db, keys, data, NSHARD, DB_INSERT, rc)) != 0)
+		fail("db_store_batch: %d stores failed", n);
+	for (i = 0; i < NSHARD; i++)
+		if (rc[i] != 0)
+			fail("db_store_batch: %s gave %d", keys[i], rc[i]);
+	for (i = 0; i < NSHARD; i += 3)
+		if (db_delete(db, keys[i]) != 0)
+			fail("db_delete of %s: %s", keys[i], strerror(errno));
+
+	if (db_scan(db, shardvisit, seen) != 0)
+		fail("db_scan stopped");
+	shardseen(seen, "db_scan");
+	db_rewind(db);
+	while ((p = db_nextrec(db, key)) != NULL)
+		shardvisit(seen, key, p);
+	shardseen(seen, "db_nextrec");
+	n = db_fetch_batch(db, keys, NSHARD, shardvisit, seen);
+	if (n != NSHARD - (NSHARD + 2) / 3)
+		fail("db_fetch_batch: found %d, not %d", n,
+		    NSHARD - (NSHARD + 2) / 3);
+	shardseen(seen, "db_fetch_batch");
+	if (db_info(db, &info) < 0 || info.nrecs != NSHARD - (NSHARD + 2) / 3 ||
+	    info.nhash != 4 * o.nhash)
+		fail("db_info: %llu records on %lu chains", info.nrecs,
+		    info.nhash);
+	db_close(db);
+
+	for (i = 0; i < NSHARD; i++) {
+		free((char *) keys[i]);
+		free((char *) data[i]);
+	}
+	free(keys);
+	free(data);
+	free(rc);
+	free(seen);
+	return (0);
+}
+
+/*
+ * writers appending to a database without a log, each reserving space at
+ * the ends of the files with no lock, until they are killed at random.
+ */
+static int
+test_reserve(const char *path, int rounds)
+{
+	DBOPTS	o;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	return (crashes(path, &o, rounds, 0));
+}
+
+/* store keys user-<from> to user-<to - 1>, each with data d<n>, in db */
+static void
+storekeys(DBHANDLE db, int from, int to)
+{
+	char	key[32], data[32];
+	int	i;
+
+	for (i = from; i < to; i++) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "d%d", i);
+		if (db_store(db, key, data, DB_STORE) != 0)
+			fail("store of %s: %s", key, strerror(errno));
+	}
+}
+
+/* the size of the log of the database at path */
+static off_t
+walsize(const char *path)
+{
+	struct stat	statbuff;
+	char		name[PATH_MAX];
+
+	sprintf(name, "%s.wal", path);
+	if (stat(name, &statbuff) < 0)
+		err_sys("can't stat %s", name);
+	return (statbuff.st_size);
+}
+
+/*
+ * the database opened twice by this process, and again by another once
+ * the second handle is closed, the first kept open throughout. the other
+ * closes the handle it inherits first, which mustn't take it for the
+ * last. the log
+ * is big enough not to be checkpointed, so it only shrinks if an open
+ * thought it was the first and recovered it.
+ */
+static int
+test_reopen(const char *path, int rounds)
+{
+	DBHANDLE	db, db2;
+	DBOPTS		o;
+	DBCHECK		res;
+	char		key[32], *data;
+	off_t		size;
+	pid_t		pid;
+	int		i, status;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.wal = 1;
+	o.walmax = 64 * 1024 * 1024;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	storekeys(db, 0, NKEYS);
+	size = walsize(path);
+	if ((db2 = db_openopt(path, O_RDWR, 0, NULL)) == NULL) {
+		fail("second open of %s: %s", path, strerror(errno));
+		db_close(db);
+		return (-1);
+	}
+	if (walsize(path) < size)
+		fail("the second open recovered the log under the first");
+	storekeys(db2, NKEYS, 2 * NKEYS);
+	db_close(db2);
+
+	size = walsize(path);
+	if ((pid = Fork()) == 0) {
+		db_close(db);		/* this process's is its own */
+		if ((db2 = db_openopt(path, O_RDWR, 0, NULL)) == NULL)
+			_exit(1);
+		if (walsize(path) < size)
+			_exit(2);
+		storekeys(db2, 2 * NKEYS, 2 * NKEYS + 1);
+		db_close(db2);
+		_exit(0);
+	}
+	Waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) == 1)
+		fail("another process couldn't open %s", path);
+	else if (WEXITSTATUS(status) == 2)
+		fail("another process recovered the log under the first");
+
+	for (i = 0; i <= 2 * NKEYS; i++) {
+		sprintf(key, "user-%d", i);
+		if ((data = db_fetch(db, key)) == NULL || data[0] != 'd' ||
+		    atoi(data + 1) != i)
+			fail("%s has %s", key, data != NULL ? data : "nothing");
+	}
+	memset(&res, 0, sizeof(res));
+	if (db_check(db, &res) < 0 || res.nrecs != 2 * NKEYS + 1)
+		fail("db_check: %llu records, %llu problems", res.nrecs,
+		    res.nbad);
+	db_close(db);
+	return (0);
+}
+
+/*
+ * the last event traced by this process to the trace file of the
+ * database at path, in ev. returns how many it has traced, or -1 if
+ * none.
+ */
+static long
+traced(const char *path, DBTRACE *ev)
+{
+	DBTRING		ring;
+	char		name[PATH_MAX];
+	off_t		off;
+	long		rc = -1;
+	int		fd, i;
+
+	sprintf(name, "%s.trc", path);
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return (-1);
+	for (i = 0; i < DBTRACE_RINGS; i++) {
+		off = offsetof(DBTRFILE, ring) + i * sizeof(DBTRING);
+		if (pread(fd, &ring, offsetof(DBTRING, ev), off) !=
+		    offsetof(DBTRING, ev))
+			break;
+		if (ring.pid != getpid() || ring.next == 0)
+			continue;
+		off += offsetof(DBTRING, ev) +
+		    (ring.next - 1) % DBTRACE_EVENTS * sizeof(DBTRACE);
+		if (pread(fd, ev, sizeof(DBTRACE), off) == sizeof(DBTRACE))
+			rc = ring.next;
+		break;
+	}
+	close(fd);
+	return (rc);
+}
+
+/*
+ * keys on one chain, the first stored at its end, fetched by a handle
+ * that promotes every fetch it finds deep in the chain, without a log and
+ * with one. the fetches are traced, to see how far each walked.
+ */
+static int
+test_promote(const char *path, int rounds)
+{
+	DBOPTS	o;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 1;
+	o.promote = 1;
+	o.trace = 1;
+	promotes(path, &o, "no log");
+	o.wal = 1;
+	promotes(path, &o, "log");
+	return (0);
+}
+
+#define NHOT	10	/* keys test_promote() fetches most */
+
+/*
+ * the first key, passed by every other on its chain, is found at the
+ * front once it has been fetched. then, with a few keys fetched over and
+ * over, each is found among the first few, and every key still has its
+ * data, once.
+ */
+static int
+promotes(const char *path, const DBOPTS *o, const char *what)
+{
+	DBHANDLE	db;
+	DBCHECK		res;
+	DBTRACE		ev;
+	char		key[32], *data;
+	int		i, k;
+
+	if ((db = create(path, o)) == NULL)
+		return (-1);
+	storekeys(db, 0, NKEYS);
+	if (db_fetch(db, "user-0") == NULL || traced(path, &ev) < 0 ||
+	    ev.hops < NKEYS - 1)
+		fail("%s: first fetch of user-0 passed %u records, not %d",
+		    what, ev.hops, NKEYS - 1);
+	if (db_fetch(db, "user-0") == NULL || traced(path, &ev) < 0 ||
+	    ev.hops != 0)
+		fail("%s: user-0 wasn't promoted: %u records passed", what,
+		    ev.hops);
+
+	srand(getpid());
+	for (i = 0; i < 20 * NHOT; i++) {
+		sprintf(key, "user-%d", rand() % NHOT);
+		db_fetch(db, key);
+	}
+	for (k = 0; k < NHOT; k++) {
+		sprintf(key, "user-%d", k);
+		if (db_fetch(db, key) == NULL || traced(path, &ev) < 0 ||
+		    ev.hops >= NHOT)
+			fail("%s: fetch of hot key %s passed %u records",
+			    what, key, ev.hops);
+	}
+
+	for (k = 0; k < NKEYS; k++) {
+		sprintf(key, "user-%d", k);
+		if ((data = db_fetch(db, key)) == NULL || data[0] != 'd' ||
+		    atoi(data + 1) != k)
+			fail("%s: %s has %s", what, key,
+			    data != NULL ? data : "nothing");
+	}
+	memset(&res, 0, sizeof(res));
+	if (db_check(db, &res) < 0 || res.nrecs != NKEYS || res.nlost != 0)
+		fail("%s: db_check: %llu records, %llu lost, %llu problems",
+		    what, res.nrecs, res.nlost, res.nbad);
+	db_close(db);
+	return (0);
+}
+
+/* count a record for db_scanmatch() */
+static int
+counted(void *arg, const char *key, const char *data)
+{
+	__atomic_add_fetch((int *) arg, 1, __ATOMIC_RELAXED);
+	return (0);
+}
+
+/*
+ * with a data record and an index record damaged, a fetch of either key
+ * fails with EIO rather than the process dying, and db_nextrec() returns
+ * EIO at each and carries on past. then, in a database with a log, a
+ * writer replaces every record with data of the same length, over and
+ * over, which rewrites them in place, while db_nextrec() and
+ * db_scanmatch() scans go on: none of them may find a record damaged,
+ * and each finds every record once.
+ */
+static int
+test_crc(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	char		key[IDXLEN_MAX + KEYPREFIX_MAX], data[32], *p;
+	volatile int	*ctl;	/* stop the writer, passes it has made */
+	unsigned int	seq = 0;
+	pid_t		pid;
+	int		r, i, n, nbad, status;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	storekeys(db, 0, NKEYS);
+	if (db_store(db, "user-crc", "data-crc-0123456789", DB_STORE) != 0)
+		fail("store of user-crc: %s", strerror(errno));
+	if (!damage(path, "data-crc-", 0) || !damage(path, "user-7", ':'))
+		fail("can't damage %s", path);
+	errno = 0;
+	if (db_fetch(db, "user-crc") != NULL || errno != EIO)
+		fail("fetch of user-crc, its data damaged: %s",
+		    strerror(errno));
+	errno = 0;
+	if (db_fetch(db, "user-7") != NULL || errno != EIO)
+		fail("fetch of user-7, its key damaged: %s", strerror(errno));
+	if ((p = db_fetch(db, "user-8")) == NULL || strcmp(p, "d8") != 0)
+		fail("user-8 has %s", p != NULL ? p : "nothing");
+	db_rewind(db);
+	n = nbad = 0;
+	errno = 0;
+	while ((p = db_nextrec(db, key)) != NULL || errno == EIO) {
+		if (p == NULL) {
+			nbad++;
+			errno = 0;
+		} else
+			n++;
+	}
+	if (n != NKEYS - 1 || nbad != 2)
+		fail("db_nextrec: %d records and %d damaged, not %d and 2", n,
+		    nbad, NKEYS - 1);
+	db_close(db);
+
+	o.wal = 1;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "%08u", seq++);
+		if (db_store(db, key, data, DB_STORE) != 0)
+			fail("store of %s: %s", key, strerror(errno));
+	}
+	if ((ctl = mmap(NULL, 2 * sizeof(*ctl), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err_sys("mmap error");
+	ctl[0] = ctl[1] = 0;
+	if ((pid = Fork()) == 0) {
+		db_close(db);
+		if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL)
+			_exit(1);
+		for ( ; !ctl[0]; ctl[1]++)
+			for (i = 0; i < NKEYS; i++) {
+				sprintf(key, "user-%d", i);
+				sprintf(data, "%08u", seq++);
+				if (db_store(db, key, data, DB_REPLACE) != 0)
+					_exit(1);
+			}
+		db_close(db);
+		_exit(0);
+	}
+	while (ctl[1] == 0 && waitpid(pid, &status, WNOHANG) == 0)
+		msleep(1);		/* till it is going */
+	for (r = 0; r < rounds || ctl[1] < 2; r++) {
+		db_rewind(db);
+		n = 0;
+		errno = 0;
+		while ((p = db_nextrec(db, key)) != NULL || errno == EIO) {
+			if (p == NULL) {
+				fail("round %d: db_nextrec: EIO", r);
+				errno = 0;
+			} else
+				n++;
+		}
+		if (n != NKEYS)
+			fail("round %d: db_nextrec found %d records, not %d", r,
+			    n, NKEYS);
+		n = 0;
+		if (db_scanmatch(db, DB_MATCH_PREFIX, "user-", counted, &n) != 0)
+			fail("round %d: db_scanmatch: %s", r, strerror(errno));
+		if (n != NKEYS)
+			fail("round %d: db_scanmatch found %d records, not %d",
+			    r, n, NKEYS);
+	}
+	ctl[0] = 1;
+	if (waitpid(pid, &status, 0) == pid && (!WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0))
+		fail("the writer failed");
+	munmap((void *) ctl, 2 * sizeof(*ctl));
+	db_close(db);
+	return (0);
+}
+
+/*
+ * a database in fixed size slots, each of its records replaced once,
+ * each by a new slot, which then frees the old: all but one reuse the
+ * slot the one before freed. then writers storing and deleting in slots
+ * are killed at random, as for test_reserve().
+ */
+static int
+test_fixed(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	DBINFO		info;
+	char		key[32], data[32], *got;
+	int		i;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.keysize = 16;
+	o.datsize = 24;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	storekeys(db, 0, NKEYS);
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "r%d", i);
+		if (db_store(db, key, data, DB_REPLACE) != 0)
+			fail("replace of %s: %s", key, strerror(errno));
+	}
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(key, "user-%d", i);
+		if ((got = db_fetch(db, key)) == NULL || got[0] != 'r' ||
+		    atoi(got + 1) != i)
+			fail("%s has %s", key, got != NULL ? got : "nothing");
+	}
+	if (db_info(db, &info) < 0 || info.nrecs != NKEYS || info.nfree != 1)
+		fail("db_info: %llu records and %llu free slots, not %d and 1",
+		    info.nrecs, info.nfree, NKEYS);
+	if (db_store(db, "user-0123456789abcdef", "d", DB_STORE) != -1 ||
+	    errno != EINVAL)
+		fail("a key longer than the slots' was stored");
+	if (db_store(db, "user-0", "0123456789abcdef0123456789", DB_STORE) !=
+	    -1 || errno != EINVAL)
+		fail("data longer than the slots' was stored");
+	db_close(db);
+
+	o.datsize = 80;		/* the writers' data */
+	return (crashes(path, &o, rounds, 0));
+}
+
+/*
+ * backups of a database taken while two processes write it, without a
+ * log and with one: one stores seq-<n> in order, and then sets last to
+ * n; the other replaces the keys test_backup() stored first, with data
+ * of varying lengths. a backup over the database itself is EINVAL, and
+ * leaves it alone.
+ */
+static int
+test_backup(const char *path, int rounds)
+{
+	DBOPTS	o;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	backups(path, &o, "no log", rounds);
+	o.wal = 1;
+	backups(path, &o, "log", rounds);
+	return (0);
+}
+
+/*
+ * each backup must check clean, and be of one moment: with last n in
+ * it, it has seq-0 to seq-<n>, and at most seq-<n + 1> after them. a
+ * replication log left at the backup's path goes.
+ */
+static int
+backups(const char *path, const DBOPTS *o, const char *what, int rounds)
+{
+	DBHANDLE	db, bk;
+	DBCHECK		res;
+	char		bpath[PATH_MAX], name[PATH_MAX], key[32], data[128];
+	char		*got;
+	volatile int	*stop;
+	pid_t		pid[2];
+	unsigned int	seq;
+	int		r, w, i, n, last, status, fd;
+	static const char pad[] = "................................"
+			    "................................";
+
+	if ((db = create(path, o)) == NULL)
+		return (-1);
+	storekeys(db, 0, NKEYS);
+	errno = 0;
+	if (db_backup(db, path) != -1 || errno != EINVAL)
+		fail("%s: backup over the database: %s", what, strerror(errno));
+	if ((got = db_fetch(db, "user-1")) == NULL || strcmp(got, "d1") != 0)
+		fail("%s: the backup over it left user-1 %s", what,
+		    got != NULL ? got : "gone");
+	sprintf(bpath, "%s-copy", path);
+	sprintf(name, "%s-copy.rep", path);
+	fd = Open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	Writen(fd, "stale", 5);
+	Close(fd);
+
+	if ((stop = mmap(NULL, sizeof(*stop), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err_sys("mmap error");
+	*stop = 0;
+	for (w = 0; w < 2; w++) {
+		if ((pid[w] = Fork()) != 0)
+			continue;
+		if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL)
+			_exit(1);
+		srand(getpid());
+		for (seq = 0; !*stop; seq++) {
+			if (w == 0) {
+				sprintf(key, "seq-%u", seq);
+				sprintf(data, "%u", seq);
+				if (db_store(db, key, data, DB_INSERT) != 0 ||
+				    db_store(db, "last", data, DB_STORE) != 0)
+					_exit(1);
+			} else {
+				sprintf(key, "user-%d", rand() % NKEYS);
+				sprintf(data, "%u %.*s", seq, (int) (seq % 60),
+				    pad);
+				if (db_store(db, key, data, DB_REPLACE) != 0)
+					_exit(1);
+			}
+		}
+		db_close(db);
+		_exit(0);
+	}
+
+	for (r = 0; r < rounds; r++) {
+		msleep(10);
+		if (db_backup(db, bpath) < 0) {
+			fail("%s: round %d: db_backup: %s", what, r,
+			    strerror(errno));
+			continue;
+		}
+		if (r == 0 && access(name, F_OK) == 0)
+			fail("%s: the backup left %s", what, name);
+		if ((bk = db_openopt(bpath, O_RDONLY, 0, NULL)) == NULL) {
+			fail("%s: round %d: can't open the backup: %s", what,
+			    r, strerror(errno));
+			continue;
+		}
+		last = (got = db_fetch(bk, "last")) != NULL ? atoi(got) : -1;
+		for (i = n = 0; i <= last + 2; i++) {
+			sprintf(key, "seq-%d", i);
+			if (db_fetch(bk, key) != NULL)
+				n++;
+			if ((i <= last) != (db_fetch(bk, key) != NULL) &&
+			    i != last + 1)
+				fail("%s: round %d: last is %d, and %s is %s",
+				    what, r, last, key, i <= last ? "missing" :
+				    "there");
+		}
+		memset(&res, 0, sizeof(res));
+		if (db_check(bk, &res) < 0 || res.nlost != 0 ||
+		    res.nrecs != NKEYS + n + (last >= 0))
+			fail("%s: round %d: db_check of the backup: %llu "
+			    "records, %llu lost, %llu problems", what, r,
+			    res.nrecs, res.nlost, res.nbad);
+		db_close(bk);
+	}
+	*stop = 1;
+	for (w = 0; w < 2; w++)
+		if (Waitpid(pid[w], &status, 0) == pid[w] &&
+		    (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			fail("%s: writer %d failed", what, w);
+	munmap((void *) stop, sizeof(*stop));
+	db_close(db);
+	return (0);
+}
+
+/*
+ * the counts db_info() keeps as keys are stored and deleted, through a
+ * close and reopen, which has them from the header, and after a writer
+ * is killed with the database open, which leaves the header's stale.
+ */
+static int
+test_info(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	DBINFO		info, was;
+	char		key[32];
+	pid_t		pid;
+	int		i, status;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	storekeys(db, 0, NKEYS);
+	if (db_info(db, &info) < 0 || info.nrecs != NKEYS || info.ndead != 0 ||
+	    info.nfree != 0 || info.nhash != o.nhash || !info.exact ||
+	    info.chainlen != (double) NKEYS / o.nhash)
+		fail("db_info of %d records: %llu records, %llu dead, %llu "
+		    "free, %lu chains", NKEYS, info.nrecs, info.ndead,
+		    info.nfree, info.nhash);
+	was = info;
+	for (i = 0; i < NKEYS; i += 2) {
+		sprintf(key, "user-%d", i);
+		if (db_delete(db, key) != 0)
+			fail("delete of %s: %s", key, strerror(errno));
+	}
+	db_info(db, &info);
+	if (info.nrecs != NKEYS / 2 || info.ndead + info.nfree != NKEYS / 2 ||
+	    info.recbytes + info.deadbytes + info.freebytes != was.recbytes)
+		fail("db_info after %d deletes: %llu records, %llu dead, %llu "
+		    "free, in %llu bytes, not %llu", NKEYS / 2, info.nrecs,
+		    info.ndead, info.nfree, info.recbytes + info.deadbytes +
+		    info.freebytes, was.recbytes);
+	infochecks(db, "after deletes");
+	db_close(db);
+
+	was = info;
+	if ((db = db_openopt(path, O_RDONLY, 0, NULL)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		return (-1);
+	}
+	db_info(db, &info);
+	if (!info.exact || info.nrecs != was.nrecs ||
+	    info.recbytes != was.recbytes || info.ndead != was.ndead ||
+	    info.deadbytes != was.deadbytes || info.nfree != was.nfree ||
+	    info.freebytes != was.freebytes)
+		fail("db_info after a reopen: %llu records, %llu dead, %llu "
+		    "free%s", info.nrecs, info.ndead, info.nfree,
+		    info.exact ? "" : ", stale");
+	db_close(db);
+
+	if ((pid = Fork()) == 0) {
+		if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL)
+			_exit(1);
+		storekeys(db, NKEYS, 2 * NKEYS);
+		kill(getpid(), SIGKILL);
+	}
+	Waitpid(pid, &status, 0);
+	if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		return (-1);
+	}
+	db_info(db, &info);
+	if (!info.exact || info.nrecs != NKEYS / 2 + NKEYS)
+		fail("db_info after a writer was killed: %llu records, not %d",
+		    info.nrecs, NKEYS / 2 + NKEYS);
+	infochecks(db, "after a writer was killed");
+	db_close(db);
+	return (0);
+}
+
+/* db_check() must count what db_info() does */
+static void
+infochecks(DBHANDLE db, const char *when)
+{
+	DBINFO	info;
+	DBCHECK	res;
+
+	db_info(db, &info);
+	memset(&res, 0, sizeof(res));
+	if (db_check(db, &res) < 0)
+		fail("%s: db_check found %llu problems", when, res.nbad);
+	if (res.nrecs != info.nrecs || res.ndead != info.ndead ||
+	    res.nfree != info.nfree)
+		fail("%s: db_check counts %llu live %llu dead %llu free, "
+		    "db_info %llu %llu %llu", when, res.nrecs, res.ndead,
+		    res.nfree, info.nrecs, info.ndead, info.nfree);
+}
+
+/*
+ * every call traced, then one in 3: each event has the op, what it
+ * returned and the key's chain, which a fetch without locks reports
+ * as the store of the key did.
+ */
+static int
+test_trace(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	DBTRACE		ev;
+	char		key[32], *data;
+	unsigned int	*chain;
+	long		n;
+	int		i;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.trace = 1;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	chain = Calloc(NKEYS, sizeof(unsigned int));
+	if ((n = traced(path, &ev)) < 0)
+		n = 0;			/* a ring left by another starts there */
+	for (i = 0; i < NKEYS; i++) {
+		storekeys(db, i, i + 1);
+		if (traced(path, &ev) != n + i + 1 || ev.op != DBTRACE_STORE ||
+		    ev.rc != 0)
+			fail("store %d: event %u, rc %d", i, ev.op, ev.rc);
+		chain[i] = ev.chain;
+	}
+	for (i = NKEYS - 1; i >= 0; i--) {
+		sprintf(key, "user-%d", i);
+		data = db_fetch(db, key);
+		if (traced(path, &ev) < 0 || ev.op != DBTRACE_FETCH ||
+		    ev.rc != (data != NULL ? 0 : -1) || data == NULL ||
+		    ev.bytes == 0)
+			fail("fetch of %s: event %u, rc %d, %u bytes read", key,
+			    ev.op, ev.rc, ev.bytes);
+		if (ev.chain != chain[i])
+			fail("fetch of %s: chain %u, stored on %u", key,
+			    ev.chain, chain[i]);
+	}
+	if (db_delete(db, "user-3") != 0 || traced(path, &ev) < 0 ||
+	    ev.op != DBTRACE_DELETE || ev.rc != 0 || ev.chain != chain[3])
+		fail("delete of user-3: event %u, rc %d, chain %u", ev.op,
+		    ev.rc, ev.chain);
+	if (db_fetch(db, "user-3") != NULL || traced(path, &ev) < 0 ||
+	    ev.rc != -1)
+		fail("fetch of user-3, deleted: rc %d", ev.rc);
+	db_close(db);
+
+	o.trace = 3;
+	if ((db = db_openopt(path, O_RDWR, 0, &o)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		free(chain);
+		return (-1);
+	}
+	n = traced(path, &ev);		/* the ring is ours again */
+	for (i = 0; i < 3 * NKEYS; i++) {
+		sprintf(key, "user-%d", i % NKEYS);
+		db_fetch(db, key);
+	}
+	if ((n = traced(path, &ev) - n) != NKEYS)
+		fail("one call in 3 traced: %ld events for %d calls", n,
+		    3 * NKEYS);
+	db_close(db);
+	free(chain);
+	return (0);
+}
+
+/* the attributes of test_index(), one for each key, 0 if deleted */
+static char	*attrs;
+
+/* the attribute of a record of test_index(): its data up to the '-' */
+static int
+indexattr(void *arg, const char *key, const char *data, char *attr)
+{
+	size_t	len = strcspn(data, "-");
+
+	if (data[len] == 0)
+		return (0);		/* not indexed */
+	memcpy(attr, data, len);
+	attr[len] = 0;
+	return (1);
+}
+
+/* for lookups(): the record must have the attribute, and be seen once */
+static int
+lookupvisit(void *arg, const char *key, const char *data)
+{
+	char	*seen = arg, attr[DBATTR_MAX];
+	int	i;
+
+	if (sscanf(key, "user-%d", &i) != 1 || i < 0 || i >= NKEYS ||
+	    !indexattr(NULL, key, data, attr) || attr[1] != 0 ||
+	    attr[0] != attrs[i])
+		fail("db_lookup: %s, %s, not %c", key, data, attrs[i]);
+	else if (seen[i]++)
+		fail("db_lookup: %s found twice", key);
+	return (0);
+}
+
+/* db_lookup() of each attribute must find what attrs has for it */
+static void
+lookups(DBHANDLE db, const char *what, const char *which)
+{
+	char	seen[NKEYS], attr[2];
+	int	i, n, want;
+
+	for (attr[1] = 0; (attr[0] = *which++) != 0; ) {
+		memset(seen, 0, sizeof(seen));
+		if ((n = db_lookup(db, "grp", attr, lookupvisit, seen)) < 0) {
+			fail("%s: db_lookup of %s: %s", what, attr,
+			    strerror(errno));
+			continue;
+		}
+		for (i = want = 0; i < NKEYS; i++) {
+			if (attrs[i] == attr[0])
+				want++;
+			if (attrs[i] == attr[0] && !seen[i])
+				fail("%s: db_lookup of %s: user-%d not found",
+				    what, attr, i);
+		}
+		if (n != want)
+			fail("%s: db_lookup of %s: %d records, not %d", what,
+			    attr, n, want);
+	}
+}
+
+/*
+ * records stored in a database with an index, 4 in 5 under attribute a
+ * and the rest under b; then a third of them replaced to put them under
+ * c, some of those and others deleted, and some replaced by data that
+ * isn't indexed. db_lookup() of each attribute must find its records
+ * and no others, through the index as kept, after a reopen, and after
+ * the index is removed and built again. the entries under a, looked up
+ * in the index itself, with fetches traced, must be on many chains,
+ * none of them holding many.
+ */
+static int
+test_index(const char *path, int rounds)
+{
+	DBHANDLE	db, idx;
+	DBOPTS		o;
+	DBTRACE		ev;
+	char		key[32], data[32], name[PATH_MAX], *chains;
+	unsigned int	maxhops = 0;
+	int		i, na = 0, nchains = 0;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	if (db_index(db, "grp", indexattr, NULL) < 0) {
+		fail("db_index: %s", strerror(errno));
+		db_close(db);
+		return (-1);
+	}
+	attrs = Calloc(NKEYS, 1);
+	for (i = 0; i < NKEYS; i++) {
+		attrs[i] = i % 5 == 0 ? 'b' : 'a';
+		sprintf(key, "user-%d", i);
+		sprintf(data, "%c-%d", attrs[i], i);
+		if (db_store(db, key, data, DB_STORE) != 0)
+			fail("store of %s: %s", key, strerror(errno));
+	}
+	lookups(db, "after stores", "abcz");
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(key, "user-%d", i);
+		if (i % 7 == 0) {
+			if (db_delete(db, key) != 0)
+				fail("delete of %s: %s", key, strerror(errno));
+			attrs[i] = 0;
+		} else if (i % 3 == 0) {
+			attrs[i] = 'c';
+			sprintf(data, "c-%d-longer", i);
+			if (db_store(db, key, data, DB_REPLACE) != 0)
+				fail("replace of %s: %s", key, strerror(errno));
+		} else if (i % 11 == 0) {
+			attrs[i] = 0;	/* not indexed, but there */
+			sprintf(data, "none%d", i);
+			if (db_store(db, key, data, DB_REPLACE) != 0)
+				fail("replace of %s: %s", key, strerror(errno));
+		}
+	}
+	lookups(db, "after replaces and deletes", "abcz");
+	if (db_lookup(db, "nosuch", "a", lookupvisit, NULL) != -1 ||
+	    errno != EINVAL)
+		fail("db_lookup of an index not declared: not EINVAL");
+	db_close(db);
+
+	if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL ||
+	    db_index(db, "grp", indexattr, NULL) < 0) {
+		fail("can't reopen %s with its index: %s", path,
+		    strerror(errno));
+		free(attrs);
+		return (-1);
+	}
+	lookups(db, "after a reopen", "abc");
+	db_close(db);
+
+	sprintf(name, "%s.grp", path);
+	o.trace = 1;
+	if ((idx = db_openopt(name, O_RDONLY, 0, &o)) == NULL) {
+		fail("can't open %s: %s", name, strerror(errno));
+		free(attrs);
+		return (-1);
+	}
+	chains = Calloc(o.nhash, 1);
+	for (i = 0; i < NKEYS; i++) {
+		if (attrs[i] != 'a')
+			continue;
+		na++;
+		sprintf(key, "a\tuser-%d", i);
+		if (db_fetch(idx, key) == NULL || traced(name, &ev) < 0 ||
+		    ev.chain >= o.nhash) {
+			fail("index entry for user-%d not found", i);
+			continue;
+		}
+		if (!chains[ev.chain]++)
+			nchains++;
+		if (ev.hops > maxhops)
+			maxhops = ev.hops;
+	}
+	if (nchains < 16 || maxhops > na / 8)
+		fail("%d entries under one attribute on %d chains, %u on the "
+		    "longest walk", na, nchains, maxhops);
+	free(chains);
+	db_close(idx);
+
+	sprintf(name, "%s.grp.idx", path);
+	unlink(name);
+	sprintf(name, "%s.grp.dat", path);
+	unlink(name);
+	if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL ||
+	    db_index(db, "grp", indexattr, NULL) < 0) {
+		fail("can't rebuild the index of %s: %s", path,
+		    strerror(errno));
+		free(attrs);
+		return (-1);
+	}
+	lookups(db, "after a rebuild of the index", "abc");
+	db_close(db);
+	free(attrs);
+	return (0);
+}
+
+/* how many of the keys user-<from> to user-<to> db hasn't as stored round n */
+static int
+unseen(DBHANDLE db, int from, int to, int n)
+{
+	char	key[32], data[32], *p;
+	int	i, nunseen = 0;
+
+	for (i = from; i < to; i++) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "d%d-%d", i, n);
+		if ((p = db_fetch(db, key)) == NULL || strcmp(p, data) != 0)
+			nunseen++;
+	}
+	return (nunseen);
+}
+
+/*
+ * stores through a handle with a write buffer, each key stored 3 times,
+ * and the first keys deleted and stored again: the handle fetches the
+ * last data of each, and another handle on the database sees none of
+ * them until db_flush(), then the last, with every record live. then a
+ * DB_INSERT of a key held is refused, and a delete drops a store held.
+ * then, with a buffer that holds a few stores, the other handle sees
+ * the earlier ones before any flush, and the rest after a close; and,
+ * with the buffer held briefly, sees a store held past that once the
+ * handle is next called.
+ */
+static int
+test_wbuf(const char *path, int rounds)
+{
+	DBHANDLE	db, rd;
+	DBOPTS		o;
+	DBINFO		info;
+	char		key[32], data[32], *p;
+	int		i, n;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 101;
+	o.sync = DB_SYNC_NONE;
+	o.syncms = 60000;
+	o.wbuf = 1 << 20;
+	if ((db = create(path, &o)) == NULL)
+		return (-1);
+	if ((rd = db_openopt(path, O_RDONLY, 0, NULL)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		db_close(db);
+		return (-1);
+	}
+	for (n = 0; n < 3; n++)
+		for (i = 0; i < NKEYS; i++) {
+			sprintf(key, "user-%d", i);
+			sprintf(data, "d%d-%d", i, n);
+			if (db_store(db, key, data, DB_STORE) != 0)
+				fail("store of %s: %s", key, strerror(errno));
+			if (n == 0 && i < 10 && db_delete(db, key) != 0)
+				fail("delete of %s, held: %s", key,
+				    strerror(errno));
+		}
+	if (unseen(db, 0, NKEYS, 2) != 0)
+		fail("stores held not read back by their handle");
+	if ((i = unseen(rd, 0, NKEYS, 2)) != NKEYS)
+		fail("another handle sees %d stores held", NKEYS - i);
+	if (db_flush(db) != 0)
+		fail("db_flush: %s", strerror(errno));
+	if ((i = unseen(rd, 0, NKEYS, 2)) != 0)
+		fail("%d stores not there after db_flush", i);
+	db_info(rd, &info);
+	if (info.nrecs != NKEYS || info.ndead != 0 || info.nfree != 0)
+		fail("after db_flush of %d keys each stored 3 times: %llu "
+		    "records, %llu dead, %llu free", NKEYS, info.nrecs,
+		    info.ndead, info.nfree);
+
+	if (db_store(db, "held", "1", DB_STORE) != 0 ||
+	    db_store(db, "held", "2", DB_INSERT) != 1)
+		fail("DB_INSERT of a key held: not refused");
+	if (db_delete(db, "held") != 0 || db_fetch(db, "held") != NULL)
+		fail("delete of a store held: not dropped");
+	db_flush(db);
+	if ((p = db_fetch(rd, "held")) != NULL)
+		fail("a store held, deleted, there after db_flush: %s", p);
+	db_close(db);
+
+	o.wbuf = 4096;
+	if ((db = db_openopt(path, O_RDWR, 0, &o)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		db_close(rd);
+		return (-1);
+	}
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "d%d-3", i);
+		if (db_store(db, key, data, DB_STORE) != 0)
+			fail("store of %s: %s", key, strerror(errno));
+	}
+	if ((i = unseen(rd, 0, NKEYS / 2, 3)) != 0)
+		fail("a full buffer: %d of the first %d stores not there", i,
+		    NKEYS / 2);
+	db_close(db);
+	if ((i = unseen(rd, 0, NKEYS, 3)) != 0)
+		fail("%d stores not there after db_close", i);
+
+	o.wbuf = 1 << 20;
+	o.syncms = 50;
+	if ((db = db_openopt(path, O_RDWR, 0, &o)) == NULL) {
+		fail("can't open %s: %s", path, strerror(errno));
+		db_close(rd);
+		return (-1);
+	}
+	if (db_store(db, "late", "1", DB_STORE) != 0)
+		fail("store of late: %s", strerror(errno));
+	if (db_fetch(rd, "late") != NULL)
+		fail("a store held seen at once");
+	msleep(200);
+	db_fetch(db, "user-1");
+	if (db_fetch(rd, "late") == NULL)
+		fail("a store held past syncms not there");
+	db_close(db);
+	db_close(rd);
+	return (0);
+}
+
+/* key i of test_match(): with the prefix, without, and with glob's specials */
+static void
+matchkey(char *key, int i)
+{
+	switch (i % 5) {
+	case 0:	sprintf(key, "user/%d", i); break;
+	case 1:	sprintf(key, "user%d", i); break;
+	case 2:	sprintf(key, "other/%d", i); break;
+	case 3:	sprintf(key, "u/%d/ser", i); break;
+	default: sprintf(key, i % 10 == 4 ? "odd*%d" : "odd[%d]", i); break;
+	}
+}
+
+/* for matches(): the key must be the one its data names; count it */
+static int
+matchvisit(void *arg, const char *key, const char *data)
+{
+	char	want[32];
+	int	i;
+
+	if (sscanf(data, "d%d", &i) != 1 || i < 0 || i >= NKEYS ||
+	    (matchkey(want, i), strcmp(key, want) != 0)) {
+		fail("db_scanmatch: %s, with %s", key, data);
+		return (0);
+	}
+	__atomic_add_fetch(&((int *) arg)[i], 1, __ATOMIC_RELAXED);
+	return (0);
+}
+
+/* for matches(): stop the scan */
+static int
+matchstop(void *arg, const char *key, const char *data)
+{
+	return (7);
+}
+
+/*
+ * db_scanmatch() of each pattern, each way, must find the keys not
+ * deleted, every 9th, that the pattern matches, each once. returns the
+ * number of scans that found something.
+ */
+static int
+matches(DBHANDLE db, const char *what)
+{
+	static const char *pats[] = { "", "user/", "user", "us", "user/1",
+	    "/1", "er", "r/", "3", "other/4", "odd*", "odd[", "nomatch",
+	    "*", "user/*", "*1?", "user[0-9]*", "*/[13]*", "?ser*", "*\\**",
+	    "[!u]*", "*r/1*", "o*r/?", "odd\\[*]", "u/*/ser", "*[" };
+	static const int hows[] = { DB_MATCH_PREFIX, DB_MATCH_SUBSTR,
+	    DB_MATCH_GLOB };
+	char	key[32];
+	int	seen[NKEYS], h, i, j, want, nfound = 0;
+
+	for (h = 0; h < 3; h++)
+		for (j = 0; j < sizeof(pats) / sizeof(pats[0]); j++) {
+			memset(seen, 0, sizeof(seen));
+			if (db_scanmatch(db, hows[h], pats[j], matchvisit,
+			    seen) != 0) {
+				fail("%s: db_scanmatch %d of \"%s\": %s", what,
+				    hows[h], pats[j], strerror(errno));
+				continue;
+			}
+			for (i = 0; i < NKEYS; i++) {
+				matchkey(key, i);
+				want = i % 9 != 0 && (hows[h] == DB_MATCH_PREFIX ?
+				    strncmp(key, pats[j], strlen(pats[j])) == 0 :
+				    hows[h] == DB_MATCH_SUBSTR ?
+				    strstr(key, pats[j]) != NULL :
+				    fnmatch(pats[j], key, 0) == 0);
+				if (seen[i] != want) {
+					fail("%s: db_scanmatch %d of \"%s\": "
+					    "%s found %d times", what, hows[h],
+					    pats[j], key, seen[i]);
+					break;
+				}
+				if (seen[i])
+					nfound++;
+			}
+		}
+	if (db_scanmatch(db, DB_MATCH_SUBSTR, "user", matchstop, NULL) != 7)
+		fail("%s: db_scanmatch not stopped by its function", what);
+	if (db_scanmatch(db, 0, "user", matchvisit, seen) != -1 ||
+	    errno != EINVAL || db_scanmatch(db, DB_MATCH_GLOB + 1, "user",
+	    matchvisit, seen) != -1 || errno != EINVAL)
+		fail("%s: db_scanmatch of an unknown how: not EINVAL", what);
+	return (nfound);
+}
+
+/*
+ * keys of many forms, with a common prefix elided and without, in one
+ * file and in shards, every 9th deleted: db_scanmatch() of prefixes,
+ * substrings and globs, some of them special, finds what a brute force
+ * match of every key does.
+ */
+static int
+test_match(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	char		key[32], data[32];
+	int		i, cfg;
+
+	for (cfg = 0; cfg < 3; cfg++) {
+		memset(&o, 0, sizeof(o));
+		o.nhash = 101;
+		if (cfg == 1)
+			o.keyprefix = "user/";
+		if (cfg == 2)
+			o.nshards = 3;
+		if ((db = create(path, &o)) == NULL)
+			return (-1);
+		for (i = 0; i < NKEYS; i++) {
+			matchkey(key, i);
+			sprintf(data, "d%d", i);
+			if (db_store(db, key, data, DB_STORE) != 0)
+				fail("store of %s: %s", key, strerror(errno));
+		}
+		for (i = 0; i < NKEYS; i += 9) {
+			matchkey(key, i);
+			if (db_delete(db, key) != 0)
+				fail("delete of %s: %s", key, strerror(errno));
+		}
+		if (matches(db, cfg == 0 ? "one file" : cfg == 1 ?
+		    "prefix elided" : "shards") == 0)
+			fail("db_scanmatch found nothing");
+		db_close(db);
+	}
+	return (0);
+}
+
+/*
+ * rounds of stores and deletes, at random, of NKEYS keys with data of
+ * varying lengths, hashed to 3 chains so that deletes pass dead records
+ * and reclaim them. then every key must have what the last operation on
+ * it made it, and db_check() must find the records db_info() counts.
+ */
+static int
+test_reclaim(const char *path, int rounds)
+{
+	DBHANDLE	db;
+	DBOPTS		o;
+	DBINFO		info;
+	DBCHECK		res;
+	char		key[32], data[128], *got;
+	unsigned int	*model, seq = 1;
+	int		r, i, k, reclaimed = 0;
+	static const char pad[] = "................................"
+			    "................................";
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 3;
+	if ((db = db_openopt(path, O_RDWR | O_CREAT | O_TRUNC, 0644, &o)) ==
+	    NULL) {
+		fail("can't create %s: %s", path, strerror(errno));
+		return (-1);
+	}
+	model = Calloc(NKEYS, sizeof(unsigned int));
+	srand(getpid());
+
+	for (r = 0; r < rounds && nfail == 0; r++) {
+		for (i = 0; i < 4 * NKEYS; i++) {
+			k = rand() % NKEYS;
+			sprintf(key, "k%d", k);
+			if (rand() % 3 == 0) {
+				if (db_delete(db, key) != (model[k] ? 0 : -1))
+					fail("round %d: delete of %s", r, key);
+				model[k] = 0;
+			} else {
+				sprintf(data, "%u %.*s", seq, (int) (seq % 60),
+				    pad);
+				if (db_store(db, key, data, DB_STORE) != 0)
+					fail("round %d: store of %s: %s", r,
+					    key, strerror(errno));
+				model[k] = seq++;
+			}
+		}
+
+		/* reopened, so that what db_info() reports is the header's. */
+		db_close(db);
+		if ((db = db_openopt(path, O_RDWR, 0, NULL)) == NULL) {
+			fail("round %d: can't open %s: %s", r, path,
+			    strerror(errno));
+			break;
+		}
+		for (k = 0; k < NKEYS; k++) {
+			sprintf(key, "k%d", k);
+			got = db_fetch(db, key);
+			if ((got != NULL ? strtoul(got, NULL, 10) : 0) !=
+			    model[k])
+				fail("round %d: %s has %s, not %u", r, key,
+				    got != NULL ? got : "nothing", model[k]);
+		}
+		db_info(db, &info);
+		memset(&res, 0, sizeof(res));
+		res.fn = problem;
+		res.arg = &r;
+		if (db_check(db, &res) < 0)
+			fail("round %d: db_check found %llu problems", r,
+			    res.nbad);
+		if (res.nrecs != info.nrecs || res.ndead != info.ndead ||
+		    res.nfree != info.nfree)
+			fail("round %d: db_check counts %llu live %llu dead "
+			    "%llu free, db_info %llu %llu %llu", r, res.nrecs,
+			    res.ndead, res.nfree, info.nrecs, info.ndead,
+			    info.nfree);
+		if (res.nlost != 0)
+			fail("round %d: %llu records on no chain", r, res.nlost);
+		if (info.nfree > 0)
+			reclaimed = 1;
+	}
+	if (nfail == 0 && !reclaimed)
+		fail("nothing was ever reclaimed");
+	db_close(db);
+	free(model);
+	return (0);
+}
+
+/*
+ * db_check() and db_rebuild() of a database in one pair of files, in
+ * shards, and in fixed size slots.
+ */
+static int
+test_check(const char *path, int rounds)
+{
+	DBOPTS	o;
+
+	memset(&o, 0, sizeof(o));
+	o.nhash = 1009;
+	checks(path, &o, "one");
+	o.nshards = 4;
+	checks(path, &o, "shards");
+	o.nshards = 0;
+	o.keysize = 16;
+	o.datsize = 24;
+	checks(path, &o, "fixed");
+	return (0);
+}
+
+#define NCHECK	(20 * NKEYS)	/* records in the database checked */
+
+/*
+ * a database created with o, of keys some deleted, some replaced and some
+ * stored again, must check clean, with the counts db_info() has, and be
+ * rebuilt to one with the same records, which checks clean too. then,
+ * with the key of one record, the data of another and the chain ptr of a
+ * third damaged, db_check() must find it, and the rebuild must have all
+ * but the first two. rebuilding a database into itself is EINVAL.
+ */
+static int
+checks(const char *path, const DBOPTS *o, const char *what)
+{
+	DBHANDLE	db;
+	DBINFO		info;
+	DBCHECK		res;
+	char		rpath[PATH_MAX], key[32], data[64], **model;
+	int		i, ndamaged = 0;
+
+	if ((db = db_openopt(path, O_RDWR | O_CREAT | O_TRUNC, 0644, o)) ==
+	    NULL) {
+		fail("%s: can't create %s: %s", what, path, strerror(errno));
+		return (-1);
+	}
+	model = Calloc(NCHECK, sizeof(char *));
+	for (i = 0; i < NCHECK; i++) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "data-%d-%s", i, i % 3 ? "x" : "longer");
+		db_store(db, key, data, DB_STORE);
+		model[i] = strdup(data);
+	}
+	for (i = 0; i < NCHECK; i += 7) {
+		sprintf(key, "user-%d", i);
+		db_delete(db, key);
+		free(model[i]);
+		model[i] = NULL;
+	}
+	for (i = 1; i < NCHECK; i += 11) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "new%d", i);
+		db_store(db, key, data, DB_STORE);
+		free(model[i]);
+		model[i] = strdup(data);
+	}
+	for (i = 0; i < NCHECK; i += 14) {
+		sprintf(key, "user-%d", i);
+		sprintf(data, "back-%d", i);
+		db_store(db, key, data, DB_STORE);
+		model[i] = strdup(data);
+	}
+	db_info(db, &info);
+
+	memset(&res, 0, sizeof(res));
+	res.fn = problem;
+	res.arg = &i;
+	i = 0;
+	if (db_check(db, &res) < 0)
+		fail("%s: db_check found %llu problems", what, res.nbad);
+	if (res.nrecs != info.nrecs || res.ndead != info.ndead ||
+	    res.nfree != info.nfree)
+		fail("%s: db_check counts %llu live %llu dead %llu free, "
+		    "db_info %llu %llu %llu", what, res.nrecs, res.ndead,
+		    res.nfree, info.nrecs, info.ndead, info.nfree);
+	sprintf(rpath, "%s.new", path);
+	memset(&res, 0, sizeof(res));
+	if (db_rebuild(db, rpath, NULL, &res) < 0)
+		fail("%s: db_rebuild: %s", what, strerror(errno));
+	else
+		verify(rpath, model, 0, what);
+	if (db_rebuild(db, path, NULL, NULL) == 0 || errno != EINVAL)
+		fail("%s: rebuilt into itself", what);
+	db_close(db);
+
+	/* damage the files. the fixed size slots have no chains.	*/
+	ndamaged += damage(path, "user-1000", o->keysize > 0 ? 0 : ':');
+	ndamaged += damage(path, "data-1003-", 0);
+	if (o->keysize == 0)
+		damage(path, "user-2005", -1);
+	if (ndamaged != 2) {
+		fail("%s: damaged %d records, not 2", what, ndamaged);
+		free(model);
+		return (-1);
+	}
+	if ((db = db_openopt(path, O_RDONLY, 0, NULL)) == NULL) {
+		fail("%s: can't open %s: %s", what, path, strerror(errno));
+		free(model);
+		return (-1);
+	}
+	memset(&res, 0, sizeof(res));
+	if (db_check(db, &res) == 0 || errno != EIO)
+		fail("%s: db_check missed the damage", what);
+	memset(&res, 0, sizeof(res));
+	res.nthreads = 3;
+	if (db_rebuild(db, rpath, NULL, &res) < 0)
+		fail("%s: db_rebuild of damage: %s", what, strerror(errno));
+	else
+		verify(rpath, model, 2, what);
+	db_close(db);
+
+	for (i = 0; i < NCHECK; i++)
+		free(model[i]);
+	free(model);
+	return (0);
+}
+
+/*
+ * the database at path must have the records in model, but for at most
+ * nmissing, and check clean.
+ */
+static int
+verify(const char *path, char **model, int nmissing, const char *what)
+{
+	DBHANDLE	db;
+	DBCHECK		res;
+	char		key[32], *data;
+	int		i, nrecs = 0, missing = 0, n = nfail;
+
+	if ((db = db_openopt(path, O_RDONLY, 0, NULL)) == NULL) {
+		fail("%s: can't open %s: %s", what, path, strerror(errno));
+		return (-1);
+	}
+	for (i = 0; i < NCHECK; i++) {
+		sprintf(key, "user-%d", i);
+		data = db_fetch(db, key);
+		if (model[i] != NULL)
+			nrecs++;
+		if (data == NULL && model[i] != NULL)
+			missing++;
+		else if (data != NULL && (model[i] == NULL ||
+		    strcmp(data, model[i]) != 0))
+			fail("%s: %s in %s has %s, not %s", what, key, path,
+			    data, model[i] != NULL ? model[i] : "nothing");
+	}
+	if (missing > nmissing)
+		fail("%s: %d records missing from %s, not %d", what, missing,
+		    path, nmissing);
+	memset(&res, 0, sizeof(res));
+	if (db_check(db, &res) < 0 || res.nrecs != nrecs - missing ||
+	    res.ndead != 0 || res.nfree != 0)
+		fail("%s: %s doesn't check clean", what, path);
+	db_close(db);
+	return (nfail > n ? -1 : 0);
+}
+
+/*
+ * flip a bit of the first occurrence of s in the index file, or files, of
+ * the database at path, or in its data files if s doesn't start "user-":
+ * in the byte after s, if sep is its separator, in the middle of s if it
+ * is 0, or in the chain ptr of its record if -1. 1 if one was found.
+ */
+static int
+damage(const char *path, const char *s, int sep)
+{
+	struct stat	statbuff;
+	char		name[PATH_MAX], *buf, *p, c;
+	int		i, fd, found = 0;
+	size_t		len = strlen(s);
+	off_t		off;
+
+	for (i = -1; i < 4 && !found; i++) {
+		if (i < 0)
+			sprintf(name, "%s.%s", path,
+			    strncmp(s, "user-", 5) == 0 ? "idx" : "dat");
+		else
+			sprintf(name, "%s.%d.%s", path, i,
+			    strncmp(s, "user-", 5) == 0 ? "idx" : "dat");
+		if ((fd = open(name, O_RDWR)) < 0)
+			continue;
+		if (fstat(fd, &statbuff) < 0 || (buf = malloc(statbuff.st_size +
+		    1)) == NULL) {
+			Close(fd);
+			continue;
+		}
+		if (pread(fd, buf, statbuff.st_size, 0) == statbuff.st_size) {
+			for (p = buf; p + len <= buf + statbuff.st_size; p++)
+				if (memcmp(p, s, len) == 0 &&
+				    (sep <= 0 || p[len] == sep))
+					break;
+			if (p + len <= buf + statbuff.st_size) {
+				/* the ptr field, 16 bytes, and the index
+				   record's length, 4, come before its key. */
+				off = p - buf + (sep < 0 ? 3 - 4 - 16 : 3);
+				c = buf[off] ^ 0x5;
+				found = pwrite(fd, &c, 1, off) == 1;
+			}
+		}
+		free(buf);
+		Close(fd);
+	}
+	return (found);
+}
+
+/*
+ * rounds of NWRITERS writers storing to and deleting their own keys in
+ * the database at path, created with o, until they are killed; each
+ * writes what it is about to do to <path>.<writer>.ops first. with where
+ * CRASH_SYNC the first dies at a crash point of a checkpoint, with
+ * CRASH_APPLY at one of applying an operation, with the database held
+ * open here through the round; with 0 all are killed at random. then
+ * the database is opened, which recovers it unless it was held open,
+ * and every key must have what the last operation on it made it, but
+ * for the one each writer was making, which may or may not have been
+ * made.
+ */
+static int
+crashes(const char *path, const DBOPTS *o, int rounds, int where)
+{
+	DBHANDLE	db, held = NULL;
+	DBCHECK		res;
+	OP		op, last[NWRITERS];
+	char		name[PATH_MAX], key[32], *data;
+	unsigned int	*model, got, want;
+	pid_t		pid[NWRITERS];
+	int		r, w, k, fd, nops[NWRITERS], status, ms;
+
+	if ((db = db_openopt(path, O_RDWR | O_CREAT | O_TRUNC, 0644, o)) ==
+	    NULL) {
+		fail("can't create %s: %s", path, strerror(errno));
+		return (-1);
+	}
+	db_close(db);
+	model = Calloc(NWRITERS * NKEYS, sizeof(unsigned int));
+	Signal(SIGUSR1, crashnext);	/* for the writers */
+
+	for (r = 0; r < rounds && nfail == 0; r++) {
+		if (where == CRASH_APPLY && (held = db_openopt(path, O_RDWR,
+		    0, NULL)) == NULL) {
+			fail("round %d: can't open %s: %s", r, path,
+			    strerror(errno));
+			break;
+		}
+		k = rand() % 200;
+		for (w = 0; w < NWRITERS; w++) {
+			if ((pid[w] = Fork()) == 0) {
+				if (w == 0 && where == CRASH_APPLY) {
+					crashat = CRASH_APPLY;
+					crashskip = 20 + k;
+				} else if (w == 0 && where != 0) {
+					crashat = r % 2 ? CRASH_TRUNCATE :
+					    CRASH_SYNC;
+					crashskip = r % 3;
+				}
+				writer(path, o, w, (r + 1) * 1000000, r);
+				_exit(0);
+			}
+		}
+		/* with crash points, wait for the first writer to reach one.
+		   the others write over what it left. past one in a
+		   checkpoint, they would clear it up with their own, so
+		   they die as they start one.	*/
+		for (ms = 0; where != 0 && ms < ROUND_MSEC; ms += 10) {
+			if (Waitpid(pid[0], &status, WNOHANG) == pid[0]) {
+				pid[0] = 0;
+				for (w = 1; where != CRASH_APPLY &&
+				    w < NWRITERS; w++)
+					kill(pid[w], SIGUSR1);
+				break;
+			}
+			msleep(10);
+		}
+		msleep(20 + rand() % 80);
+		for (w = 0; w < NWRITERS; w++)
+			if (pid[w] != 0) {
+				kill(pid[w], SIGKILL);
+				Waitpid(pid[w], NULL, 0);
+			}
+		if (where != 0 && ms >= ROUND_MSEC)
+			printf("\tround %d: no crash point reached\n", r);
+
+		/* all but the last operation of each writer were made.	*/
+		for (w = 0; w < NWRITERS; w++) {
+			sprintf(name, "%s.%d.ops", path, w);
+			nops[w] = 0;
+			if ((fd = open(name, O_RDONLY)) < 0)
+				continue;	/* killed before it began */
+			for ( ; read(fd, &op, sizeof(op)) == sizeof(op);
+			    nops[w]++) {
+				if (nops[w] > 0)
+					model[w * NKEYS + last[w].key] =
+					    last[w].seq;
+				last[w] = op;
+			}
+			Close(fd);
+			unlink(name);
+		}
+
+		if ((db = held) == NULL &&
+		    (db = db_openopt(path, O_RDWR, 0, NULL)) == NULL) {
+			fail("round %d: can't open %s: %s", r, path,
+			    strerror(errno));
+			break;
+		}
+		for (w = 0; w < NWRITERS; w++) {
+			for (k = 0; k < NKEYS; k++) {
+				sprintf(key, "w%dk%d", w, k);
+				data = db_fetch(db, key);
+				got = data != NULL ? strtoul(data, NULL, 10) : 0;
+				want = model[w * NKEYS + k];
+				if (got == want)
+					continue;
+				if (nops[w] > 0 && last[w].key == k &&
+				    got == last[w].seq) {
+					model[w * NKEYS + k] = got;
+					continue;
+				}
+				fail("round %d: %s has %u, not %u", r, key,
+				    got, want);
+			}
+		}
+		/* a store cut short leaves a record on no chain, which is
+		   no damage; the problems are printed if there is some.	*/
+		memset(&res, 0, sizeof(res));
+		if (db_check(db, &res) < 0) {
+			fail("round %d: db_check found %llu problems", r,
+			    res.nbad);
+			res.fn = problem;
+			res.arg = &r;
+			db_check(db, &res);
+		}
+		db_close(db);
+	}
+	free(model);
+	return (0);
+}
+
+/*
+ * store and delete keys w<w>k<n> at random till killed, the data of the
+ * i'th store the number seq + i, padded out to vary its length.
+ */
+static void
+writer(const char *path, const DBOPTS *o, int w, unsigned int seq,
+    int round)
+{
+	DBHANDLE	db;
+	OP		op;
+	struct stat	statbuff;
+	char		name[PATH_MAX], key[32], data[128];
+	int		fd;
+	static const char pad[] = "................................"
+			    "................................";
+
+	if ((db = db_openopt(path, O_RDWR, 0, o)) == NULL)
+		err_sys("writer: can't open %s", path);
+	sprintf(name, "%s.idx", path);
+	if (stat(name, &statbuff) < 0)
+		err_sys("writer: can't stat %s", name);
+	idxino = statbuff.st_ino;
+	sprintf(name, "%s.dat", path);
+	if (stat(name, &statbuff) < 0)
+		err_sys("writer: can't stat %s", name);
+	datino = statbuff.st_ino;
+	sprintf(name, "%s.wal", path);
+	if (stat(name, &statbuff) == 0)
+		walino = statbuff.st_ino;
+	sprintf(name, "%s.%d.ops", path, w);
+	fd = Open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	srand(getpid() ^ round);
+	for (;;) {
+		op.key = rand() % NKEYS;
+		op.seq = rand() % 5 == 0 ? 0 : seq++;
+		Writen(fd, &op, sizeof(op));
+		sprintf(key, "w%dk%u", w, op.key);
+		if (op.seq == 0)
+			db_delete(db, key);
+		else {
+			sprintf(data, "%u %.*s", op.seq, (int) (op.seq % 60),
+			    pad);
+			db_store(db, key, data, DB_STORE);
+		}
+	}
+}
@@ -0,0 +1,164 @@
+#include "lib.h"
+#include "db.h"
+
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * dbtrace: print the events traced by the processes that have a database
+ * open with trace (see DBTRFILE in db.h).
+ *
+ *	dbtrace [-s usec] [-p pid] name
+ *
+ * the events of all the rings, of all the shards if the database is
+ * sharded, are printed oldest first, one a line: when it began, the
+ * process (0 once it has closed the database), the operation and what
+ * it returned, its hash chain, shard and the records passed on it, the
+ * bytes read, and the usec spent waiting for locks and in all. the file can be read while they run; events
+ * overwritten while we copy them are left out.
+ * -s prints only the events that took at least usec, -p only those of
+ * one process.
+ */
+
+typedef struct {
+	DBTRACE	ev;
+	int	pid;
+	int	shard;		/* -1 if not sharded */
+} EVENT;
+
+static EVENT	*events;
+static size_t	nevents, maxevents;
+
+static int	cmpevent(const void *, const void *);
+static int	readtrace(const char *, int, long, int);
+static void	usage(void);
+
+int
+main(int argc, char *argv[])
+{
+	char	*path, buf[64];
+	long	slow = 0;
+	int	c, i, pid = 0;
+	size_t	n;
+	time_t	t;
+	static const char *ops[] = { "?", "fetch", "store", "delete" };
+
+	while ((c = getopt(argc, argv, "p:s:")) != EOF) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 's':
+			slow = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	if ((path = malloc(strlen(argv[optind]) + 9)) == NULL)	/* ".255.trc" */
+		err_dump("malloc error");
+	sprintf(path, "%s.trc", argv[optind]);
+	if (readtrace(path, -1, slow, pid) < 0) {
+		/* the shards have one each */
+		for (i = 0; i < SHARDS_MAX; i++) {
+			sprintf(path, "%s.%d.trc", argv[optind], i);
+			if (readtrace(path, i, slow, pid) < 0)
+				break;
+		}
+		if (i == 0)
+			err_sys("can't open %s.trc", argv[optind]);
+	}
+	qsort(events, nevents, sizeof(EVENT), cmpevent);
+
+	for (n = 0; n < nevents; n++) {
+		DBTRACE	*ev = &events[n].ev;
+
+		t = ev->usec / 1000000;
+		strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&t));
+		printf("%s.%06lld %7d %-6s %2d chain %-8u", buf,
+		    ev->usec % 1000000, events[n].pid,
+		    ops[ev->op <= DBTRACE_DELETE ? ev->op : 0], ev->rc,
+		    ev->chain);
+		if (events[n].shard >= 0)
+			printf(" shard %-3d", events[n].shard);
+		printf(" hops %-5u read %-7u lockwait %-8u latency %u\n",
+		    ev->hops, ev->bytes, ev->lockwait, ev->latency);
+	}
+	free(events);
+	free(path);
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	err_quit("usage: dbtrace [-s usec] [-p pid] name");
+}
+
+static int
+cmpevent(const void *a, const void *b)
+{
+	long long	ua = ((const EVENT *) a)->ev.usec;
+	long long	ub = ((const EVENT *) b)->ev.usec;
+
+	return (ua < ub ? -1 : ua > ub);
+}
+
+/*
+ * add the events in the trace file path, of the shard given, that took
+ * at least slow usec, and were made by pid if it isn't 0. returns -1 if
+ * the file can't be opened.
+ */
+static int
+readtrace(const char *path, int shard, long slow, int pid)
+{
+	DBTRFILE	*tf;
+	DBTRING		*r;
+	DBTRACE		*copy;
+	unsigned long long first, next, i;
+	int		fd, j, rpid;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+	if ((tf = mmap(NULL, sizeof(DBTRFILE), PROT_READ, MAP_SHARED, fd,
+	    0)) == MAP_FAILED)
+		err_sys("can't map %s", path);
+	close(fd);
+	if (tf->magic != DBTRACE_MAGIC)
+		err_quit("%s is no trace file", path);
+	if ((copy = malloc(sizeof(tf->ring[0].ev))) == NULL)
+		err_dump("malloc error");
+
+	for (j = 0; j < DBTRACE_RINGS; j++) {
+		r = &tf->ring[j];
+		rpid = __atomic_load_n(&r->pid, __ATOMIC_RELAXED);
+		if (pid != 0 && rpid != pid)
+			continue;
+		/* copy the ring, then keep the events its writer hasn't
+		   started to overwrite since.	*/
+		next = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+		memcpy(copy, r->ev, sizeof(r->ev));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		first = __atomic_load_n(&r->next, __ATOMIC_RELAXED);
+		first = first >= DBTRACE_EVENTS ? first - DBTRACE_EVENTS + 1 : 0;
+		for (i = first; i < next; i++) {
+			if (copy[i % DBTRACE_EVENTS].latency < slow)
+				continue;
+			if (nevents == maxevents) {
+				maxevents = maxevents > 0 ? 2 * maxevents : 1024;
+				if ((events = realloc(events,
+				    maxevents * sizeof(EVENT))) == NULL)
+					err_dump("realloc error");
+			}
+			events[nevents].ev = copy[i % DBTRACE_EVENTS];
+			events[nevents].pid = rpid;
+			events[nevents++].shard = shard;
+		}
+	}
+	free(copy);
+	munmap(tf, sizeof(DBTRFILE));
+	return (0);
+}
@@ -1,5 +1,8 @@
 #include "lib.h"
 
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
 /* error ***********************************************************************************************
  * <stdarg.h> <errorno.h> <string.h>
  */
@@ -289,6 +292,196 @@ Writen(int fd, void *ptr, size_t nbytes)
                 err_sys("written error");
 }
 
+/* io_uring ********************************************************************
+ * <linux/io_uring.h> <sys/mman.h> <sys/syscall.h>
+ */
+int
+uring_init(struct uring *ring, unsigned entries)
+{
+#ifdef __NR_io_uring_setup
+        struct io_uring_params p;
+        void    *ptr;
+
+        memset(ring, 0, sizeof(*ring));
+        memset(&p, 0, sizeof(p));
+        if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+                return (-1);
+
+        ring->sq_ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sq_ring = mmap(NULL, ring->sq_ringsz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        ring->cq_ring = mmap(NULL, ring->cq_ringsz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ptr = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_SQES);
+        if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+            ptr == MAP_FAILED) {
+                if (ptr != MAP_FAILED)
+                        munmap(ptr, p.sq_entries * sizeof(struct io_uring_sqe));
+                if (ring->sq_ring == MAP_FAILED)
+                        ring->sq_ring = NULL;
+                if (ring->cq_ring == MAP_FAILED)
+                        ring->cq_ring = NULL;
+                uring_exit(ring);
+                return (-1);
+        }
+        ring->sqes = ptr;
+        ring->sq_entries = p.sq_entries;
+        ring->sq_head = (unsigned *) ((char *) ring->sq_ring + p.sq_off.head);
+        ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + p.sq_off.tail);
+        ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *) ((char *) ring->sq_ring + p.sq_off.array);
+        ring->cq_head = (unsigned *) ((char *) ring->cq_ring + p.cq_off.head);
+        ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + p.cq_off.tail);
+        ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+        ring->sq_local = *ring->sq_tail;
+        return (0);
+#else
+        ring->fd = -1;
+        errno = ENOSYS;
+        return (-1);
+#endif
+}
+void
+uring_exit(struct uring *ring)
+{
+        if (ring->sqes != NULL)
+                munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+        if (ring->sq_ring != NULL)
+                munmap(ring->sq_ring, ring->sq_ringsz);
+        if (ring->cq_ring != NULL)
+                munmap(ring->cq_ring, ring->cq_ringsz);
+        if (ring->fd >= 0)
+                close(ring->fd);
+        memset(ring, 0, sizeof(*ring));
+        ring->fd = -1;
+}
+/*
+ * return the next free submission entry, cleared, or NULL if the
+ * submission queue is full and uring_submit must be called first.
+ */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+        struct io_uring_sqe *sqe;
+        unsigned        head;
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local - head >= ring->sq_entries)
+                return (NULL);
+        sqe = &ring->sqes[ring->sq_local & *ring->sq_mask];
+        ring->sq_array[ring->sq_local & *ring->sq_mask] = ring->sq_local & *ring->sq_mask;
+        ring->sq_local++;
+        memset(sqe, 0, sizeof(*sqe));
+        return (sqe);
+}
+/*
+ * hand the queued entries to the kernel and wait for at least wait_nr
+ * completions. returns the number of entries submitted, -1 on error.
+ */
+int
+uring_submit(struct uring *ring, unsigned wait_nr)
+{
+#ifdef __NR_io_uring_enter
+        unsigned        n;
+        int             rc;
+
+        n = ring->sq_local - *ring->sq_tail;
+        __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+        if (n == 0 && wait_nr == 0)
+                return (0);
+again:
+        rc = syscall(__NR_io_uring_enter, ring->fd, n, wait_nr,
+            wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc < 0 && errno == EINTR)
+                goto again;
+        return (rc);
+#else
+        errno = ENOSYS;
+        return (-1);
+#endif
+}
+/*
+ * return the oldest completion without waiting, or NULL if there is none.
+ */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *ring)
+{
+        unsigned        head;
+
+        head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+                return (NULL);
+        return (&ring->cqes[head & *ring->cq_mask]);
+}
+void
+uring_cqe_seen(struct uring *ring)
+{
+        __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* crc32c **********************************************************************
+ */
+static unsigned int     crc32c_table[256];
+
+static void
+crc32c_init(void)
+{
+        unsigned int    i, j, crc;
+
+        for (i = 0; i < 256; i++) {
+                crc = i;
+                for (j = 0; j < 8; j++)
+                        crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+                crc32c_table[i] = crc;
+        }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * the SSE4.2 crc32 instruction computes the same crc, 8 bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+static unsigned int
+crc32c_sse42(unsigned int crc, const unsigned char *ptr, size_t len)
+{
+        unsigned long long      c = crc, v;
+
+        for ( ; len >= 8; ptr += 8, len -= 8) {
+                memcpy(&v, ptr, 8);
+                c = __builtin_ia32_crc32di(c, v);
+        }
+        crc = c;
+        while (len-- > 0)
+                crc = __builtin_ia32_crc32qi(crc, *ptr++);
+        return (crc);
+}
+
+static int      crc32c_hw = -1;         /* have SSE4.2, -1 until we know */
+#endif
+
+unsigned int
+crc32c(unsigned int crc, const void *buf, size_t len)
+{
+        const unsigned char *ptr = buf;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (crc32c_hw < 0)
+                crc32c_hw = __builtin_cpu_supports("sse4.2");
+        if (crc32c_hw)
+                return (~crc32c_sse42(~crc, ptr, len));
+#endif
+        if (crc32c_table[1] == 0)       /* first use */
+                crc32c_init();
+        crc = ~crc;
+        while (len-- > 0)
+                crc = crc32c_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+        return (~crc);
+}
+
 /* inet_ntop ***************************************************************
  * <arpa/inet.h>
  */
@@ -7,6 +7,11 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
 
 #define read_lock(fd, offset, whence, len)	\
 		lock_reg((fd), F_SETLK, F_RDLCK, (offset), (whence), (len))
@@ -60,6 +65,37 @@ void Write(int fd, void *ptr, size_t nbytes);
 ssize_t writen(int fd, const void *vptr, size_t n);
 void Writen(int fd, void *ptr, size_t nbytes);
 
+/* io_uring *******************************************************************
+ * <linux/io_uring.h> <sys/mman.h> <sys/syscall.h>
+ * just enough of the rings to submit reads and reap their completions.
+ * uring_init fails with ENOSYS where the kernel lacks io_uring.
+ */
+struct uring {
+	int		fd;
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail, *cq_mask;
+	unsigned	sq_entries;
+	unsigned	sq_local;	/* our tail, published by uring_submit */
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void		*sq_ring, *cq_ring;
+	size_t		sq_ringsz, cq_ringsz;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+/* crc32c *********************************************************************
+ * the Castagnoli crc, as used by iSCSI and ext4, with the SSE4.2 crc32
+ * instruction where there is one. start with crc 0, and
+ * pass the result back in to continue over more bytes.
+ */
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+
 /* wrap inet_ntop ***************************************************************
  * <arpa/inet.h>
  */